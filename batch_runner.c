@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "batch_runner.h"
+
+typedef struct {
+	batch_job job;
+	pid_t pid;
+	int status;
+	struct timespec start_time;
+	double elapsed;
+} job_entry;
+
+static char* dup_string(const char* str, size_t len) {
+	char* ret = malloc(len + 1);
+	if (ret == NULL) return NULL;
+	memcpy(ret, str, len);
+	ret[len] = '\0';
+	return ret;
+}
+
+static void free_job(batch_job* job) {
+	uint32_t i;
+	free(job->stdin_path);
+	free(job->stdout_path);
+	for (i = 0; i < job->argc; i++) free(job->argv[i]);
+	free(job->argv);
+}
+
+/* 1行をジョブに変換する。空行などジョブでない時は0、エラー時は-1を返す */
+static int parse_job(batch_job* job, const char* line, uint32_t line_no) {
+	char* tokens[2] = {NULL, NULL};
+	int token_cnt = 0;
+	const char* p = line;
+	job->stdin_path = NULL;
+	job->stdout_path = NULL;
+	job->argc = 0;
+	job->argv = NULL;
+	for (;;) {
+		const char* start;
+		char* token;
+		while (isspace((unsigned char)*p)) p++;
+		if (*p == '\0' || (*p == '#' && token_cnt == 0 && job->argc == 0)) break;
+		start = p;
+		while (*p != '\0' && !isspace((unsigned char)*p)) p++;
+		token = dup_string(start, p - start);
+		if (token == NULL) {
+			perror("malloc");
+			free(tokens[0]); free(tokens[1]); free_job(job);
+			return -1;
+		}
+		if (token_cnt < 2) {
+			tokens[token_cnt++] = token;
+		} else {
+			char** new_argv = realloc(job->argv, sizeof(*new_argv) * (job->argc + 2));
+			if (new_argv == NULL) {
+				perror("realloc");
+				free(token); free(tokens[0]); free(tokens[1]); free_job(job);
+				return -1;
+			}
+			job->argv = new_argv;
+			job->argv[job->argc++] = token;
+			job->argv[job->argc] = NULL;
+		}
+	}
+	if (token_cnt == 0) return 0;
+	if (token_cnt < 2) {
+		fprintf(stderr, "batch manifest line %"PRIu32": stdout file missing\n", line_no);
+		free(tokens[0]);
+		return -1;
+	}
+	if (strcmp(tokens[0], "-") == 0) free(tokens[0]); else job->stdin_path = tokens[0];
+	if (strcmp(tokens[1], "-") == 0) free(tokens[1]); else job->stdout_path = tokens[1];
+	return 1;
+}
+
+static job_entry* read_manifest(uint32_t* job_num, const char* manifest_path) {
+	FILE* fp = fopen(manifest_path, "r");
+	job_entry* jobs = NULL;
+	uint32_t num = 0, line_no = 0;
+	char* line = NULL;
+	size_t line_len = 0, line_cap = 0;
+	int error = 0;
+	int c;
+	if (fp == NULL) {
+		fprintf(stderr, "batch manifest open failed\n");
+		return NULL;
+	}
+	do {
+		c = getc(fp);
+		if (c == '\n' || c == EOF) {
+			batch_job job;
+			int res;
+			if (c == EOF && line_len == 0) break;
+			line_no++;
+			if (line == NULL) line = dup_string("", 0);
+			if (line == NULL) { perror("malloc"); error = 1; break; }
+			line[line_len] = '\0';
+			res = parse_job(&job, line, line_no);
+			if (res < 0) { error = 1; break; }
+			if (res > 0) {
+				job_entry* new_jobs = realloc(jobs, sizeof(*jobs) * (num + 1));
+				if (new_jobs == NULL) {
+					perror("realloc");
+					free_job(&job);
+					error = 1;
+					break;
+				}
+				jobs = new_jobs;
+				jobs[num].job = job;
+				jobs[num].pid = -1;
+				jobs[num].status = -1;
+				jobs[num].elapsed = 0;
+				num++;
+			}
+			line_len = 0;
+		} else {
+			if (line_len + 1 >= line_cap) {
+				size_t new_cap = line_cap == 0 ? 256 : line_cap * 2;
+				char* new_line = realloc(line, new_cap);
+				if (new_line == NULL) { perror("realloc"); error = 1; break; }
+				line = new_line;
+				line_cap = new_cap;
+			}
+			line[line_len++] = (char)c;
+		}
+	} while (c != EOF);
+	free(line);
+	if (error || ferror(fp)) {
+		uint32_t i;
+		if (ferror(fp)) fprintf(stderr, "batch manifest read error\n");
+		for (i = 0; i < num; i++) free_job(&jobs[i].job);
+		free(jobs);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	*job_num = num;
+	/* ジョブが無い場合もNULLと区別する */
+	if (jobs == NULL) jobs = malloc(sizeof(*jobs));
+	return jobs;
+}
+
+static int redirect_fd(int target_fd, const char* path, int flags) {
+	int fd = open(path, flags, 0666);
+	if (fd < 0) return 0;
+	if (fd != target_fd) {
+		if (dup2(fd, target_fd) < 0) {
+			close(fd);
+			return 0;
+		}
+		close(fd);
+	}
+	return 1;
+}
+
+static void run_job_child(const batch_job* job, batch_job_runner runner) {
+	if (job->stdin_path != NULL && !redirect_fd(0, job->stdin_path, O_RDONLY)) {
+		fprintf(stderr, "failed to open %s for stdin\n", job->stdin_path);
+		_exit(2);
+	}
+	if (job->stdout_path != NULL && !redirect_fd(1, job->stdout_path, O_WRONLY | O_CREAT | O_TRUNC)) {
+		fprintf(stderr, "failed to open %s for stdout\n", job->stdout_path);
+		_exit(2);
+	}
+	exit(runner(job));
+}
+
+int run_batch(const char* manifest_path, int max_workers, batch_job_runner runner) {
+	uint32_t job_num = 0, next_job = 0, running = 0, i;
+	job_entry* jobs = read_manifest(&job_num, manifest_path);
+	int all_ok = 1;
+	if (jobs == NULL) return 1;
+	if (max_workers <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		max_workers = cpus > 0 ? (int)cpus : 1;
+	}
+	/* 読み込み済みのイメージは、fork()によりワーカー間で共有される */
+	fflush(stdout);
+	fflush(stderr);
+	while (next_job < job_num || running > 0) {
+		pid_t pid;
+		int status;
+		struct timespec now;
+		/* 空いているワーカーに次のジョブを割り当てる */
+		while (next_job < job_num && running < (uint32_t)max_workers) {
+			job_entry* entry = &jobs[next_job];
+			clock_gettime(CLOCK_MONOTONIC, &entry->start_time);
+			pid = fork();
+			if (pid < 0) {
+				perror("fork");
+				if (running == 0) {
+					for (i = 0; i < job_num; i++) free_job(&jobs[i].job);
+					free(jobs);
+					return 1;
+				}
+				break;
+			} else if (pid == 0) {
+				run_job_child(&entry->job, runner);
+			}
+			entry->pid = pid;
+			next_job++;
+			running++;
+		}
+		/* 終わったジョブを回収する */
+		do {
+			pid = waitpid(-1, &status, 0);
+		} while (pid < 0 && errno == EINTR);
+		if (pid < 0) {
+			perror("waitpid");
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < next_job; i++) {
+			if (jobs[i].pid == pid) {
+				jobs[i].pid = -1;
+				jobs[i].status = status;
+				jobs[i].elapsed = (now.tv_sec - jobs[i].start_time.tv_sec) +
+					(now.tv_nsec - jobs[i].start_time.tv_nsec) / 1e9;
+				running--;
+				break;
+			}
+		}
+	}
+	for (i = 0; i < job_num; i++) {
+		int status = jobs[i].status;
+		if (status >= 0 && WIFEXITED(status)) {
+			fprintf(stderr, "job %"PRIu32": exit %d, %.6f sec\n", i, WEXITSTATUS(status), jobs[i].elapsed);
+			if (WEXITSTATUS(status) != 0) all_ok = 0;
+		} else if (status >= 0 && WIFSIGNALED(status)) {
+			fprintf(stderr, "job %"PRIu32": signal %d, %.6f sec\n", i, WTERMSIG(status), jobs[i].elapsed);
+			all_ok = 0;
+		} else {
+			fprintf(stderr, "job %"PRIu32": not run\n", i);
+			all_ok = 0;
+		}
+		free_job(&jobs[i].job);
+	}
+	free(jobs);
+	return all_ok ? 0 : 1;
+}
@@ -0,0 +1,25 @@
+#ifndef BATCH_RUNNER_H_GUARD_4E0B7C21_9D3A_4F6B_8C55_2A61D9E0F317
+#define BATCH_RUNNER_H_GUARD_4E0B7C21_9D3A_4F6B_8C55_2A61D9E0F317
+
+#include <stdint.h>
+
+typedef struct {
+	char* stdin_path; /* NULL = 継承する */
+	char* stdout_path; /* NULL = 継承する */
+	uint32_t argc;
+	char** argv;
+} batch_job;
+
+/* ジョブを実行し、終了ステータスを返す (子プロセスで呼ばれる) */
+typedef int (*batch_job_runner)(const batch_job* job);
+
+/*
+マニフェストの各行を1個のジョブとして、最大max_workers個の子プロセスで並列に実行する。
+行の形式 : 標準入力のファイル 標準出力のファイル 引数...
+ファイルに"-"を指定すると、インタプリタのものを引き継ぐ。空行と#で始まる行は無視する。
+max_workersが0以下のときは、オンラインのCPU数を用いる。
+全ジョブが成功した時0、そうでない時1を返す。
+*/
+int run_batch(const char* manifest_path, int max_workers, batch_job_runner runner);
+
+#endif
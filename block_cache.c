@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "block_cache.h"
+#include "dynamic_memory.h"
+#include "checkpoint.h"
+#include "read_file.h"
+
+#define BLOCK_HASH_SIZE 65536
+#define PAGE_HASH_SIZE 4096
+/* キャッシュに入れる命令の数の上限 (超えたら全て捨てる) */
+#define BLOCK_CACHE_INST_MAX (UINT32_C(1) << 18)
+/* 無効にしたまま残しておくブロックの数の上限 (超えたら全て捨てる) */
+#define BLOCK_CACHE_ZOMBIE_MAX 4096
+#define RETURN_STACK_SIZE 64
+/* 保存するファイルの形式の版 (変えたら古いファイルは使わない) */
+#define BLOCK_FILE_VERSION 3
+
+/* コードのあるページと、そこに命令があるブロック */
+typedef struct code_page code_page;
+struct code_page {
+	uint32_t page; /* アドレス / DMEMORY_PAGE_SIZE */
+	uint32_t low, high; /* ブロックの命令がある範囲 (ページ内のオフセット、highは含まない) */
+	x86_block** blocks;
+	uint32_t block_num, block_capacity;
+	code_page* next;
+};
+
+static x86_block** block_hash = NULL;
+static code_page* page_hash[PAGE_HASH_SIZE];
+static x86_block* all_blocks = NULL; /* 有効なブロックと、無効にして残しているブロック */
+static x86_block* garbage_blocks = NULL; /* 全て捨てた時の、解放を待つブロック */
+static uint32_t inst_total = 0, zombie_num = 0;
+/* 前回の保存か読み込みの後にブロックを作ったか */
+static int blocks_modified = 0;
+
+typedef struct {
+	uint32_t eip, esp;
+	x86_block* caller;
+} return_entry;
+
+/* 溢れたら古いものから上書きする */
+static return_entry return_stack[RETURN_STACK_SIZE];
+static uint32_t return_top = 0, return_num = 0;
+
+static uint32_t block_hash_index(uint32_t eip) {
+	return (eip * UINT32_C(2654435761)) >> 16;
+}
+
+static code_page* find_page(uint32_t page) {
+	code_page* cp;
+	for (cp = page_hash[page % PAGE_HASH_SIZE]; cp != NULL; cp = cp->next) {
+		if (cp->page == page) return cp;
+	}
+	return NULL;
+}
+
+/* ブロックの命令のうち、ページにある範囲 */
+static void block_range_in_page(const x86_block* block, uint32_t page, uint32_t* low, uint32_t* high) {
+	uint64_t page_start = (uint64_t)page * DMEMORY_PAGE_SIZE;
+	uint64_t start = block->code_addr, end = (uint64_t)block->code_addr + block->code_size;
+	if (start < page_start) start = page_start;
+	if (end > page_start + DMEMORY_PAGE_SIZE) end = page_start + DMEMORY_PAGE_SIZE;
+	*low = (uint32_t)(start - page_start);
+	*high = (uint32_t)(end - page_start);
+}
+
+static void page_add_block(uint32_t page, x86_block* block) {
+	code_page* cp = find_page(page);
+	uint32_t low, high;
+	if (cp == NULL) {
+		cp = malloc(sizeof(*cp));
+		if (cp == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		cp->page = page;
+		cp->low = DMEMORY_PAGE_SIZE;
+		cp->high = 0;
+		cp->blocks = NULL;
+		cp->block_num = cp->block_capacity = 0;
+		cp->next = page_hash[page % PAGE_HASH_SIZE];
+		page_hash[page % PAGE_HASH_SIZE] = cp;
+		dmemory_watch_code(page * DMEMORY_PAGE_SIZE, 1);
+	}
+	if (cp->block_num >= cp->block_capacity) {
+		uint32_t new_capacity = cp->block_capacity == 0 ? 16 : cp->block_capacity * 2;
+		x86_block** new_blocks = realloc(cp->blocks, sizeof(*new_blocks) * new_capacity);
+		if (new_blocks == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		cp->blocks = new_blocks;
+		cp->block_capacity = new_capacity;
+	}
+	cp->blocks[cp->block_num++] = block;
+	block_range_in_page(block, page, &low, &high);
+	if (low < cp->low) cp->low = low;
+	if (high > cp->high) cp->high = high;
+}
+
+static void free_page(code_page* cp) {
+	code_page** p = &page_hash[cp->page % PAGE_HASH_SIZE];
+	while (*p != cp) p = &(*p)->next;
+	*p = cp->next;
+	dmemory_watch_code(cp->page * DMEMORY_PAGE_SIZE, 0);
+	free(cp->blocks);
+	free(cp);
+}
+
+static void page_remove_block(uint32_t page, x86_block* block) {
+	code_page* cp = find_page(page);
+	uint32_t i, low, high;
+	if (cp == NULL) return;
+	for (i = 0; i < cp->block_num; i++) {
+		if (cp->blocks[i] == block) {
+			cp->blocks[i] = cp->blocks[--cp->block_num];
+			break;
+		}
+	}
+	if (cp->block_num == 0) {
+		free_page(cp);
+		return;
+	}
+	cp->low = DMEMORY_PAGE_SIZE;
+	cp->high = 0;
+	for (i = 0; i < cp->block_num; i++) {
+		block_range_in_page(cp->blocks[i], page, &low, &high);
+		if (low < cp->low) cp->low = low;
+		if (high > cp->high) cp->high = high;
+	}
+}
+
+static void invalidate_block(x86_block* block) {
+	x86_block** p = &block_hash[block_hash_index(block->eip)];
+	uint32_t page;
+	if (!block->valid) return;
+	block->valid = 0;
+	while (*p != block) p = &(*p)->hash_next;
+	*p = block->hash_next;
+	for (page = block->code_addr / DMEMORY_PAGE_SIZE;
+	page <= (block->code_addr + block->code_size - 1) / DMEMORY_PAGE_SIZE; page++) {
+		page_remove_block(page, block);
+	}
+	zombie_num++;
+}
+
+/* 登録したページが書き換えられる時に、書き換えられる範囲にあるブロックを無効にする */
+static void code_written(uint32_t addr, uint32_t size) {
+	uint32_t page = addr / DMEMORY_PAGE_SIZE;
+	uint32_t offset = addr % DMEMORY_PAGE_SIZE;
+	for (;;) {
+		code_page* cp = find_page(page);
+		x86_block* hit = NULL;
+		uint32_t i, low, high;
+		if (cp == NULL) {
+			dmemory_watch_code(addr, 0);
+			break;
+		}
+		if (offset >= cp->high || offset + size <= cp->low) break;
+		for (i = 0; i < cp->block_num; i++) {
+			block_range_in_page(cp->blocks[i], page, &low, &high);
+			if (offset < high && low < offset + size) {
+				hit = cp->blocks[i];
+				break;
+			}
+		}
+		if (hit == NULL) break;
+		/* ページの表が変わる (解放されることもある) ので、探し直す */
+		invalidate_block(hit);
+	}
+	if (zombie_num > BLOCK_CACHE_ZOMBIE_MAX) block_cache_flush();
+}
+
+static x86_block* find_block(uint32_t eip) {
+	x86_block* block;
+	if (block_hash == NULL) return NULL;
+	for (block = block_hash[block_hash_index(eip)]; block != NULL; block = block->hash_next) {
+		if (block->eip == eip) return block;
+	}
+	return NULL;
+}
+
+x86_block* block_cache_lookup(uint32_t eip) {
+	while (garbage_blocks != NULL) {
+		x86_block* next = garbage_blocks->all_next;
+		free(garbage_blocks);
+		garbage_blocks = next;
+	}
+	return find_block(eip);
+}
+
+x86_block* block_cache_new(uint32_t eip, uint32_t code_addr, uint32_t code_size,
+const x86_inst* insts, uint32_t inst_num) {
+	x86_block* block;
+	uint32_t i, page;
+	if (block_hash == NULL) {
+		block_hash = calloc(BLOCK_HASH_SIZE, sizeof(*block_hash));
+		if (block_hash == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+		dmemory_set_code_callback(code_written);
+	}
+	if (inst_total + inst_num > BLOCK_CACHE_INST_MAX) block_cache_flush();
+	block = malloc(sizeof(*block) + sizeof(*insts) * inst_num);
+	if (block == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	block->eip = eip;
+	block->code_addr = code_addr;
+	block->code_size = code_size;
+	block->valid = 1;
+	for (i = 0; i < X86_BLOCK_TARGET_NUM; i++) {
+		block->target_eip[i] = 0;
+		block->target_block[i] = NULL;
+	}
+	block->target_next = 0;
+	block->return_block = NULL;
+	memset(&block->loop, 0, sizeof(block->loop));
+	block->loop.kind = X86_LOOP_NONE;
+	block->optimized = 0;
+	block->exec_count = 0;
+	block->inst_num = inst_num;
+	memcpy(block->insts, insts, sizeof(*insts) * inst_num);
+
+	block->hash_next = block_hash[block_hash_index(eip)];
+	block_hash[block_hash_index(eip)] = block;
+	block->all_next = all_blocks;
+	all_blocks = block;
+	inst_total += inst_num;
+	for (page = code_addr / DMEMORY_PAGE_SIZE; page <= (code_addr + code_size - 1) / DMEMORY_PAGE_SIZE; page++) {
+		page_add_block(page, block);
+	}
+	blocks_modified = 1;
+	return block;
+}
+
+void block_cache_flush(void) {
+	x86_block* block = all_blocks;
+	uint32_t i;
+	if (block == NULL) return;
+	/* 使っている途中のブロックがあるかもしれないので、解放は次のblock_cache_lookupまで待つ */
+	for (;;) {
+		block->valid = 0;
+		if (block->all_next == NULL) break;
+		block = block->all_next;
+	}
+	block->all_next = garbage_blocks;
+	garbage_blocks = all_blocks;
+	all_blocks = NULL;
+	memset(block_hash, 0, sizeof(*block_hash) * BLOCK_HASH_SIZE);
+	for (i = 0; i < PAGE_HASH_SIZE; i++) {
+		while (page_hash[i] != NULL) free_page(page_hash[i]);
+	}
+	inst_total = 0;
+	zombie_num = 0;
+	return_num = 0;
+}
+
+x86_block* block_cache_follow(x86_block* from, uint32_t eip) {
+	x86_block* block;
+	uint32_t i, slot;
+	if (!from->valid) return find_block(eip);
+	slot = from->target_next;
+	for (i = 0; i < X86_BLOCK_TARGET_NUM; i++) {
+		if (from->target_block[i] != NULL && from->target_eip[i] == eip) {
+			if (from->target_block[i]->valid) return from->target_block[i];
+			slot = i;
+			break;
+		}
+	}
+	block = find_block(eip);
+	if (block != NULL) {
+		from->target_eip[slot] = eip;
+		from->target_block[slot] = block;
+		if (slot == from->target_next) from->target_next = (slot + 1) % X86_BLOCK_TARGET_NUM;
+	}
+	return block;
+}
+
+void block_cache_push_return(x86_block* caller, uint32_t return_eip, uint32_t esp) {
+	return_top = (return_top + 1) % RETURN_STACK_SIZE;
+	return_stack[return_top].eip = return_eip;
+	return_stack[return_top].esp = esp;
+	return_stack[return_top].caller = caller;
+	if (return_num < RETURN_STACK_SIZE) return_num++;
+}
+
+x86_block* block_cache_pop_return(uint32_t return_eip, uint32_t esp) {
+	return_entry* entry;
+	x86_block* block;
+	/* 戻りアドレスより下に積んだものは、longjmpなどで戻らずに捨てられた呼び出し */
+	while (return_num > 0 && return_stack[return_top].esp < esp) {
+		return_top = (return_top + RETURN_STACK_SIZE - 1) % RETURN_STACK_SIZE;
+		return_num--;
+	}
+	if (return_num == 0 || return_stack[return_top].esp != esp) return NULL;
+	entry = &return_stack[return_top];
+	return_top = (return_top + RETURN_STACK_SIZE - 1) % RETURN_STACK_SIZE;
+	return_num--;
+	if (entry->eip != return_eip || !entry->caller->valid) return NULL;
+	block = entry->caller->return_block;
+	if (block != NULL && block->valid && block->eip == return_eip) return block;
+	block = find_block(return_eip);
+	if (block != NULL) entry->caller->return_block = block;
+	return block;
+}
+
+/* ファイルの先頭 (形式・ビルド・キー・構造体の版と大きさ) */
+static void put_file_header(checkpoint_writer* writer, uint64_t key, const char* build_id) {
+	checkpoint_put_bytes(writer, "X86IBLKC", 8);
+	checkpoint_put_uint(writer, BLOCK_FILE_VERSION);
+	checkpoint_put_string(writer, build_id);
+	checkpoint_put_uint(writer, (uint32_t)key);
+	checkpoint_put_uint(writer, (uint32_t)(key >> 32));
+	checkpoint_put_uint(writer, X86_INST_LAYOUT_VERSION);
+	checkpoint_put_uint(writer, X86_LOOP_IDIOM_LAYOUT_VERSION);
+	checkpoint_put_uint(writer, sizeof(x86_inst));
+	checkpoint_put_uint(writer, sizeof(x86_loop_idiom));
+}
+
+int block_cache_save_file(const char* filename, uint64_t key, const char* build_id) {
+	checkpoint_writer writer;
+	x86_block* block;
+	uint32_t num = 0;
+	char* temp_name;
+	FILE* fp;
+	int ok = 1;
+	if (!blocks_modified) return 1;
+	for (block = all_blocks; block != NULL; block = block->all_next) {
+		if (block->valid) num++;
+	}
+	checkpoint_writer_init(&writer);
+	put_file_header(&writer, key, build_id);
+	checkpoint_put_uint(&writer, num);
+	for (block = all_blocks; block != NULL; block = block->all_next) {
+		uint8_t* code;
+		if (!block->valid) continue;
+		checkpoint_put_uint(&writer, block->eip);
+		checkpoint_put_uint(&writer, block->code_addr);
+		checkpoint_put_uint(&writer, block->code_size);
+		checkpoint_put_uint(&writer, block->inst_num);
+		checkpoint_put_bytes(&writer, &block->loop, sizeof(block->loop));
+		checkpoint_put_uint(&writer, (uint32_t)block->optimized);
+		checkpoint_put_bytes(&writer, block->insts, sizeof(*block->insts) * block->inst_num);
+		/* 読み込む時に、命令のバイト列が変わっていないかを確かめる */
+		code = malloc(block->code_size);
+		if (code == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		dmemory_read(code, block->code_addr, block->code_size);
+		checkpoint_put_bytes(&writer, code, block->code_size);
+		free(code);
+	}
+	if (writer.error) {
+		fprintf(stderr, "failed to build block cache file\n");
+		checkpoint_writer_free(&writer);
+		return 0;
+	}
+	/* 同時に保存する他のプロセスと混ざらないよう、一時ファイルに書いてから置き換える */
+	temp_name = malloc(strlen(filename) + 32);
+	if (temp_name == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	sprintf(temp_name, "%s.%ld.tmp", filename, (long)getpid());
+	fp = fopen(temp_name, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "block cache file open failed\n");
+		ok = 0;
+	} else {
+		if (fwrite(writer.data, 1, writer.size, fp) != writer.size) ok = 0;
+		if (fclose(fp) != 0) ok = 0;
+		if (ok && rename(temp_name, filename) != 0) ok = 0;
+		if (!ok) {
+			fprintf(stderr, "block cache file write failed\n");
+			remove(temp_name);
+		}
+	}
+	if (ok) blocks_modified = 0;
+	free(temp_name);
+	checkpoint_writer_free(&writer);
+	return ok;
+}
+
+int block_cache_load_file(const char* filename, uint64_t key, const char* build_id) {
+	checkpoint_writer expected;
+	checkpoint_reader reader;
+	file_image image;
+	x86_inst* insts = NULL;
+	uint8_t *code = NULL, *current = NULL;
+	uint32_t num, i;
+	int modified = blocks_modified;
+	/* まだ保存されていないのは普通のことなので、何も言わない */
+	if (access(filename, R_OK) != 0) return 0;
+	if (!open_file_image(&image, filename)) return 0;
+	checkpoint_writer_init(&expected);
+	put_file_header(&expected, key, build_id);
+	/* 別のビルドや別のイメージのファイルは使わない */
+	if (expected.error || image.size < expected.size ||
+	memcmp(image.data, expected.data, expected.size) != 0) {
+		checkpoint_writer_free(&expected);
+		close_file_image(&image);
+		return 0;
+	}
+	reader.data = image.data;
+	reader.size = image.size;
+	reader.pos = expected.size;
+	reader.error = 0;
+	checkpoint_writer_free(&expected);
+	num = checkpoint_get_uint(&reader);
+	for (i = 0; i < num && !reader.error; i++) {
+		x86_loop_idiom loop;
+		int optimized;
+		uint32_t eip = checkpoint_get_uint(&reader);
+		uint32_t code_addr = checkpoint_get_uint(&reader);
+		uint32_t code_size = checkpoint_get_uint(&reader);
+		uint32_t inst_num = checkpoint_get_uint(&reader);
+		x86_block* block;
+		checkpoint_get_bytes(&reader, &loop, sizeof(loop));
+		optimized = checkpoint_get_uint(&reader) != 0;
+		if (reader.error || inst_num == 0 || code_size == 0 ||
+		inst_num > (reader.size - reader.pos) / sizeof(*insts) || code_size > reader.size - reader.pos) {
+			reader.error = 1;
+			break;
+		}
+		free(insts);
+		free(code);
+		free(current);
+		insts = malloc(sizeof(*insts) * inst_num);
+		code = malloc(code_size);
+		current = malloc(code_size);
+		if (insts == NULL || code == NULL || current == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		checkpoint_get_bytes(&reader, insts, sizeof(*insts) * inst_num);
+		checkpoint_get_bytes(&reader, code, code_size);
+		if (reader.error) break;
+		/* 既にあるブロックと、命令のバイト列が今のメモリと違うブロックは使わない */
+		if (find_block(eip) != NULL || code_addr > UINT32_MAX - (code_size - 1) ||
+		!dmemory_is_allocated(code_addr, code_size)) continue;
+		dmemory_read(current, code_addr, code_size);
+		if (memcmp(code, current, code_size) != 0) continue;
+		block = block_cache_new(eip, code_addr, code_size, insts, inst_num);
+		block->loop = loop;
+		block->optimized = optimized;
+	}
+	free(insts);
+	free(code);
+	free(current);
+	close_file_image(&image);
+	/* 読み込んだブロックは保存し直さなくてよい */
+	blocks_modified = modified;
+	if (reader.error) {
+		fprintf(stderr, "warning: block cache file %s is broken, ignored\n", filename);
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,104 @@
+#ifndef BLOCK_CACHE_H_GUARD_1ECB5979_FE3A_4F62_AF2A_F9F00453BF87
+#define BLOCK_CACHE_H_GUARD_1ECB5979_FE3A_4F62_AF2A_F9F00453BF87
+
+#include <stdint.h>
+#include "x86_inst.h"
+
+/*
+デコードした命令の列 (ブロック) のキャッシュ。
+ブロックは分岐命令などで終わる連続した命令で、先頭のEIPで引く。
+コードのあるページはdmemory_watch_codeで登録し、書き換えられたら重なるブロックを無効にする。
+無効にしたブロックはvalidを偽にして残しておき、block_cache_lookupを呼んだ時にまとめて解放する。
+*/
+
+/* ブロックに入れる命令の最大数 */
+#define X86_BLOCK_INST_MAX 64
+/* ブロックごとに覚える分岐先の数 */
+#define X86_BLOCK_TARGET_NUM 4
+
+typedef struct x86_block x86_block;
+
+/* ブロック全体が1バイトずつ進むループになっている時の、その種類 */
+enum {
+	X86_LOOP_NONE,
+	X86_LOOP_COPY, /* [src]から[dest]へ1バイトずつコピーし、countのレジスタが0になるまで繰り返す */
+	X86_LOOP_SCAN /* [src]から1バイトずつ、値と一致するまで進む */
+};
+
+/* x86_loop_idiomのメンバやその意味を変えたら増やす (X86_INST_LAYOUT_VERSIONと同じ) */
+#define X86_LOOP_IDIOM_LAYOUT_VERSION 1
+
+typedef struct {
+	uint8_t kind;
+	uint8_t src_reg, dest_reg, count_reg; /* 1ずつ進めるレジスタと、1ずつ減らして数えるレジスタ */
+	uint8_t src_inst, dest_inst; /* メモリを読む命令と書く命令の位置 */
+	uint8_t src_advanced; /* src_instより前でsrc_regを進めるか */
+	uint8_t value_kind, value_reg; /* SCANで比べる値 (OP_KIND_IMM/OP_KIND_REG/OP_KIND_REG_HIGH8) */
+	uint32_t value;
+} x86_loop_idiom;
+
+struct x86_block {
+	uint32_t eip; /* 先頭の命令のEIP */
+	uint32_t code_addr, code_size; /* 命令のバイト列の (セグメントを足した) アドレスと大きさ */
+	int valid;
+
+	/* 最後の命令の分岐先と、そのブロック (直接の分岐も間接の分岐も同じ表を使う) */
+	uint32_t target_eip[X86_BLOCK_TARGET_NUM];
+	x86_block* target_block[X86_BLOCK_TARGET_NUM];
+	uint32_t target_next; /* 次に置き換える要素 */
+	/* 最後の命令がCALLの時、そこから戻った先のブロック */
+	x86_block* return_block;
+	/* ループをまとめて実行できる形なら、その内容 */
+	x86_loop_idiom loop;
+	/* フラグの解析とループの照合を済ませたか (済ませていなければ、全てのフラグを求める) */
+	int optimized;
+	uint32_t exec_count; /* 済ませる前に、ブロックの先頭から実行した回数 */
+
+	x86_block* hash_next;
+	x86_block* all_next;
+
+	uint32_t inst_num;
+	x86_inst insts[];
+};
+
+/*
+EIPから始まる有効なブロックを探す (無ければNULL)。
+無効にしたブロックをここで解放するので、以前に得たブロックへのポインタは使えなくなる。
+*/
+x86_block* block_cache_lookup(uint32_t eip);
+
+/* デコードした命令の列からブロックを作ってキャッシュに入れる */
+x86_block* block_cache_new(uint32_t eip, uint32_t code_addr, uint32_t code_size,
+	const x86_inst* insts, uint32_t inst_num);
+
+/* 全てのブロックを無効にする */
+void block_cache_flush(void);
+
+/*
+fromの最後の命令で分岐した先のブロックを探す。
+fromの分岐先の表に無ければ全体から探して表に覚える。見つからなければNULLを返す。
+*/
+x86_block* block_cache_follow(x86_block* from, uint32_t eip);
+
+/*
+戻りアドレスのスタック (シャドウスタック)。
+CALLの後に、戻りアドレスとそれを積んだ位置を記録する。RETで読んだ戻りアドレスと位置が一致すれば、
+記録したCALLのブロックが覚えている戻り先のブロックを返す (一致しなければNULL)。
+*/
+void block_cache_push_return(x86_block* caller, uint32_t return_eip, uint32_t esp);
+x86_block* block_cache_pop_return(uint32_t return_eip, uint32_t esp);
+
+/*
+有効なブロックをファイルに保存する。keyとbuild_idは読み込む時に一致を確かめる。
+同じディレクトリの一時ファイルに書いてから置き換えるので、複数のプロセスが同時に保存してもよい。
+前回の保存か読み込みの後に新しいブロックができていなければ、何もしない。
+*/
+int block_cache_save_file(const char* filename, uint64_t key, const char* build_id);
+
+/*
+block_cache_save_fileで保存したブロックを読み込む。命令のバイト列が今のメモリと一致するブロックだけを使う。
+ファイルが無い、keyやbuild_idが違う、または壊れている時は0を返す。
+*/
+int block_cache_load_file(const char* filename, uint64_t key, const char* build_id);
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include "block_worker.h"
+
+/* 待ち行列の要素数 */
+#define WORKER_QUEUE_SIZE 64
+
+enum {
+	JOB_EMPTY, /* ゲストのスレッドが使える */
+	JOB_QUEUED, /* 最適化のスレッドが使う */
+	JOB_DONE /* 最適化が済み、ゲストのスレッドが受け取る */
+};
+
+typedef struct {
+	atomic_int state;
+	uint32_t eip, inst_num;
+	x86_inst original[X86_BLOCK_INST_MAX];
+	x86_inst optimized[X86_BLOCK_INST_MAX];
+	x86_loop_idiom loop;
+} worker_job;
+
+static worker_job jobs[WORKER_QUEUE_SIZE];
+/* submit_indexとcollect_indexはゲストのスレッドだけが、work_indexは最適化のスレッドだけが使う */
+static uint32_t submit_index = 0, collect_index = 0, work_index = 0;
+/* 入れたものの数だけ増やし、最適化のスレッドはこれで待つ */
+static sem_t queued_sem;
+static block_worker_optimize optimize_func = NULL;
+/* スレッドを起動したプロセス (fork()した子プロセスにはスレッドが無い) */
+static pid_t started_pid = 0;
+
+static void* worker_main(void* arg) {
+	(void)arg;
+	for (;;) {
+		worker_job* job = &jobs[work_index % WORKER_QUEUE_SIZE];
+		if (sem_wait(&queued_sem) != 0) continue; /* シグナルで中断された */
+		/* ゲストのスレッドが書いた命令の列を、状態を読んだ後で読む */
+		if (atomic_load_explicit(&job->state, memory_order_acquire) != JOB_QUEUED) continue;
+		memcpy(job->optimized, job->original, sizeof(*job->original) * job->inst_num);
+		memset(&job->loop, 0, sizeof(job->loop));
+		job->loop.kind = X86_LOOP_NONE;
+		optimize_func(job->optimized, job->inst_num, &job->loop);
+		atomic_store_explicit(&job->state, JOB_DONE, memory_order_release);
+		work_index++;
+	}
+	return NULL;
+}
+
+int block_worker_start(block_worker_optimize optimize) {
+	pthread_t thread;
+	uint32_t i, queued = 0;
+	int err;
+	if (started_pid == getpid()) return 1;
+	if (started_pid != 0) {
+		/* fork()した子プロセスなので、まだ最適化していないものを新しいスレッドに渡し直す */
+		sem_destroy(&queued_sem);
+		work_index = collect_index;
+		while (work_index != submit_index &&
+		atomic_load_explicit(&jobs[work_index % WORKER_QUEUE_SIZE].state, memory_order_acquire) == JOB_DONE) {
+			work_index++;
+		}
+		queued = submit_index - work_index;
+	} else {
+		for (i = 0; i < WORKER_QUEUE_SIZE; i++) atomic_init(&jobs[i].state, JOB_EMPTY);
+	}
+	if (sem_init(&queued_sem, 0, queued) != 0) {
+		perror("sem_init");
+		started_pid = 0;
+		return 0;
+	}
+	optimize_func = optimize;
+	err = pthread_create(&thread, NULL, worker_main, NULL);
+	if (err != 0) {
+		fprintf(stderr, "failed to start optimizing thread: %s\n", strerror(err));
+		sem_destroy(&queued_sem);
+		started_pid = 0;
+		return 0;
+	}
+	/* 終了を待たない (ゲストが終わればプロセスごと終える) */
+	pthread_detach(thread);
+	started_pid = getpid();
+	return 1;
+}
+
+int block_worker_submit(const x86_block* block) {
+	worker_job* job = &jobs[submit_index % WORKER_QUEUE_SIZE];
+	if (started_pid == 0 || block->inst_num > X86_BLOCK_INST_MAX) return 0;
+	if (atomic_load_explicit(&job->state, memory_order_acquire) != JOB_EMPTY) return 0;
+	job->eip = block->eip;
+	job->inst_num = block->inst_num;
+	memcpy(job->original, block->insts, sizeof(*block->insts) * block->inst_num);
+	atomic_store_explicit(&job->state, JOB_QUEUED, memory_order_release);
+	submit_index++;
+	sem_post(&queued_sem);
+	return 1;
+}
+
+uint32_t block_worker_pending(void) {
+	return submit_index - collect_index;
+}
+
+void block_worker_collect(block_worker_apply apply) {
+	while (collect_index != submit_index) {
+		worker_job* job = &jobs[collect_index % WORKER_QUEUE_SIZE];
+		if (atomic_load_explicit(&job->state, memory_order_acquire) != JOB_DONE) break;
+		apply(job->eip, job->original, job->optimized, job->inst_num, &job->loop);
+		atomic_store_explicit(&job->state, JOB_EMPTY, memory_order_release);
+		collect_index++;
+	}
+}
@@ -0,0 +1,33 @@
+#ifndef BLOCK_WORKER_H_GUARD_BF40668F_DD5D_468F_8EC9_F3390A6C1D66
+#define BLOCK_WORKER_H_GUARD_BF40668F_DD5D_468F_8EC9_F3390A6C1D66
+
+#include <stdint.h>
+#include "x86_inst.h"
+#include "block_cache.h"
+
+/*
+ブロックの最適化 (フラグの解析とループの照合) を別のスレッドで行う。
+ゲストのスレッドは命令のコピーを待ち行列に入れて実行を続け、済んだものを後で受け取ってブロックに反映する。
+待ち行列は1個ずつの書き手と読み手のリングで、要素の受け渡しはアトミックな状態の読み書きで行う。
+*/
+
+/* 命令の列を最適化する (別のスレッドで呼ぶので、ゲストの状態を読み書きしてはいけない) */
+typedef void (*block_worker_optimize)(x86_inst* insts, uint32_t inst_num, x86_loop_idiom* loop);
+
+/* 最適化した結果を反映する (ゲストのスレッドで呼ぶ)。originalは入れた時の命令の列 */
+typedef void (*block_worker_apply)(uint32_t eip, const x86_inst* original, const x86_inst* optimized,
+	uint32_t inst_num, const x86_loop_idiom* loop);
+
+/* スレッドを起動する (fork()した子プロセスでは起動し直す)。成功:1 失敗:0 */
+int block_worker_start(block_worker_optimize optimize);
+
+/* ブロックを最適化の待ち行列に入れる。待ち行列がいっぱいなどで入れられなければ0を返す */
+int block_worker_submit(const x86_block* block);
+
+/* 入れたもののうち、まだ受け取っていないものの数 */
+uint32_t block_worker_pending(void);
+
+/* 最適化が済んだものを、入れた順にapplyに渡す */
+void block_worker_collect(block_worker_apply apply);
+
+#endif
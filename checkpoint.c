@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dynamic_memory.h"
+#include "checkpoint.h"
+
+/*
+ファイルの形式 (数値は全てリトルエンディアン)
+  0: "X86ICKPT"
+  8: バージョン (4バイト)
+ 12: ページの大きさ (4バイト)
+ 16: 状態のオフセット (8バイト)
+ 24: 状態の大きさ (8バイト)
+ 32: ページのアドレス表のオフセット (8バイト) 各4バイト
+ 40: ページ数 (8バイト)
+ 48: ページデータのオフセット (8バイト) ページ境界に揃える
+*/
+#define CHECKPOINT_VERSION 11
+#define HEADER_SIZE 56
+
+static uint64_t read_num(const uint8_t* data, int size) {
+	uint64_t ret = 0;
+	int i;
+	for (i = 0; i < size; i++) {
+		ret |= (uint64_t)data[i] << (i * 8);
+	}
+	return ret;
+}
+
+static void write_num(uint8_t* out, uint64_t value, int size) {
+	int i;
+	for (i = 0; i < size; i++) {
+		out[i] = (value >> (8 * i)) & 0xff;
+	}
+}
+
+void checkpoint_writer_init(checkpoint_writer* writer) {
+	writer->data = NULL;
+	writer->size = 0;
+	writer->capacity = 0;
+	writer->error = 0;
+}
+
+void checkpoint_writer_free(checkpoint_writer* writer) {
+	free(writer->data);
+	checkpoint_writer_init(writer);
+}
+
+void checkpoint_put_bytes(checkpoint_writer* writer, const void* data, size_t size) {
+	if (writer->error) return;
+	if (writer->capacity - writer->size < size) {
+		size_t new_capacity = writer->capacity == 0 ? 4096 : writer->capacity;
+		uint8_t* new_data;
+		while (new_capacity - writer->size < size) {
+			if (new_capacity > SIZE_MAX / 2) {
+				writer->error = 1;
+				return;
+			}
+			new_capacity *= 2;
+		}
+		new_data = realloc(writer->data, new_capacity);
+		if (new_data == NULL) {
+			writer->error = 1;
+			return;
+		}
+		writer->data = new_data;
+		writer->capacity = new_capacity;
+	}
+	memcpy(writer->data + writer->size, data, size);
+	writer->size += size;
+}
+
+void checkpoint_put_uint(checkpoint_writer* writer, uint32_t value) {
+	uint8_t buffer[4];
+	write_num(buffer, value, 4);
+	checkpoint_put_bytes(writer, buffer, 4);
+}
+
+void checkpoint_put_string(checkpoint_writer* writer, const char* str) {
+	/* 長さ+1を書き込み、NULLは0で表す */
+	if (str == NULL) {
+		checkpoint_put_uint(writer, 0);
+	} else {
+		size_t len = strlen(str);
+		if (len >= UINT32_MAX) {
+			writer->error = 1;
+			return;
+		}
+		checkpoint_put_uint(writer, (uint32_t)len + 1);
+		checkpoint_put_bytes(writer, str, len);
+	}
+}
+
+void checkpoint_get_bytes(checkpoint_reader* reader, void* out, size_t size) {
+	if (reader->error || reader->size - reader->pos < size) {
+		reader->error = 1;
+		memset(out, 0, size);
+		return;
+	}
+	memcpy(out, reader->data + reader->pos, size);
+	reader->pos += size;
+}
+
+uint32_t checkpoint_get_uint(checkpoint_reader* reader) {
+	uint8_t buffer[4];
+	checkpoint_get_bytes(reader, buffer, 4);
+	return (uint32_t)read_num(buffer, 4);
+}
+
+char* checkpoint_get_string(checkpoint_reader* reader) {
+	uint32_t len = checkpoint_get_uint(reader);
+	char* str;
+	if (len == 0 || reader->error) return NULL;
+	len--;
+	if (reader->size - reader->pos < len) {
+		reader->error = 1;
+		return NULL;
+	}
+	str = malloc((size_t)len + 1);
+	if (str == NULL) {
+		reader->error = 1;
+		return NULL;
+	}
+	checkpoint_get_bytes(reader, str, len);
+	str[len] = '\0';
+	return str;
+}
+
+typedef struct {
+	FILE* fp;
+	uint32_t* addrs;
+	uint64_t num, capacity;
+	int error;
+} page_list;
+
+static void collect_page(void* ctx, uint32_t addr, const uint8_t* data) {
+	page_list* list = ctx;
+	(void)data;
+	if (list->error) return;
+	if (list->num >= list->capacity) {
+		uint64_t new_capacity = list->capacity == 0 ? 1024 : list->capacity * 2;
+		uint32_t* new_addrs = realloc(list->addrs, sizeof(*new_addrs) * new_capacity);
+		if (new_addrs == NULL) {
+			list->error = 1;
+			return;
+		}
+		list->addrs = new_addrs;
+		list->capacity = new_capacity;
+	}
+	list->addrs[list->num++] = addr;
+}
+
+static void write_page(void* ctx, uint32_t addr, const uint8_t* data) {
+	page_list* list = ctx;
+	(void)addr;
+	if (list->error) return;
+	if (fwrite(data, 1, DMEMORY_PAGE_SIZE, list->fp) != DMEMORY_PAGE_SIZE) list->error = 1;
+}
+
+static int write_padding(FILE* fp, uint64_t from, uint64_t to) {
+	static const uint8_t zero[DMEMORY_PAGE_SIZE];
+	while (from < to) {
+		size_t size = to - from < DMEMORY_PAGE_SIZE ? (size_t)(to - from) : DMEMORY_PAGE_SIZE;
+		if (fwrite(zero, 1, size, fp) != size) return 0;
+		from += size;
+	}
+	return 1;
+}
+
+int checkpoint_save(const char* filename, const checkpoint_writer* state) {
+	uint8_t header[HEADER_SIZE];
+	page_list list;
+	uint64_t state_offset = HEADER_SIZE, table_offset, data_offset, i;
+	int ok = 1;
+	if (state->error) {
+		fprintf(stderr, "failed to build checkpoint state\n");
+		return 0;
+	}
+	list.fp = NULL;
+	list.addrs = NULL;
+	list.num = list.capacity = 0;
+	list.error = 0;
+	dmemory_for_each_page(collect_page, &list);
+	if (list.error) {
+		fprintf(stderr, "failed to list pages for checkpoint\n");
+		free(list.addrs);
+		return 0;
+	}
+	table_offset = state_offset + state->size;
+	data_offset = table_offset + 4 * list.num;
+	data_offset = (data_offset + DMEMORY_PAGE_SIZE - 1) / DMEMORY_PAGE_SIZE * DMEMORY_PAGE_SIZE;
+
+	list.fp = fopen(filename, "wb");
+	if (list.fp == NULL) {
+		fprintf(stderr, "checkpoint file open failed\n");
+		free(list.addrs);
+		return 0;
+	}
+	memcpy(header, "X86ICKPT", 8);
+	write_num(header + 8, CHECKPOINT_VERSION, 4);
+	write_num(header + 12, DMEMORY_PAGE_SIZE, 4);
+	write_num(header + 16, state_offset, 8);
+	write_num(header + 24, state->size, 8);
+	write_num(header + 32, table_offset, 8);
+	write_num(header + 40, list.num, 8);
+	write_num(header + 48, data_offset, 8);
+	if (fwrite(header, 1, HEADER_SIZE, list.fp) != HEADER_SIZE ||
+	(state->size > 0 && fwrite(state->data, 1, state->size, list.fp) != state->size)) ok = 0;
+	for (i = 0; ok && i < list.num; i++) {
+		uint8_t entry[4];
+		write_num(entry, list.addrs[i], 4);
+		if (fwrite(entry, 1, 4, list.fp) != 4) ok = 0;
+	}
+	if (ok) ok = write_padding(list.fp, table_offset + 4 * list.num, data_offset);
+	if (ok) {
+		dmemory_for_each_page(write_page, &list);
+		ok = !list.error;
+	}
+	if (fclose(list.fp) != 0) ok = 0;
+	free(list.addrs);
+	if (!ok) fprintf(stderr, "checkpoint file write error\n");
+	return ok;
+}
+
+int checkpoint_load(checkpoint_reader* state, const char* filename) {
+	int fd;
+	struct stat st;
+	uint8_t* data;
+	uint64_t filesize, state_offset, state_size, table_offset, page_num, data_offset, i;
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "checkpoint file open failed\n");
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < HEADER_SIZE) {
+		fprintf(stderr, "checkpoint file too small\n");
+		close(fd);
+		return 0;
+	}
+	filesize = (uint64_t)st.st_size;
+	/* ページのデータは書き込み時に複製されるので、マップは読み込み専用でよく、解除もしない */
+	data = mmap(NULL, (size_t)filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		return 0;
+	}
+	state_offset = read_num(data + 16, 8);
+	state_size = read_num(data + 24, 8);
+	table_offset = read_num(data + 32, 8);
+	page_num = read_num(data + 40, 8);
+	data_offset = read_num(data + 48, 8);
+	if (memcmp(data, "X86ICKPT", 8) != 0 || read_num(data + 8, 4) != CHECKPOINT_VERSION ||
+	read_num(data + 12, 4) != DMEMORY_PAGE_SIZE) {
+		fprintf(stderr, "not a checkpoint file of this interpreter\n");
+		munmap(data, (size_t)filesize);
+		return 0;
+	}
+	if (state_offset > filesize || filesize - state_offset < state_size ||
+	table_offset > filesize || (filesize - table_offset) / 4 < page_num ||
+	data_offset % DMEMORY_PAGE_SIZE != 0 || data_offset > filesize ||
+	(filesize - data_offset) / DMEMORY_PAGE_SIZE < page_num) {
+		fprintf(stderr, "broken checkpoint file\n");
+		munmap(data, (size_t)filesize);
+		return 0;
+	}
+	for (i = 0; i < page_num; i++) {
+		uint32_t addr = (uint32_t)read_num(data + table_offset + 4 * i, 4);
+		dmemory_map_external(addr, DMEMORY_PAGE_SIZE, data + data_offset + DMEMORY_PAGE_SIZE * i);
+	}
+	state->data = data + state_offset;
+	state->size = (size_t)state_size;
+	state->pos = 0;
+	state->error = 0;
+	return 1;
+}
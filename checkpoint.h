@@ -0,0 +1,40 @@
+#ifndef CHECKPOINT_H_GUARD_8A3F5E12_C7D4_4B9E_A1F0_63D2B84E7C59
+#define CHECKPOINT_H_GUARD_8A3F5E12_C7D4_4B9E_A1F0_63D2B84E7C59
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 各モジュールの状態を書き出すバッファ。エラーはerrorに記録し、最後にまとめて確認する */
+typedef struct {
+	uint8_t* data;
+	size_t size, capacity;
+	int error;
+} checkpoint_writer;
+
+/* 書き出された状態を読み込む。範囲外の読み込みはerrorに記録する */
+typedef struct {
+	const uint8_t* data;
+	size_t size, pos;
+	int error;
+} checkpoint_reader;
+
+void checkpoint_writer_init(checkpoint_writer* writer);
+void checkpoint_writer_free(checkpoint_writer* writer);
+void checkpoint_put_uint(checkpoint_writer* writer, uint32_t value);
+void checkpoint_put_bytes(checkpoint_writer* writer, const void* data, size_t size);
+void checkpoint_put_string(checkpoint_writer* writer, const char* str); /* NULLも可 */
+
+uint32_t checkpoint_get_uint(checkpoint_reader* reader);
+void checkpoint_get_bytes(checkpoint_reader* reader, void* out, size_t size);
+char* checkpoint_get_string(checkpoint_reader* reader); /* mallocで確保する。NULLも返りうる */
+
+/*
+状態と割り当てられている全ページをファイルに書き出す。
+ファイルはページ境界に揃えて配置するので、読み込み時はmmapしたものをそのままページとして使う。
+*/
+int checkpoint_save(const char* filename, const checkpoint_writer* state);
+
+/* ファイルをマップしてページを割り当て、状態を読むためのreaderを設定する */
+int checkpoint_load(checkpoint_reader* state, const char* filename);
+
+#endif
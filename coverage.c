@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <string.h>
+#include "coverage.h"
+
+static uint8_t trace_map[COVERAGE_MAP_SIZE];
+static uint8_t total_map[COVERAGE_MAP_SIZE];
+static uint32_t prev_location = 0;
+
+void coverage_begin_run(void) {
+	memset(trace_map, 0, sizeof(trace_map));
+	prev_location = 0;
+}
+
+void coverage_record_block(uint32_t addr) {
+	uint32_t location = (addr * UINT32_C(2654435761)) >> 16;
+	uint8_t* counter = &trace_map[(location ^ prev_location) % COVERAGE_MAP_SIZE];
+	if (*counter < UINT8_MAX) (*counter)++;
+	prev_location = location >> 1;
+}
+
+/* 実行回数を1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128以上に区分したビットにする */
+static uint8_t count_to_bucket(uint8_t count) {
+	if (count == 0) return 0;
+	if (count <= 3) return 1 << (count - 1);
+	if (count <= 7) return 1 << 3;
+	if (count <= 15) return 1 << 4;
+	if (count <= 31) return 1 << 5;
+	if (count <= 127) return 1 << 6;
+	return 1 << 7;
+}
+
+uint32_t coverage_end_run(void) {
+	uint32_t i, new_cnt = 0;
+	for (i = 0; i < COVERAGE_MAP_SIZE; i++) {
+		uint8_t bucket;
+		if (trace_map[i] == 0) continue;
+		bucket = count_to_bucket(trace_map[i]);
+		if (bucket & ~total_map[i]) {
+			total_map[i] |= bucket;
+			new_cnt++;
+		}
+	}
+	return new_cnt;
+}
+
+int coverage_save(const char* filename) {
+	FILE* fp = fopen(filename, "wb");
+	int ok;
+	if (fp == NULL) {
+		fprintf(stderr, "failed to open coverage file %s\n", filename);
+		return 0;
+	}
+	ok = fwrite(total_map, 1, sizeof(total_map), fp) == sizeof(total_map);
+	if (fclose(fp) != 0) ok = 0;
+	if (!ok) fprintf(stderr, "failed to write coverage file %s\n", filename);
+	return ok;
+}
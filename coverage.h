@@ -0,0 +1,24 @@
+#ifndef COVERAGE_H_GUARD_E2FB3F10_EC0B_4EC0_94F2_300B9F0E9C74
+#define COVERAGE_H_GUARD_E2FB3F10_EC0B_4EC0_94F2_300B9F0E9C74
+
+#include <stdint.h>
+
+/*
+AFL形式の辺カバレッジを記録する。
+分岐命令の後に実行されるブロックの先頭アドレスをcoverage_record_blockに渡すと、
+直前のブロックとの組をマップに数える。
+*/
+#define COVERAGE_MAP_SIZE 65536
+
+/* 1回の実行のマップを初期化する */
+void coverage_begin_run(void);
+
+void coverage_record_block(uint32_t addr);
+
+/* 1回の実行の結果を累積マップに統合し、新しく現れた辺 (または実行回数の区分) の数を返す */
+uint32_t coverage_end_run(void);
+
+/* 累積マップをファイルに書き出す */
+int coverage_save(const char* filename);
+
+#endif
@@ -5,6 +5,7 @@
 #include "dynamic_memory.h"
 #include "dmem_utils.h"
 #include "dmem_libc_stdio.h"
+#include "checkpoint.h"
 
 /* 32 * 128 = 4096 */
 #define BYTE_PER_IOB_FILE 32
@@ -12,6 +13,7 @@
 
 typedef struct {
 	FILE* fp;
+	char* path; /* チェックポイントから開き直すため、fopenしたファイルの名前を保持する */
 	int is_standard;
 	int can_read;
 	int can_write;
@@ -55,6 +57,7 @@ int dmem_libc_stdio_initialize(uint32_t iob_addr_in) {
 	iob_addr = iob_addr_in;
 	for (i = 0; i < IOB_SIZE; i++) {
 		file_info[i].fp = NULL;
+		file_info[i].path = NULL;
 		file_info[i].is_standard = 0;
 		file_info[i].can_read = 0;
 		file_info[i].can_write = 0;
@@ -477,6 +480,8 @@ int dmem_libc_fclose(uint32_t* ret, uint32_t esp) {
 	fflush_ok = fflush_core(info);
 	fclose_ok = info->is_standard || fclose(info->fp) == 0;
 	info->fp = NULL;
+	free(info->path);
+	info->path = NULL;
 	info->is_standard = 0;
 	info->can_read = 0;
 	info->can_write = 0;
@@ -609,12 +614,12 @@ int dmem_libc_fopen(uint32_t* ret, uint32_t esp) {
 		*ret = 0;
 		return 1;
 	}
+	new_info->path = filename;
 	new_info->is_standard = 0;
 	new_info->can_read = (mode_decoded == MODE_READ || is_plus);
 	new_info->can_write = (mode_decoded != MODE_READ || is_plus);
 	new_info->previous_operation = POP_NONE;
 
-	free(filename);
 	free(mode);
 	*ret = ret_ptr;
 	return 1;
@@ -874,3 +879,75 @@ int dmem_read(uint32_t* ret, uint32_t esp) {
 	free(buffer);
 	return 1;
 }
+
+void dmem_libc_stdio_save_state(checkpoint_writer* writer) {
+	uint32_t i, num;
+	checkpoint_put_uint(writer, iob_addr);
+	for (num = 0, i = 0; i < IOB_SIZE; i++) {
+		if (file_info[i].fp != NULL) num++;
+	}
+	checkpoint_put_uint(writer, num);
+	for (i = 0; i < IOB_SIZE; i++) {
+		file_info_t* info = &file_info[i];
+		long pos;
+		if (info->fp == NULL) continue;
+		/* 標準入出力以外は、ファイル名と位置から開き直す */
+		pos = info->is_standard ? 0 : ftell(info->fp);
+		checkpoint_put_uint(writer, i);
+		checkpoint_put_uint(writer, info->is_standard);
+		checkpoint_put_string(writer, info->path);
+		checkpoint_put_uint(writer, pos < 0 ? 0 : (uint32_t)pos);
+		checkpoint_put_uint(writer, info->can_read);
+		checkpoint_put_uint(writer, info->can_write);
+		checkpoint_put_uint(writer, info->previous_operation);
+	}
+}
+
+int dmem_libc_stdio_load_state(checkpoint_reader* reader) {
+	uint32_t num, i;
+	/* 現在開いているファイルを閉じてから状態を戻す */
+	for (i = 0; i < IOB_SIZE; i++) {
+		if (file_info[i].fp != NULL && !file_info[i].is_standard) fclose(file_info[i].fp);
+		free(file_info[i].path);
+		file_info[i].path = NULL;
+	}
+	if (!dmem_libc_stdio_initialize(checkpoint_get_uint(reader))) return 0;
+	for (i = 0; i < IOB_SIZE; i++) file_info[i].fp = NULL;
+	num = checkpoint_get_uint(reader);
+	while (!reader->error && num-- > 0) {
+		uint32_t idx = checkpoint_get_uint(reader);
+		uint32_t is_standard = checkpoint_get_uint(reader);
+		char* path = checkpoint_get_string(reader);
+		uint32_t pos = checkpoint_get_uint(reader);
+		file_info_t* info;
+		if (reader->error || idx >= IOB_SIZE) {
+			free(path);
+			return 0;
+		}
+		info = &file_info[idx];
+		info->is_standard = is_standard;
+		info->can_read = checkpoint_get_uint(reader);
+		info->can_write = checkpoint_get_uint(reader);
+		info->previous_operation = (enum pop_t)checkpoint_get_uint(reader);
+		if (is_standard) {
+			free(path);
+			switch (idx) {
+			case FILE_INFO_IDX_STDIN: info->fp = stdin; break;
+			case FILE_INFO_IDX_STDOUT: info->fp = stdout; break;
+			case FILE_INFO_IDX_STDERR: info->fp = stderr; break;
+			default: return 0;
+			}
+		} else {
+			if (path == NULL) return 0;
+			info->fp = fopen(path, info->can_write ? "r+b" : "rb");
+			if (info->fp == NULL || fseek(info->fp, pos, SEEK_SET) != 0) {
+				fprintf(stderr, "failed to reopen %s from checkpoint\n", path);
+				free(path);
+				return 0;
+			}
+			info->path = path;
+			info->previous_operation = POP_SEEK;
+		}
+	}
+	return !reader->error;
+}
@@ -2,8 +2,11 @@
 #define DMEM_LIBC_STDIO_H_GUARD_3294DE58_BD9B_412C_A988_D2950B9E8913
 
 #include <stdint.h>
+#include "checkpoint.h"
 
 int dmem_libc_stdio_initialize(uint32_t iob_addr_in);
+void dmem_libc_stdio_save_state(checkpoint_writer* writer);
+int dmem_libc_stdio_load_state(checkpoint_reader* reader);
 
 int dmem_libc_fclose(uint32_t* ret, uint32_t esp);
 int dmem_libc_fflush(uint32_t* ret, uint32_t esp);
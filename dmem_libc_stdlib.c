@@ -4,6 +4,7 @@
 #include "dmem_libc_stdlib.h"
 #include "dynamic_memory.h"
 #include "dmem_utils.h"
+#include "checkpoint.h"
 
 #define HEAP_ALIGN UINT32_C(64)
 
@@ -216,3 +217,37 @@ int dmem_libc_realloc(uint32_t* ret, uint32_t esp) {
 	/* 指定の領域が見つからなかった */
 	return 0;
 }
+
+void dmem_libc_stdlib_save_state(checkpoint_writer* writer) {
+	heap_info_t* ptr;
+	uint32_t num = 0;
+	checkpoint_put_uint(writer, heap_start);
+	for (ptr = heap_info_head; ptr != NULL; ptr = ptr->next) num++;
+	checkpoint_put_uint(writer, num);
+	for (ptr = heap_info_head; ptr != NULL; ptr = ptr->next) {
+		checkpoint_put_uint(writer, ptr->size);
+		checkpoint_put_uint(writer, ptr->used);
+	}
+}
+
+int dmem_libc_stdlib_load_state(checkpoint_reader* reader) {
+	heap_info_t** pptr = &heap_info_head;
+	uint32_t num;
+	while (heap_info_head != NULL) {
+		heap_info_t* next = heap_info_head->next;
+		free(heap_info_head);
+		heap_info_head = next;
+	}
+	heap_start = checkpoint_get_uint(reader);
+	num = checkpoint_get_uint(reader);
+	while (!reader->error && num-- > 0) {
+		heap_info_t* node = malloc(sizeof(heap_info_t));
+		if (node == NULL) return 0;
+		node->size = checkpoint_get_uint(reader);
+		node->used = checkpoint_get_uint(reader);
+		node->next = NULL;
+		*pptr = node;
+		pptr = &node->next;
+	}
+	return !reader->error;
+}
@@ -2,8 +2,11 @@
 #define DMEM_LIBC_STDLIB_H_GUARD_A1E97A66_E562_4B10_B55F_C9DB80FDE5D2
 
 #include <stdint.h>
+#include "checkpoint.h"
 
 int dmem_libc_stdlib_initialize(uint32_t heap_start_addr);
+void dmem_libc_stdlib_save_state(checkpoint_writer* writer);
+int dmem_libc_stdlib_load_state(checkpoint_reader* reader);
 
 int dmem_libc_calloc(uint32_t* ret, uint32_t esp);
 int dmem_libc_free(uint32_t* ret, uint32_t esp);
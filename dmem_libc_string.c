@@ -32,88 +32,90 @@ int dmem_libc_strcpy(uint32_t* ret, uint32_t esp) {
 	str = dmem_read_string(src);
 	if (str == NULL) return 0;
 	str_len = strlen(str);
-	if (UINT32_MAX - 1 < str_len) return 0;
-	if (!dmemory_is_allocated(dest, (uint32_t)str_len + 1)) return 0;
+	if (UINT32_MAX - 1 < str_len || !dmemory_is_allocated(dest, (uint32_t)str_len + 1)) {
+		free(str);
+		return 0;
+	}
 	dmemory_write(str, dest, (uint32_t)str_len + 1);
+	free(str);
 	*ret = dest;
 	return 1;
 }
 
 int dmem_libc_strncpy(uint32_t* ret, uint32_t esp) {
+	uint8_t buffer[DMEMORY_PAGE_SIZE];
 	uint32_t dest, src, limit;
-	uint32_t i;
+	uint32_t done = 0;
 	int use_src = 1;
-	int printf(const char*, ...);
 	if (!dmem_get_args(esp, 3, &dest, &src, &limit)) return 0;
 	if (!dmemory_is_allocated(dest, limit)) return 0;
-	for (i = 0; i < limit; i++) {
-		uint8_t c;
-		int ok = 0;
+	/* 終端のNULまではページ単位で読んでコピーし、残りは0で埋める */
+	while (done < limit) {
+		uint32_t chunk = DMEMORY_PAGE_SIZE - (src + done) % DMEMORY_PAGE_SIZE;
+		if (chunk > limit - done) chunk = limit - done;
 		if (use_src) {
-			if (UINT32_MAX - i < src) return 0;
-			c = (uint8_t)dmem_read_uint(&ok, src + i, 1);
-			if (!ok) return 0;
-			if (c == 0) use_src = 0;
+			const uint8_t* nul;
+			if (UINT32_MAX - done < src || !dmemory_is_allocated(src + done, chunk)) return 0;
+			dmemory_read(buffer, src + done, chunk);
+			nul = memchr(buffer, 0, chunk);
+			if (nul != NULL) {
+				memset(buffer + (nul - buffer), 0, chunk - (uint32_t)(nul - buffer));
+				use_src = 0;
+			}
 		} else {
-			c = 0;
+			memset(buffer, 0, chunk);
 		}
-		dmemory_write(&c, dest + i, 1);
+		dmemory_write(buffer, dest + done, chunk);
+		done += chunk;
 	}
 	*ret = dest;
 	return 1;
 }
 
+/* 最大limitバイトの文字列を、両方のページを越えない範囲ずつ読み込んで比較する */
+static int compare_strings(uint32_t* ret, uint32_t sptr1, uint32_t sptr2, uint32_t limit) {
+	uint8_t buffer1[DMEMORY_PAGE_SIZE], buffer2[DMEMORY_PAGE_SIZE];
+	while (limit > 0) {
+		uint32_t chunk1 = DMEMORY_PAGE_SIZE - sptr1 % DMEMORY_PAGE_SIZE;
+		uint32_t chunk2 = DMEMORY_PAGE_SIZE - sptr2 % DMEMORY_PAGE_SIZE;
+		uint32_t chunk = chunk1 < chunk2 ? chunk1 : chunk2;
+		uint32_t i;
+		if (chunk > limit) chunk = limit;
+		if (!dmemory_is_allocated(sptr1, chunk) || !dmemory_is_allocated(sptr2, chunk)) return 0;
+		dmemory_read(buffer1, sptr1, chunk);
+		dmemory_read(buffer2, sptr2, chunk);
+		for (i = 0; i < chunk; i++) {
+			if (buffer1[i] > buffer2[i]) {
+				*ret = 1;
+				return 1;
+			} else if (buffer1[i] < buffer2[i]) {
+				*ret = -1;
+				return 1;
+			} else if (buffer1[i] == 0) { /* buffer1[i] == buffer2[i] */
+				*ret = 0;
+				return 1;
+			}
+		}
+		limit -= chunk;
+		if (limit == 0) break;
+		if (UINT32_MAX - sptr1 < chunk || UINT32_MAX - sptr2 < chunk) return 0;
+		sptr1 += chunk;
+		sptr2 += chunk;
+	}
+	*ret = 0;
+	return 1;
+}
+
 int dmem_libc_strcmp(uint32_t* ret, uint32_t esp) {
 	uint32_t sptr1, sptr2;
-	uint32_t i;
 	if (!dmem_get_args(esp, 2, &sptr1, &sptr2)) return 0;
-
-	for (i = 0; ; i++) {
-		uint32_t c1, c2;
-		int ok1, ok2;
-		if (UINT32_MAX - sptr1 < i || UINT32_MAX - sptr2 < i) return 0;
-		c1 = dmem_read_uint(&ok1, sptr1 + i, 1);
-		c2 = dmem_read_uint(&ok2, sptr2 + i, 1);
-		if (!(ok1 && ok2)) return 0;
-		if (c1 > c2) {
-			*ret = 1;
-			return 1;
-		} else if (c1 < c2) {
-			*ret = -1;
-			return 1;
-		} else if (c1 == 0) { /* c1 == c2 */
-			*ret = 0;
-			return 1;
-		}
-		if (i == UINT32_MAX) return 0;
-	}
+	return compare_strings(ret, sptr1, sptr2, UINT32_MAX);
 }
 
 int dmem_libc_strncmp(uint32_t* ret, uint32_t esp) {
 	uint32_t sptr1, sptr2, n;
-	uint32_t i;
 	if (!dmem_get_args(esp, 3, &sptr1, &sptr2, &n)) return 0;
-
-	for (i = 0; i < n; i++) {
-		uint32_t c1, c2;
-		int ok1, ok2;
-		if (UINT32_MAX - sptr1 < i || UINT32_MAX - sptr2 < i) return 0;
-		c1 = dmem_read_uint(&ok1, sptr1 + i, 1);
-		c2 = dmem_read_uint(&ok2, sptr2 + i, 1);
-		if (!(ok1 && ok2)) return 0;
-		if (c1 > c2) {
-			*ret = 1;
-			return 1;
-		} else if (c1 < c2) {
-			*ret = -1;
-			return 1;
-		} else if (c1 == 0) { /* c1 == c2 */
-			break;
-		}
-		if (i == UINT32_MAX) return 0;
-	}
-	*ret = 0;
-	return 1;
+	return compare_strings(ret, sptr1, sptr2, n);
 }
 
 int dmem_libc_strchr(uint32_t* ret, uint32_t esp) {
@@ -151,19 +153,29 @@ int dmem_libc_memset(uint32_t* ret, uint32_t esp) {
 
 int dmem_libc_strlen(uint32_t* ret, uint32_t esp) {
 	uint32_t str_ptr;
-	uint32_t i;
 	if (!dmem_get_args(esp, 1, &str_ptr)) return 0;
+	return dmem_string_length(ret, str_ptr);
+}
 
-	i = 0;
-	for (;;) {
-		int ok;
-		uint32_t c = dmem_read_uint(&ok, str_ptr + i, 1);
-		if (!ok) return 0;
-		if (c == 0) {
-			*ret = i;
+int dmem_libc_memchr(uint32_t* ret, uint32_t esp) {
+	uint8_t buffer[DMEMORY_PAGE_SIZE];
+	uint32_t ptr, target, size;
+	if (!dmem_get_args(esp, 3, &ptr, &target, &size)) return 0;
+	/* 見つかった所より先は、割り当てられていなくてもよい */
+	while (size > 0) {
+		uint32_t chunk = DMEMORY_PAGE_SIZE - ptr % DMEMORY_PAGE_SIZE;
+		const uint8_t* found;
+		if (chunk > size) chunk = size;
+		if (!dmemory_is_allocated(ptr, chunk)) return 0;
+		dmemory_read(buffer, ptr, chunk);
+		found = memchr(buffer, (uint8_t)target, chunk);
+		if (found != NULL) {
+			*ret = ptr + (uint32_t)(found - buffer);
 			return 1;
 		}
-		if (i == UINT32_MAX || UINT32_MAX - i - 1 < str_ptr) return 0;
-		i++;
+		size -= chunk;
+		ptr += chunk;
 	}
+	*ret = 0;
+	return 1;
 }
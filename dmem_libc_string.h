@@ -13,5 +13,6 @@ int dmem_libc_strncmp(uint32_t* ret, uint32_t esp);
 int dmem_libc_strchr(uint32_t* ret, uint32_t esp);
 int dmem_libc_memset(uint32_t* ret, uint32_t esp);
 int dmem_libc_strlen(uint32_t* ret, uint32_t esp);
+int dmem_libc_memchr(uint32_t* ret, uint32_t esp);
 
 #endif
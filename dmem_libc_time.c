@@ -2,6 +2,7 @@
 #include "dmem_libc_time.h"
 #include "dynamic_memory.h"
 #include "dmem_utils.h"
+#include "checkpoint.h"
 
 static uint32_t buffer_start;
 #define LOCALTIME_TM (buffer_start + UINT32_C(0)) /* 36 (0x24) bytes */
@@ -13,6 +14,14 @@ int dmem_libc_time_initialize(uint32_t buffer_start_addr) {
 	return 1;
 }
 
+void dmem_libc_time_save_state(checkpoint_writer* writer) {
+	checkpoint_put_uint(writer, buffer_start);
+}
+
+int dmem_libc_time_load_state(checkpoint_reader* reader) {
+	return dmem_libc_time_initialize(checkpoint_get_uint(reader));
+}
+
 int dmem_libc_localtime(uint32_t* ret, uint32_t esp) {
 	uint32_t time_addr;
 	uint32_t time_val;
@@ -2,8 +2,11 @@
 #define DMEM_LIBC_TIME_H_GUARD_BC438B62_33B4_4B18_8BDF_816472AD2787
 
 #include <stdint.h>
+#include "checkpoint.h"
 
 int dmem_libc_time_initialize(uint32_t buffer_start_addr);
+void dmem_libc_time_save_state(checkpoint_writer* writer);
+int dmem_libc_time_load_state(checkpoint_reader* reader);
 
 int dmem_libc_localtime(uint32_t* ret, uint32_t esp);
 int dmem_libc_strftime(uint32_t* ret, uint32_t esp);
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include "dmem_utils.h"
 #include "dynamic_memory.h"
 
@@ -26,21 +27,35 @@ uint32_t dmem_read_uint(int* ok, uint32_t addr, int size) {
 	return res;
 }
 
-char* dmem_read_string(uint32_t addr) {
+int dmem_string_length(uint32_t* length, uint32_t addr) {
+	uint8_t buffer[DMEMORY_PAGE_SIZE];
 	uint32_t size = 0;
-	uint8_t test_value;
+	/* ページ単位で読み込んで、終端のNULを探す */
+	for (;;) {
+		uint32_t chunk = DMEMORY_PAGE_SIZE - addr % DMEMORY_PAGE_SIZE;
+		const uint8_t* nul;
+		if (!dmemory_is_allocated(addr, chunk)) return 0;
+		dmemory_read(buffer, addr, chunk);
+		nul = memchr(buffer, 0, chunk);
+		if (nul != NULL) {
+			*length = size + (uint32_t)(nul - buffer);
+			return 1;
+		}
+		size += chunk;
+		addr += chunk;
+		if (addr == 0) return 0; /* アドレス空間の終わりを越えた */
+	}
+}
+
+char* dmem_read_string(uint32_t addr) {
+	uint32_t length;
 	char* ret;
-	/* 文字列の範囲を調べる(終端のNULを含む) */
-	do {
-		if (!dmemory_is_allocated(addr + size, 1)) return NULL;
-		dmemory_read(&test_value, addr + size, 1);
-		if (size == UINT32_MAX) return NULL;
-		size++;
-	} while (test_value != 0);
-	/* 調べた範囲を読み込む */
-	ret = malloc(size);
+	/* 文字列の範囲を調べる */
+	if (!dmem_string_length(&length, addr)) return NULL;
+	/* 調べた範囲を読み込む(終端のNULを含む) */
+	ret = malloc((size_t)length + 1);
 	if (ret == NULL) return NULL;
-	dmemory_read(ret, addr, size);
+	dmemory_read(ret, addr, length + 1);
 	return ret;
 }
 
@@ -5,6 +5,8 @@
 
 int dmem_write_uint(uint32_t addr, uint32_t value, int size);
 uint32_t dmem_read_uint(int* ok, uint32_t addr, int size);
+/* addrから始まる文字列の長さ (終端のNULを含まない) を求める */
+int dmem_string_length(uint32_t* length, uint32_t addr);
 char* dmem_read_string(uint32_t addr);
 int dmem_get_args(uint32_t esp, int num, ...);
 
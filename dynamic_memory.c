@@ -9,10 +9,121 @@
 #define SECOND_TABLE_SHIFT 12
 #define ALLOCATE_UNIT_SIZE 4096
 
-typedef uint8_t allocate_unit[ALLOCATE_UNIT_SIZE];
+#define PAGE_NUM (FIRST_TABLE_SIZE * SECOND_TABLE_SIZE)
+
+/* スナップショットと共有されるページ (ref_cnt > 1) や外部のデータを指すページは、書き込み前に複製する */
+typedef struct {
+	uint8_t* data;
+	uint32_t ref_cnt;
+	int is_external;
+} allocate_unit;
 typedef allocate_unit* allocate_unit_table[SECOND_TABLE_SIZE];
 
-static allocate_unit_table* aut_table[FIRST_TABLE_SIZE];
+struct dmemory_space {
+	allocate_unit_table* tables[FIRST_TABLE_SIZE];
+};
+
+/* aut_tableは現在のアドレス空間の表を指す */
+static dmemory_space initial_space;
+static dmemory_space* current_space = &initial_space;
+static allocate_unit_table** aut_table = initial_space.tables;
+
+/*
+割り当てただけのページが共有するゼロのページ。
+外部のデータとして扱うので最初の書き込みで複製され、参照は常に1個余分に持っておき解放しない。
+*/
+static const uint8_t zero_page[ALLOCATE_UNIT_SIZE];
+static allocate_unit zero_unit = {(uint8_t*)zero_page, 1, 1};
+
+struct dmemory_snapshot {
+	allocate_unit_table* tables[FIRST_TABLE_SIZE];
+};
+
+/* 基準のスナップショットから書き込みや割り当ての変化があったページ (ダーティビットとその一覧) */
+static const dmemory_snapshot* base_snapshot = NULL;
+static uint32_t dirty_listed[PAGE_NUM / 32];
+static uint32_t* dirty_pages = NULL;
+static uint32_t dirty_page_num = 0, dirty_page_capacity = 0;
+
+/* 実行するコードを読み込んだページ (内容が変わる時に通知する) と、その一覧 (解除されたページも残り得る) */
+static uint32_t code_watched[PAGE_NUM / 32];
+static uint32_t* code_pages = NULL;
+static uint32_t code_page_num = 0, code_page_capacity = 0;
+static dmemory_code_callback code_callback = NULL;
+
+static allocate_unit* new_unit(void) {
+	allocate_unit* unit = malloc(sizeof(*unit) + ALLOCATE_UNIT_SIZE);
+	if (unit == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	unit->data = (uint8_t*)(unit + 1);
+	unit->ref_cnt = 1;
+	unit->is_external = 0;
+	return unit;
+}
+
+static void release_unit(allocate_unit* unit) {
+	if (unit != NULL && --unit->ref_cnt == 0) free(unit);
+}
+
+static allocate_unit_table* new_table(void) {
+	allocate_unit_table* table = malloc(sizeof(*table));
+	int j;
+	if (table == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (j = 0; j < SECOND_TABLE_SIZE; j++) (*table)[j] = NULL;
+	return table;
+}
+
+static void mark_dirty(int fidx, int sidx) {
+	uint32_t page = (uint32_t)fidx * SECOND_TABLE_SIZE + sidx;
+	if (base_snapshot == NULL) return;
+	if (dirty_listed[page / 32] & (UINT32_C(1) << (page % 32))) return;
+	if (dirty_page_num >= dirty_page_capacity) {
+		uint32_t new_capacity = dirty_page_capacity == 0 ? 1024 : dirty_page_capacity * 2;
+		uint32_t* new_pages = realloc(dirty_pages, sizeof(*new_pages) * new_capacity);
+		if (new_pages == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		dirty_pages = new_pages;
+		dirty_page_capacity = new_capacity;
+	}
+	dirty_listed[page / 32] |= UINT32_C(1) << (page % 32);
+	dirty_pages[dirty_page_num++] = page;
+}
+
+/* 登録されたページなら、内容が変わる範囲を通知する */
+static void notify_code(int fidx, int sidx, uint32_t offset, uint32_t size) {
+	uint32_t page = (uint32_t)fidx * SECOND_TABLE_SIZE + sidx;
+	if (!(code_watched[page / 32] & (UINT32_C(1) << (page % 32)))) return;
+	if (code_callback != NULL) code_callback(page * ALLOCATE_UNIT_SIZE + offset, size);
+}
+
+static void clear_dirty(void) {
+	uint32_t i;
+	for (i = 0; i < dirty_page_num; i++) {
+		dirty_listed[dirty_pages[i] / 32] &= ~(UINT32_C(1) << (dirty_pages[i] % 32));
+	}
+	dirty_page_num = 0;
+}
+
+/* 書き込み用に、他と共有していないページを得る */
+static allocate_unit* get_unit_for_write(int fidx, int sidx) {
+	allocate_unit* unit = (*aut_table[fidx])[sidx];
+	if (unit->ref_cnt > 1 || unit->is_external) {
+		allocate_unit* copy = new_unit();
+		memcpy(copy->data, unit->data, ALLOCATE_UNIT_SIZE);
+		release_unit(unit);
+		(*aut_table[fidx])[sidx] = copy;
+		mark_dirty(fidx, sidx);
+		unit = copy;
+	}
+	return unit;
+}
 
 static int get_idxs(int* fidx_s, int* sidx_s, int* fidx_e, int* sidx_e, uint32_t addr, uint32_t size) {
 	if (size == 0) return 0;
@@ -39,7 +150,7 @@ void dmemory_read(void* dest, uint32_t addr, uint32_t size) {
 		for (j = jmin; j <= jmax; j++) {
 			if (read_size > size) read_size = size;
 			if (aut_table[i] != NULL && (*aut_table[i])[j] != NULL) {
-				memcpy(destu8, *(*aut_table[i])[j] + read_offset, read_size);
+				memcpy(destu8, (*aut_table[i])[j]->data + read_offset, read_size);
 			}
 			destu8 += read_size;
 			size -= read_size;
@@ -63,7 +174,9 @@ void dmemory_write(void* src, uint32_t addr, uint32_t size) {
 		for (j = jmin; j <= jmax; j++) {
 			if (write_size > size) write_size = size;
 			if (aut_table[i] != NULL && (*aut_table[i])[j] != NULL) {
-				memcpy(*(*aut_table[i])[j] + write_offset, srcu8, write_size);
+				notify_code(i, j, write_offset, write_size);
+				memcpy(get_unit_for_write(i, j)->data + write_offset, srcu8, write_size);
+				mark_dirty(i, j);
 			}
 			srcu8 += write_size;
 			size -= write_size;
@@ -73,6 +186,22 @@ void dmemory_write(void* src, uint32_t addr, uint32_t size) {
 	}
 }
 
+const uint8_t* dmemory_page_for_read(uint32_t addr) {
+	int fidx = (addr >> FIRST_TABLE_SHIFT) % FIRST_TABLE_SIZE;
+	int sidx = (addr >> SECOND_TABLE_SHIFT) % SECOND_TABLE_SIZE;
+	if (aut_table[fidx] == NULL || (*aut_table[fidx])[sidx] == NULL) return NULL;
+	return (*aut_table[fidx])[sidx]->data;
+}
+
+uint8_t* dmemory_page_for_write(uint32_t addr) {
+	int fidx = (addr >> FIRST_TABLE_SHIFT) % FIRST_TABLE_SIZE;
+	int sidx = (addr >> SECOND_TABLE_SHIFT) % SECOND_TABLE_SIZE;
+	if (aut_table[fidx] == NULL || (*aut_table[fidx])[sidx] == NULL) return NULL;
+	notify_code(fidx, sidx, 0, ALLOCATE_UNIT_SIZE);
+	mark_dirty(fidx, sidx);
+	return get_unit_for_write(fidx, sidx)->data;
+}
+
 void dmemory_allocate(uint32_t addr, uint32_t size) {
 	int fidx_s, sidx_s, fidx_e, sidx_e;
 	if (!get_idxs(&fidx_s, &sidx_s, &fidx_e, &sidx_e, addr, size)) return;
@@ -80,21 +209,12 @@ void dmemory_allocate(uint32_t addr, uint32_t size) {
 	for (i = fidx_s; i <= fidx_e; i++) {
 		int jmin = (i == fidx_s ? sidx_s : 0);
 		int jmax = (i == fidx_e ? sidx_e : SECOND_TABLE_SIZE - 1);
-		if (aut_table[i] == NULL) {
-			aut_table[i] = malloc(sizeof(*aut_table[i]));
-			if (aut_table[i] == NULL) {
-				perror("malloc");
-				exit(1);
-			}
-			for (j = 0; j < SECOND_TABLE_SIZE; j++) (*aut_table[i])[j] = NULL;
-		}
+		if (aut_table[i] == NULL) aut_table[i] = new_table();
 		for (j = jmin; j <= jmax; j++) {
 			if ((*aut_table[i])[j] == NULL) {
-				(*aut_table[i])[j] = calloc(1, sizeof(*(*aut_table[i])[j]));
-				if ((*aut_table[i])[j] == NULL) {
-					perror("calloc");
-					exit(1);
-				}
+				zero_unit.ref_cnt++;
+				(*aut_table[i])[j] = &zero_unit;
+				mark_dirty(i, j);
 			}
 		}
 	}
@@ -109,8 +229,12 @@ void dmemory_deallocate(uint32_t addr, uint32_t size) {
 		int jmax = (i == fidx_e ? sidx_e : SECOND_TABLE_SIZE - 1);
 		if (aut_table[i] != NULL) {
 			for (j = jmin; j <= jmax; j++) {
-				free((*aut_table[i])[j]);
-				(*aut_table[i])[j] = NULL;
+				if ((*aut_table[i])[j] != NULL) {
+					notify_code(i, j, 0, ALLOCATE_UNIT_SIZE);
+					release_unit((*aut_table[i])[j]);
+					(*aut_table[i])[j] = NULL;
+					mark_dirty(i, j);
+				}
 			}
 			if (jmin == 0 && jmax == SECOND_TABLE_SIZE - 1) {
 				free(aut_table[i]);
@@ -120,6 +244,56 @@ void dmemory_deallocate(uint32_t addr, uint32_t size) {
 	}
 }
 
+void dmemory_map_external(uint32_t addr, uint32_t size, const void* data) {
+	const uint8_t* datau8 = (const uint8_t*)data;
+	int fidx_s, sidx_s, fidx_e, sidx_e;
+	int i, j;
+	if (addr % ALLOCATE_UNIT_SIZE != 0 || size % ALLOCATE_UNIT_SIZE != 0) return;
+	if (!get_idxs(&fidx_s, &sidx_s, &fidx_e, &sidx_e, addr, size)) return;
+	for (i = fidx_s; i <= fidx_e; i++) {
+		int jmin = (i == fidx_s ? sidx_s : 0);
+		int jmax = (i == fidx_e ? sidx_e : SECOND_TABLE_SIZE - 1);
+		if (aut_table[i] == NULL) aut_table[i] = new_table();
+		for (j = jmin; j <= jmax; j++) {
+			allocate_unit* unit = malloc(sizeof(*unit));
+			if (unit == NULL) {
+				perror("malloc");
+				exit(1);
+			}
+			unit->data = (uint8_t*)datau8;
+			unit->ref_cnt = 1;
+			unit->is_external = 1;
+			if ((*aut_table[i])[j] != NULL) notify_code(i, j, 0, ALLOCATE_UNIT_SIZE);
+			release_unit((*aut_table[i])[j]);
+			(*aut_table[i])[j] = unit;
+			mark_dirty(i, j);
+			datau8 += ALLOCATE_UNIT_SIZE;
+		}
+	}
+}
+
+void dmemory_for_each_page(dmemory_page_callback callback, void* ctx) {
+	int i, j;
+	for (i = 0; i < FIRST_TABLE_SIZE; i++) {
+		if (aut_table[i] == NULL) continue;
+		for (j = 0; j < SECOND_TABLE_SIZE; j++) {
+			if ((*aut_table[i])[j] != NULL) {
+				uint32_t addr = ((uint32_t)i << FIRST_TABLE_SHIFT) | ((uint32_t)j << SECOND_TABLE_SHIFT);
+				callback(ctx, addr, (*aut_table[i])[j]->data);
+			}
+		}
+	}
+}
+
+int dmemory_is_dirty(uint32_t addr) {
+	uint32_t page = addr >> SECOND_TABLE_SHIFT;
+	return (dirty_listed[page / 32] >> (page % 32)) & 1;
+}
+
+uint32_t dmemory_dirty_page_count(void) {
+	return dirty_page_num;
+}
+
 int dmemory_is_allocated(uint32_t addr, uint32_t size) {
 	int fidx_s, sidx_s, fidx_e, sidx_e;
 	if (size == 0) return 1;
@@ -134,3 +308,177 @@ int dmemory_is_allocated(uint32_t addr, uint32_t size) {
 	}
 	return 1;
 }
+
+/* 現在のアドレス空間のページを共有する表を作る */
+static void share_tables(allocate_unit_table* tables[]) {
+	int i, j;
+	for (i = 0; i < FIRST_TABLE_SIZE; i++) {
+		if (aut_table[i] == NULL) {
+			tables[i] = NULL;
+		} else {
+			tables[i] = new_table();
+			for (j = 0; j < SECOND_TABLE_SIZE; j++) {
+				allocate_unit* unit = (*aut_table[i])[j];
+				if (unit != NULL) unit->ref_cnt++;
+				(*tables[i])[j] = unit;
+			}
+		}
+	}
+}
+
+static void release_tables(allocate_unit_table* tables[]) {
+	int i, j;
+	for (i = 0; i < FIRST_TABLE_SIZE; i++) {
+		if (tables[i] != NULL) {
+			for (j = 0; j < SECOND_TABLE_SIZE; j++) release_unit((*tables[i])[j]);
+			free(tables[i]);
+			tables[i] = NULL;
+		}
+	}
+}
+
+dmemory_snapshot* dmemory_take_snapshot(void) {
+	dmemory_snapshot* snapshot = malloc(sizeof(*snapshot));
+	if (snapshot == NULL) return NULL;
+	share_tables(snapshot->tables);
+	base_snapshot = snapshot;
+	clear_dirty();
+	return snapshot;
+}
+
+/* 現在のページをスナップショットのものに戻す */
+static void restore_page(const dmemory_snapshot* snapshot, int fidx, int sidx) {
+	allocate_unit* saved = snapshot->tables[fidx] == NULL ? NULL : (*snapshot->tables[fidx])[sidx];
+	allocate_unit* current;
+	if (aut_table[fidx] == NULL) {
+		if (saved == NULL) return;
+		aut_table[fidx] = new_table();
+	}
+	current = (*aut_table[fidx])[sidx];
+	if (current == saved) return;
+	if (current != NULL) notify_code(fidx, sidx, 0, ALLOCATE_UNIT_SIZE);
+	if (saved != NULL) saved->ref_cnt++;
+	release_unit(current);
+	(*aut_table[fidx])[sidx] = saved;
+}
+
+void dmemory_restore_snapshot(const dmemory_snapshot* snapshot) {
+	int i, j;
+	if (snapshot == base_snapshot) {
+		/* 変化したページのみを戻す */
+		uint32_t k;
+		for (k = 0; k < dirty_page_num; k++) {
+			restore_page(snapshot, dirty_pages[k] / SECOND_TABLE_SIZE, dirty_pages[k] % SECOND_TABLE_SIZE);
+		}
+	} else {
+		for (i = 0; i < FIRST_TABLE_SIZE; i++) {
+			if (aut_table[i] == NULL && snapshot->tables[i] == NULL) continue;
+			for (j = 0; j < SECOND_TABLE_SIZE; j++) restore_page(snapshot, i, j);
+		}
+		base_snapshot = snapshot;
+	}
+	clear_dirty();
+}
+
+void dmemory_free_snapshot(dmemory_snapshot* snapshot) {
+	if (snapshot == NULL) return;
+	release_tables(snapshot->tables);
+	if (base_snapshot == snapshot) {
+		base_snapshot = NULL;
+		clear_dirty();
+	}
+	free(snapshot);
+}
+
+dmemory_space* dmemory_current_space(void) {
+	return current_space;
+}
+
+dmemory_space* dmemory_new_space(void) {
+	dmemory_space* space = malloc(sizeof(*space));
+	int i;
+	if (space == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < FIRST_TABLE_SIZE; i++) space->tables[i] = NULL;
+	return space;
+}
+
+dmemory_space* dmemory_fork_space(void) {
+	dmemory_space* space = malloc(sizeof(*space));
+	if (space == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	share_tables(space->tables);
+	return space;
+}
+
+/* 解除されたページを一覧から除く */
+static void compact_code_pages(void) {
+	uint32_t i, num = 0;
+	for (i = 0; i < code_page_num; i++) {
+		uint32_t page = code_pages[i];
+		if (code_watched[page / 32] & (UINT32_C(1) << (page % 32))) code_pages[num++] = page;
+	}
+	code_page_num = num;
+}
+
+static allocate_unit* unit_in_space(const dmemory_space* space, uint32_t page) {
+	allocate_unit_table* table = space->tables[page / SECOND_TABLE_SIZE];
+	return table == NULL ? NULL : (*table)[page % SECOND_TABLE_SIZE];
+}
+
+void dmemory_switch_space(dmemory_space* space) {
+	uint32_t i, num;
+	if (space == current_space) return;
+	compact_code_pages();
+	num = code_page_num;
+	/* 登録されたページのうち、空間の間で中身が異なるものだけを通知する (fork後に共有しているページはそのまま使える) */
+	for (i = 0; i < num; i++) {
+		uint32_t page = code_pages[i];
+		if (unit_in_space(current_space, page) != unit_in_space(space, page)) {
+			notify_code(page / SECOND_TABLE_SIZE, page % SECOND_TABLE_SIZE, 0, ALLOCATE_UNIT_SIZE);
+		}
+	}
+	current_space = space;
+	aut_table = space->tables;
+	/* ダーティビットは空間ごとには持たないので、以降の復元は全体を比較する */
+	if (base_snapshot != NULL) {
+		base_snapshot = NULL;
+		clear_dirty();
+	}
+}
+
+void dmemory_free_space(dmemory_space* space) {
+	if (space == NULL || space == current_space) return;
+	release_tables(space->tables);
+	if (space != &initial_space) free(space);
+}
+
+void dmemory_set_code_callback(dmemory_code_callback callback) {
+	code_callback = callback;
+}
+
+void dmemory_watch_code(uint32_t addr, int watch) {
+	uint32_t page = addr >> SECOND_TABLE_SHIFT;
+	if (watch) {
+		if (code_watched[page / 32] & (UINT32_C(1) << (page % 32))) return;
+		if (code_page_num >= code_page_capacity) compact_code_pages();
+		if (code_page_num >= code_page_capacity) {
+			uint32_t new_capacity = code_page_capacity == 0 ? 256 : code_page_capacity * 2;
+			uint32_t* new_pages = realloc(code_pages, sizeof(*new_pages) * new_capacity);
+			if (new_pages == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+			code_pages = new_pages;
+			code_page_capacity = new_capacity;
+		}
+		code_watched[page / 32] |= UINT32_C(1) << (page % 32);
+		code_pages[code_page_num++] = page;
+	} else {
+		code_watched[page / 32] &= ~(UINT32_C(1) << (page % 32));
+	}
+}
@@ -5,8 +5,63 @@
 
 void dmemory_read(void* dest, uint32_t addr, uint32_t size);
 void dmemory_write(void* src, uint32_t addr, uint32_t size);
+/* 割り当てたページは、最初に書き込まれるまで共有のゼロのページを指す */
 void dmemory_allocate(uint32_t addr, uint32_t size);
 void dmemory_deallocate(uint32_t addr, uint32_t size);
 int dmemory_is_allocated(uint32_t addr, uint32_t size);
 
+#define DMEMORY_PAGE_SIZE 4096
+
+/*
+ページ単位で、ホスト上の既存のデータを読み込み専用として割り当てる。書き込み時に複製される。
+addrとsizeはページ境界に揃っている必要があり、dataは以降ずっと有効でなければならない。
+*/
+void dmemory_map_external(uint32_t addr, uint32_t size, const void* data);
+
+/*
+addrを含むページの内容を指すポインタを返す (割り当てられていなければNULL)。
+書き込み用は共有を解いてから返す。どちらも、次にメモリを操作するまでの間だけ有効。
+*/
+const uint8_t* dmemory_page_for_read(uint32_t addr);
+uint8_t* dmemory_page_for_write(uint32_t addr);
+
+/* 割り当てられている全ページについて、アドレスの昇順にcallbackを呼ぶ */
+typedef void (*dmemory_page_callback)(void* ctx, uint32_t addr, const uint8_t* data);
+void dmemory_for_each_page(dmemory_page_callback callback, void* ctx);
+
+/*
+アドレス空間全体のスナップショット。
+ページはスナップショットと共有され、スナップショット後の最初の書き込み時に複製される。
+最後に取得または復元したスナップショットへの復元は、その後に変化したページのみを処理する。
+*/
+typedef struct dmemory_snapshot dmemory_snapshot;
+
+dmemory_snapshot* dmemory_take_snapshot(void);
+void dmemory_restore_snapshot(const dmemory_snapshot* snapshot);
+void dmemory_free_snapshot(dmemory_snapshot* snapshot);
+
+/*
+独立したアドレス空間。複製した空間はページを共有し、最初の書き込み時に複製する。
+切り替えは表を差し替えるだけで、現在の空間は解放できない。
+*/
+typedef struct dmemory_space dmemory_space;
+
+dmemory_space* dmemory_current_space(void);
+dmemory_space* dmemory_new_space(void);
+dmemory_space* dmemory_fork_space(void); /* 現在の空間を複製する */
+void dmemory_switch_space(dmemory_space* space);
+void dmemory_free_space(dmemory_space* space);
+
+/*
+実行するコードを読み込んだページを登録する。登録したページの内容が書き込みや割り当ての解除、
+スナップショットの復元や空間の切り替えで変わる時は、変わる範囲 (ページを越えない) を渡してcallbackを呼ぶ。
+*/
+typedef void (*dmemory_code_callback)(uint32_t addr, uint32_t size);
+void dmemory_set_code_callback(dmemory_code_callback callback);
+void dmemory_watch_code(uint32_t addr, int watch); /* addrを含むページを登録する (watchが偽なら解除する) */
+
+/* 最後に取得または復元したスナップショット以降に書き込まれたページか (スナップショットが無い時は偽) */
+int dmemory_is_dirty(uint32_t addr);
+uint32_t dmemory_dirty_page_count(void);
+
 #endif
@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <limits.h>
+#include <inttypes.h>
+#include "x86_regs.h"
+#include "dynamic_memory.h"
+#include "dmem_utils.h"
+#include "linux_syscall.h"
+#include "checkpoint.h"
+
+#define LINUX_EBADF 9
+#define LINUX_EFAULT 14
+#define LINUX_ENOENT 2
+#define LINUX_ENOMEM 12
+#define LINUX_EINVAL 22
+#define LINUX_EMFILE 24
+#define LINUX_ENOTTY 25
+#define LINUX_ESPIPE 29
+#define LINUX_ENOSYS 38
+
+#define LINUX_O_ACCMODE 03
+#define LINUX_O_CREAT 0100
+#define LINUX_O_TRUNC 01000
+#define LINUX_O_APPEND 02000
+
+#define LINUX_MAP_FIXED 0x10
+#define LINUX_MAP_ANONYMOUS 0x20
+
+#define PAGE_MASK (DMEMORY_PAGE_SIZE - 1)
+
+static uint32_t brk_origin = 0, brk_addr = 0;
+static uint32_t mmap_top = 0, mmap_addr = 0;
+static uint32_t exit_status = 0;
+
+typedef struct {
+	FILE* stream;
+	char* path; /* チェックポイントから開き直すため、openしたファイルの名前を保持する */
+	int can_read, can_write, is_append;
+	enum {
+		POP_NONE, POP_READ, POP_WRITE, POP_SEEK
+	} prev_operation;
+} fd_info;
+
+#define FD_MAX 1024
+
+static fd_info fds[FD_MAX];
+
+static uint32_t error_value(int err) {
+	return (uint32_t)-err;
+}
+
+static uint32_t round_up_page(uint32_t value) {
+	return (value + PAGE_MASK) & ~(uint32_t)PAGE_MASK;
+}
+
+int initialize_linux_syscall(uint32_t brk_origin_in, uint32_t mmap_top_in) {
+	int i;
+	brk_origin = brk_addr = brk_origin_in;
+	mmap_top = mmap_addr = mmap_top_in & ~(uint32_t)PAGE_MASK;
+	for (i = 0; i < FD_MAX; i++) {
+		fds[i].stream = NULL;
+		fds[i].path = NULL;
+		fds[i].can_read = 0;
+		fds[i].can_write = 0;
+		fds[i].is_append = 0;
+		fds[i].prev_operation = POP_NONE;
+	}
+	fds[0].stream = stdin;
+	fds[0].can_read = 1;
+	fds[1].stream = stdout;
+	fds[1].can_write = 1;
+	fds[2].stream = stderr;
+	fds[2].can_write = 1;
+	return 1;
+}
+
+static fd_info* get_fd(uint32_t fd) {
+	return fd < FD_MAX && fds[fd].stream != NULL ? &fds[fd] : NULL;
+}
+
+/* 読み書きの結果 (バイト数または-errno) を返す */
+static uint32_t do_read(fd_info* fi, uint32_t buf, uint32_t n) {
+	uint8_t* data;
+	size_t read_size;
+	if (fi == NULL || !fi->can_read) return error_value(LINUX_EBADF);
+	if (n == 0) return 0;
+	if (!dmemory_is_allocated(buf, n)) return error_value(LINUX_EFAULT);
+	data = malloc(n);
+	if (data == NULL) return error_value(LINUX_ENOMEM);
+	if (fi->prev_operation == POP_WRITE) fseek(fi->stream, 0, SEEK_CUR);
+	read_size = fread(data, 1, n, fi->stream);
+	fi->prev_operation = POP_READ;
+	dmemory_write(data, buf, read_size);
+	free(data);
+	return read_size;
+}
+
+static uint32_t do_write(fd_info* fi, uint32_t buf, uint32_t n) {
+	uint8_t* data;
+	uint32_t ret;
+	if (fi == NULL || !fi->can_write) return error_value(LINUX_EBADF);
+	if (n == 0) return 0;
+	if (!dmemory_is_allocated(buf, n)) return error_value(LINUX_EFAULT);
+	data = malloc(n);
+	if (data == NULL) return error_value(LINUX_ENOMEM);
+	dmemory_read(data, buf, n);
+	if (fi->prev_operation == POP_READ) fseek(fi->stream, 0, SEEK_CUR);
+	ret = fwrite(data, 1, n, fi->stream) == n ? n : error_value(LINUX_EFAULT);
+	fi->prev_operation = POP_WRITE;
+	free(data);
+	return ret;
+}
+
+/* readv/writev : iovecの各要素を順に処理し、途中で足りなくなったら止める */
+static uint32_t do_vector(fd_info* fi, uint32_t iov, uint32_t iovcnt, int is_write) {
+	uint32_t i, total = 0;
+	if (iovcnt > 1024) return error_value(LINUX_EINVAL);
+	for (i = 0; i < iovcnt; i++) {
+		int ok_base, ok_len;
+		uint32_t base = dmem_read_uint(&ok_base, iov + 8 * i, 4);
+		uint32_t len = dmem_read_uint(&ok_len, iov + 8 * i + 4, 4);
+		uint32_t ret;
+		if (!ok_base || !ok_len) return error_value(LINUX_EFAULT);
+		ret = is_write ? do_write(fi, base, len) : do_read(fi, base, len);
+		if (ret > UINT32_C(0xfffff000)) return i == 0 ? ret : total;
+		total += ret;
+		if (ret < len) break;
+	}
+	return total;
+}
+
+static uint32_t linux_open(uint32_t name_ptr, uint32_t flags) {
+	char* name = dmem_read_string(name_ptr);
+	const char* mode;
+	uint32_t fd;
+	int want_read, want_write, want_append;
+	if (name == NULL) return error_value(LINUX_EFAULT);
+	for (fd = 0; fd < FD_MAX; fd++) {
+		if (fds[fd].stream == NULL) break;
+	}
+	if (fd >= FD_MAX) {
+		free(name);
+		return error_value(LINUX_EMFILE);
+	}
+	want_read = ((flags & LINUX_O_ACCMODE) != 1);
+	want_write = ((flags & LINUX_O_ACCMODE) != 0);
+	want_append = want_write && (flags & LINUX_O_APPEND);
+	if (want_write && (flags & LINUX_O_TRUNC)) {
+		/* 内容を消すのは作成を許された時に限る */
+		mode = want_read ? "w+" : "w";
+		if (!(flags & LINUX_O_CREAT)) {
+			FILE* test = fopen(name, "r");
+			if (test == NULL) {
+				free(name);
+				return error_value(LINUX_ENOENT);
+			}
+			fclose(test);
+		}
+		fds[fd].stream = fopen(name, mode);
+	} else if (want_append) {
+		fds[fd].stream = fopen(name, want_read ? "r+" : "r");
+		if (fds[fd].stream != NULL) {
+			fclose(fds[fd].stream);
+			fds[fd].stream = fopen(name, want_read ? "a+" : "a");
+		} else if (flags & LINUX_O_CREAT) {
+			fds[fd].stream = fopen(name, want_read ? "a+" : "a");
+		}
+	} else {
+		/* ファイルの内容を消さずに開くためにrを使う */
+		fds[fd].stream = fopen(name, want_write ? "r+" : "r");
+		if (fds[fd].stream == NULL && (flags & LINUX_O_CREAT)) {
+			fds[fd].stream = fopen(name, want_read ? "w+" : "w");
+		}
+	}
+	if (fds[fd].stream == NULL) {
+		free(name);
+		return error_value(LINUX_ENOENT);
+	}
+	fds[fd].path = name;
+	fds[fd].can_read = want_read;
+	fds[fd].can_write = want_write;
+	fds[fd].is_append = want_append;
+	fds[fd].prev_operation = POP_NONE;
+	return fd;
+}
+
+static uint32_t linux_close(uint32_t fd) {
+	fd_info* fi = get_fd(fd);
+	if (fi == NULL) return error_value(LINUX_EBADF);
+	/* 標準入出力はインタプリタも使うので閉じない */
+	if (fi->path != NULL) fclose(fi->stream);
+	free(fi->path);
+	fi->stream = NULL;
+	fi->path = NULL;
+	return 0;
+}
+
+/* 移動後の位置を*resultに格納し、0または-errnoを返す */
+static uint32_t do_seek(fd_info* fi, int64_t offset, uint32_t whence, int64_t* result) {
+	long pos;
+	if (fi == NULL) return error_value(LINUX_EBADF);
+	if (whence > 2) return error_value(LINUX_EINVAL);
+	if (fi->path == NULL) return error_value(LINUX_ESPIPE);
+	if (offset < LONG_MIN || LONG_MAX < offset) return error_value(LINUX_EINVAL);
+	if (fseek(fi->stream, (long)offset, whence == 0 ? SEEK_SET : whence == 1 ? SEEK_CUR : SEEK_END) != 0) {
+		return error_value(LINUX_EINVAL);
+	}
+	fi->prev_operation = POP_SEEK;
+	pos = ftell(fi->stream);
+	if (pos < 0) return error_value(LINUX_EINVAL);
+	*result = pos;
+	return 0;
+}
+
+static uint32_t linux_lseek(uint32_t fd, uint32_t offset, uint32_t whence) {
+	int64_t result = 0;
+	uint32_t ret = do_seek(get_fd(fd), (int32_t)offset, whence, &result);
+	if (ret != 0) return ret;
+	return result > INT32_MAX ? error_value(LINUX_EINVAL) : (uint32_t)result;
+}
+
+static uint32_t linux_llseek(uint32_t fd, uint32_t offset_high, uint32_t offset_low, uint32_t result_ptr, uint32_t whence) {
+	int64_t result = 0;
+	uint32_t ret = do_seek(get_fd(fd), (int64_t)(((uint64_t)offset_high << 32) | offset_low), whence, &result);
+	if (ret != 0) return ret;
+	if (!dmem_write_uint(result_ptr, (uint32_t)result, 4) ||
+	!dmem_write_uint(result_ptr + 4, (uint32_t)((uint64_t)result >> 32), 4)) {
+		return error_value(LINUX_EFAULT);
+	}
+	return 0;
+}
+
+static uint32_t linux_brk(uint32_t new_addr) {
+	uint32_t old_end = round_up_page(brk_addr), new_end;
+	if (new_addr < brk_origin || new_addr > mmap_addr) return brk_addr;
+	new_end = round_up_page(new_addr);
+	if (new_addr > brk_addr) {
+		dmemory_allocate(brk_addr, new_addr - brk_addr);
+	} else if (new_end < old_end) {
+		dmemory_deallocate(new_end, old_end - new_end);
+	}
+	brk_addr = new_addr;
+	return brk_addr;
+}
+
+static uint32_t do_mmap(uint32_t addr, uint32_t len, uint32_t flags, uint32_t fd, uint64_t offset) {
+	uint32_t target;
+	fd_info* fi = NULL;
+	if (len == 0 || len > UINT32_MAX - PAGE_MASK) return error_value(LINUX_EINVAL);
+	len = round_up_page(len);
+	if (!(flags & LINUX_MAP_ANONYMOUS)) {
+		fi = get_fd(fd);
+		if (fi == NULL || !fi->can_read) return error_value(LINUX_EBADF);
+		if (fi->path == NULL || offset > LONG_MAX) return error_value(LINUX_EINVAL);
+	}
+	if (flags & LINUX_MAP_FIXED) {
+		if ((addr & PAGE_MASK) != 0 || UINT32_MAX - addr < len - 1) return error_value(LINUX_EINVAL);
+		target = addr;
+		dmemory_deallocate(target, len);
+	} else {
+		if (mmap_addr - brk_addr < len || mmap_addr < len) return error_value(LINUX_ENOMEM);
+		target = mmap_addr - len;
+		mmap_addr = target;
+	}
+	dmemory_allocate(target, len);
+	if (fi != NULL) {
+		/* ファイルの内容を読み込む (MAP_SHAREDも書き戻さない) */
+		long pos = ftell(fi->stream);
+		uint8_t* data = malloc(len);
+		size_t read_size = 0;
+		if (data == NULL) return error_value(LINUX_ENOMEM);
+		if (fseek(fi->stream, (long)offset, SEEK_SET) == 0) read_size = fread(data, 1, len, fi->stream);
+		dmemory_write(data, target, read_size);
+		free(data);
+		if (pos >= 0) fseek(fi->stream, pos, SEEK_SET);
+		fi->prev_operation = POP_SEEK;
+	}
+	return target;
+}
+
+static uint32_t linux_munmap(uint32_t addr, uint32_t len) {
+	if ((addr & PAGE_MASK) != 0 || len == 0 || len > UINT32_MAX - PAGE_MASK) return error_value(LINUX_EINVAL);
+	len = round_up_page(len);
+	if (UINT32_MAX - addr < len - 1) return error_value(LINUX_EINVAL);
+	dmemory_deallocate(addr, len);
+	/* 最後に割り当てた領域なら、次の割り当てで再利用する */
+	if (addr == mmap_addr && mmap_top - mmap_addr >= len) mmap_addr += len;
+	return 0;
+}
+
+static uint32_t linux_clock_gettime(uint32_t clock_id, uint32_t tp) {
+	struct timespec ts;
+	clockid_t id;
+	switch (clock_id) {
+		case 0: id = CLOCK_REALTIME; break;
+		case 1: id = CLOCK_MONOTONIC; break;
+		case 2: id = CLOCK_PROCESS_CPUTIME_ID; break;
+		case 3: id = CLOCK_THREAD_CPUTIME_ID; break;
+		default: return error_value(LINUX_EINVAL);
+	}
+	if (clock_gettime(id, &ts) != 0) return error_value(LINUX_EINVAL);
+	if (!dmem_write_uint(tp, (uint32_t)ts.tv_sec, 4) || !dmem_write_uint(tp + 4, (uint32_t)ts.tv_nsec, 4)) {
+		return error_value(LINUX_EFAULT);
+	}
+	return 0;
+}
+
+int linux_syscall(uint32_t regs[]) {
+	uint32_t ret;
+	switch (regs[EAX]) {
+		case 1: /* exit */
+		case 252: /* exit_group */
+			exit_status = regs[EBX] & 0xff;
+			return 0;
+		case 3: /* read */
+			ret = do_read(get_fd(regs[EBX]), regs[ECX], regs[EDX]);
+			break;
+		case 4: /* write */
+			ret = do_write(get_fd(regs[EBX]), regs[ECX], regs[EDX]);
+			break;
+		case 5: /* open */
+			ret = linux_open(regs[EBX], regs[ECX]);
+			break;
+		case 6: /* close */
+			ret = linux_close(regs[EBX]);
+			break;
+		case 19: /* lseek */
+			ret = linux_lseek(regs[EBX], regs[ECX], regs[EDX]);
+			break;
+		case 45: /* brk */
+			ret = linux_brk(regs[EBX]);
+			break;
+		case 54: /* ioctl : 端末としては振る舞わない */
+			ret = get_fd(regs[EBX]) != NULL ? error_value(LINUX_ENOTTY) : error_value(LINUX_EBADF);
+			break;
+		case 90: /* mmap (引数はメモリ上の構造体) */
+			{
+				uint32_t args[6];
+				int i, ok = 1;
+				for (i = 0; ok && i < 6; i++) args[i] = dmem_read_uint(&ok, regs[EBX] + 4 * i, 4);
+				ret = ok ? do_mmap(args[0], args[1], args[3], args[4], args[5]) : error_value(LINUX_EFAULT);
+			}
+			break;
+		case 91: /* munmap */
+			ret = linux_munmap(regs[EBX], regs[ECX]);
+			break;
+		case 140: /* _llseek */
+			ret = linux_llseek(regs[EBX], regs[ECX], regs[EDX], regs[ESI], regs[EDI]);
+			break;
+		case 145: /* readv */
+			ret = do_vector(get_fd(regs[EBX]), regs[ECX], regs[EDX], 0);
+			break;
+		case 146: /* writev */
+			ret = do_vector(get_fd(regs[EBX]), regs[ECX], regs[EDX], 1);
+			break;
+		case 192: /* mmap2 (オフセットはページ単位) */
+			ret = do_mmap(regs[EBX], regs[ECX], regs[ESI], regs[EDI], (uint64_t)regs[EBP] * DMEMORY_PAGE_SIZE);
+			break;
+		case 265: /* clock_gettime */
+			ret = linux_clock_gettime(regs[EBX], regs[ECX]);
+			break;
+		default: /* 未実装 */
+			ret = error_value(LINUX_ENOSYS);
+			break;
+	}
+	regs[EAX] = ret;
+	return 1;
+}
+
+uint32_t linux_syscall_exit_status(void) {
+	return exit_status;
+}
+
+void linux_syscall_save_state(checkpoint_writer* writer) {
+	uint32_t i, num;
+	checkpoint_put_uint(writer, brk_origin);
+	checkpoint_put_uint(writer, brk_addr);
+	checkpoint_put_uint(writer, mmap_top);
+	checkpoint_put_uint(writer, mmap_addr);
+	for (num = 0, i = 0; i < FD_MAX; i++) {
+		if (fds[i].stream != NULL) num++;
+	}
+	checkpoint_put_uint(writer, num);
+	for (i = 0; i < FD_MAX; i++) {
+		fd_info* fi = &fds[i];
+		long pos;
+		if (fi->stream == NULL) continue;
+		/* 標準入出力以外は、ファイル名と位置から開き直す */
+		pos = fi->path != NULL ? ftell(fi->stream) : 0;
+		checkpoint_put_uint(writer, i);
+		checkpoint_put_string(writer, fi->path);
+		checkpoint_put_uint(writer, pos < 0 ? 0 : (uint32_t)pos);
+		checkpoint_put_uint(writer, fi->can_read);
+		checkpoint_put_uint(writer, fi->can_write);
+		checkpoint_put_uint(writer, fi->is_append);
+	}
+}
+
+int linux_syscall_load_state(checkpoint_reader* reader) {
+	uint32_t num, i;
+	uint32_t origin = checkpoint_get_uint(reader);
+	uint32_t addr = checkpoint_get_uint(reader);
+	uint32_t top = checkpoint_get_uint(reader);
+	uint32_t current = checkpoint_get_uint(reader);
+	/* 現在開いているファイルを閉じてから状態を戻す */
+	for (i = 0; i < FD_MAX; i++) {
+		if (fds[i].path != NULL) {
+			fclose(fds[i].stream);
+			free(fds[i].path);
+			fds[i].path = NULL;
+		}
+	}
+	if (!initialize_linux_syscall(origin, top)) return 0;
+	brk_addr = addr;
+	mmap_addr = current;
+	for (i = 0; i < 3; i++) fds[i].stream = NULL;
+	num = checkpoint_get_uint(reader);
+	while (!reader->error && num-- > 0) {
+		uint32_t fd = checkpoint_get_uint(reader);
+		char* path = checkpoint_get_string(reader);
+		uint32_t pos = checkpoint_get_uint(reader);
+		fd_info* fi;
+		if (reader->error || fd >= FD_MAX) {
+			free(path);
+			return 0;
+		}
+		fi = &fds[fd];
+		fi->can_read = checkpoint_get_uint(reader);
+		fi->can_write = checkpoint_get_uint(reader);
+		fi->is_append = checkpoint_get_uint(reader);
+		if (path != NULL) {
+			const char* mode = fi->is_append ? (fi->can_read ? "a+" : "a") : (fi->can_write ? "r+" : "r");
+			fi->stream = fopen(path, mode);
+			if (fi->stream == NULL || fseek(fi->stream, pos, SEEK_SET) != 0) {
+				fprintf(stderr, "failed to reopen %s from checkpoint\n", path);
+				free(path);
+				return 0;
+			}
+			fi->path = path;
+			fi->prev_operation = POP_SEEK;
+		} else {
+			/* 標準入出力は番号で判別する */
+			fi->stream = fd == 0 ? stdin : fd == 1 ? stdout : stderr;
+			fi->prev_operation = POP_NONE;
+		}
+	}
+	return !reader->error;
+}
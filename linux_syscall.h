@@ -0,0 +1,22 @@
+#ifndef LINUX_SYSCALL_H_GUARD_485E7173_4C37_44F9_AC65_75076F21DB14
+#define LINUX_SYSCALL_H_GUARD_485E7173_4C37_44F9_AC65_75076F21DB14
+
+#include <stdint.h>
+#include "checkpoint.h"
+
+/*
+i386 Linuxのシステムコール (int 0x80) のサブセット。
+brkはbrk_originから上に伸ばし、mmapはmmap_topから下に向けて割り当てる。
+*/
+int initialize_linux_syscall(uint32_t brk_origin, uint32_t mmap_top);
+
+/* 成功:1 失敗:-1 プログラム終了(成功):0 (ゲストへのエラーは-errnoをEAXに返す) */
+int linux_syscall(uint32_t regs[]);
+
+/* linux_syscallが0を返した時の、exit/exit_groupに渡された終了ステータス */
+uint32_t linux_syscall_exit_status(void);
+
+void linux_syscall_save_state(checkpoint_writer* writer);
+int linux_syscall_load_state(checkpoint_reader* reader);
+
+#endif
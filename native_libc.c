@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "native_libc.h"
+#include "read_elf.h"
+#include "dmem_libc_string.h"
+#include "dmem_utils.h"
+#include "x86_regs.h"
+
+/* 参照用のELFの関数の内容のうち、比較に使う最小と最大のバイト数 */
+#define SIGNATURE_MIN 16
+#define SIGNATURE_MAX 4096
+
+typedef struct {
+	const char* name;
+	int (*func)(uint32_t* ret, uint32_t esp);
+} native_func;
+
+static const native_func funcs[NATIVE_LIBC_FUNC_NUM] = {
+	{"memcpy", dmem_libc_memcpy},
+	{"memmove", dmem_libc_memcpy}, /* 一時バッファを経由してコピーするので、重なっていてもよい */
+	{"memset", dmem_libc_memset},
+	{"memchr", dmem_libc_memchr},
+	{"strlen", dmem_libc_strlen},
+	{"strcmp", dmem_libc_strcmp},
+	{"strncmp", dmem_libc_strncmp},
+	{"strchr", dmem_libc_strchr},
+	{"strcpy", dmem_libc_strcpy},
+	{"strncpy", dmem_libc_strncpy}
+};
+
+static uint32_t enabled_funcs = 0; /* ビットiが1なら、funcs[i]を置き換える */
+static native_libc_table table = {{0}, {0}, 0, 1, 0};
+
+/* 参照用のELFの関数の内容 */
+typedef struct {
+	int func;
+	uint8_t* data;
+	uint32_t size;
+} signature;
+static signature signatures[NATIVE_LIBC_ENTRY_MAX];
+static uint32_t signature_num = 0;
+
+static int find_func(const char* name, size_t length) {
+	int i;
+	for (i = 0; i < NATIVE_LIBC_FUNC_NUM; i++) {
+		if (strlen(funcs[i].name) == length && strncmp(funcs[i].name, name, length) == 0) return i;
+	}
+	return -1;
+}
+
+/* シンボルの名前が置き換える関数か、IFUNCで選ばれるその実装 (__strlen_sse2など) なら、関数の番号を返す */
+static int find_symbol_func(const char* name) {
+	const char* variant;
+	int idx;
+	if (strncmp(name, "__", 2) != 0) return find_func(name, strlen(name));
+	variant = strchr(name + 2, '_');
+	if (variant == NULL) return -1;
+	idx = find_func(name + 2, (size_t)(variant - (name + 2)));
+	/* __memcpy_chkなどは引数が違う */
+	if (idx < 0 || variant[1] == '\0' || strncmp(variant + 1, "chk", 3) == 0) return -1;
+	return idx;
+}
+
+int native_libc_enable(const char* names) {
+	const char* p = names;
+	if (strcmp(names, "all") == 0) {
+		enabled_funcs = (UINT32_C(1) << NATIVE_LIBC_FUNC_NUM) - 1;
+		return 1;
+	}
+	for (;;) {
+		const char* end = strchr(p, ',');
+		size_t length = end != NULL ? (size_t)(end - p) : strlen(p);
+		int idx = find_func(p, length);
+		if (idx < 0) {
+			fprintf(stderr, "unknown function to replace natively: %.*s\n", (int)length, p);
+			return 0;
+		}
+		enabled_funcs |= UINT32_C(1) << idx;
+		if (end == NULL) break;
+		p = end + 1;
+	}
+	return 1;
+}
+
+static void set_signature(void* ctx, const char* name, uint32_t addr, uint32_t size, const uint8_t* code) {
+	int idx = find_symbol_func(name);
+	signature* sig = &signatures[signature_num];
+	(void)ctx;
+	(void)addr;
+	if (idx < 0 || code == NULL || size < SIGNATURE_MIN || signature_num >= NATIVE_LIBC_ENTRY_MAX) return;
+	/* 長い関数は先頭だけを比べる */
+	if (size > SIGNATURE_MAX) size = SIGNATURE_MAX;
+	sig->data = malloc(size);
+	if (sig->data == NULL) return;
+	memcpy(sig->data, code, size);
+	sig->size = size;
+	sig->func = idx;
+	signature_num++;
+}
+
+int native_libc_set_reference(const char* filename) {
+	if (!read_elf_symbols(filename, set_signature, NULL)) return 0;
+	if (signature_num == 0) {
+		fprintf(stderr, "no libc routine to replace natively in reference %s\n", filename);
+		return 0;
+	}
+	return 1;
+}
+
+static void update_range(void) {
+	uint32_t i;
+	table.low = 1;
+	table.high = 0;
+	for (i = 0; i < table.num; i++) {
+		if (table.low > table.high || table.addr[i] < table.low) table.low = table.addr[i];
+		if (table.addr[i] > table.high) table.high = table.addr[i];
+	}
+}
+
+/* 入口を追加する。同じアドレスの別名は最初のものを使う */
+static void add_entry(int idx, uint32_t addr, const char* filename) {
+	uint32_t i;
+	for (i = 0; i < table.num; i++) {
+		if (table.addr[i] == addr) return;
+	}
+	if (table.num >= NATIVE_LIBC_ENTRY_MAX) {
+		fprintf(stderr, "warning: too many libc routines in %s, %s at %08"PRIx32" not replaced\n",
+			filename, funcs[idx].name, addr);
+		return;
+	}
+	table.addr[table.num] = addr;
+	table.func[table.num] = (uint8_t)idx;
+	table.num++;
+}
+
+/* 関数ごとに、入口が見つかっているか */
+static int has_entry(int idx) {
+	uint32_t i;
+	for (i = 0; i < table.num; i++) {
+		if (table.func[i] == idx) return 1;
+	}
+	return 0;
+}
+
+static void set_symbol(void* ctx, const char* name, uint32_t addr, uint32_t size, const uint8_t* code) {
+	int idx = find_symbol_func(name);
+	(void)code;
+	/* 大きさの無いシンボルは、別名のラベルなどかもしれないので使わない */
+	/* (IFUNCのシンボルはリゾルバを指すので、STT_FUNCだけを渡すread_elf_symbolsで除かれる) */
+	if (idx < 0 || !(enabled_funcs & (UINT32_C(1) << idx)) || size == 0 || addr == 0) return;
+	add_entry(idx, addr, ctx);
+}
+
+/* 参照用の関数の内容が一致した場所の数と、最初の場所 */
+typedef struct {
+	uint32_t match_num[NATIVE_LIBC_ENTRY_MAX];
+	uint32_t match_addr[NATIVE_LIBC_ENTRY_MAX];
+	uint32_t skip_funcs; /* シンボルで見つかったので探さない関数 */
+} signature_search;
+
+static void search_signatures(void* ctx, uint32_t addr, const uint8_t* data, uint32_t size) {
+	signature_search* search = ctx;
+	uint32_t i;
+	for (i = 0; i < signature_num; i++) {
+		const signature* sig = &signatures[i];
+		uint32_t pos;
+		if ((search->skip_funcs >> sig->func) & 1) continue;
+		if (sig->size > size) continue;
+		for (pos = 0; pos <= size - sig->size; pos++) {
+			const uint8_t* found = memchr(data + pos, sig->data[0], size - sig->size - pos + 1);
+			if (found == NULL) break;
+			pos = (uint32_t)(found - data);
+			if (memcmp(found, sig->data, sig->size) == 0) {
+				if (search->match_num[i]++ == 0) search->match_addr[i] = addr + pos;
+			}
+		}
+	}
+}
+
+int native_libc_attach(const char* filename) {
+	signature_search search;
+	uint32_t i;
+	memset(&table, 0, sizeof(table));
+	update_range();
+	if (enabled_funcs == 0) return 1;
+	if (!read_elf_symbols(filename, set_symbol, (void*)filename)) return 0;
+	/* シンボルで見つからなかった関数は、参照用の関数の内容で探す (曖昧なら使わない) */
+	memset(&search, 0, sizeof(search));
+	search.skip_funcs = ~enabled_funcs;
+	for (i = 0; i < NATIVE_LIBC_FUNC_NUM; i++) {
+		if (has_entry((int)i)) search.skip_funcs |= UINT32_C(1) << i;
+	}
+	if (!read_elf_code(filename, search_signatures, &search)) return 0;
+	for (i = 0; i < signature_num; i++) {
+		if (search.match_num[i] == 1) {
+			add_entry(signatures[i].func, search.match_addr[i], filename);
+		} else if (search.match_num[i] > 1) {
+			fprintf(stderr, "warning: %s matches %"PRIu32" places in %s, not replaced\n",
+				funcs[signatures[i].func].name, search.match_num[i], filename);
+		}
+	}
+	if (table.num == 0) fprintf(stderr, "warning: no libc routine to replace natively found in %s\n", filename);
+	update_range();
+	return 1;
+}
+
+void native_libc_save(native_libc_table* state) {
+	*state = table;
+}
+
+void native_libc_load(const native_libc_table* state) {
+	table = *state;
+}
+
+int native_libc_call(uint32_t* eip, uint32_t regs[], uint32_t eflags) {
+	uint32_t ret_addr, value, i;
+	int ok;
+	if (*eip < table.low || table.high < *eip) return 0;
+	for (i = 0; i < table.num; i++) {
+		if (table.addr[i] == *eip) break;
+	}
+	if (i >= table.num) return 0;
+	/* 関数の入口でDFが立っているのはABIに反するので、ゲストのコードに任せる */
+	if (eflags & DF) return 0;
+	ret_addr = dmem_read_uint(&ok, regs[ESP], 4);
+	if (!ok || regs[ESP] > UINT32_MAX - 4) return 0;
+	/* 引数のメモリが無いなどで失敗したら、ゲストのコードで例外などを起こさせる */
+	if (!funcs[table.func[i]].func(&value, regs[ESP])) return 0;
+	/* cdeclなので、引数は呼び出し元が消す。EAX以外のレジスタは変えない */
+	regs[EAX] = value;
+	regs[ESP] += 4;
+	*eip = ret_addr;
+	return 1;
+}
+
+void native_libc_save_state(checkpoint_writer* writer) {
+	uint32_t i;
+	checkpoint_put_uint(writer, enabled_funcs);
+	checkpoint_put_uint(writer, table.num);
+	for (i = 0; i < table.num; i++) {
+		checkpoint_put_uint(writer, table.addr[i]);
+		checkpoint_put_uint(writer, table.func[i]);
+	}
+}
+
+int native_libc_load_state(checkpoint_reader* reader) {
+	uint32_t i;
+	enabled_funcs = checkpoint_get_uint(reader);
+	table.num = checkpoint_get_uint(reader);
+	if (table.num > NATIVE_LIBC_ENTRY_MAX) {
+		table.num = 0;
+		reader->error = 1;
+	}
+	for (i = 0; i < table.num; i++) {
+		table.addr[i] = checkpoint_get_uint(reader);
+		table.func[i] = (uint8_t)checkpoint_get_uint(reader);
+		if (table.func[i] >= NATIVE_LIBC_FUNC_NUM) reader->error = 1;
+	}
+	if (reader->error) table.num = 0;
+	update_range();
+	return !reader->error;
+}
@@ -0,0 +1,50 @@
+#ifndef NATIVE_LIBC_H_GUARD_D6639B80_B549_408C_8CB5_BD16490225C7
+#define NATIVE_LIBC_H_GUARD_D6639B80_B549_408C_8CB5_BD16490225C7
+
+#include <stdint.h>
+#include "checkpoint.h"
+
+/*
+ELFのゲストが持っているlibcの文字列関数 (memcpyなど) を、ホストの実装 (dmem_libc_*) で置き換える。
+関数の先頭は.symtabの大域の関数シンボルから探す。静的リンクしたglibcのようにstrlenなどがIFUNCなら、
+リゾルバが選ぶ実装 (__strlen_sse2など、"__名前_種類"のシンボル。__memcpy_chk系は除く) を全て置き換える。
+シンボルが見つからなければ (stripされていれば)、同じlibcをリンクした参照用のELFの関数の内容と
+バイト単位で一致する場所を探す (再配置されるオペランドもそのまま比べるので、
+call命令や絶対アドレスを含む関数は見つからない)。
+置き換えた関数の先頭にEIPが来たら、cdeclの呼び出しとして引数を読み、EAXに結果を入れて戻る。
+DFが立っている時や、引数のメモリが割り当てられていない時は、置き換えずにゲストのコードを実行する。
+*/
+
+/* 置き換えられる関数の数 */
+#define NATIVE_LIBC_FUNC_NUM 10
+
+/* 置き換える関数の入口の最大数 (IFUNCの実装ごとに1個使う) */
+#define NATIVE_LIBC_ENTRY_MAX 64
+
+/* 置き換える関数の入口。プロセスごとに持つ */
+typedef struct {
+	uint32_t addr[NATIVE_LIBC_ENTRY_MAX];
+	uint8_t func[NATIVE_LIBC_ENTRY_MAX]; /* 置き換える関数の番号 */
+	uint32_t num;
+	uint32_t low, high; /* addrの最小と最大 (関係の無いEIPを素早く除くため) */
+} native_libc_table;
+
+/* 置き換える関数を、カンマ区切りの名前 (または"all") で指定する */
+int native_libc_enable(const char* names);
+
+/* stripされたゲストで関数を探すための、シンボルのある参照用のELFを読み込む */
+int native_libc_set_reference(const char* filename);
+
+/* 読み込んだELFファイルから、置き換える関数を探し直す */
+int native_libc_attach(const char* filename);
+
+void native_libc_save(native_libc_table* table);
+void native_libc_load(const native_libc_table* table);
+
+/* EIPが置き換えた関数の先頭なら、ホストの実装を実行して戻り、1を返す。それ以外は0を返す */
+int native_libc_call(uint32_t* eip, uint32_t regs[], uint32_t eflags);
+
+void native_libc_save_state(checkpoint_writer* writer);
+int native_libc_load_state(checkpoint_reader* reader);
+
+#endif
@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include "x86_regs.h"
 #include "pe_import.h"
 #include "pe_libs.h"
 #include "dynamic_memory.h"
 #include "dmem_utils.h"
+#include "checkpoint.h"
 
 typedef struct {
 	int is_ord;
@@ -14,7 +16,7 @@ typedef struct {
 } func_info;
 
 typedef struct {
-	uint32_t int_addr, iat_addr, iat_size;
+	uint32_t int_addr, iat_addr;
 	int has_int;
 	char* name;
 	func_info* funcs;
@@ -24,6 +26,13 @@ typedef struct {
 static imported_lib_info* imported_libs = NULL;
 static uint32_t imported_lib_count = 0;
 
+/*
+インポートした関数は、先頭から順にスタブのページの1バイトずつに対応させ、IATにそのアドレスを入れる。
+スタブはHLTで埋めておき、分岐以外で入った時は止まるようにする。
+*/
+static uint32_t stub_base = 0;
+static uint32_t stub_num = 0;
+
 static uint32_t read_num(const uint8_t* data, int size) {
 	uint32_t ret = 0;
 	int i;
@@ -42,7 +51,17 @@ static void write_num(uint8_t* out, uint32_t value, int size) {
 
 int pe_import_initialize(const pe_import_params* params, uint32_t work_start, uint32_t argc, uint32_t argv) {
 	uint32_t iat_end = params->iat_addr + (params->iat_size > 0 ? params->iat_size - 1 : 0);
-	if (!pe_libs_initialize(work_start, argc, argv)) return 0;
+	uint8_t stub_fill[PE_IMPORT_STUB_SIZE];
+	if (UINT32_MAX - work_start < PE_IMPORT_STUB_SIZE) {
+		fprintf(stderr, "no enough space for PE import stubs\n");
+		return 0;
+	}
+	stub_base = work_start;
+	stub_num = 0;
+	dmemory_allocate(stub_base, PE_IMPORT_STUB_SIZE);
+	memset(stub_fill, 0xF4, sizeof(stub_fill));
+	dmemory_write(stub_fill, stub_base, PE_IMPORT_STUB_SIZE);
+	if (!pe_libs_initialize(work_start + PE_IMPORT_STUB_SIZE, argc, argv)) return 0;
 	free(imported_libs);
 	imported_libs = NULL;
 	imported_lib_count = 0;
@@ -85,7 +104,6 @@ int pe_import_initialize(const pe_import_params* params, uint32_t work_start, ui
 			imported_libs[i].has_int = (imported_libs[i].int_addr != 0);
 			imported_libs[i].int_addr += params->image_base;
 			imported_libs[i].iat_addr += params->image_base;
-			imported_libs[i].iat_size = 0;
 			name_ptr += params->image_base;
 			/* インポート対象の名前情報を得る */
 			imported_libs[i].name = dmem_read_string(name_ptr);
@@ -135,11 +153,15 @@ int pe_import_initialize(const pe_import_params* params, uint32_t work_start, ui
 						new_func->is_ord = 0;
 						new_func->hint_or_ord = read_num(hint, 2);
 					}
-					write_num(entry, get_buffer_address(lib_id, new_func->name, imported_libs[i].iat_addr + j * 4), 4);
+					if (stub_num >= PE_IMPORT_STUB_SIZE) {
+						fprintf(stderr, "too many functions imported from PE\n");
+						return 0;
+					}
+					write_num(entry, get_buffer_address(lib_id, new_func->name, stub_base + stub_num), 4);
+					stub_num++;
 					dmemory_write(entry, imported_libs[i].iat_addr + j * 4, 4);
 				}
 				imported_libs[i].func_num = j;
-				imported_libs[i].iat_size = j * 4;
 			}
 		}
 		imported_lib_count = i;
@@ -147,20 +169,23 @@ int pe_import_initialize(const pe_import_params* params, uint32_t work_start, ui
 	return 1;
 }
 
+int pe_import_is_stub(uint32_t addr) {
+	return addr - stub_base < stub_num;
+}
+
 int pe_import(uint32_t* eip, uint32_t regs[]) {
-	uint32_t i;
+	uint32_t i, index;
 	const imported_lib_info* called_lib = NULL;
 	const func_info* called_func = NULL;
 	uint32_t stack_remove_size;
-	for (i = 0; i < imported_lib_count; i++) {
-		if (imported_libs[i].iat_addr <= *eip && *eip - imported_libs[i].iat_addr < imported_libs[i].iat_size) {
-			uint32_t offset = *eip - imported_libs[i].iat_addr;
+	index = *eip - stub_base;
+	for (i = 0; index < stub_num && i < imported_lib_count; i++) {
+		if (index < imported_libs[i].func_num) {
 			called_lib = &imported_libs[i];
-			if (offset % 4 == 0) {
-				called_func = &imported_libs[i].funcs[offset / 4];
-			}
+			called_func = &imported_libs[i].funcs[index];
 			break;
 		}
+		index -= imported_libs[i].func_num;
 	}
 	if (called_lib == NULL) {
 		fprintf(stderr, "library not found for EIP %08"PRIx32"\n", *eip);
@@ -176,3 +201,75 @@ int pe_import(uint32_t* eip, uint32_t regs[]) {
 	regs[ESP] += 4 + stack_remove_size;
 	return 1;
 }
+
+uint32_t pe_import_exit_status(void) {
+	return pe_libs_exit_status();
+}
+
+void pe_import_save_state(checkpoint_writer* writer) {
+	uint32_t i, j;
+	pe_libs_save_state(writer);
+	checkpoint_put_uint(writer, stub_base);
+	checkpoint_put_uint(writer, imported_lib_count);
+	for (i = 0; i < imported_lib_count; i++) {
+		const imported_lib_info* lib = &imported_libs[i];
+		checkpoint_put_uint(writer, lib->int_addr);
+		checkpoint_put_uint(writer, lib->iat_addr);
+		checkpoint_put_uint(writer, lib->has_int);
+		checkpoint_put_string(writer, lib->name);
+		checkpoint_put_uint(writer, lib->func_num);
+		for (j = 0; j < lib->func_num; j++) {
+			checkpoint_put_uint(writer, lib->funcs[j].is_ord);
+			checkpoint_put_string(writer, lib->funcs[j].name);
+			checkpoint_put_uint(writer, lib->funcs[j].hint_or_ord);
+		}
+	}
+}
+
+int pe_import_load_state(checkpoint_reader* reader) {
+	uint32_t i, j, num;
+	if (!pe_libs_load_state(reader)) return 0;
+	for (i = 0; i < imported_lib_count; i++) {
+		for (j = 0; j < imported_libs[i].func_num; j++) free(imported_libs[i].funcs[j].name);
+		free(imported_libs[i].funcs);
+		free(imported_libs[i].name);
+	}
+	free(imported_libs);
+	imported_libs = NULL;
+	imported_lib_count = 0;
+	stub_base = checkpoint_get_uint(reader);
+	stub_num = 0;
+	num = checkpoint_get_uint(reader);
+	if (reader->error) return 0;
+	if (num > 0) {
+		imported_libs = calloc(num, sizeof(*imported_libs));
+		if (imported_libs == NULL) {
+			perror("calloc");
+			return 0;
+		}
+	}
+	for (i = 0; i < num && !reader->error; i++) {
+		imported_lib_info* lib = &imported_libs[i];
+		lib->int_addr = checkpoint_get_uint(reader);
+		lib->iat_addr = checkpoint_get_uint(reader);
+		lib->has_int = checkpoint_get_uint(reader);
+		lib->name = checkpoint_get_string(reader);
+		lib->func_num = checkpoint_get_uint(reader);
+		if (reader->error || lib->name == NULL) return 0;
+		if (lib->func_num > 0) {
+			lib->funcs = calloc(lib->func_num, sizeof(*lib->funcs));
+			if (lib->funcs == NULL) {
+				perror("calloc");
+				return 0;
+			}
+		}
+		for (j = 0; j < lib->func_num && !reader->error; j++) {
+			lib->funcs[j].is_ord = checkpoint_get_uint(reader);
+			lib->funcs[j].name = checkpoint_get_string(reader);
+			lib->funcs[j].hint_or_ord = checkpoint_get_uint(reader);
+		}
+		imported_lib_count = i + 1;
+		stub_num += lib->func_num;
+	}
+	return !reader->error;
+}
@@ -2,6 +2,7 @@
 #define PE_IMPORT_H_GUARD_6FA7674E_5527_4DF1_8BE1_13B3365EB3D8
 
 #include <stdint.h>
+#include "checkpoint.h"
 
 typedef struct {
 	uint32_t image_base;
@@ -9,9 +10,22 @@ typedef struct {
 	uint32_t iat_addr, iat_size;
 } pe_import_params;
 
+/* インポートした関数のスタブに使う、作業領域の先頭の大きさ (残りはライブラリの作業領域) */
+#define PE_IMPORT_STUB_SIZE UINT32_C(0x1000)
+
 int pe_import_initialize(const pe_import_params* params, uint32_t work_start, uint32_t argc, uint32_t argv);
 
+/* addrがインポートした関数のスタブか */
+int pe_import_is_stub(uint32_t addr);
+
+/* EIPのスタブに対応する関数を実行して戻る */
 /* 成功:1 失敗:-1 プログラム終了(成功):0 */
 int pe_import(uint32_t* eip, uint32_t regs[]);
 
+/* pe_importが0を返した時の終了ステータス */
+uint32_t pe_import_exit_status(void);
+
+void pe_import_save_state(checkpoint_writer* writer);
+int pe_import_load_state(checkpoint_reader* reader);
+
 #endif
@@ -9,9 +9,12 @@
 #include "dmem_libc.h"
 #include "x86_regs.h"
 #include "pe_libs.h"
+#include "checkpoint.h"
+#include "plugin.h"
 
 static uint32_t work_origin;
 static uint32_t argc_value, argv_value;
+static uint32_t exit_status = 0;
 
 #define WORK_ARGV0 (work_origin + UINT32_C(0x00000000))
 #define WORK_ARGV1 (work_origin + UINT32_C(0x00000004))
@@ -46,6 +49,10 @@ static int strcmp_ncs(const char* a, const char* b) {
 	}
 }
 
+uint32_t pe_libs_exit_status(void) {
+	return exit_status;
+}
+
 int pe_libs_initialize(uint32_t work_start, uint32_t argc, uint32_t argv) {
 	if (UINT32_MAX - work_start < WORK_SIZE - 1) {
 		fprintf(stderr, "no enough space for PE work\n");
@@ -80,6 +87,26 @@ int pe_libs_initialize(uint32_t work_start, uint32_t argc, uint32_t argv) {
 	return 1;
 }
 
+void pe_libs_save_state(checkpoint_writer* writer) {
+	checkpoint_put_uint(writer, work_origin);
+	checkpoint_put_uint(writer, argc_value);
+	checkpoint_put_uint(writer, argv_value);
+	dmem_libc_stdio_save_state(writer);
+	dmem_libc_stdlib_save_state(writer);
+	dmem_libc_time_save_state(writer);
+}
+
+int pe_libs_load_state(checkpoint_reader* reader) {
+	work_origin = checkpoint_get_uint(reader);
+	argc_value = checkpoint_get_uint(reader);
+	argv_value = checkpoint_get_uint(reader);
+	if (!dmem_libc_stdio_load_state(reader)) return 0;
+	if (!dmem_libc_stdlib_load_state(reader)) return 0;
+	if (!dmem_libc_string_initialize()) return 0;
+	if (!dmem_libc_time_load_state(reader)) return 0;
+	return !reader->error;
+}
+
 int get_lib_id(const char* lib_name) {
 	if (strcmp_ncs(lib_name, "msvcrt.dll") == 0) return LIB_ID_MSVCRT;
 	return LIB_ID_UNKNOWN;
@@ -157,6 +184,7 @@ static uint32_t exec_msvcrt(uint32_t regs[], const char* func_name) {
 		/* atexitで登録した関数を実行 */
 		/* バッファをフラッシュ */
 		/* ストリームを閉じる */
+		if (!dmem_get_args(regs[ESP], 1, &exit_status)) exit_status = 0;
 		return PE_LIB_EXEC_EXIT;
 	} else if (strcmp(func_name, "fputs") == 0) {
 		CALL_DMEM_LIBC(fputs)
@@ -197,6 +225,8 @@ static uint32_t exec_msvcrt(uint32_t regs[], const char* func_name) {
 		CALL_DMEM_LIBC(strncpy)
 	} else if (strcmp(func_name, "memset") == 0) {
 		CALL_DMEM_LIBC(memset)
+	} else if (strcmp(func_name, "memchr") == 0) {
+		CALL_DMEM_LIBC(memchr)
 	} else if (strcmp(func_name, "realloc") == 0) {
 		CALL_DMEM_LIBC(realloc)
 	} else if (strcmp(func_name, "sprintf") == 0) {
@@ -250,6 +280,7 @@ static uint32_t exec_kernel32(uint32_t regs[], const char* func_name) {
 		regs[EAX] = 0;
 		return 0;
 	} else if (strcmp(func_name, "ExitProcess") == 0) {
+		if (!dmem_get_args(regs[ESP], 1, &exit_status)) exit_status = 0;
 		return PE_LIB_EXEC_EXIT;
 	} else if (strcmp(func_name, "SetErrorMode") == 0) {
 		/* 無視 */
@@ -336,6 +367,10 @@ static uint32_t exec_libintl3(uint32_t regs[], const char* func_name) {
 }
 
 uint32_t pe_lib_exec(uint32_t regs[], const char* lib_name, const char* func_name, uint16_t func_ord) {
+	uint32_t stack_remove_size;
+	int plugin_ret = plugin_exec_import(regs, lib_name, func_name, func_ord, &stack_remove_size);
+	if (plugin_ret < 0) return PE_LIB_EXEC_FAILED;
+	if (plugin_ret > 0) return stack_remove_size;
 	if (func_name == NULL) {
 		fprintf(stderr, "function #%"PRIu16" in library %s called. (ord value unsupported)\n",
 			func_ord, lib_name);
@@ -2,11 +2,14 @@
 #define PE_LIBS_H_GUARD_B697AD19_9017_4B08_B4AB_7906D3493DA3
 
 #include <stdint.h>
+#include "checkpoint.h"
 
 #define PE_LIB_EXEC_FAILED UINT32_C(0xffffffff)
 #define PE_LIB_EXEC_EXIT UINT32_C(0xfffffffe)
 
 int pe_libs_initialize(uint32_t work_start, uint32_t argc, uint32_t argv);
+void pe_libs_save_state(checkpoint_writer* writer);
+int pe_libs_load_state(checkpoint_reader* reader);
 
 int get_lib_id(const char* lib_name);
 uint32_t get_buffer_address(int lib_id, const char* identifier, uint32_t default_addr);
@@ -15,4 +18,7 @@ uint32_t get_buffer_address(int lib_id, const char* identifier, uint32_t default
 /* func_ordはfunc_nameがNULLの時に使用する */
 uint32_t pe_lib_exec(uint32_t regs[], const char* lib_name, const char* func_name, uint16_t func_ord);
 
+/* pe_lib_execがPE_LIB_EXEC_EXITを返した時の、exitやExitProcessに渡された終了ステータス */
+uint32_t pe_libs_exit_status(void);
+
 #endif
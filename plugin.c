@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <dlfcn.h>
+#include "plugin.h"
+#include "x86_plugin.h"
+#include "x86_regs.h"
+#include "read_elf.h"
+#include "dynamic_memory.h"
+#include "dmem_utils.h"
+
+/* 登録の種類 */
+enum {
+	REG_IMPORT,
+	REG_IMPORT_ORDINAL,
+	REG_SYMBOL,
+	REG_ADDRESS
+};
+
+typedef struct {
+	int kind;
+	x86_plugin_handler handler;
+	char* lib_name; /* REG_IMPORT, REG_IMPORT_ORDINAL */
+	char* name; /* REG_IMPORT, REG_SYMBOL */
+	uint16_t ordinal; /* REG_IMPORT_ORDINAL */
+	uint32_t addr; /* REG_ADDRESS */
+} registration;
+
+static registration* registrations = NULL;
+static uint32_t registration_num = 0, registration_capacity = 0;
+
+/* アドレスで呼ぶハンドラ (indexはregistrationsの添字) */
+typedef struct {
+	uint32_t addr;
+	uint32_t index;
+} address_entry;
+
+/* ELFごとの表。images[0]はELFに依らない、アドレスで登録されたハンドラのみの表 */
+typedef struct {
+	char* filename; /* ELFファイル名 (images[0]やチェックポイントから作った表ではNULL) */
+	address_entry* entries; /* addrの昇順 */
+	uint32_t entry_num;
+} image_table;
+
+static image_table* images = NULL;
+static uint32_t image_num = 0;
+static uint32_t current_image = 0;
+
+static char* copy_string(const char* str) {
+	char* copy = malloc(strlen(str) + 1);
+	if (copy == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	strcpy(copy, str);
+	return copy;
+}
+
+static int strcmp_ncs(const char* a, const char* b) {
+	while (*a != '\0' && tolower((unsigned char)*a) == tolower((unsigned char)*b)) {
+		a++;
+		b++;
+	}
+	return tolower((unsigned char)*a) - tolower((unsigned char)*b);
+}
+
+static registration* add_registration(int kind, const x86_plugin_handler* handler) {
+	registration* reg;
+	if (handler == NULL || handler->func == NULL) {
+		fprintf(stderr, "plugin handler has no function\n");
+		return NULL;
+	}
+	if (handler->convention < X86_PLUGIN_CDECL || X86_PLUGIN_THISCALL < handler->convention) {
+		fprintf(stderr, "unknown calling convention %d for plugin handler\n", handler->convention);
+		return NULL;
+	}
+	if (handler->arg_num > X86_PLUGIN_ARG_MAX) {
+		fprintf(stderr, "too many arguments (%"PRIu32") for plugin handler\n", handler->arg_num);
+		return NULL;
+	}
+	if (registration_num >= registration_capacity) {
+		uint32_t new_capacity = registration_capacity == 0 ? 16 : registration_capacity * 2;
+		registration* new_regs = realloc(registrations, sizeof(*new_regs) * new_capacity);
+		if (new_regs == NULL) {
+			perror("realloc");
+			return NULL;
+		}
+		registrations = new_regs;
+		registration_capacity = new_capacity;
+	}
+	reg = &registrations[registration_num];
+	memset(reg, 0, sizeof(*reg));
+	reg->kind = kind;
+	reg->handler = *handler;
+	return reg;
+}
+
+static int register_import(const char* lib_name, const char* func_name, const x86_plugin_handler* handler) {
+	registration* reg = add_registration(REG_IMPORT, handler);
+	if (reg == NULL || lib_name == NULL || func_name == NULL) return 0;
+	if ((reg->lib_name = copy_string(lib_name)) == NULL) return 0;
+	if ((reg->name = copy_string(func_name)) == NULL) {
+		free(reg->lib_name);
+		return 0;
+	}
+	registration_num++;
+	return 1;
+}
+
+static int register_import_ordinal(const char* lib_name, uint16_t ordinal, const x86_plugin_handler* handler) {
+	registration* reg = add_registration(REG_IMPORT_ORDINAL, handler);
+	if (reg == NULL || lib_name == NULL) return 0;
+	if ((reg->lib_name = copy_string(lib_name)) == NULL) return 0;
+	reg->ordinal = ordinal;
+	registration_num++;
+	return 1;
+}
+
+static int register_symbol(const char* name, const x86_plugin_handler* handler) {
+	registration* reg = add_registration(REG_SYMBOL, handler);
+	if (reg == NULL || name == NULL) return 0;
+	if ((reg->name = copy_string(name)) == NULL) return 0;
+	registration_num++;
+	return 1;
+}
+
+static int register_address(uint32_t addr, const x86_plugin_handler* handler) {
+	registration* reg = add_registration(REG_ADDRESS, handler);
+	if (reg == NULL) return 0;
+	reg->addr = addr;
+	registration_num++;
+	return 1;
+}
+
+static int read_chunks(uint32_t addr, uint32_t size, x86_plugin_read_chunk callback, void* ctx) {
+	uint32_t offset = 0;
+	if (size > 0 && size - 1 > UINT32_MAX - addr) return 0;
+	while (offset < size) {
+		uint32_t cur = addr + offset;
+		uint32_t chunk = DMEMORY_PAGE_SIZE - cur % DMEMORY_PAGE_SIZE;
+		const uint8_t* page = dmemory_page_for_read(cur);
+		if (page == NULL) return 0;
+		if (chunk > size - offset) chunk = size - offset;
+		if (!callback(ctx, page + cur % DMEMORY_PAGE_SIZE, offset, chunk)) break;
+		offset += chunk;
+	}
+	return 1;
+}
+
+static int write_chunks(uint32_t addr, uint32_t size, x86_plugin_write_chunk callback, void* ctx) {
+	uint32_t offset = 0;
+	if (size > 0 && size - 1 > UINT32_MAX - addr) return 0;
+	while (offset < size) {
+		uint32_t cur = addr + offset;
+		uint32_t chunk = DMEMORY_PAGE_SIZE - cur % DMEMORY_PAGE_SIZE;
+		uint8_t* page = dmemory_page_for_write(cur);
+		if (page == NULL) return 0;
+		if (chunk > size - offset) chunk = size - offset;
+		if (!callback(ctx, page + cur % DMEMORY_PAGE_SIZE, offset, chunk)) break;
+		offset += chunk;
+	}
+	return 1;
+}
+
+static int read_memory(void* dest, uint32_t addr, uint32_t size) {
+	if (size == 0) return 1;
+	if (!dmemory_is_allocated(addr, size)) return 0;
+	dmemory_read(dest, addr, size);
+	return 1;
+}
+
+static int write_memory(const void* src, uint32_t addr, uint32_t size) {
+	if (size == 0) return 1;
+	if (!dmemory_is_allocated(addr, size)) return 0;
+	dmemory_write((void*)src, addr, size);
+	return 1;
+}
+
+static const x86_plugin_api api = {
+	X86_PLUGIN_API_VERSION,
+	register_import,
+	register_import_ordinal,
+	register_symbol,
+	register_address,
+	read_chunks,
+	write_chunks,
+	read_memory,
+	write_memory
+};
+
+static int compare_entries(const void* a, const void* b) {
+	const address_entry* ea = a;
+	const address_entry* eb = b;
+	if (ea->addr != eb->addr) return ea->addr < eb->addr ? -1 : 1;
+	return ea->index < eb->index ? -1 : ea->index > eb->index ? 1 : 0;
+}
+
+/* 表を並べ、同じアドレスには後で登録したハンドラだけを残す */
+static void sort_entries(image_table* image) {
+	uint32_t i, num = 0;
+	if (image->entry_num == 0) return;
+	qsort(image->entries, image->entry_num, sizeof(*image->entries), compare_entries);
+	for (i = 0; i < image->entry_num; i++) {
+		if (num > 0 && image->entries[num - 1].addr == image->entries[i].addr) num--;
+		image->entries[num++] = image->entries[i];
+	}
+	image->entry_num = num;
+}
+
+/* 表にアドレスで登録されたハンドラを入れる (entriesはregistration_num個入る大きさで確保しておく) */
+static void add_address_entries(image_table* image) {
+	uint32_t i;
+	for (i = 0; i < registration_num; i++) {
+		if (registrations[i].kind != REG_ADDRESS) continue;
+		image->entries[image->entry_num].addr = registrations[i].addr;
+		image->entries[image->entry_num].index = i;
+		image->entry_num++;
+	}
+}
+
+static void add_symbol_entry(void* ctx, const char* name, uint32_t addr, uint32_t size, const uint8_t* code) {
+	image_table* image = ctx;
+	uint32_t i;
+	(void)size;
+	(void)code;
+	for (i = 0; i < registration_num; i++) {
+		if (registrations[i].kind != REG_SYMBOL || strcmp(registrations[i].name, name) != 0) continue;
+		if (image->entry_num >= registration_num) return; /* 同じ名前のシンボルが重複している */
+		image->entries[image->entry_num].addr = addr;
+		image->entries[image->entry_num].index = i;
+		image->entry_num++;
+		/* 同じ名前の登録が複数あれば、後のものを使う (並べる時に前のものは消える) */
+	}
+}
+
+static image_table* add_image(void) {
+	image_table* new_images = realloc(images, sizeof(*new_images) * (image_num + 1));
+	image_table* image;
+	if (new_images == NULL) {
+		perror("realloc");
+		return NULL;
+	}
+	images = new_images;
+	image = &images[image_num];
+	image->filename = NULL;
+	image->entry_num = 0;
+	/* 1個のシンボルが複数の登録に一致しても、登録の数を越えることはない */
+	image->entries = malloc(sizeof(*image->entries) * (registration_num > 0 ? registration_num : 1));
+	if (image->entries == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	image_num++;
+	return image;
+}
+
+int plugin_load(const char* filename) {
+	void* handle;
+	x86_plugin_init_func init;
+	image_table* image;
+	handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		fprintf(stderr, "failed to load plugin %s: %s\n", filename, dlerror());
+		return 0;
+	}
+	init = (x86_plugin_init_func)dlsym(handle, X86_PLUGIN_INIT_NAME);
+	if (init == NULL) {
+		fprintf(stderr, "plugin %s has no %s()\n", filename, X86_PLUGIN_INIT_NAME);
+		dlclose(handle);
+		return 0;
+	}
+	if (!init(&api)) {
+		fprintf(stderr, "plugin %s failed to initialize\n", filename);
+		return 0;
+	}
+	/* ハンドラが呼ばれうるので、ライブラリは閉じない */
+	/* アドレスで登録されたハンドラの表を作り直す */
+	while (image_num > 0) {
+		image_num--;
+		free(images[image_num].filename);
+		free(images[image_num].entries);
+	}
+	if ((image = add_image()) == NULL) return 0;
+	add_address_entries(image);
+	sort_entries(image);
+	current_image = 0;
+	return 1;
+}
+
+int plugin_attach(const char* filename) {
+	image_table* image;
+	uint32_t i;
+	for (i = 1; i < image_num; i++) {
+		if (images[i].filename != NULL && strcmp(images[i].filename, filename) == 0) {
+			current_image = i;
+			return 1;
+		}
+	}
+	for (i = 0; i < registration_num; i++) {
+		if (registrations[i].kind == REG_SYMBOL) break;
+	}
+	if (i >= registration_num) {
+		/* シンボルで登録されたハンドラが無ければ、ELFに依らない表を使う */
+		current_image = 0;
+		return 1;
+	}
+	if ((image = add_image()) == NULL) return 0;
+	if ((image->filename = copy_string(filename)) == NULL) return 0;
+	add_address_entries(image);
+	if (!read_elf_symbols(filename, add_symbol_entry, image)) return 0;
+	sort_entries(image);
+	current_image = image_num - 1;
+	return 1;
+}
+
+uint32_t plugin_current_image(void) {
+	return current_image;
+}
+
+void plugin_select_image(uint32_t image) {
+	if (image < image_num) current_image = image;
+}
+
+/* 引数を読んでハンドラを呼び、結果をEAXとEDXに入れる */
+static int invoke(const x86_plugin_handler* handler, uint32_t regs[], uint32_t* stack_remove_size) {
+	uint32_t args[X86_PLUGIN_ARG_MAX];
+	uint32_t ret[2];
+	uint32_t reg_arg_num = 0, stack_arg_num = 0;
+	uint32_t i;
+	if (handler->convention == X86_PLUGIN_FASTCALL) reg_arg_num = 2;
+	else if (handler->convention == X86_PLUGIN_THISCALL) reg_arg_num = 1;
+	for (i = 0; i < handler->arg_num; i++) {
+		if (i < reg_arg_num) {
+			args[i] = regs[i == 0 ? ECX : EDX];
+		} else {
+			int ok;
+			stack_arg_num++;
+			args[i] = dmem_read_uint(&ok, regs[ESP] + 4 * stack_arg_num, 4);
+			if (!ok) {
+				fprintf(stderr, "failed to read argument %"PRIu32" for plugin handler\n", i);
+				return 0;
+			}
+		}
+	}
+	ret[0] = regs[EAX];
+	ret[1] = regs[EDX];
+	if (!handler->func(handler->ctx, ret, args, regs[ESP])) return 0;
+	regs[EAX] = ret[0];
+	regs[EDX] = ret[1];
+	*stack_remove_size = handler->convention == X86_PLUGIN_CDECL ? 0 : 4 * stack_arg_num;
+	return 1;
+}
+
+int plugin_call(uint32_t* eip, uint32_t regs[]) {
+	const image_table* image;
+	uint32_t low, high, ret_addr, stack_remove_size;
+	int ok;
+	if (current_image >= image_num) return 0;
+	image = &images[current_image];
+	if (image->entry_num == 0) return 0;
+	if (*eip < image->entries[0].addr || image->entries[image->entry_num - 1].addr < *eip) return 0;
+	/* 二分探索 */
+	low = 0;
+	high = image->entry_num;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if (image->entries[mid].addr < *eip) low = mid + 1;
+		else high = mid;
+	}
+	if (low >= image->entry_num || image->entries[low].addr != *eip) return 0;
+	ret_addr = dmem_read_uint(&ok, regs[ESP], 4);
+	if (!ok) {
+		fprintf(stderr, "failed to read return address for plugin handler at %08"PRIx32"\n", *eip);
+		return -1;
+	}
+	if (!invoke(&registrations[image->entries[low].index].handler, regs, &stack_remove_size)) {
+		fprintf(stderr, "plugin handler at %08"PRIx32" failed\n", *eip);
+		return -1;
+	}
+	/* ret */
+	regs[ESP] += 4 + stack_remove_size;
+	*eip = ret_addr;
+	return 1;
+}
+
+int plugin_exec_import(uint32_t regs[], const char* lib_name, const char* func_name, uint16_t func_ord,
+uint32_t* stack_remove_size) {
+	uint32_t i;
+	/* 後で登録したものを優先する */
+	for (i = registration_num; i > 0; i--) {
+		const registration* reg = &registrations[i - 1];
+		if (reg->kind == REG_IMPORT) {
+			if (func_name == NULL || strcmp(reg->name, func_name) != 0) continue;
+		} else if (reg->kind == REG_IMPORT_ORDINAL) {
+			if (func_name != NULL || reg->ordinal != func_ord) continue;
+		} else {
+			continue;
+		}
+		if (strcmp_ncs(reg->lib_name, lib_name) != 0) continue;
+		if (!invoke(&reg->handler, regs, stack_remove_size)) {
+			if (func_name != NULL) {
+				fprintf(stderr, "plugin handler for %s() in %s failed\n", func_name, lib_name);
+			} else {
+				fprintf(stderr, "plugin handler for #%"PRIu16" in %s failed\n", func_ord, lib_name);
+			}
+			return -1;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+void plugin_save_state(checkpoint_writer* writer) {
+	const image_table* image = current_image < image_num ? &images[current_image] : NULL;
+	uint32_t i;
+	checkpoint_put_uint(writer, registration_num);
+	checkpoint_put_uint(writer, image != NULL ? image->entry_num : 0);
+	for (i = 0; image != NULL && i < image->entry_num; i++) {
+		checkpoint_put_uint(writer, image->entries[i].addr);
+		checkpoint_put_uint(writer, image->entries[i].index);
+	}
+}
+
+int plugin_load_state(checkpoint_reader* reader) {
+	image_table* image;
+	uint32_t num, entry_num, i;
+	int same;
+	num = checkpoint_get_uint(reader);
+	entry_num = checkpoint_get_uint(reader);
+	if (reader->error) return 0;
+	if (num != registration_num || entry_num > registration_num) {
+		fprintf(stderr, "checkpoint was saved with %"PRIu32" plugin handlers, but %"PRIu32" are registered\n",
+			num, registration_num);
+		return 0;
+	}
+	if ((image = add_image()) == NULL) return 0;
+	for (i = 0; i < entry_num; i++) {
+		image->entries[i].addr = checkpoint_get_uint(reader);
+		image->entries[i].index = checkpoint_get_uint(reader);
+		if (image->entries[i].index >= registration_num) reader->error = 1;
+	}
+	image->entry_num = entry_num;
+	if (reader->error) {
+		image_num--;
+		free(image->entries);
+		return 0;
+	}
+	/* スナップショットから何度も戻す時に表が増えないよう、今の表と同じなら今の表を使う */
+	same = current_image < image_num - 1 && images[current_image].entry_num == entry_num &&
+		(entry_num == 0 || memcmp(images[current_image].entries, image->entries, sizeof(*image->entries) * entry_num) == 0);
+	if (same) {
+		image_num--;
+		free(image->entries);
+	} else {
+		current_image = image_num - 1;
+	}
+	return 1;
+}
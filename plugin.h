@@ -0,0 +1,36 @@
+#ifndef PLUGIN_H_GUARD_CEBF9800_5279_4C6E_BE2D_3E861F84577D
+#define PLUGIN_H_GUARD_CEBF9800_5279_4C6E_BE2D_3E861F84577D
+
+#include <stdint.h>
+#include "checkpoint.h"
+
+/*
+プラグイン (x86_plugin.h) の読み込みと、登録されたハンドラの呼び出し。
+アドレスで呼ぶハンドラの表は読み込んだELFごとに作り、プロセスごとにどの表を使うかを持つ。
+*/
+
+/* 共有ライブラリを読み込み、初期化関数を呼ぶ */
+int plugin_load(const char* filename);
+
+/* 読み込んだELFファイルの.symtabから、シンボルで登録されたハンドラのアドレスを探す */
+int plugin_attach(const char* filename);
+
+/* 現在のプロセスが使う表 */
+uint32_t plugin_current_image(void);
+void plugin_select_image(uint32_t image);
+
+/* EIPにハンドラがあれば呼んで戻る。実行した:1 ハンドラが無い:0 失敗:-1 */
+int plugin_call(uint32_t* eip, uint32_t regs[]);
+
+/*
+PEのインポートの関数のハンドラを呼ぶ。ESPと戻りアドレスは変えず、*stack_remove_sizeに消す引数の大きさを入れる。
+実行した:1 ハンドラが無い:0 失敗:-1
+*/
+int plugin_exec_import(uint32_t regs[], const char* lib_name, const char* func_name, uint16_t func_ord,
+	uint32_t* stack_remove_size);
+
+/* ハンドラの状態は保存しない。読み込む時は、同じプラグインを同じ順で読み込んでおく必要がある */
+void plugin_save_state(checkpoint_writer* writer);
+int plugin_load_state(checkpoint_reader* reader);
+
+#endif
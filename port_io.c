@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include "port_io.h"
+
+#define PORT_DEVICE_MAX 16
+
+static port_device devices[PORT_DEVICE_MAX];
+static int device_num = 0;
+
+static const port_device* find_device(uint16_t port) {
+	int i;
+	for (i = 0; i < device_num; i++) {
+		if (devices[i].first_port <= port && (uint32_t)(port - devices[i].first_port) < devices[i].port_num) {
+			return &devices[i];
+		}
+	}
+	return NULL;
+}
+
+int port_io_register(const port_device* device) {
+	if (device_num >= PORT_DEVICE_MAX) {
+		fprintf(stderr, "too many port devices\n");
+		return 0;
+	}
+	devices[device_num++] = *device;
+	return 1;
+}
+
+int port_io_read(uint16_t port, int width, uint32_t* value) {
+	const port_device* device = find_device(port);
+	if (device == NULL || device->read == NULL) {
+		*value = UINT32_C(0xffffffff);
+		return 1;
+	}
+	return device->read(device->ctx, port, width, value);
+}
+
+int port_io_write(uint16_t port, int width, uint32_t value) {
+	const port_device* device = find_device(port);
+	if (device == NULL || device->write == NULL) return 1;
+	return device->write(device->ctx, port, width, value);
+}
+
+int port_io_write_block(uint16_t port, const uint8_t* data, size_t size) {
+	const port_device* device = find_device(port);
+	size_t i;
+	if (device == NULL) return 1;
+	if (device->write_block != NULL) return device->write_block(device->ctx, port, data, size);
+	if (device->write == NULL) return 1;
+	for (i = 0; i < size; i++) {
+		if (!device->write(device->ctx, port, 1, data[i])) return 0;
+	}
+	return 1;
+}
+
+/* コンソールの入力は、受信データの有無を調べられるように自前でバッファリングする */
+static uint8_t console_buffer[4096];
+static uint32_t console_pos = 0, console_len = 0;
+static int console_eof = 0;
+
+static int console_fill(int wait) {
+	ssize_t ret;
+	if (console_pos < console_len) return 1;
+	if (console_eof) return 0;
+	if (!wait) {
+		struct pollfd pfd;
+		pfd.fd = 0;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) <= 0) return 0;
+	} else {
+		/* 入力を待つ前に、プロンプトなどを出しておく */
+		fflush(stdout);
+	}
+	ret = read(0, console_buffer, sizeof(console_buffer));
+	if (ret <= 0) {
+		console_eof = 1;
+		return 0;
+	}
+	console_pos = 0;
+	console_len = (uint32_t)ret;
+	return 1;
+}
+
+static int console_read(void* ctx, uint16_t port, int width, uint32_t* value) {
+	(void)ctx;
+	(void)width;
+	if (port == PORT_CONSOLE_DATA) {
+		*value = console_fill(1) ? console_buffer[console_pos++] : UINT32_C(0xffffffff);
+	} else if (port == PORT_CONSOLE_STATUS) {
+		*value = 0x60 | (console_fill(0) ? 0x01 : 0x00);
+	} else {
+		*value = 0;
+	}
+	return 1;
+}
+
+static int console_write(void* ctx, uint16_t port, int width, uint32_t value) {
+	(void)ctx;
+	(void)width;
+	if (port == PORT_CONSOLE_DATA) putchar((int)(value & 0xff));
+	return 1;
+}
+
+static int console_write_block(void* ctx, uint16_t port, const uint8_t* data, size_t size) {
+	(void)ctx;
+	if (port == PORT_CONSOLE_DATA) return fwrite(data, 1, size, stdout) == size;
+	return 1;
+}
+
+static int exit_requested = 0;
+static uint32_t exit_status = 0;
+
+static int exit_write(void* ctx, uint16_t port, int width, uint32_t value) {
+	(void)ctx;
+	(void)port;
+	exit_status = value & (width >= 4 ? UINT32_C(0xffffffff) : (UINT32_C(1) << (width * 8)) - 1);
+	exit_requested = 1;
+	return 1;
+}
+
+static uint32_t timer_high = 0;
+
+static int timer_read(void* ctx, uint16_t port, int width, uint32_t* value) {
+	(void)ctx;
+	(void)width;
+	if (port == PORT_TIMER_LOW) {
+		struct timespec ts;
+		uint64_t ns;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ns = (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+		timer_high = (uint32_t)(ns >> 32);
+		*value = (uint32_t)ns;
+	} else if (port == PORT_TIMER_HIGH) {
+		*value = timer_high;
+	} else {
+		*value = 0;
+	}
+	return 1;
+}
+
+int port_io_initialize(void) {
+	port_device console = {PORT_CONSOLE_DATA, 8, NULL, console_read, console_write, console_write_block};
+	port_device exit_port = {PORT_EXIT, 1, NULL, NULL, exit_write, NULL};
+	port_device timer = {PORT_TIMER_LOW, 8, NULL, timer_read, NULL, NULL};
+	device_num = 0;
+	console_pos = console_len = 0;
+	console_eof = 0;
+	exit_requested = 0;
+	exit_status = 0;
+	timer_high = 0;
+	return port_io_register(&console) && port_io_register(&exit_port) && port_io_register(&timer);
+}
+
+int port_io_exit_requested(uint32_t* status) {
+	if (exit_requested) *status = exit_status;
+	return exit_requested;
+}
+
+void port_io_save_state(checkpoint_writer* writer) {
+	checkpoint_put_uint(writer, console_len - console_pos);
+	checkpoint_put_bytes(writer, console_buffer + console_pos, console_len - console_pos);
+	checkpoint_put_uint(writer, console_eof);
+	checkpoint_put_uint(writer, timer_high);
+}
+
+int port_io_load_state(checkpoint_reader* reader) {
+	uint32_t len;
+	if (!port_io_initialize()) return 0;
+	len = checkpoint_get_uint(reader);
+	if (reader->error || len > sizeof(console_buffer)) return 0;
+	checkpoint_get_bytes(reader, console_buffer, len);
+	console_len = len;
+	console_eof = checkpoint_get_uint(reader);
+	timer_high = checkpoint_get_uint(reader);
+	return !reader->error;
+}
@@ -0,0 +1,51 @@
+#ifndef PORT_IO_H_GUARD_E2ECFBBF_285B_40C4_A47A_2BB26D3669B8
+#define PORT_IO_H_GUARD_E2ECFBBF_285B_40C4_A47A_2BB26D3669B8
+
+#include <stddef.h>
+#include <stdint.h>
+#include "checkpoint.h"
+
+/*
+IN/OUT命令のためのポートI/Oバス。
+ポートの範囲ごとにデバイスを登録し、デバイスの無いポートは読むと全ビット1、書き込みは無視する。
+*/
+typedef struct {
+	uint16_t first_port;
+	uint32_t port_num;
+	void* ctx;
+	/* widthは1, 2, 4のいずれか。成功:1 失敗:0 */
+	int (*read)(void* ctx, uint16_t port, int width, uint32_t* value);
+	int (*write)(void* ctx, uint16_t port, int width, uint32_t value);
+	/* rep outsbで連続したバイトをまとめて渡す (NULLならwriteを1バイトずつ呼ぶ) */
+	int (*write_block)(void* ctx, uint16_t port, const uint8_t* data, size_t size);
+} port_device;
+
+int port_io_register(const port_device* device);
+int port_io_read(uint16_t port, int width, uint32_t* value);
+int port_io_write(uint16_t port, int width, uint32_t value);
+int port_io_write_block(uint16_t port, const uint8_t* data, size_t size);
+
+/*
+標準のデバイス
+コンソール : データポートへの書き込みを標準出力に、読み込みを標準入力から (EOFでは全ビット1)
+             状態ポートはbit0が受信データあり、bit5とbit6が送信可能 (16550のLSRと同じ)
+終了 : 書き込んだ値を終了ステータスとしてゲストを終了する
+タイマー : 下位ポートを読むとナノ秒単位の単調増加する時刻の下位32ビットを返し、
+           その時の上位32ビットを上位ポートから読めるようにする
+*/
+#define PORT_CONSOLE_DATA 0x3f8
+#define PORT_CONSOLE_STATUS 0x3fd
+#define PORT_EXIT 0xf4
+#define PORT_TIMER_LOW 0x500
+#define PORT_TIMER_HIGH 0x504
+
+/* 登録済みのデバイスを消して、標準のデバイスを登録する */
+int port_io_initialize(void);
+
+/* 終了ポートに書き込まれていたら真を返し、statusに値を入れる */
+int port_io_exit_requested(uint32_t* status);
+
+void port_io_save_state(checkpoint_writer* writer);
+int port_io_load_state(checkpoint_reader* reader);
+
+#endif
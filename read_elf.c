@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include "dynamic_memory.h"
 #include "read_file.h"
@@ -14,77 +15,264 @@ static uint32_t read_num(const uint8_t* data, int size) {
 	return ret;
 }
 
-int read_elf(uint32_t* eip_value, const char* filename) {
-	size_t filesize = 0;
-	uint8_t* filedata = read_whole_file(&filesize, filename);
-	uint32_t sh_offset, sh_ent_size, sh_num, sh_size;
-	uint8_t* sheader;
+/* プログラムヘッダのPT_LOADセグメントを読み込む */
+static int load_segments(file_image* image, uint32_t ph_offset, uint32_t ph_ent_size, uint32_t ph_num) {
 	uint32_t i;
-	if (filedata == 0) return 0;
+	if ((uint64_t)ph_offset + (uint64_t)ph_ent_size * ph_num > image->size) {
+		fprintf(stderr, "ELF program header table is out of file\n");
+		return 0;
+	}
+	if (ph_ent_size < 32) {
+		fprintf(stderr, "ELF program header entry size too small\n");
+		return 0;
+	}
+	for (i = 0; i < ph_num; i++) {
+		const uint8_t* ent = image->data + ph_offset + ph_ent_size * i;
+		uint32_t type = read_num(ent + 0, 4);
+		uint32_t offset = read_num(ent + 4, 4);
+		uint32_t vaddr = read_num(ent + 8, 4);
+		uint32_t file_size = read_num(ent + 16, 4);
+		uint32_t mem_size = read_num(ent + 20, 4);
+		if (type != 1 || mem_size == 0) continue; /* PT_LOADのみ */
+		if (file_size > mem_size) {
+			fprintf(stderr, "ELF segment %"PRIu32" file size exceeds memory size\n", i);
+			return 0;
+		}
+		if (UINT32_MAX - vaddr < mem_size - 1) {
+			fprintf(stderr, "ELF segment %"PRIu32" out of address space\n", i);
+			return 0;
+		}
+		if ((uint64_t)offset + file_size > image->size) {
+			fprintf(stderr, "ELF segment %"PRIu32" data is out of file\n", i);
+			return 0;
+		}
+		/* ファイルに無い部分 (bss) はゼロのページのまま */
+		dmemory_allocate(vaddr, mem_size);
+		if (file_size > 0) load_file_image(image, vaddr, offset, file_size);
+	}
+	return 1;
+}
+
+/* プログラムヘッダが無い場合、SHF_ALLOCのセクションを読み込む */
+static int load_sections(file_image* image, uint32_t sh_offset, uint32_t sh_ent_size, uint32_t sh_num) {
+	uint32_t i;
+	if ((uint64_t)sh_offset + (uint64_t)sh_ent_size * sh_num > image->size) {
+		fprintf(stderr, "ELF section header table is out of file\n");
+		return 0;
+	}
+	if (sh_ent_size < 40) {
+		fprintf(stderr, "ELF section header entry size too small\n");
+		return 0;
+	}
+	for (i = 0; i < sh_num; i++) {
+		const uint8_t* ent = image->data + sh_offset + sh_ent_size * i;
+		uint32_t type = read_num(ent + 4, 4);
+		uint32_t flags = read_num(ent + 8, 4);
+		uint32_t addr = read_num(ent + 12, 4);
+		uint32_t offset = read_num(ent + 16, 4);
+		uint32_t size = read_num(ent + 20, 4);
+		if (flags & 2) { /* メモリにロードする */
+			if (size > 0 && UINT32_MAX - addr < size - 1) {
+				fprintf(stderr, "ELF section %"PRIu32" out of address space\n", i);
+				return 0;
+			}
+			dmemory_allocate(addr, size);
+			if (type != 8) { /* SHT_NOBITSでない */
+				if ((uint64_t)offset + size > image->size) {
+					fprintf(stderr, "ELF section %"PRIu32" data is out of file\n", i);
+					return 0;
+				}
+				load_file_image(image, addr, offset, size);
+			}
+		}
+	}
+	return 1;
+}
+
+/* ELFヘッダを検査してファイルを開く */
+static int open_elf(file_image* image, const char* filename) {
+	uint8_t* filedata;
+	size_t filesize;
+	if (!open_file_image(image, filename)) return 0;
+	filedata = image->data;
+	filesize = image->size;
 	if (filesize < 16) {
 		fprintf(stderr, "file size too small for ELF ident\n");
-		free(filedata); return 0;
+		close_file_image(image); return 0;
 	}
 	if (filedata[0] != 0x7f || filedata[1] != 'E' || filedata[2] != 'L' || filedata[3] != 'F') {
 		fprintf(stderr, "not ELF file\n");
-		free(filedata); return 0;
+		close_file_image(image); return 0;
 	}
 	if (filedata[4] != 1) {
 		fprintf(stderr, "only 32-bit ELF file is supported, but this is %s\n",
 			filedata[4] == 0 ? "invalid" : filedata[4] == 2 ? "64-bit" : "unknown");
-		free(filedata); return 0;
+		close_file_image(image); return 0;
 	}
 	if (filedata[5] != 1) {
 		fprintf(stderr, "only little endian ELF file is supported\n");
-		free(filedata); return 0;
+		close_file_image(image); return 0;
 	}
 	if (filedata[6] != 1) {
 		fprintf(stderr, "warning: unknown ELF version %"PRIu8"\n", filedata[6]);
 	}
 	if (filesize < 52) {
 		fprintf(stderr, "file size too small for ELF header\n");
-		free(filedata); return 0;
+		close_file_image(image); return 0;
 	}
+	return 1;
+}
+
+int read_elf(uint32_t* eip_value, const char* filename) {
+	file_image image;
+	uint8_t* filedata;
+	uint32_t ph_offset, ph_num, sh_offset, sh_num;
+	int ok;
+	if (!open_elf(&image, filename)) return 0;
+	filedata = image.data;
 	*eip_value = read_num(filedata + 24, 4);
+	ph_offset = read_num(filedata + 28, 4);
+	ph_num = read_num(filedata + 44, 2);
 	sh_offset = read_num(filedata + 32, 4);
-	sh_ent_size = read_num(filedata + 46, 2);
 	sh_num = read_num(filedata + 48, 2);
-	sh_size = (uint32_t)sh_ent_size * (uint32_t)sh_num;
-	if (sh_offset == 0) {
-		fprintf(stderr, "warning: no section header table in ELF\n");
-		free(filedata); return 1;
+	if (ph_offset != 0 && ph_num > 0) {
+		ok = load_segments(&image, ph_offset, read_num(filedata + 42, 2), ph_num);
+	} else if (sh_offset != 0) {
+		ok = load_sections(&image, sh_offset, read_num(filedata + 46, 2), sh_num);
+	} else {
+		fprintf(stderr, "warning: no program header or section header table in ELF\n");
+		ok = 1;
 	}
-	if ((uint64_t)sh_offset + sh_size > filesize) {
-		fprintf(stderr, "ELF section header table is out of file\n");
-		free(filedata); return 0;
+	close_file_image(&image);
+	return ok;
+}
+
+/* i386のELFで、セクションヘッダの表がファイルに収まっているかを調べる */
+static int check_section_table(const file_image* image, uint32_t* sh_offset, uint32_t* sh_ent_size, uint32_t* sh_num) {
+	if (read_num(image->data + 18, 2) != 3) { /* EM_386 */
+		fprintf(stderr, "ELF machine is not i386\n");
+		return 0;
 	}
-	if (sh_ent_size < 40) {
+	*sh_offset = read_num(image->data + 32, 4);
+	*sh_ent_size = read_num(image->data + 46, 2);
+	*sh_num = read_num(image->data + 48, 2);
+	if (*sh_offset == 0) *sh_num = 0;
+	if (*sh_num > 0 && *sh_ent_size < 40) {
 		fprintf(stderr, "ELF section header entry size too small\n");
-		free(filedata); return 0;
+		return 0;
+	}
+	if ((uint64_t)*sh_offset + (uint64_t)*sh_ent_size * *sh_num > image->size) {
+		fprintf(stderr, "ELF section header table is out of file\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* シンボルの値のアドレスにある、ファイル上のsizeバイトのデータを返す (無ければNULL) */
+static const uint8_t* symbol_data(const file_image* image, uint32_t sh_offset, uint32_t sh_ent_size, uint32_t sh_num,
+uint32_t shndx, uint32_t value, uint32_t size) {
+	const uint8_t* sec;
+	uint32_t addr, offset, sec_size;
+	if (shndx == 0 || shndx >= sh_num || size == 0) return NULL;
+	sec = image->data + sh_offset + sh_ent_size * shndx;
+	if (read_num(sec + 4, 4) == 8) return NULL; /* SHT_NOBITS */
+	addr = read_num(sec + 12, 4);
+	offset = read_num(sec + 16, 4);
+	sec_size = read_num(sec + 20, 4);
+	if (value < addr || value - addr > sec_size || sec_size - (value - addr) < size) return NULL;
+	if ((uint64_t)offset + sec_size > image->size) return NULL;
+	return image->data + offset + (value - addr);
+}
+
+int read_elf_symbols(const char* filename, elf_symbol_callback callback, void* ctx) {
+	file_image image;
+	uint32_t sh_offset, sh_ent_size, sh_num, i;
+	if (!open_elf(&image, filename)) return 0;
+	if (!check_section_table(&image, &sh_offset, &sh_ent_size, &sh_num)) {
+		close_file_image(&image); return 0;
 	}
-	sheader = filedata + sh_offset;
 	for (i = 0; i < sh_num; i++) {
-		uint8_t* ent = sheader + sh_ent_size * i;
-		uint32_t type = read_num(ent + 4, 4);
-		uint32_t flags = read_num(ent + 8, 4);
-		uint32_t addr = read_num(ent + 12, 4);
-		uint32_t offset = read_num(ent + 16, 4);
-		uint32_t size = read_num(ent + 20, 4);
-		if (flags & 2) { /* メモリにロードする */
-			if (size > 0 && UINT32_MAX - addr < size - 1) {
-				fprintf(stderr, "ELF section %"PRIu32" out of address space\n", i);
-				free(filedata); return 0;
-			}
-			dmemory_allocate(addr, size);
-			if (type != 8) { /* SHT_NOBITSでない */
-				if ((uint64_t)offset + size > filesize) {
-					fprintf(stderr, "ELF section %"PRIu32" data is out of file\n", i);
-					free(filedata); return 0;
-				}
-				dmemory_write(filedata + offset, addr, size);
-			}
+		const uint8_t* sec = image.data + sh_offset + sh_ent_size * i;
+		const uint8_t* str_sec;
+		uint32_t offset, size, link, ent_size, str_offset, str_size, j;
+		if (read_num(sec + 4, 4) != 2) continue; /* SHT_SYMTABのみ */
+		offset = read_num(sec + 16, 4);
+		size = read_num(sec + 20, 4);
+		link = read_num(sec + 24, 4);
+		ent_size = read_num(sec + 36, 4);
+		if (ent_size < 16 || (uint64_t)offset + size > image.size || link >= sh_num) {
+			fprintf(stderr, "ELF symbol table %"PRIu32" is broken\n", i);
+			close_file_image(&image); return 0;
+		}
+		str_sec = image.data + sh_offset + sh_ent_size * link;
+		str_offset = read_num(str_sec + 16, 4);
+		str_size = read_num(str_sec + 20, 4);
+		if ((uint64_t)str_offset + str_size > image.size) {
+			fprintf(stderr, "ELF string table %"PRIu32" is out of file\n", link);
+			close_file_image(&image); return 0;
+		}
+		for (j = 0; j + ent_size <= size; j += ent_size) {
+			const uint8_t* sym = image.data + offset + j;
+			uint32_t name = read_num(sym + 0, 4);
+			uint32_t value = read_num(sym + 4, 4);
+			uint32_t sym_size = read_num(sym + 8, 4);
+			uint32_t info = read_num(sym + 12, 1);
+			uint32_t shndx = read_num(sym + 14, 2);
+			const char* name_str;
+			if ((info & 0xf) != 2) continue; /* STT_FUNC */
+			if ((info >> 4) != 1 && (info >> 4) != 2) continue; /* STB_GLOBALかSTB_WEAK */
+			if (shndx == 0 || shndx >= 0xff00) continue; /* 未定義や特殊なセクション */
+			if (name >= str_size || memchr(image.data + str_offset + name, 0, str_size - name) == NULL) continue;
+			name_str = (const char*)image.data + str_offset + name;
+			callback(ctx, name_str, value, sym_size,
+				symbol_data(&image, sh_offset, sh_ent_size, sh_num, shndx, value, sym_size));
+		}
+	}
+	close_file_image(&image);
+	return 1;
+}
+
+int read_elf_code(const char* filename, elf_code_callback callback, void* ctx) {
+	file_image image;
+	uint32_t ph_offset, ph_ent_size, ph_num, i;
+	if (!open_elf(&image, filename)) return 0;
+	ph_offset = read_num(image.data + 28, 4);
+	ph_ent_size = read_num(image.data + 42, 2);
+	ph_num = read_num(image.data + 44, 2);
+	if (ph_offset != 0 && ph_num > 0) {
+		if ((uint64_t)ph_offset + (uint64_t)ph_ent_size * ph_num > image.size || ph_ent_size < 32) {
+			fprintf(stderr, "ELF program header table is broken\n");
+			close_file_image(&image); return 0;
+		}
+		for (i = 0; i < ph_num; i++) {
+			const uint8_t* ent = image.data + ph_offset + ph_ent_size * i;
+			uint32_t offset = read_num(ent + 4, 4);
+			uint32_t vaddr = read_num(ent + 8, 4);
+			uint32_t file_size = read_num(ent + 16, 4);
+			uint32_t flags = read_num(ent + 24, 4);
+			/* 実行可能 (PF_X) なPT_LOADセグメントのみ */
+			if (read_num(ent + 0, 4) != 1 || !(flags & 1) || file_size == 0) continue;
+			if ((uint64_t)offset + file_size > image.size) continue;
+			callback(ctx, vaddr, image.data + offset, file_size);
+		}
+	} else {
+		uint32_t sh_offset, sh_ent_size, sh_num;
+		if (!check_section_table(&image, &sh_offset, &sh_ent_size, &sh_num)) {
+			close_file_image(&image); return 0;
+		}
+		for (i = 0; i < sh_num; i++) {
+			const uint8_t* ent = image.data + sh_offset + sh_ent_size * i;
+			uint32_t type = read_num(ent + 4, 4);
+			uint32_t flags = read_num(ent + 8, 4);
+			uint32_t addr = read_num(ent + 12, 4);
+			uint32_t offset = read_num(ent + 16, 4);
+			uint32_t size = read_num(ent + 20, 4);
+			/* SHF_ALLOCかつSHF_EXECINSTRで、ファイルにデータがあるセクションのみ */
+			if ((flags & 6) != 6 || type == 8 || size == 0) continue;
+			if ((uint64_t)offset + size > image.size) continue;
+			callback(ctx, addr, image.data + offset, size);
 		}
 	}
-	free(filedata);
+	close_file_image(&image);
 	return 1;
 }
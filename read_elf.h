@@ -5,4 +5,15 @@
 
 int read_elf(uint32_t* eip_value, const char* filename);
 
+/*
+i386のELFの.symtabにある、定義済みの大域 (GLOBALかWEAK) の関数シンボルについてcallbackを呼ぶ。
+codeはファイル上の関数のsizeバイトの内容 (ファイルに無ければNULL) で、callbackの中でのみ有効。
+*/
+typedef void (*elf_symbol_callback)(void* ctx, const char* name, uint32_t addr, uint32_t size, const uint8_t* code);
+int read_elf_symbols(const char* filename, elf_symbol_callback callback, void* ctx);
+
+/* 実行可能なセグメント (プログラムヘッダが無ければセクション) のファイル上の内容についてcallbackを呼ぶ */
+typedef void (*elf_code_callback)(void* ctx, uint32_t addr, const uint8_t* data, uint32_t size);
+int read_elf_code(const char* filename, elf_code_callback callback, void* ctx);
+
 #endif
@@ -2,50 +2,104 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dynamic_memory.h"
 #include "read_file.h"
 
 #define BUFFER_SIZE 4096
 
-void* read_whole_file(size_t* size, const char* filename) {
-	FILE* fp;
-	size_t read_size = 0;
-	char* buffer = NULL;
-	fp = fopen(filename, "rb");
-	if (fp == NULL) {
-		fprintf(stderr, "input file open failed\n");
-		return NULL;
-	}
+/* mmapできないファイルを読み込む。バッファは倍々に伸ばす */
+static int read_stream(file_image* image, int fd) {
+	size_t read_size = 0, capacity = 0;
+	uint8_t* buffer = NULL;
 	for (;;) {
-		char data[BUFFER_SIZE];
-		size_t new_read_size = fread(data, sizeof(*data), BUFFER_SIZE, fp);
-		if (ferror(fp)) {
-			fprintf(stderr, "input file read error\n");
-			fclose(fp);
-			free(buffer);
-			return NULL;
-		} else if (new_read_size == 0) {
-			break;
-		} else {
-			char *new_buffer;
-			if (SIZE_MAX - read_size < new_read_size) {
+		ssize_t new_read_size;
+		if (capacity - read_size < BUFFER_SIZE) {
+			uint8_t* new_buffer;
+			size_t new_capacity = capacity == 0 ? BUFFER_SIZE : capacity * 2;
+			if (new_capacity <= capacity) {
 				fprintf(stderr, "input file too big\n");
-				fclose(fp);
 				free(buffer);
-				return NULL;
+				return 0;
 			}
-			new_buffer = realloc(buffer, read_size + new_read_size);
+			new_buffer = realloc(buffer, new_capacity);
 			if (new_buffer == NULL) {
 				perror("realloc");
 				free(buffer);
-				fclose(fp);
-				return NULL;
+				return 0;
 			}
 			buffer = new_buffer;
-			memcpy(buffer + read_size, data, new_read_size);
-			read_size += new_read_size;
+			capacity = new_capacity;
+		}
+		new_read_size = read(fd, buffer + read_size, capacity - read_size);
+		if (new_read_size < 0) {
+			fprintf(stderr, "input file read error\n");
+			free(buffer);
+			return 0;
+		} else if (new_read_size == 0) {
+			break;
+		}
+		read_size += (size_t)new_read_size;
+	}
+	image->data = buffer;
+	image->size = read_size;
+	image->is_mapped = 0;
+	return 1;
+}
+
+int open_file_image(file_image* image, const char* filename) {
+	struct stat st;
+	int fd, ok = 1;
+	image->data = NULL;
+	image->size = 0;
+	image->is_mapped = 0;
+	image->is_shared = 0;
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "input file open failed\n");
+		return 0;
+	}
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	(uint64_t)st.st_size <= SIZE_MAX) {
+		void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			image->data = data;
+			image->size = (size_t)st.st_size;
+			image->is_mapped = 1;
 		}
 	}
-	fclose(fp);
-	if (size != NULL) *size = read_size;
-	return buffer;
+	if (!image->is_mapped) ok = read_stream(image, fd);
+	close(fd);
+	return ok;
+}
+
+void close_file_image(file_image* image) {
+	if (image->is_mapped) {
+		if (!image->is_shared) munmap(image->data, image->size);
+	} else {
+		free(image->data);
+	}
+	image->data = NULL;
+	image->size = 0;
+}
+
+void load_file_image(file_image* image, uint32_t addr, size_t offset, uint32_t size) {
+	uint32_t head, body;
+	dmemory_allocate(addr, size);
+	if (!image->is_mapped || addr % DMEMORY_PAGE_SIZE != offset % DMEMORY_PAGE_SIZE) {
+		dmemory_write(image->data + offset, addr, size);
+		return;
+	}
+	head = (DMEMORY_PAGE_SIZE - addr % DMEMORY_PAGE_SIZE) % DMEMORY_PAGE_SIZE;
+	if (head > size) head = size;
+	body = (size - head) - (size - head) % DMEMORY_PAGE_SIZE;
+	dmemory_write(image->data + offset, addr, head);
+	if (body > 0) {
+		dmemory_map_external(addr + head, body, image->data + offset + head);
+		image->is_shared = 1;
+	}
+	dmemory_write(image->data + offset + head + body, addr + head + body, size - head - body);
 }
@@ -2,7 +2,26 @@
 #define READ_FILE_H_GUARD_765C099B_9A27_466E_974C_79A0CC949AA4
 
 #include <stddef.h>
+#include <stdint.h>
 
-void* read_whole_file(size_t* size, const char* filename);
+/*
+実行ファイルの内容。通常のファイルはmmapでマップし、できないもの (パイプなど) は読み込む。
+マップしたページをメモリに割り当てた場合は、close_file_imageでもマップを解除しない。
+*/
+typedef struct {
+	uint8_t* data;
+	size_t size;
+	int is_mapped;
+	int is_shared;
+} file_image;
+
+int open_file_image(file_image* image, const char* filename);
+void close_file_image(file_image* image);
+
+/*
+ファイルのoffsetからsizeバイトをaddrに割り当てて読み込む (範囲は呼び出し側で確認する)。
+マップしたファイルとページ境界の位置が揃う部分は、コピーせずにファイルのページを共有する。
+*/
+void load_file_image(file_image* image, uint32_t addr, size_t offset, uint32_t size);
 
 #endif
@@ -4,6 +4,6 @@
 #include <stdint.h>
 #include "pe_import.h"
 
-int read_pe(uint32_t* eip_value, uint32_t* stack_size, pe_import_params* import_params, const char* filename);
+int read_pe(uint32_t* eip_value, uint32_t* stack_reserve_value, pe_import_params* import_params, const char* filename);
 
 #endif
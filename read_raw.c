@@ -5,11 +5,14 @@
 #include "read_file.h"
 
 int read_raw(const char* filename) {
-	size_t file_size = 0;
-	void* file_data = read_whole_file(&file_size, filename);
-	if (file_data == NULL) return 0;
-	dmemory_allocate(0, file_size);
-	dmemory_write(file_data, 0, file_size);
-	free(file_data);
+	file_image image;
+	if (!open_file_image(&image, filename)) return 0;
+	if (image.size > UINT32_MAX) {
+		fprintf(stderr, "raw file too big\n");
+		close_file_image(&image);
+		return 0;
+	}
+	if (image.size > 0) load_file_image(&image, 0, 0, (uint32_t)image.size);
+	close_file_image(&image);
 	return 1;
 }
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+
+#define SERVER_ARGS_SIZE_MAX (1024 * 1024)
+#define SERVER_FD_MAX 3
+
+static int read_all(int fd, void* buf, size_t size) {
+	size_t done = 0;
+	while (done < size) {
+		ssize_t ret = read(fd, (char*)buf + done, size - done);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret <= 0) return 0;
+		done += ret;
+	}
+	return 1;
+}
+
+/* 要求のヘッダと標準入出力のfdを受け取る。受け取ったfdの数を返し、失敗時は-1を返す */
+static int receive_header(int conn, uint32_t header[2], int fds[SERVER_FD_MAX]) {
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * SERVER_FD_MAX)];
+	} control;
+	struct cmsghdr* cmsg;
+	ssize_t ret;
+	int fd_num = 0, i;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = header;
+	iov.iov_len = sizeof(uint32_t) * 2;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	do {
+		ret = recvmsg(conn, &msg, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0) return -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		int num;
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+		num = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		if (num > SERVER_FD_MAX - fd_num) num = SERVER_FD_MAX - fd_num;
+		memcpy(fds + fd_num, CMSG_DATA(cmsg), sizeof(int) * num);
+		fd_num += num;
+	}
+	/* ヘッダの残りは普通に読む */
+	if ((msg.msg_flags & MSG_CTRUNC) != 0 ||
+	((size_t)ret < iov.iov_len && !read_all(conn, (char*)header + ret, iov.iov_len - ret))) {
+		for (i = 0; i < fd_num; i++) close(fds[i]);
+		return -1;
+	}
+	return fd_num;
+}
+
+/* NUL終端された引数をargcに分ける */
+static int split_args(char** argv, char* args, uint32_t argc, uint32_t size) {
+	uint32_t i, pos = 0;
+	for (i = 0; i < argc; i++) {
+		if (pos >= size) return 0;
+		argv[i] = args + pos;
+		pos += strlen(args + pos) + 1;
+	}
+	argv[argc] = NULL;
+	return 1;
+}
+
+static int handle_request(int conn, batch_job_runner runner) {
+	uint32_t header[2];
+	int fds[SERVER_FD_MAX];
+	int fd_num, i;
+	int32_t status = 2;
+	char* args = NULL;
+	batch_job job;
+	fd_num = receive_header(conn, header, fds);
+	if (fd_num < 0) {
+		fprintf(stderr, "failed to receive request\n");
+		return 2;
+	}
+	job.stdin_path = NULL;
+	job.stdout_path = NULL;
+	job.argc = 0;
+	job.argv = NULL;
+	/* 引数は1個につき1バイト以上ある */
+	if (fd_num < 2 || header[0] > header[1] || header[1] > SERVER_ARGS_SIZE_MAX) {
+		fprintf(stderr, "invalid request\n");
+	} else if ((args = malloc(header[1] + 1)) == NULL ||
+	(job.argv = malloc(sizeof(*job.argv) * (header[0] + 1))) == NULL) {
+		perror("malloc");
+	} else if (!read_all(conn, args, header[1])) {
+		fprintf(stderr, "failed to receive arguments\n");
+	} else {
+		args[header[1]] = '\0';
+		if (!split_args(job.argv, args, header[0], header[1])) {
+			fprintf(stderr, "invalid request\n");
+		} else {
+			/* 受け取ったfdを標準入出力にする */
+			job.argc = header[0];
+			for (i = 0; i < fd_num; i++) {
+				if (dup2(fds[i], i) < 0) {
+					perror("dup2");
+					break;
+				}
+			}
+			if (i >= fd_num) {
+				clearerr(stdin);
+				status = runner(&job);
+				fflush(NULL);
+			}
+		}
+	}
+	for (i = 0; i < fd_num; i++) {
+		if (fds[i] != i) close(fds[i]);
+	}
+	send(conn, &status, sizeof(status), MSG_NOSIGNAL);
+	free(args);
+	free(job.argv);
+	return status;
+}
+
+int run_server(const char* socket_path, batch_job_runner runner) {
+	struct sockaddr_un addr;
+	struct stat st;
+	int sock;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", socket_path);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	/* 前回のサーバーが残したソケットは消す */
+	if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(sock);
+		return 1;
+	}
+	if (listen(sock, SOMAXCONN) < 0) {
+		perror("listen");
+		close(sock);
+		return 1;
+	}
+	/* 終わった子プロセスは自動で回収させる */
+	signal(SIGCHLD, SIG_IGN);
+	/* 読み込み済みのイメージは、fork()により全ての要求で共有される */
+	fflush(stdout);
+	fflush(stderr);
+	for (;;) {
+		pid_t pid;
+		int conn = accept(sock, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			perror("accept");
+			close(sock);
+			return 1;
+		}
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+		} else if (pid == 0) {
+			close(sock);
+			exit(handle_request(conn, runner));
+		}
+		close(conn);
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef SERVER_H_GUARD_9F6C37ED_0DB4_4FEA_B3F4_FB7643B6AD81
+#define SERVER_H_GUARD_9F6C37ED_0DB4_4FEA_B3F4_FB7643B6AD81
+
+#include "batch_runner.h"
+
+/*
+Unixドメインソケットsocket_pathで要求を待ち、要求ごとにfork()した子プロセスでrunnerを実行する。
+読み込み済みのイメージや状態は、fork()により全ての要求で共有される。
+
+要求の形式 (数値はホストのバイトオーダー) :
+  uint32_t argc, uint32_t size, 続いてsizeバイトのNUL終端された引数argc個
+  最初のメッセージにSCM_RIGHTSで標準入力・標準出力 (・標準エラー出力) のfdを付ける
+応答 : ジョブが終わった時に、runnerの返り値 (ゲストの終了ステータス) をint32_tで1個返す
+
+ジョブのstdin_pathとstdout_pathはNULLで、受け取ったfdに差し替えた状態でrunnerを呼ぶ。
+エラーで待ち受けを続けられなくなった時に1を返す。
+*/
+int run_server(const char* socket_path, batch_job_runner runner);
+
+#endif
@@ -0,0 +1,631 @@
+#include <string.h>
+#include <math.h>
+#include "sse.h"
+#include "x86_regs.h"
+
+#define MXCSR_IE 0x0001
+#define MXCSR_DEFAULT 0x1f80
+
+/* シフトの種類 */
+enum {
+	SHIFT_RIGHT,
+	SHIFT_RIGHT_ARITH,
+	SHIFT_LEFT
+};
+
+static sse_state sse;
+
+void sse_initialize(void) {
+	memset(&sse, 0, sizeof(sse));
+	sse.mxcsr = MXCSR_DEFAULT;
+}
+
+void sse_save(sse_state* state) {
+	*state = sse;
+}
+
+void sse_load(const sse_state* state) {
+	sse = *state;
+}
+
+int sse_is_opcode(int opcode) {
+	return (0x10 <= opcode && opcode <= 0x1f) || (0x28 <= opcode && opcode <= 0x2f) ||
+		(0x50 <= opcode && opcode <= 0x7f) || opcode == 0xae || opcode == 0xc2 ||
+		(0xc4 <= opcode && opcode <= 0xc6) || opcode >= 0xd0;
+}
+
+int sse_decode(sse_inst* inst) {
+	int prefix = inst->prefix;
+	int opcode = inst->opcode;
+	int reg = inst->reg;
+	int is_ps_or_pd = prefix == SSE_PREFIX_NONE || prefix == SSE_PREFIX_66;
+	/* スカラー命令のメモリオペランドは、F3 (単精度) なら4バイト、F2 (倍精度) なら8バイト */
+	int scalar_size = prefix == SSE_PREFIX_F3 ? 4 : (prefix == SSE_PREFIX_F2 ? 8 : 16);
+	inst->mem_size = 16;
+	inst->is_store = 0;
+	inst->use_imm = 0;
+	switch (opcode) {
+	case 0x10: /* MOVUPS, MOVUPD, MOVSS, MOVSD */
+		inst->mem_size = scalar_size;
+		return 1;
+	case 0x11:
+		inst->mem_size = scalar_size;
+		inst->is_store = 1;
+		return 1;
+	case 0x12: case 0x16: /* MOVLPS, MOVLPD, MOVHPS, MOVHPD (レジスタ同士ならMOVHLPS, MOVLHPS) */
+		inst->mem_size = 8;
+		return prefix == SSE_PREFIX_NONE || (prefix == SSE_PREFIX_66 && inst->is_mem);
+	case 0x13: case 0x17:
+		inst->mem_size = 8;
+		inst->is_store = 1;
+		return is_ps_or_pd && inst->is_mem;
+	case 0x14: case 0x15: /* UNPCKLPS, UNPCKHPS, UNPCKLPD, UNPCKHPD */
+	case 0x28: /* MOVAPS, MOVAPD */
+	case 0x54: case 0x55: case 0x56: case 0x57: /* ANDPS, ANDNPS, ORPS, XORPS (PDも) */
+		return is_ps_or_pd;
+	case 0x18: case 0x19: case 0x1a: case 0x1b: case 0x1c: case 0x1d: case 0x1e: case 0x1f:
+		/* PREFETCHhと複数バイトのNOP (何もしない) */
+		inst->mem_size = 0;
+		return 1;
+	case 0x29:
+		inst->is_store = 1;
+		return is_ps_or_pd;
+	case 0x2a: /* CVTSI2SS, CVTSI2SD */
+		inst->mem_size = 4;
+		return !is_ps_or_pd;
+	case 0x2b: /* MOVNTPS, MOVNTPD */
+		inst->is_store = 1;
+		return is_ps_or_pd && inst->is_mem;
+	case 0x2c: case 0x2d: /* CVTTSS2SI, CVTSS2SI, CVTTSD2SI, CVTSD2SI */
+		inst->mem_size = scalar_size;
+		return !is_ps_or_pd;
+	case 0x2e: case 0x2f: /* UCOMISS, COMISS, UCOMISD, COMISD */
+		inst->mem_size = prefix == SSE_PREFIX_NONE ? 4 : 8;
+		return is_ps_or_pd;
+	case 0x50: /* MOVMSKPS, MOVMSKPD */
+		return is_ps_or_pd && !inst->is_mem;
+	case 0x51: case 0x58: case 0x59: case 0x5c: case 0x5d: case 0x5e: case 0x5f:
+		/* SQRT, ADD, MUL, SUB, MIN, DIV, MAX */
+		inst->mem_size = scalar_size;
+		return 1;
+	case 0x52: case 0x53: /* RSQRTPS, RSQRTSS, RCPPS, RCPSS */
+		inst->mem_size = scalar_size;
+		return prefix == SSE_PREFIX_NONE || prefix == SSE_PREFIX_F3;
+	case 0x5a: /* CVTPS2PD, CVTPD2PS, CVTSS2SD, CVTSD2SS */
+		inst->mem_size = prefix == SSE_PREFIX_NONE ? 8 : scalar_size;
+		return 1;
+	case 0x5b: /* CVTDQ2PS, CVTPS2DQ, CVTTPS2DQ */
+		return prefix != SSE_PREFIX_F2;
+	case 0x6e: /* MOVD xmm, r/m32 */
+		inst->mem_size = 4;
+		return prefix == SSE_PREFIX_66;
+	case 0x6f: /* MOVDQA, MOVDQU */
+		return prefix == SSE_PREFIX_66 || prefix == SSE_PREFIX_F3;
+	case 0x70: /* PSHUFD, PSHUFHW, PSHUFLW */
+		inst->use_imm = 1;
+		return prefix != SSE_PREFIX_NONE;
+	case 0x71: case 0x72: case 0x73: /* 即値によるシフト */
+		inst->use_imm = 1;
+		if (prefix != SSE_PREFIX_66 || inst->is_mem) return 0;
+		if (opcode == 0x73) return reg == 2 || reg == 3 || reg == 6 || reg == 7;
+		return reg == 2 || reg == 4 || reg == 6;
+	case 0x7e: /* MOVD r/m32, xmm (66)、MOVQ xmm, xmm/m64 (F3) */
+		if (prefix == SSE_PREFIX_66) {
+			inst->mem_size = 4;
+			inst->is_store = 1;
+			return 1;
+		}
+		inst->mem_size = 8;
+		return prefix == SSE_PREFIX_F3;
+	case 0x7f: /* MOVDQA, MOVDQU */
+		inst->is_store = 1;
+		return prefix == SSE_PREFIX_66 || prefix == SSE_PREFIX_F3;
+	case 0xae: /* LDMXCSR, STMXCSR, LFENCE, MFENCE, SFENCE */
+		if (prefix != SSE_PREFIX_NONE) return 0;
+		if (inst->is_mem) {
+			inst->mem_size = 4;
+			inst->is_store = reg == 3;
+			return reg == 2 || reg == 3;
+		}
+		return reg >= 5;
+	case 0xc2: /* CMPPS, CMPPD, CMPSS, CMPSD */
+		inst->mem_size = scalar_size;
+		inst->use_imm = 1;
+		return 1;
+	case 0xc4: /* PINSRW */
+		inst->mem_size = 2;
+		inst->use_imm = 1;
+		return prefix == SSE_PREFIX_66;
+	case 0xc5: /* PEXTRW */
+		inst->use_imm = 1;
+		return prefix == SSE_PREFIX_66 && !inst->is_mem;
+	case 0xc6: /* SHUFPS, SHUFPD */
+		inst->use_imm = 1;
+		return is_ps_or_pd;
+	case 0xd6: /* MOVQ xmm/m64, xmm */
+		inst->mem_size = 8;
+		inst->is_store = 1;
+		return prefix == SSE_PREFIX_66;
+	case 0xd7: /* PMOVMSKB */
+		return prefix == SSE_PREFIX_66 && !inst->is_mem;
+	case 0xe6: /* CVTTPD2DQ, CVTDQ2PD, CVTPD2DQ */
+		inst->mem_size = prefix == SSE_PREFIX_F3 ? 8 : 16;
+		return prefix != SSE_PREFIX_NONE;
+	case 0xe7: /* MOVNTDQ */
+		inst->is_store = 1;
+		return prefix == SSE_PREFIX_66 && inst->is_mem;
+	}
+	/* 残りは66 0F 60～6D, 74～76, D1～FEの整数演算 (プリフィックスが無いものはMMXなので未対応) */
+	if (prefix != SSE_PREFIX_66) return 0;
+	return (0x60 <= opcode && opcode <= 0x6d) || (0x74 <= opcode && opcode <= 0x76) ||
+		(0xd1 <= opcode && opcode <= 0xfe && opcode != 0xf0 && opcode != 0xf7);
+}
+
+/* 飽和演算 */
+static int8_t saturate_i8(int32_t value) {
+	return value < INT8_MIN ? INT8_MIN : (value > INT8_MAX ? INT8_MAX : (int8_t)value);
+}
+
+static uint8_t saturate_u8(int32_t value) {
+	return value < 0 ? 0 : (value > UINT8_MAX ? UINT8_MAX : (uint8_t)value);
+}
+
+static int16_t saturate_i16(int32_t value) {
+	return value < INT16_MIN ? INT16_MIN : (value > INT16_MAX ? INT16_MAX : (int16_t)value);
+}
+
+static uint16_t saturate_u16(int32_t value) {
+	return value < 0 ? 0 : (value > UINT16_MAX ? UINT16_MAX : (uint16_t)value);
+}
+
+/* MXCSRの丸めモードで32ビット整数に変換する。範囲外やNaNは不定値 (0x80000000) にする */
+static int32_t to_int32(double value, int truncate) {
+	double rounded;
+	if (truncate) {
+		rounded = trunc(value);
+	} else {
+		switch ((sse.mxcsr >> 13) & 3) {
+		case 0: rounded = nearbyint(value); break;
+		case 1: rounded = floor(value); break;
+		case 2: rounded = ceil(value); break;
+		default: rounded = trunc(value); break;
+		}
+	}
+	if (!(rounded >= -2147483648.0 && rounded < 2147483648.0)) {
+		sse.mxcsr |= MXCSR_IE;
+		return INT32_MIN;
+	}
+	return (int32_t)rounded;
+}
+
+/* CMPPS系の比較の述語 */
+static int compare_predicate(double a, double b, int predicate) {
+	switch (predicate & 7) {
+	case 0: return a == b; /* EQ */
+	case 1: return a < b; /* LT */
+	case 2: return a <= b; /* LE */
+	case 3: return isnan(a) || isnan(b); /* UNORD */
+	case 4: return !(a == b); /* NEQ */
+	case 5: return !(a < b); /* NLT */
+	case 6: return !(a <= b); /* NLE */
+	default: return !isnan(a) && !isnan(b); /* ORD */
+	}
+}
+
+/* レジスタの下位 (highなら上位) の半分を、sizeバイトずつ交互に並べる */
+static void unpack(sse_reg* dest, const sse_reg* src, int size, int high) {
+	sse_reg result;
+	int base = high ? 8 : 0;
+	int i;
+	for (i = 0; i < 8 / size; i++) {
+		memcpy(result.u8 + i * 2 * size, dest->u8 + base + i * size, size);
+		memcpy(result.u8 + (i * 2 + 1) * size, src->u8 + base + i * size, size);
+	}
+	*dest = result;
+}
+
+/* 各レーンをbitsビットの整数としてシフトする */
+static void shift_lanes(sse_reg* dest, int bits, int kind, uint64_t count) {
+	int i;
+	if (count >= (uint64_t)bits) {
+		if (kind != SHIFT_RIGHT_ARITH) {
+			memset(dest, 0, sizeof(*dest));
+			return;
+		}
+		count = bits - 1;
+	}
+	switch (bits * 4 + kind) {
+	case 16 * 4 + SHIFT_RIGHT: for (i = 0; i < 8; i++) dest->u16[i] >>= count; break;
+	case 16 * 4 + SHIFT_RIGHT_ARITH: for (i = 0; i < 8; i++) dest->i16[i] >>= count; break;
+	case 16 * 4 + SHIFT_LEFT: for (i = 0; i < 8; i++) dest->u16[i] <<= count; break;
+	case 32 * 4 + SHIFT_RIGHT: for (i = 0; i < 4; i++) dest->u32[i] >>= count; break;
+	case 32 * 4 + SHIFT_RIGHT_ARITH: for (i = 0; i < 4; i++) dest->i32[i] >>= count; break;
+	case 32 * 4 + SHIFT_LEFT: for (i = 0; i < 4; i++) dest->u32[i] <<= count; break;
+	case 64 * 4 + SHIFT_RIGHT: for (i = 0; i < 2; i++) dest->u64[i] >>= count; break;
+	case 64 * 4 + SHIFT_LEFT: for (i = 0; i < 2; i++) dest->u64[i] <<= count; break;
+	}
+}
+
+/* 浮動小数点の各レーンの演算 (SQRT, RSQRT, RCP, ADD, MUL, SUB, MIN, DIV, MAX)。dとsは同じ型の配列 */
+#define FLOAT_LANES(d, s, n, sqrt_func) \
+	switch (opcode) { \
+	case 0x51: for (i = 0; i < (n); i++) d[i] = sqrt_func(s[i]); break; \
+	case 0x52: for (i = 0; i < (n); i++) d[i] = 1 / sqrt_func(s[i]); break; \
+	case 0x53: for (i = 0; i < (n); i++) d[i] = 1 / s[i]; break; \
+	case 0x58: for (i = 0; i < (n); i++) d[i] += s[i]; break; \
+	case 0x59: for (i = 0; i < (n); i++) d[i] *= s[i]; break; \
+	case 0x5c: for (i = 0; i < (n); i++) d[i] -= s[i]; break; \
+	case 0x5d: for (i = 0; i < (n); i++) d[i] = d[i] < s[i] ? d[i] : s[i]; break; \
+	case 0x5e: for (i = 0; i < (n); i++) d[i] /= s[i]; break; \
+	case 0x5f: for (i = 0; i < (n); i++) d[i] = d[i] > s[i] ? d[i] : s[i]; break; \
+	}
+
+static void float_op(int opcode, int prefix, sse_reg* dest, const sse_reg* src) {
+	int i;
+	switch (prefix) {
+	case SSE_PREFIX_NONE: FLOAT_LANES(dest->f32, src->f32, 4, sqrtf) break;
+	case SSE_PREFIX_66: FLOAT_LANES(dest->f64, src->f64, 2, sqrt) break;
+	case SSE_PREFIX_F3: FLOAT_LANES(dest->f32, src->f32, 1, sqrtf) break;
+	default: FLOAT_LANES(dest->f64, src->f64, 1, sqrt) break;
+	}
+}
+
+static void compare_op(int prefix, int predicate, sse_reg* dest, const sse_reg* src) {
+	int i;
+	if (prefix == SSE_PREFIX_NONE || prefix == SSE_PREFIX_F3) {
+		for (i = 0; i < (prefix == SSE_PREFIX_NONE ? 4 : 1); i++) {
+			dest->u32[i] = compare_predicate(dest->f32[i], src->f32[i], predicate) ? UINT32_C(0xffffffff) : 0;
+		}
+	} else {
+		for (i = 0; i < (prefix == SSE_PREFIX_66 ? 2 : 1); i++) {
+			dest->u64[i] = compare_predicate(dest->f64[i], src->f64[i], predicate) ? ~UINT64_C(0) : 0;
+		}
+	}
+}
+
+/* CVT系の変換 (5A, 5B, E6) */
+static void convert_op(int opcode, int prefix, sse_reg* dest, const sse_reg* src) {
+	sse_reg result = *dest;
+	int i;
+	switch (opcode * 4 + prefix) {
+	case 0x5a * 4 + SSE_PREFIX_NONE: /* CVTPS2PD */
+		for (i = 0; i < 2; i++) result.f64[i] = src->f32[i];
+		break;
+	case 0x5a * 4 + SSE_PREFIX_66: /* CVTPD2PS */
+		for (i = 0; i < 2; i++) result.f32[i] = (float)src->f64[i];
+		result.u64[1] = 0;
+		break;
+	case 0x5a * 4 + SSE_PREFIX_F3: /* CVTSS2SD */
+		result.f64[0] = src->f32[0];
+		break;
+	case 0x5a * 4 + SSE_PREFIX_F2: /* CVTSD2SS */
+		result.f32[0] = (float)src->f64[0];
+		break;
+	case 0x5b * 4 + SSE_PREFIX_NONE: /* CVTDQ2PS */
+		for (i = 0; i < 4; i++) result.f32[i] = (float)src->i32[i];
+		break;
+	case 0x5b * 4 + SSE_PREFIX_66: /* CVTPS2DQ */
+	case 0x5b * 4 + SSE_PREFIX_F3: /* CVTTPS2DQ */
+		for (i = 0; i < 4; i++) result.i32[i] = to_int32(src->f32[i], prefix == SSE_PREFIX_F3);
+		break;
+	case 0xe6 * 4 + SSE_PREFIX_F3: /* CVTDQ2PD */
+		for (i = 0; i < 2; i++) result.f64[i] = src->i32[i];
+		break;
+	case 0xe6 * 4 + SSE_PREFIX_66: /* CVTTPD2DQ */
+	case 0xe6 * 4 + SSE_PREFIX_F2: /* CVTPD2DQ */
+		for (i = 0; i < 2; i++) result.i32[i] = to_int32(src->f64[i], prefix == SSE_PREFIX_66);
+		result.u64[1] = 0;
+		break;
+	}
+	*dest = result;
+}
+
+/* 66 0F 60～6D, 74～76, D1～FEの整数演算 */
+static void integer_op(int opcode, sse_reg* dest, const sse_reg* src) {
+	static const int shift_kind_table[] = {SHIFT_RIGHT, SHIFT_RIGHT_ARITH, SHIFT_LEFT};
+	sse_reg result;
+	int i;
+	switch (opcode) {
+	case 0x60: case 0x61: case 0x62: /* PUNPCKLBW, PUNPCKLWD, PUNPCKLDQ */
+	case 0x68: case 0x69: case 0x6a: /* PUNPCKHBW, PUNPCKHWD, PUNPCKHDQ */
+		unpack(dest, src, 1 << (opcode & 3), opcode >= 0x68);
+		break;
+	case 0x6c: case 0x6d: /* PUNPCKLQDQ, PUNPCKHQDQ */
+		unpack(dest, src, 8, opcode == 0x6d);
+		break;
+	case 0x63: /* PACKSSWB */
+		for (i = 0; i < 8; i++) {
+			result.i8[i] = saturate_i8(dest->i16[i]);
+			result.i8[i + 8] = saturate_i8(src->i16[i]);
+		}
+		*dest = result;
+		break;
+	case 0x67: /* PACKUSWB */
+		for (i = 0; i < 8; i++) {
+			result.u8[i] = saturate_u8(dest->i16[i]);
+			result.u8[i + 8] = saturate_u8(src->i16[i]);
+		}
+		*dest = result;
+		break;
+	case 0x6b: /* PACKSSDW */
+		for (i = 0; i < 4; i++) {
+			result.i16[i] = saturate_i16(dest->i32[i]);
+			result.i16[i + 4] = saturate_i16(src->i32[i]);
+		}
+		*dest = result;
+		break;
+	case 0x64: for (i = 0; i < 16; i++) dest->u8[i] = dest->i8[i] > src->i8[i] ? 0xff : 0; break; /* PCMPGTB */
+	case 0x65: for (i = 0; i < 8; i++) dest->u16[i] = dest->i16[i] > src->i16[i] ? 0xffff : 0; break; /* PCMPGTW */
+	case 0x66: for (i = 0; i < 4; i++) dest->u32[i] = dest->i32[i] > src->i32[i] ? UINT32_C(0xffffffff) : 0; break;
+	case 0x74: for (i = 0; i < 16; i++) dest->u8[i] = dest->u8[i] == src->u8[i] ? 0xff : 0; break; /* PCMPEQB */
+	case 0x75: for (i = 0; i < 8; i++) dest->u16[i] = dest->u16[i] == src->u16[i] ? 0xffff : 0; break; /* PCMPEQW */
+	case 0x76: for (i = 0; i < 4; i++) dest->u32[i] = dest->u32[i] == src->u32[i] ? UINT32_C(0xffffffff) : 0; break;
+	case 0xd1: case 0xd2: case 0xd3: /* PSRLW, PSRLD, PSRLQ */
+	case 0xe1: case 0xe2: /* PSRAW, PSRAD */
+	case 0xf1: case 0xf2: case 0xf3: /* PSLLW, PSLLD, PSLLQ */
+		shift_lanes(dest, 8 << (opcode & 3), shift_kind_table[(opcode >> 4) - 0xd], src->u64[0]);
+		break;
+	case 0xd4: for (i = 0; i < 2; i++) dest->u64[i] += src->u64[i]; break; /* PADDQ */
+	case 0xd5: for (i = 0; i < 8; i++) dest->u16[i] = (uint16_t)((uint32_t)dest->u16[i] * src->u16[i]); break; /* PMULLW */
+	case 0xd8: for (i = 0; i < 16; i++) dest->u8[i] = dest->u8[i] > src->u8[i] ? dest->u8[i] - src->u8[i] : 0; break; /* PSUBUSB */
+	case 0xd9: for (i = 0; i < 8; i++) dest->u16[i] = dest->u16[i] > src->u16[i] ? dest->u16[i] - src->u16[i] : 0; break; /* PSUBUSW */
+	case 0xda: for (i = 0; i < 16; i++) dest->u8[i] = dest->u8[i] < src->u8[i] ? dest->u8[i] : src->u8[i]; break; /* PMINUB */
+	case 0xdb: for (i = 0; i < 2; i++) dest->u64[i] &= src->u64[i]; break; /* PAND */
+	case 0xdc: for (i = 0; i < 16; i++) dest->u8[i] = saturate_u8(dest->u8[i] + src->u8[i]); break; /* PADDUSB */
+	case 0xdd: for (i = 0; i < 8; i++) dest->u16[i] = saturate_u16(dest->u16[i] + src->u16[i]); break; /* PADDUSW */
+	case 0xde: for (i = 0; i < 16; i++) dest->u8[i] = dest->u8[i] > src->u8[i] ? dest->u8[i] : src->u8[i]; break; /* PMAXUB */
+	case 0xdf: for (i = 0; i < 2; i++) dest->u64[i] = ~dest->u64[i] & src->u64[i]; break; /* PANDN */
+	case 0xe0: for (i = 0; i < 16; i++) dest->u8[i] = (dest->u8[i] + src->u8[i] + 1) >> 1; break; /* PAVGB */
+	case 0xe3: for (i = 0; i < 8; i++) dest->u16[i] = (dest->u16[i] + src->u16[i] + 1) >> 1; break; /* PAVGW */
+	case 0xe4: for (i = 0; i < 8; i++) dest->u16[i] = (uint16_t)(((uint32_t)dest->u16[i] * src->u16[i]) >> 16); break; /* PMULHUW */
+	case 0xe5: for (i = 0; i < 8; i++) dest->i16[i] = (int16_t)((dest->i16[i] * src->i16[i]) >> 16); break; /* PMULHW */
+	case 0xe8: for (i = 0; i < 16; i++) dest->i8[i] = saturate_i8(dest->i8[i] - src->i8[i]); break; /* PSUBSB */
+	case 0xe9: for (i = 0; i < 8; i++) dest->i16[i] = saturate_i16(dest->i16[i] - src->i16[i]); break; /* PSUBSW */
+	case 0xea: for (i = 0; i < 8; i++) dest->i16[i] = dest->i16[i] < src->i16[i] ? dest->i16[i] : src->i16[i]; break; /* PMINSW */
+	case 0xeb: for (i = 0; i < 2; i++) dest->u64[i] |= src->u64[i]; break; /* POR */
+	case 0xec: for (i = 0; i < 16; i++) dest->i8[i] = saturate_i8(dest->i8[i] + src->i8[i]); break; /* PADDSB */
+	case 0xed: for (i = 0; i < 8; i++) dest->i16[i] = saturate_i16(dest->i16[i] + src->i16[i]); break; /* PADDSW */
+	case 0xee: for (i = 0; i < 8; i++) dest->i16[i] = dest->i16[i] > src->i16[i] ? dest->i16[i] : src->i16[i]; break; /* PMAXSW */
+	case 0xef: for (i = 0; i < 2; i++) dest->u64[i] ^= src->u64[i]; break; /* PXOR */
+	case 0xf4: for (i = 0; i < 2; i++) dest->u64[i] = (uint64_t)dest->u32[i * 2] * src->u32[i * 2]; break; /* PMULUDQ */
+	case 0xf5: /* PMADDWD */
+		for (i = 0; i < 4; i++) {
+			int64_t sum = (int64_t)dest->i16[i * 2] * src->i16[i * 2] + (int64_t)dest->i16[i * 2 + 1] * src->i16[i * 2 + 1];
+			dest->u32[i] = (uint32_t)sum;
+		}
+		break;
+	case 0xf6: /* PSADBW */
+		for (i = 0; i < 2; i++) {
+			uint64_t sum = 0;
+			int j;
+			for (j = i * 8; j < i * 8 + 8; j++) {
+				sum += dest->u8[j] > src->u8[j] ? dest->u8[j] - src->u8[j] : src->u8[j] - dest->u8[j];
+			}
+			dest->u64[i] = sum;
+		}
+		break;
+	case 0xf8: for (i = 0; i < 16; i++) dest->u8[i] -= src->u8[i]; break; /* PSUBB */
+	case 0xf9: for (i = 0; i < 8; i++) dest->u16[i] -= src->u16[i]; break; /* PSUBW */
+	case 0xfa: for (i = 0; i < 4; i++) dest->u32[i] -= src->u32[i]; break; /* PSUBD */
+	case 0xfb: for (i = 0; i < 2; i++) dest->u64[i] -= src->u64[i]; break; /* PSUBQ */
+	case 0xfc: for (i = 0; i < 16; i++) dest->u8[i] += src->u8[i]; break; /* PADDB */
+	case 0xfd: for (i = 0; i < 8; i++) dest->u16[i] += src->u16[i]; break; /* PADDW */
+	case 0xfe: for (i = 0; i < 4; i++) dest->u32[i] += src->u32[i]; break; /* PADDD */
+	}
+}
+
+/* 即値でのシフト (66 0F 71～73) */
+static void shift_imm_op(int opcode, int reg, sse_reg* dest, uint8_t count) {
+	sse_reg result;
+	if (opcode == 0x73 && (reg == 3 || reg == 7)) {
+		/* PSRLDQ, PSLLDQ (バイト単位) */
+		memset(&result, 0, sizeof(result));
+		if (count < 16) {
+			if (reg == 3) {
+				memcpy(result.u8, dest->u8 + count, 16 - count);
+			} else {
+				memcpy(result.u8 + count, dest->u8, 16 - count);
+			}
+		}
+		*dest = result;
+	} else {
+		static const int kind_table[] = {0, 0, SHIFT_RIGHT, 0, SHIFT_RIGHT_ARITH, 0, SHIFT_LEFT, 0};
+		shift_lanes(dest, 16 << (opcode - 0x71), kind_table[reg], count);
+	}
+}
+
+static void shuffle_op(int opcode, int prefix, uint8_t imm, sse_reg* dest, const sse_reg* src) {
+	sse_reg result;
+	int i;
+	if (opcode == 0xc6) {
+		if (prefix == SSE_PREFIX_NONE) {
+			/* SHUFPS */
+			result.u32[0] = dest->u32[imm & 3];
+			result.u32[1] = dest->u32[(imm >> 2) & 3];
+			result.u32[2] = src->u32[(imm >> 4) & 3];
+			result.u32[3] = src->u32[(imm >> 6) & 3];
+		} else {
+			/* SHUFPD */
+			result.u64[0] = dest->u64[imm & 1];
+			result.u64[1] = src->u64[(imm >> 1) & 1];
+		}
+	} else if (prefix == SSE_PREFIX_66) {
+		/* PSHUFD */
+		for (i = 0; i < 4; i++) result.u32[i] = src->u32[(imm >> (i * 2)) & 3];
+	} else {
+		/* PSHUFHW (F3)、PSHUFLW (F2) */
+		int base = prefix == SSE_PREFIX_F3 ? 4 : 0;
+		result = *src;
+		for (i = 0; i < 4; i++) result.u16[base + i] = src->u16[base + ((imm >> (i * 2)) & 3)];
+	}
+	*dest = result;
+}
+
+void sse_execute(const sse_inst* inst, uint8_t* mem, uint32_t* regs, uint32_t* eflags) {
+	int opcode = inst->opcode;
+	int prefix = inst->prefix;
+	sse_reg* dest = &sse.xmm[inst->reg];
+	sse_reg* rm_reg = &sse.xmm[inst->rm];
+	sse_reg src;
+	uint32_t mask = 0;
+	int i;
+	/* r/mのオペランド。メモリならレジスタの下位に読み込み、残りは0にする */
+	if (mem != NULL) {
+		memset(&src, 0, sizeof(src));
+		if (!inst->is_store) memcpy(&src, mem, inst->mem_size);
+	} else {
+		src = *rm_reg;
+	}
+	switch (opcode) {
+	case 0x10:
+		if (mem != NULL || prefix == SSE_PREFIX_NONE || prefix == SSE_PREFIX_66) {
+			*dest = src;
+		} else if (prefix == SSE_PREFIX_F3) {
+			dest->u32[0] = src.u32[0];
+		} else {
+			dest->u64[0] = src.u64[0];
+		}
+		break;
+	case 0x11: case 0x29: case 0x2b: case 0x7f: case 0xe7:
+		if (mem != NULL) {
+			memcpy(mem, dest, inst->mem_size);
+		} else if (opcode == 0x11 && prefix == SSE_PREFIX_F3) {
+			rm_reg->u32[0] = dest->u32[0];
+		} else if (opcode == 0x11 && prefix == SSE_PREFIX_F2) {
+			rm_reg->u64[0] = dest->u64[0];
+		} else {
+			*rm_reg = *dest;
+		}
+		break;
+	case 0x12: /* MOVLPS (メモリ)、MOVHLPS (レジスタ) */
+		dest->u64[0] = mem != NULL ? src.u64[0] : src.u64[1];
+		break;
+	case 0x13:
+		memcpy(mem, &dest->u64[0], 8);
+		break;
+	case 0x16: /* MOVHPS (メモリ)、MOVLHPS (レジスタ) */
+		dest->u64[1] = src.u64[0];
+		break;
+	case 0x17:
+		memcpy(mem, &dest->u64[1], 8);
+		break;
+	case 0x14: case 0x15:
+		unpack(dest, &src, prefix == SSE_PREFIX_NONE ? 4 : 8, opcode == 0x15);
+		break;
+	case 0x28: case 0x6f:
+		*dest = src;
+		break;
+	case 0x2a:
+		{
+			int32_t value = mem != NULL ? src.i32[0] : (int32_t)regs[inst->rm];
+			if (prefix == SSE_PREFIX_F3) {
+				dest->f32[0] = (float)value;
+			} else {
+				dest->f64[0] = value;
+			}
+		}
+		break;
+	case 0x2c: case 0x2d:
+		regs[inst->reg] = (uint32_t)to_int32(prefix == SSE_PREFIX_F3 ? src.f32[0] : src.f64[0], opcode == 0x2c);
+		break;
+	case 0x2e: case 0x2f:
+		{
+			double a = prefix == SSE_PREFIX_NONE ? dest->f32[0] : dest->f64[0];
+			double b = prefix == SSE_PREFIX_NONE ? src.f32[0] : src.f64[0];
+			*eflags &= ~(OF | SF | ZF | AF | PF | CF);
+			if (isnan(a) || isnan(b)) {
+				*eflags |= ZF | PF | CF;
+			} else if (a < b) {
+				*eflags |= CF;
+			} else if (a == b) {
+				*eflags |= ZF;
+			}
+		}
+		break;
+	case 0x50:
+		if (prefix == SSE_PREFIX_NONE) {
+			for (i = 0; i < 4; i++) mask |= (src.u32[i] >> 31) << i;
+		} else {
+			for (i = 0; i < 2; i++) mask |= (uint32_t)(src.u64[i] >> 63) << i;
+		}
+		regs[inst->reg] = mask;
+		break;
+	case 0x51: case 0x52: case 0x53: case 0x58: case 0x59: case 0x5c: case 0x5d: case 0x5e: case 0x5f:
+		float_op(opcode, prefix, dest, &src);
+		break;
+	case 0x54: for (i = 0; i < 2; i++) dest->u64[i] &= src.u64[i]; break;
+	case 0x55: for (i = 0; i < 2; i++) dest->u64[i] = ~dest->u64[i] & src.u64[i]; break;
+	case 0x56: for (i = 0; i < 2; i++) dest->u64[i] |= src.u64[i]; break;
+	case 0x57: for (i = 0; i < 2; i++) dest->u64[i] ^= src.u64[i]; break;
+	case 0x5a: case 0x5b: case 0xe6:
+		convert_op(opcode, prefix, dest, &src);
+		break;
+	case 0x6e:
+		memset(dest, 0, sizeof(*dest));
+		dest->u32[0] = mem != NULL ? src.u32[0] : regs[inst->rm];
+		break;
+	case 0x70: case 0xc6:
+		shuffle_op(opcode, prefix, inst->imm, dest, &src);
+		break;
+	case 0x71: case 0x72: case 0x73:
+		shift_imm_op(opcode, inst->reg, rm_reg, inst->imm);
+		break;
+	case 0x7e:
+		if (prefix == SSE_PREFIX_F3) {
+			/* MOVQ xmm, xmm/m64 */
+			dest->u64[0] = src.u64[0];
+			dest->u64[1] = 0;
+		} else if (mem != NULL) {
+			memcpy(mem, &dest->u32[0], 4);
+		} else {
+			regs[inst->rm] = dest->u32[0];
+		}
+		break;
+	case 0xae:
+		if (mem != NULL && inst->reg == 2) {
+			sse.mxcsr = src.u32[0] & 0xffff;
+		} else if (mem != NULL) {
+			memcpy(mem, &sse.mxcsr, 4);
+		}
+		/* フェンスは何もしない */
+		break;
+	case 0xc2:
+		compare_op(prefix, inst->imm, dest, &src);
+		break;
+	case 0xc4:
+		dest->u16[inst->imm & 7] = mem != NULL ? src.u16[0] : (uint16_t)regs[inst->rm];
+		break;
+	case 0xc5:
+		regs[inst->reg] = src.u16[inst->imm & 7];
+		break;
+	case 0xd6:
+		if (mem != NULL) {
+			memcpy(mem, &dest->u64[0], 8);
+		} else {
+			rm_reg->u64[0] = dest->u64[0];
+			rm_reg->u64[1] = 0;
+		}
+		break;
+	case 0xd7:
+		for (i = 0; i < 16; i++) mask |= (uint32_t)(src.u8[i] >> 7) << i;
+		regs[inst->reg] = mask;
+		break;
+	default:
+		if (0x18 <= opcode && opcode <= 0x1f) break;
+		integer_op(opcode, dest, &src);
+		break;
+	}
+}
+
+void sse_save_state(checkpoint_writer* writer) {
+	int i;
+	checkpoint_put_uint(writer, sse.mxcsr);
+	for (i = 0; i < 8; i++) checkpoint_put_bytes(writer, sse.xmm[i].u8, sizeof(sse.xmm[i].u8));
+}
+
+int sse_load_state(checkpoint_reader* reader) {
+	int i;
+	sse.mxcsr = checkpoint_get_uint(reader);
+	for (i = 0; i < 8; i++) checkpoint_get_bytes(reader, sse.xmm[i].u8, sizeof(sse.xmm[i].u8));
+	return !reader->error;
+}
@@ -0,0 +1,74 @@
+#ifndef SSE_H_GUARD_07D535B2_354F_46E2_85C7_CA9E8E77C16B
+#define SSE_H_GUARD_07D535B2_354F_46E2_85C7_CA9E8E77C16B
+
+#include <stdint.h>
+#include "checkpoint.h"
+
+/*
+SSE/SSE2の命令 (XMMレジスタを使うもの) のエミュレーション。
+各レーンの計算はCのループで書いているので、x86のホストではコンパイラがSIMD命令にする。
+レジスタとメモリの間はバイト列をそのままコピーするので、ホストはリトルエンディアンを仮定する。
+MXCSRの丸めモードは整数への変換だけに使い、例外フラグは変換の失敗 (IE) だけを記録する。
+*/
+typedef union {
+	uint8_t u8[16];
+	uint16_t u16[8];
+	uint32_t u32[4];
+	uint64_t u64[2];
+	int8_t i8[16];
+	int16_t i16[8];
+	int32_t i32[4];
+	int64_t i64[2];
+	float f32[4];
+	double f64[2];
+} sse_reg;
+
+typedef struct {
+	sse_reg xmm[8];
+	uint32_t mxcsr;
+} sse_state;
+
+/* 必須プリフィックス (F2とF3は66より優先する) */
+enum {
+	SSE_PREFIX_NONE,
+	SSE_PREFIX_66,
+	SSE_PREFIX_F3,
+	SSE_PREFIX_F2
+};
+
+/* デコードした命令 */
+typedef struct {
+	/* sse_decodeを呼ぶ前に設定する */
+	int prefix;
+	int opcode; /* 0Fの次のバイト */
+	int reg, rm; /* mod r/mのフィールド */
+	int is_mem; /* r/mがメモリか */
+	/* sse_decodeが設定する */
+	int mem_size; /* メモリオペランドのバイト数 */
+	int is_store; /* メモリオペランドに書き込む (読み込まない) か */
+	int use_imm; /* 8ビットの即値が続くか */
+	/* sse_executeを呼ぶ前に設定する */
+	uint8_t imm;
+} sse_inst;
+
+void sse_initialize(void);
+
+void sse_save(sse_state* state);
+void sse_load(const sse_state* state);
+
+/* 0Fの次のバイトが、SSEの命令 (またはヒントのNOP) のものか */
+int sse_is_opcode(int opcode);
+
+/* 命令のオペランドの情報を設定する。未対応の命令なら0を返す */
+int sse_decode(sse_inst* inst);
+
+/*
+命令を実行する。memはメモリオペランドの内容 (r/mがレジスタならNULL) で、
+書き込む命令ではmemに書き込む内容が入る。汎用レジスタやEFLAGSを読み書きする命令のために、それらを渡す。
+*/
+void sse_execute(const sse_inst* inst, uint8_t* mem, uint32_t* regs, uint32_t* eflags);
+
+void sse_save_state(checkpoint_writer* writer);
+int sse_load_state(checkpoint_reader* reader);
+
+#endif
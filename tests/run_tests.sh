@@ -0,0 +1,200 @@
+#!/bin/sh
+# インタプリタのテスト。ゲストはtests/guestsのアセンブリからgcc -m32とldで作る。
+# 使い方: sh tests/run_tests.sh [インタプリタのパス]
+
+X=${1:-./x86_interpreter}
+case $X in /*) ;; *) X=$(pwd)/$X ;; esac
+SRC=$(cd "$(dirname "$0")/guests" && pwd)
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+failed=0
+
+# build_raw 名前 : 0番地に置くバイナリを作る
+build_raw() {
+	gcc -m32 -c "$SRC/$1.S" -o "$WORK/$1.o" &&
+	ld -m elf_i386 -Ttext=0 -e _start --oformat=binary "$WORK/$1.o" -o "$WORK/$1.bin"
+}
+
+# build_elf 名前 : ELFを作る
+build_elf() {
+	gcc -m32 -c "$SRC/$1.S" -o "$WORK/$1.o" &&
+	ld -m elf_i386 -Ttext=0x1000 -e _start "$WORK/$1.o" -o "$WORK/$1"
+}
+
+# check 名前 期待する値 実際の値
+check() {
+	if [ "$2" = "$3" ]; then
+		echo "ok: $1"
+	else
+		echo "FAIL: $1 (expected $2, got $3)"
+		failed=1
+	fi
+}
+
+# バッチの各ジョブについて、ゲストの終了ステータスを報告する
+test_batch_exit_status() {
+	build_raw exit_port && build_elf exit_group || { failed=1; return; }
+	printf -- '- -\n- -\n' > "$WORK/manifest"
+	(cd "$WORK" && "$X" --port-io --raw exit_port.bin --batch manifest) > /dev/null 2> "$WORK/port.log"
+	check "batch exit port status" "job 0: exit 186 job 1: exit 186" \
+		"$(grep -o 'job [0-9]*: exit [0-9]*' "$WORK/port.log" | tr '\n' ' ' | sed 's/ $//')"
+	(cd "$WORK" && "$X" --linux-syscall 0x10000000 --elf exit_group --batch manifest) > /dev/null 2> "$WORK/linux.log"
+	check "batch exit_group status" "job 0: exit 186 job 1: exit 186" \
+		"$(grep -o 'job [0-9]*: exit [0-9]*' "$WORK/linux.log" | tr '\n' ' ' | sed 's/ $//')"
+}
+
+# サーバーの応答で、ゲストの終了ステータスを返す (クライアントにはpython3を使う)
+test_server_exit_status() {
+	build_raw exit_port || { failed=1; return; }
+	if ! command -v python3 > /dev/null; then
+		echo "skip: server exit status (no python3)"
+		return
+	fi
+	(cd "$WORK" && "$X" --port-io --raw exit_port.bin --save-checkpoint exit_port.ckpt) > /dev/null 2>&1
+	"$X" --port-io --server "$WORK/server.sock" --load-checkpoint "$WORK/exit_port.ckpt" > /dev/null 2>&1 &
+	server_pid=$!
+	i=0
+	while [ ! -S "$WORK/server.sock" ] && [ $i -lt 50 ]; do sleep 0.1; i=$((i + 1)); done
+	python3 - "$WORK/server.sock" > "$WORK/server.log" 2>&1 <<'PY'
+import socket, struct, sys
+s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+s.connect(sys.argv[1])
+socket.send_fds(s, [struct.pack('II', 0, 0)], [0, 1, 2])
+r = b''
+while len(r) < 4:
+    c = s.recv(4 - len(r))
+    if not c: break
+    r += c
+print(struct.unpack('i', r)[0] if len(r) == 4 else 'no reply')
+PY
+	kill $server_pid 2> /dev/null
+	wait $server_pid 2> /dev/null
+	check "server exit port status" "186" "$(tail -n 1 "$WORK/server.log")"
+}
+
+# --native-libcで置き換えた関数の結果を確かめる (置き換えなければゲストの関数は誤った値を返す)
+test_native_libc() {
+	build_elf native_libc || { failed=1; return; }
+	"$X" --linux-syscall 0x10000000 --native-libc all --elf "$WORK/native_libc" > /dev/null 2> "$WORK/native_libc.log"
+	status=$?
+	[ -s "$WORK/native_libc.log" ] && status="$status ($(head -n 1 "$WORK/native_libc.log"))"
+	check "native libc" 0 "$status"
+	"$X" --linux-syscall 0x10000000 --elf "$WORK/native_libc" > /dev/null 2>&1
+	check "native libc (not replaced)" 1 $?
+}
+
+# fork後にコードを書き換えたプロセスと、書き換えていないプロセスを交互に実行する
+test_fork_smc() {
+	build_elf fork_smc || { failed=1; return; }
+	check "fork smc" ok "$("$X" --xv6-syscall 0x80000000 --elf "$WORK/fork_smc" 2>&1 < /dev/null)"
+}
+
+# run_guest 名前 : 終了ポートに0を書いて終わるはずのゲストを実行する
+run_guest() {
+	if ! build_raw "$1"; then
+		failed=1
+		return
+	fi
+	"$X" --port-io --raw "$WORK/$1.bin" > /dev/null 2> "$WORK/$1.log" < /dev/null
+	status=$?
+	# エラーで止まったのに終了ステータスが0になるインタプリタでも、失敗とわかるようにする
+	[ -s "$WORK/$1.log" ] && status="$status ($(head -n 1 "$WORK/$1.log"))"
+	check "$1" 0 "$status"
+}
+
+# フラグの解析を使った実行で、各場面のフラグが--trace (解析を使わない) の時と同じになる
+test_flags() {
+	run_guest flags
+	"$X" --port-io --raw "$WORK/flags.bin" > "$WORK/flags.out" 2> /dev/null < /dev/null
+	"$X" --port-io --raw "$WORK/flags.bin" --trace 2> /dev/null < /dev/null | grep '^F ' > "$WORK/flags.trace"
+	[ -s "$WORK/flags.out" ] && cmp -s "$WORK/flags.out" "$WORK/flags.trace"
+	check "flags (same as --trace)" 0 $?
+}
+
+# コピーのループが割り当てられていないページで止まった時のEIPとレジスタを、--traceの時と比べる
+test_bulk_fault() {
+	build_raw bulk_fault || { failed=1; return; }
+	store=$(nm "$WORK/bulk_fault.o" | awk '$3 == "fault_store" { print $1 }')
+	src=$(nm "$WORK/bulk_fault.o" | awk '$3 == "src" { printf "%08x", ("0x" $1) + 10 }')
+	"$X" --port-io --raw "$WORK/bulk_fault.bin" > /dev/null 2> "$WORK/bulk_fault.log" < /dev/null
+	"$X" --port-io --raw "$WORK/bulk_fault.bin" --trace > /dev/null 2> "$WORK/bulk_fault.trace" < /dev/null
+	check "bulk fault" "failed to write memory 00001000 at $store" "$(head -n 1 "$WORK/bulk_fault.log")"
+	check "bulk fault registers" "ECX:0000005a ESI:$src EDI:00001000" \
+		"$(grep -o 'ECX:[0-9a-f]*\|ESI:[0-9a-f]*\|EDI:[0-9a-f]*' "$WORK/bulk_fault.log" | tr '\n' ' ' | sed 's/ $//')"
+	cmp -s "$WORK/bulk_fault.log" "$WORK/bulk_fault.trace"
+	check "bulk fault (same as --trace)" 0 $?
+}
+
+# --block-cacheで保存したブロックを次の実行で読み込み、イメージやインタプリタが違えば使わない
+test_block_cache() {
+	build_raw block_cache || { failed=1; return; }
+	mkdir "$WORK/blocks"
+	"$X" --port-io --raw "$WORK/block_cache.bin" --block-cache "$WORK/blocks" > /dev/null 2>&1 < /dev/null
+	check "block cache (first run)" 5 $?
+	file=$(ls "$WORK/blocks"/*.x86blk)
+	inode=$(ls -i "$file")
+	"$X" --port-io --raw "$WORK/block_cache.bin" --block-cache "$WORK/blocks" > /dev/null 2>&1 < /dev/null
+	check "block cache (second run)" 5 $?
+	# 全てのブロックを読み込めば何もデコードしないので、ファイルを保存し直さない
+	check "block cache (loaded)" "$inode" "$(ls -i "$file")"
+
+	# 同じファイルでも、インタプリタの実行ファイルが違えば読み込まずに保存し直す
+	cp "$X" "$WORK/x86_interpreter.rebuilt" && printf x >> "$WORK/x86_interpreter.rebuilt"
+	"$WORK/x86_interpreter.rebuilt" --port-io --raw "$WORK/block_cache.bin" --block-cache "$WORK/blocks" > /dev/null 2>&1 < /dev/null
+	check "block cache (other build)" 5 $?
+	[ "$(ls -i "$file")" != "$inode" ]
+	check "block cache (other build not loaded)" 0 $?
+
+	# result_valueの即値を書き換えたイメージ
+	offset=$(nm "$WORK/block_cache.o" | awk '$3 == "result_value" { print $1 }')
+	cp "$WORK/block_cache.bin" "$WORK/block_cache2.bin"
+	printf '\007' | dd of="$WORK/block_cache2.bin" bs=1 seek=$((0x$offset + 1)) conv=notrunc 2> /dev/null
+	"$X" --port-io --raw "$WORK/block_cache2.bin" --block-cache "$WORK/blocks" > /dev/null 2>&1 < /dev/null
+	check "block cache (changed image)" 7 $?
+	# 変えたイメージのファイルを元のイメージのもので置き換えても、それを使わない
+	file2=$(ls "$WORK/blocks"/*.x86blk | grep -v "^$file\$")
+	cp "$file" "$file2"
+	"$X" --port-io --raw "$WORK/block_cache2.bin" --block-cache "$WORK/blocks" > /dev/null 2>&1 < /dev/null
+	check "block cache (changed image, other file)" 7 $?
+}
+
+# run_optimize_thread 名前 回数 : --optimize-threadを付けても、付けない時と出力と終了ステータスが同じになる
+# (どの結果がいつ反映されるかはスレッドの速さで変わるので、何回か実行する)
+run_optimize_thread() {
+	build_raw "$1" || { failed=1; return; }
+	"$X" --port-io --raw "$WORK/$1.bin" > "$WORK/$1.out" 2>&1 < /dev/null
+	expected="exit $?"
+	i=0
+	while [ $i -lt "$2" ]; do
+		"$X" --port-io --raw "$WORK/$1.bin" --optimize-thread > "$WORK/$1.thread.out" 2>&1 < /dev/null
+		actual="exit $?"
+		cmp -s "$WORK/$1.out" "$WORK/$1.thread.out" || actual="$actual (different output)"
+		[ "$actual" = "$expected" ] || break
+		i=$((i + 1))
+	done
+	check "$1 (--optimize-thread)" "$expected" "$actual"
+}
+
+test_batch_exit_status
+test_server_exit_status
+test_native_libc
+test_fork_smc
+run_guest loop
+run_guest bulk_loop
+test_bulk_fault
+run_guest sahf_lahf
+run_guest imul
+run_guest x87
+run_guest sse
+run_guest smc
+run_guest ret_stack
+test_block_cache
+test_flags
+run_guest optimize
+run_optimize_thread loop 1
+run_optimize_thread imul 1
+run_optimize_thread sahf_lahf 1
+run_optimize_thread flags 1
+run_optimize_thread optimize 5
+
+exit $failed
@@ -0,0 +1,27 @@
+#ifndef X86_CPU_H_GUARD_387001C3_94D9_4E16_9B6E_A4F3A85171FE
+#define X86_CPU_H_GUARD_387001C3_94D9_4E16_9B6E_A4F3A85171FE
+
+#include <stdint.h>
+#include "x87.h"
+#include "sse.h"
+#include "native_libc.h"
+
+/* ゲストのCPUの状態。プロセスを切り替える時に保存・復元する */
+typedef struct {
+	uint32_t regs[8];
+	uint32_t eip, eflags;
+	uint32_t segment_offsets[6];
+	uint32_t stack_top, stack_reserve_bottom, stack_commit_bottom;
+	x87_state fpu;
+	sse_state sse;
+	native_libc_table native_libc;
+	uint32_t plugin_image; /* プラグインのハンドラの表 */
+} x86_cpu_state;
+
+void x86_cpu_save(x86_cpu_state* state);
+void x86_cpu_load(const x86_cpu_state* state);
+
+/* ELFファイルを現在のアドレス空間に読み込み、引数を積んだスタックで実行を開始する状態にする */
+int x86_cpu_exec(const char* filename, uint32_t argc, char** argv);
+
+#endif
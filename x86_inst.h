@@ -0,0 +1,163 @@
+#ifndef X86_INST_H_GUARD_FEEAF134_CE98_4937_9ED4_577467F901F9
+#define X86_INST_H_GUARD_FEEAF134_CE98_4937_9ED4_577467F901F9
+
+#include <stdint.h>
+#include "sse.h"
+
+/* 命令の最大の長さ */
+#define X86_INST_MAX_LENGTH 15
+
+/* 命令の種類 */
+enum {
+	OP_ARITHMETIC,
+	OP_SHIFT,
+	OP_XCHG,
+	OP_CMPXCHG,
+	OP_MOV,
+	OP_CMOV,
+	OP_MOVZX,
+	OP_MOVSX,
+	OP_SETCC,
+	OP_LEA,
+	OP_INCDEC,
+	OP_NOT,
+	OP_MUL,
+	OP_IMUL,
+	OP_DIV,
+	OP_IDIV,
+	OP_PUSH,
+	OP_POP,
+	OP_PUSHA,
+	OP_POPA,
+	OP_PUSHF,
+	OP_POPF,
+	OP_STRING,
+	OP_CALL,
+	OP_JUMP,
+	OP_CALL_ABSOLUTE,
+	OP_JUMP_ABSOLUTE,
+	OP_CALL_FAR,
+	OP_JUMP_FAR,
+	OP_CBW,
+	OP_CWD,
+	OP_SAHF,
+	OP_LAHF,
+	OP_RETN,
+	OP_LEAVE,
+	OP_INT,
+	OP_INTO,
+	OP_IRET,
+	OP_LOOP,
+	OP_IN,
+	OP_OUT,
+	OP_HLT,
+	OP_CMC,
+	OP_SET_FLAG,
+	OP_CLEAR_FLAG,
+	OP_FPU,
+	OP_SSE,
+	OP_RDTSC,
+	OP_CPUID,
+	OP_BIT_TEST,
+	OP_BIT_SCAN,
+	OP_BSWAP
+};
+
+/* 演算命令の種類 */
+enum {
+	OP_ADD, OP_ADC, OP_SUB, OP_SBB, OP_AND, OP_OR, OP_XOR, OP_CMP, OP_TEST, OP_NEG,
+	OP_READ_MODRM, /* mod r/mの値を見て演算の種類を決める */
+	OP_READ_MODRM_MUL, /* mod r/mの値を見て演算の種類を決める(MUL系) */
+	OP_READ_MODRM_INC /* mod r/mの値を見て演算の種類を決める(INC系) */
+};
+
+enum {
+	OP_ROL, OP_ROR, OP_RCL, OP_RCR, OP_SHL, OP_SHR, OP_SAR,
+	OP_SHLD, OP_SHRD,
+	OP_READ_MODRM_SHIFT /* mod r/mの値を見て演算の種類を決める(シフト系) */
+};
+
+enum {
+	OP_BT, OP_BTS, OP_BTR, OP_BTC, OP_BSF, OP_BSR,
+	OP_READ_MODRM_BIT /* mod r/mの値を見て演算の種類を決める(BT系) */
+};
+
+/* ストリング命令の種類 */
+enum {
+	OP_STR_MOV,
+	OP_STR_CMP,
+	OP_STR_STO,
+	OP_STR_LOD,
+	OP_STR_SCA,
+	OP_STR_IN,
+	OP_STR_OUT
+};
+
+/* オペランドの情報 */
+enum {
+	OP_KIND_IMM, /* 即値 (imm_value) */
+	OP_KIND_MEM, /* メモリ上のデータ (実効アドレス) */
+	OP_KIND_REG, /* AH/CH/DH/BHではないレジスタ上のデータ (*_reg_index) */
+	OP_KIND_REG_HIGH8 /* レジスタAH/CH/DH/BH上のデータ (*_reg_index) */
+};
+
+/* 分岐・CMOVcc・SETccの条件 (0x0～0xFはJccのオペコードの下位4ビット) */
+enum {
+	COND_ALWAYS = 0x10,
+	COND_NEVER,
+	COND_CXZ /* CX/ECXが0 */
+};
+
+/*
+x86_inst (とsse_inst) のメンバやその意味を変えたら増やす。
+ブロックのファイルはこの値を記録し、違う値のファイルは読まない。
+*/
+#define X86_INST_LAYOUT_VERSION 1
+
+/*
+デコードした命令。レジスタやフラグの値に依らない情報だけを持ち、
+分岐の条件や実効アドレスは実行する時に求める。
+*/
+typedef struct {
+	uint32_t addr; /* 命令の先頭のEIP */
+	uint8_t length; /* 命令のバイト数 */
+
+	uint8_t is_data_16bit;
+	uint8_t is_addr_16bit;
+	uint8_t is_rep;
+	uint8_t is_rep_while_zero;
+
+	uint8_t op_kind; /* 命令の種類 */
+	uint8_t op_arithmetic_kind; /* 演算命令の種類 */
+	uint8_t op_shift_kind;
+	uint8_t op_bit_kind;
+	uint8_t op_string_kind; /* ストリング命令の種類 */
+	uint8_t op_width; /* オペランドのバイト数 */
+	uint8_t cond; /* ジャンプを行う条件 */
+	uint8_t use_imm; /* 即値を使うか */
+	uint8_t imul_store_upper; /* IMUL命令において、上位の値を保存するか */
+	uint8_t op_fpu_kind; /* FPU系命令のカテゴリ */
+	uint8_t op_fpu_reg, op_fpu_rm; /* FPU系命令のmod r/mのregとr/m */
+
+	uint8_t src_kind;
+	uint8_t src_reg_index;
+	uint8_t dest_kind;
+	uint8_t dest_reg_index;
+	uint8_t need_dest_value;
+	uint8_t data_segment;
+
+	/* メモリオペランドの実効アドレス (ea_base + ea_index * ea_scale + ea_disp) */
+	uint8_t ea_no_base; /* ea_baseのレジスタを使わないか */
+	uint8_t ea_base;
+	uint8_t ea_index;
+	uint8_t ea_scale; /* 0ならea_indexを使わない */
+	uint32_t ea_disp;
+
+	uint32_t imm_value; /* 即値の値 */
+	sse_inst op_sse; /* SSE系命令 */
+
+	/* 命令が書くステータスフラグ (OF/SF/ZF/AF/PF/CF) のうち、後で読まれるかもしれないもの */
+	uint16_t live_flags;
+} x86_inst;
+
+#endif
@@ -1,6 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <inttypes.h>
+#include <time.h>
 #include "x86_regs.h"
 #include "dynamic_memory.h"
 #include "dmem_utils.h"
@@ -8,12 +11,77 @@
 #include "read_elf.h"
 #include "read_pe.h"
 #include "xv6_syscall.h"
+#include "linux_syscall.h"
+#include "x86_cpu.h"
 #include "pe_import.h"
+#include "batch_runner.h"
+#include "server.h"
+#include "checkpoint.h"
+#include "coverage.h"
+#include "x87.h"
+#include "sse.h"
+#include "port_io.h"
+#include "native_libc.h"
+#include "plugin.h"
+#include "x86_inst.h"
+#include "block_cache.h"
+#include "block_worker.h"
+#include "read_file.h"
 
 static int strict_mode = 0;
 static int use_xv6_syscall = 0;
 static int use_pe_import = 0;
+static int use_linux_syscall = 0;
+static int use_port_io = 0;
+static int use_native_libc = 0;
+static int use_plugins = 0;
 static pe_import_params import_params;
+static int guest_exited = 0; /* プログラムが自分で終了したか(偽 = エラーで停止) */
+static uint32_t guest_exit_status = 0; /* プログラムが自分で終了した時の終了ステータス (下位8ビット) */
+static uint64_t instructions_retired = 0; /* 実行を終えた命令の数 */
+static int use_host_tsc = 0; /* RDTSCでホストのTSCを返すか(偽 = 実行した命令数を返す) */
+/* CPUIDのEAX=1で返す機能フラグ (デフォルトはFPU、TSC、CMOV、SSEとSSE2) */
+static uint32_t cpuid_features_edx = UINT32_C(1) | (UINT32_C(1) << 4) | (UINT32_C(1) << 15) |
+	(UINT32_C(1) << 25) | (UINT32_C(1) << 26);
+static uint32_t cpuid_features_ecx = 0;
+
+static int enable_trace = 0;
+static int enable_loop_idiom = 1; /* 1バイトずつのループをまとめて実行するか */
+static int use_optimize_thread = 0; /* ブロックの最適化を別のスレッドで行うか */
+static int import_as_iat = 0;
+static int enable_fs = 0;
+static uint32_t initial_eip = 0;
+static uint32_t initial_esp = UINT32_C(0xfffff000);
+static uint32_t stack_size = 4096; /* 最初に割り当てるスタックのサイズ */
+static uint32_t stack_limit = UINT32_C(0x800000); /* スタックを伸ばせる最大のサイズ */
+static uint32_t xv6_syscall_work = UINT32_C(0x80000000);
+static uint32_t linux_brk_origin = 0;
+static uint32_t pe_import_work = UINT32_C(0x80000000);
+static uint32_t fs_addr = UINT32_C(0x7ffff000);
+static const char* save_checkpoint_path = NULL;
+static int use_checkpoint_eip = 0;
+static uint32_t checkpoint_eip = 0;
+static int enable_coverage = 0;
+static const char* block_cache_dir = NULL; /* デコードしたブロックを保存するディレクトリ */
+static char* block_cache_path = NULL; /* 今のイメージのブロックを保存するファイル */
+static uint64_t block_cache_key = 0;
+
+/*
+ブロックのファイルを作ったビルド (構造体の中身や解析の方法が変わったら使えない)。
+どのオブジェクトが変わっても違う値になるよう、実行ファイル全体のハッシュを使う。
+*/
+static char block_cache_build_id[17] = "";
+
+/*
+スタックは[stack_reserve_bottom, stack_top)を予約しておき、
+stack_commit_bottomより下のページはアクセスされた時やESPが下がった時に割り当てる。
+予約領域のすぐ下のSTACK_GUARD_SIZEバイトへのアクセスはスタックオーバーフローとする。
+*/
+#define STACK_GUARD_SIZE UINT32_C(0x10000)
+
+/* 演算の結果で変わるフラグ */
+#define STATUS_FLAGS (OF | SF | ZF | AF | PF | CF)
+static uint32_t stack_top = 0, stack_reserve_bottom = 0, stack_commit_bottom = 0;
 
 uint32_t regs[8];
 uint32_t eip;
@@ -33,8 +101,25 @@ void print_regs(FILE* fp) {
 		eflags & DF ? 'x' : ' ', eflags & OF ? 'x' : ' ');
 }
 
+/* addrが予約されたスタックの領域にあれば、そこまでのページを割り当てて真を返す */
+static int grow_stack(uint32_t addr) {
+	if (addr < stack_reserve_bottom || stack_top <= addr) return 0;
+	if (addr < stack_commit_bottom) {
+		uint32_t new_bottom = addr - addr % DMEMORY_PAGE_SIZE;
+		if (new_bottom < stack_reserve_bottom) new_bottom = stack_reserve_bottom;
+		dmemory_allocate(new_bottom, stack_commit_bottom - new_bottom);
+		stack_commit_bottom = new_bottom;
+	}
+	return 1;
+}
+
+static int is_stack_guard(uint32_t addr) {
+	uint32_t guard_bottom = stack_reserve_bottom < STACK_GUARD_SIZE ? 0 : stack_reserve_bottom - STACK_GUARD_SIZE;
+	return stack_top != 0 && guard_bottom <= addr && addr < stack_reserve_bottom;
+}
+
 int memory_access(uint8_t* data_read, uint32_t addr, uint8_t data, int we) {
-	if (dmemory_is_allocated(addr, 1)) {
+	if (dmemory_is_allocated(addr, 1) || (grow_stack(addr) && dmemory_is_allocated(addr, 1))) {
 		if (we) dmemory_write(&data, addr, 1);
 		dmemory_read(data_read, addr, 1);
 		return 1;
@@ -55,7 +140,11 @@ static uint32_t step_memread(int* success, uint32_t inst_addr, int segment, uint
 		uint32_t this_addr = segment_offsets[segment] + addr + i;
 		uint8_t value;
 		if (!memory_access(&value, this_addr, 0, 0)) {
-			fprintf(stderr, "failed to read memory %08"PRIx32" at %08"PRIx32"\n\n", this_addr, inst_addr);
+			if (is_stack_guard(this_addr)) {
+				fprintf(stderr, "stack overflow at EIP %08"PRIx32" (reading %08"PRIx32")\n\n", inst_addr, this_addr);
+			} else {
+				fprintf(stderr, "failed to read memory %08"PRIx32" at %08"PRIx32"\n\n", this_addr, inst_addr);
+			}
 			print_regs(stderr);
 			*success = 0;
 			return 0;
@@ -83,7 +172,11 @@ static int step_memwrite(uint32_t inst_addr, int segment, uint32_t addr, uint32_
 		uint32_t this_addr = segment_offsets[segment] + addr + i;
 		uint8_t dummy_read;
 		if (!memory_access(&dummy_read, this_addr, (value >> (i * 8)) & 0xff, 1)) {
-			fprintf(stderr, "failed to write memory %08"PRIx32" at %08"PRIx32"\n\n", this_addr, inst_addr);
+			if (is_stack_guard(this_addr)) {
+				fprintf(stderr, "stack overflow at EIP %08"PRIx32" (writing %08"PRIx32")\n\n", inst_addr, this_addr);
+			} else {
+				fprintf(stderr, "failed to write memory %08"PRIx32" at %08"PRIx32"\n\n", this_addr, inst_addr);
+			}
 			print_regs(stderr);
 			return 0;
 		}
@@ -91,6 +184,109 @@ static int step_memwrite(uint32_t inst_addr, int segment, uint32_t addr, uint32_
 	return 1;
 }
 
+/* FPUのメモリオペランドのように、4バイトを超えるデータをまとめて読み書きする */
+static int step_memread_bytes(uint32_t inst_addr, int segment, uint32_t addr, uint8_t* data, int size) {
+	int i;
+	for (i = 0; i < size; i++) {
+		int memread_ok = 0;
+		data[i] = (uint8_t)step_memread(&memread_ok, inst_addr, segment, addr + i, 1);
+		if (!memread_ok) return 0;
+	}
+	return 1;
+}
+
+static int step_memwrite_bytes(uint32_t inst_addr, int segment, uint32_t addr, const uint8_t* data, int size) {
+	int i;
+	for (i = 0; i < size; i++) {
+		if (!step_memwrite(inst_addr, segment, addr + i, data[i], 1)) return 0;
+	}
+	return 1;
+}
+
+/* ポートI/Oの結果を確認する。エラーの時や終了ポートに書き込まれた時は0を返す */
+static int step_port_done(int ok, uint32_t inst_addr) {
+	uint32_t status;
+	if (!ok) {
+		fprintf(stderr, "port I/O failed at %08"PRIx32"\n", inst_addr);
+		print_regs(stderr);
+		return 0;
+	}
+	if (port_io_exit_requested(&status)) {
+		guest_exited = 1;
+		guest_exit_status = status & 0xff;
+		return 0;
+	}
+	return 1;
+}
+
+static uint64_t read_host_tsc(void) {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	uint32_t low, high;
+	__asm__ __volatile__ ("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+#else
+	/* TSCが読めない環境では、ナノ秒単位の時刻で代用する */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* ビット操作はコンパイラの組み込み関数で行う (valueは0以外) */
+static uint32_t bit_scan_forward(uint32_t value) {
+#if defined(__GNUC__)
+	return (uint32_t)__builtin_ctz(value);
+#else
+	uint32_t i = 0;
+	while (!(value & 1)) {
+		value >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+static uint32_t bit_scan_reverse(uint32_t value) {
+#if defined(__GNUC__)
+	return 31 - (uint32_t)__builtin_clz(value);
+#else
+	uint32_t i = 31;
+	while (!(value & UINT32_C(0x80000000))) {
+		value <<= 1;
+		i--;
+	}
+	return i;
+#endif
+}
+
+static uint32_t byte_swap32(uint32_t value) {
+#if defined(__GNUC__)
+	return __builtin_bswap32(value);
+#else
+	return (value >> 24) | ((value >> 8) & UINT32_C(0xff00)) |
+		((value << 8) & UINT32_C(0xff0000)) | (value << 24);
+#endif
+}
+
+static void step_cpuid(void) {
+	/* ベンダー名 "x86interpret" をEBX, EDX, ECXの順に格納する */
+	static const char vendor[12] = {'x', '8', '6', 'i', 'n', 't', 'e', 'r', 'p', 'r', 'e', 't'};
+	uint32_t leaf = regs[EAX];
+	regs[EAX] = regs[EBX] = regs[ECX] = regs[EDX] = 0;
+	if (leaf == 0) {
+		regs[EAX] = 1; /* 最大の標準リーフ */
+		memcpy(&regs[EBX], vendor, 4);
+		memcpy(&regs[EDX], vendor + 4, 4);
+		memcpy(&regs[ECX], vendor + 8, 4);
+	} else if (leaf == 1) {
+		regs[EAX] = 0x00000633; /* ファミリー6 モデル3 ステッピング3 */
+		regs[ECX] = cpuid_features_ecx;
+		regs[EDX] = cpuid_features_edx;
+	} else if (leaf == UINT32_C(0x80000000)) {
+		regs[EAX] = UINT32_C(0x80000000); /* 拡張リーフは無い */
+	}
+}
+
 static int step_push(uint32_t inst_addr, uint32_t value, int op_width, int is_addr_16bit) {
 	uint32_t addr = regs[ESP];
 	if (is_addr_16bit) addr &= 0xffff;
@@ -123,86 +319,94 @@ static uint32_t step_pop(int* success, uint32_t inst_addr, int op_width, int is_
 	return value;
 }
 
-int step(void) {
-	uint32_t inst_addr = eip; /* エラー時の検証用 */
+/*
+分岐先がインポートした関数のスタブや、プラグイン・ホストの実装で置き換えた関数なら、それを実行して戻る。
+これらには分岐でしか入らないので、分岐命令の後だけで調べる。続ける:1 止める:0
+*/
+static int dispatch_branch_target(void) {
+	if (use_pe_import && pe_import_is_stub(eip)) {
+		int ret = pe_import(&eip, regs);
+		if (ret == 0) {
+			guest_exited = 1;
+			guest_exit_status = pe_import_exit_status() & 0xff;
+			return 0;
+		}
+		if (ret < 0) {
+			print_regs(stderr);
+			return 0;
+		}
+		return 1;
+	}
+	if (use_plugins) {
+		int ret = plugin_call(&eip, regs);
+		if (ret < 0) {
+			print_regs(stderr);
+			return 0;
+		}
+		if (ret > 0) return 1;
+	}
+	if (use_native_libc) native_libc_call(&eip, regs, eflags);
+	return 1;
+}
+
+/* 命令のバイト列のpos以降のsizeバイトを読み、符号拡張する (step_memreadと同じ) */
+static uint32_t fetch_code_value(int* success, const uint8_t* code, uint32_t code_size, uint32_t* pos, int size) {
+	uint32_t res = 0;
+	int i;
+	if (*pos > code_size || code_size - *pos < (uint32_t)size) {
+		*success = 0;
+		return 0;
+	}
+	for (i = 0; i < size; i++) {
+		res |= (uint32_t)code[*pos + i] << (i * 8);
+	}
+	*pos += size;
+	if (size < 4) {
+		if (res & (UINT32_C(0x80) << ((size - 1) * 8))) {
+			res |= UINT32_C(0xffffffff) << (size * 8);
+		} else {
+			res &= UINT32_C(0xffffffff) >> ((4 - size) * 8);
+		}
+	}
+	*success = 1;
+	return res;
+}
+
+/* 命令のバイト列がcode_sizeバイトしか読めなかった時のエラー。0を返す */
+static int decode_fetch_failed(uint32_t inst_addr, uint32_t code_size, int report) {
+	if (report) {
+		if (code_size >= X86_INST_MAX_LENGTH) {
+			fprintf(stderr, "instruction too long at %08"PRIx32"\n\n", inst_addr);
+		} else {
+			fprintf(stderr, "failed to read memory %08"PRIx32" at %08"PRIx32"\n\n",
+				segment_offsets[CS] + inst_addr + code_size, inst_addr);
+		}
+		print_regs(stderr);
+	}
+	return 0;
+}
+
+/*
+inst_addrの命令を、そこから読めるバイト列codeからデコードする。
+reportが偽なら、デコードできなくてもエラーを表示しない (ブロックの続きを先読みする時)。成功:1 失敗:0
+*/
+static int decode_inst(x86_inst* inst, uint32_t inst_addr, const uint8_t* code, uint32_t code_size, int report) {
+	uint32_t pos = 0; /* 読んだバイト数 */
 	uint8_t fetch_data;
-	int memread_ok;
+	int fetch_ok;
 
 	int is_data_16bit = 0;
 	int is_addr_16bit = 0;
 	int is_rep = 0;
 	int is_rep_while_zero = 0;
 
-	enum {
-		OP_ARITHMETIC,
-		OP_SHIFT,
-		OP_XCHG,
-		OP_CMPXCHG,
-		OP_MOV,
-		OP_CMOV,
-		OP_MOVZX,
-		OP_MOVSX,
-		OP_SETCC,
-		OP_LEA,
-		OP_INCDEC,
-		OP_NOT,
-		OP_MUL,
-		OP_IMUL,
-		OP_DIV,
-		OP_IDIV,
-		OP_PUSH,
-		OP_POP,
-		OP_PUSHA,
-		OP_POPA,
-		OP_PUSHF,
-		OP_POPF,
-		OP_STRING,
-		OP_CALL,
-		OP_JUMP,
-		OP_CALL_ABSOLUTE,
-		OP_JUMP_ABSOLUTE,
-		OP_CALL_FAR,
-		OP_JUMP_FAR,
-		OP_CBW,
-		OP_CWD,
-		OP_SAHF,
-		OP_LAHF,
-		OP_RETN,
-		OP_LEAVE,
-		OP_INT,
-		OP_INTO,
-		OP_IRET,
-		OP_LOOP,
-		OP_IN,
-		OP_OUT,
-		OP_HLT,
-		OP_CMC,
-		OP_SET_FLAG,
-		OP_CLEAR_FLAG,
-		OP_FPU,
-	} op_kind = OP_ARITHMETIC; /* 命令の種類 */
-	enum {
-		OP_ADD, OP_ADC, OP_SUB, OP_SBB, OP_AND, OP_OR, OP_XOR, OP_CMP, OP_TEST, OP_NEG,
-		OP_READ_MODRM, /* mod r/mの値を見て演算の種類を決める */
-		OP_READ_MODRM_MUL, /* mod r/mの値を見て演算の種類を決める(MUL系) */
-		OP_READ_MODRM_INC /* mod r/mの値を見て演算の種類を決める(INC系) */
-	} op_arithmetic_kind = OP_ADD; /* 演算命令の種類 */
-	enum {
-		OP_ROL, OP_ROR, OP_RCL, OP_RCR, OP_SHL, OP_SHR, OP_SAR,
-		OP_SHLD, OP_SHRD,
-		OP_READ_MODRM_SHIFT /* mod r/mの値を見て演算の種類を決める(シフト系) */
-	} op_shift_kind = OP_ROL;
-	enum {
-		OP_STR_MOV,
-		OP_STR_CMP,
-		OP_STR_STO,
-		OP_STR_LOD,
-		OP_STR_SCA,
-		OP_STR_IN,
-		OP_STR_OUT
-	} op_string_kind = OP_STR_MOV; /* ストリング命令の種類 */
+	int op_kind = OP_ARITHMETIC; /* 命令の種類 */
+	int op_arithmetic_kind = OP_ADD; /* 演算命令の種類 */
+	int op_shift_kind = OP_ROL;
+	int op_bit_kind = OP_BT;
+	int op_string_kind = OP_STR_MOV; /* ストリング命令の種類 */
 	int op_width = 1; /* オペランドのバイト数 */
-	int jmp_take = 0; /* ジャンプを行うか */
+	int cond = COND_NEVER; /* ジャンプを行う条件 */
 	int use_mod_rm = 0; /* mod r/mを使うか */
 	int is_dest_reg = 0; /* mod r/mを使うとき、結果の書き込み先がr/mではなくregか */
 	int modrm_disable_src = 0; /* mod r/mを使う時、srcをmod r/mから設定するのをやめるか */
@@ -211,20 +415,14 @@ int step(void) {
 	int use_imm = 0; /* 即値を使うか */
 	int one_byte_imm = 0; /* 即値が1バイトか(偽 = オペランドのサイズ) */
 	int op_fpu_kind = 0; /* FPU系命令のカテゴリ */
+	int op_fpu_reg = 0, op_fpu_rm = 0; /* FPU系命令のmod r/mのregとr/m */
+	sse_inst op_sse; /* SSE系命令 */
 	int imul_store_upper = 0; /* IMUL命令において、上位の値を保存するか */
 	int imul_enable_dest = 0; /* IMUL命令において、destの指定を有効にするか(偽 = AL/AX/EAX固定) */
 
 	/* オペランドの情報 */
-	enum {
-		OP_KIND_IMM, /* 即値 (imm_value) */
-		OP_KIND_MEM, /* メモリ上のデータ (*_addr) */
-		OP_KIND_REG, /* AH/CH/DH/BHではないレジスタ上のデータ (*_reg_index) */
-		OP_KIND_REG_HIGH8 /* レジスタAH/CH/DH/BH上のデータ (*_reg_index) */
-	};
-	uint32_t src_addr = 0;
 	int src_kind = OP_KIND_IMM;
 	int src_reg_index = 0;
-	uint32_t dest_addr = 0;
 	int dest_kind = OP_KIND_IMM;
 	int dest_reg_index = 0;
 	int need_dest_value = 0;
@@ -233,23 +431,13 @@ int step(void) {
 
 	uint32_t imm_value = 0; /* 即値の値 */
 
-	if (use_pe_import && import_params.iat_size >= 4 &&
-	import_params.iat_addr <= eip && eip - import_params.iat_addr < import_params.iat_size) {
-		int ret = pe_import(&eip, regs);
-		if (ret == 0) return 0;
-		if (ret < 0) {
-			print_regs(stderr);
-			return 0;
-		}
-		return 1;
-	}
+	memset(&op_sse, 0, sizeof(op_sse));
 
 	/* プリフィックスを解析する */
 	for(;;) {
 		/* 命令フェッチ */
-		fetch_data = step_memread(&memread_ok, inst_addr, CS, eip, 1);
-		if (!memread_ok) return 0;
-		eip++;
+		fetch_data = (uint8_t)fetch_code_value(&fetch_ok, code, code_size, &pos, 1);
+		if (!fetch_ok) return decode_fetch_failed(inst_addr, code_size, report);
 		/* プリフィックスか判定 */
 		if (fetch_data == 0x26) { /* ES override */
 			data_segment = ES;
@@ -282,49 +470,37 @@ int step(void) {
 		}
 	}
 
-#define SET_JMP_TAKE \
-	switch (fetch_data & 0x0E) { \
-	case 0x0: jmp_take = (eflags & OF); break; /* JO */ \
-	case 0x2: jmp_take = (eflags & CF); break; /* JB */ \
-	case 0x4: jmp_take = (eflags & ZF); break; /* JZ */ \
-	case 0x6: jmp_take = (eflags & CF) || (eflags & ZF); break; /* JBE */ \
-	case 0x8: jmp_take = (eflags & SF); break; /* JS */ \
-	case 0xA: jmp_take = (eflags & PF); break; /* JP */ \
-	case 0xC: jmp_take = ((eflags & SF) != 0) != ((eflags & OF) != 0); break; /* JL */ \
-	case 0xE: jmp_take = (eflags & ZF) || (((eflags & SF) != 0) != ((eflags & OF) != 0)); break; /* JLE */ \
-	} \
-	if (fetch_data & 0x01) jmp_take = !jmp_take;
-
 	/* オペコードを解析する */
 	if (fetch_data == 0x0F) {
-		fetch_data = step_memread(&memread_ok, inst_addr, CS, eip, 1);
-		if (!memread_ok) return 0;
-		eip++;
+		fetch_data = (uint8_t)fetch_code_value(&fetch_ok, code, code_size, &pos, 1);
+		if (!fetch_ok) return decode_fetch_failed(inst_addr, code_size, report);
 		if ((fetch_data & 0xF0) == 0x40) {
 			/* CMOVcc */
 			if (strict_mode) {
-				fprintf(stderr, "CMOVcc instruction, not in 80386, detected at %08"PRIx32"\n", inst_addr);
-				print_regs(stderr);
+				if (report) {
+					fprintf(stderr, "CMOVcc instruction, not in 80386, detected at %08"PRIx32"\n", inst_addr);
+					print_regs(stderr);
+				}
 				return 0;
 			}
 			op_kind = OP_CMOV;
 			op_width = is_data_16bit ? 2 : 4;
 			use_mod_rm = 1;
 			is_dest_reg = 1;
-			SET_JMP_TAKE
+			cond = fetch_data & 0x0F;
 		} else if ((fetch_data & 0xF0) == 0x80) {
 			/* Jcc rel16/32 */
 			op_kind = OP_JUMP;
 			op_width = is_data_16bit ? 2 : 4;
 			use_imm = 1;
-			SET_JMP_TAKE
+			cond = fetch_data & 0x0F;
 		} else if ((fetch_data & 0xF0) == 0x90) {
 			/* SETcc */
 			op_kind = OP_SETCC;
 			op_width = 1;
 			use_mod_rm = 1;
 			is_dest_reg = 0;
-			SET_JMP_TAKE
+			cond = fetch_data & 0x0F;
 		} else if ((fetch_data & 0xFE) == 0xA4 || (fetch_data & 0xFE) == 0xAC) {
 			/* SHLD/SHRD */
 			op_kind = OP_SHIFT;
@@ -348,8 +524,10 @@ int step(void) {
 		} else if ((fetch_data & 0xFE) == 0xB0) {
 			/* CMPXCHG */
 			if (strict_mode) {
-				fprintf(stderr, "CMPXCHG instruction, not in 80386, detected at %08"PRIx32"\n", inst_addr);
-				print_regs(stderr);
+				if (report) {
+					fprintf(stderr, "CMPXCHG instruction, not in 80386, detected at %08"PRIx32"\n", inst_addr);
+					print_regs(stderr);
+				}
 				return 0;
 			}
 			op_kind = OP_CMPXCHG;
@@ -357,6 +535,60 @@ int step(void) {
 			use_mod_rm = 1;
 			is_dest_reg = 0;
 			need_dest_value = 1;
+		} else if (fetch_data == 0x31 || fetch_data == 0xA2) {
+			/* RDTSC/CPUID */
+			if (strict_mode) {
+				if (report) {
+					fprintf(stderr, "%s instruction, not in 80386, detected at %08"PRIx32"\n",
+						fetch_data == 0x31 ? "RDTSC" : "CPUID", inst_addr);
+					print_regs(stderr);
+				}
+				return 0;
+			}
+			op_kind = fetch_data == 0x31 ? OP_RDTSC : OP_CPUID;
+		} else if (fetch_data == 0xA3 || fetch_data == 0xAB || fetch_data == 0xB3 || fetch_data == 0xBB) {
+			/* BT/BTS/BTR/BTC r/m16/32, r16/32 */
+			static const int kind_table[] = {OP_BT, OP_BTS, OP_BTR, OP_BTC};
+			op_kind = OP_BIT_TEST;
+			op_bit_kind = kind_table[(fetch_data >> 3) & 3];
+			op_width = (is_data_16bit ? 2 : 4);
+			use_mod_rm = 1;
+			is_dest_reg = 0;
+			need_dest_value = 1;
+		} else if (fetch_data == 0xBA) {
+			/* BT/BTS/BTR/BTC r/m16/32, imm8 */
+			op_kind = OP_BIT_TEST;
+			op_bit_kind = OP_READ_MODRM_BIT;
+			op_width = (is_data_16bit ? 2 : 4);
+			use_mod_rm = 1;
+			is_dest_reg = 0;
+			modrm_disable_src = 1;
+			src_kind = OP_KIND_IMM;
+			use_imm = 1;
+			one_byte_imm = 1;
+			need_dest_value = 1;
+		} else if (fetch_data == 0xBC || fetch_data == 0xBD) {
+			/* BSF/BSR */
+			op_kind = OP_BIT_SCAN;
+			op_bit_kind = (fetch_data & 0x01) ? OP_BSR : OP_BSF;
+			op_width = (is_data_16bit ? 2 : 4);
+			use_mod_rm = 1;
+			is_dest_reg = 1;
+		} else if ((fetch_data & 0xF8) == 0xC8) {
+			/* BSWAP */
+			if (strict_mode) {
+				if (report) {
+					fprintf(stderr, "BSWAP instruction, not in 80386, detected at %08"PRIx32"\n", inst_addr);
+					print_regs(stderr);
+				}
+				return 0;
+			}
+			op_kind = OP_BSWAP;
+			op_width = 4;
+			src_kind = OP_KIND_REG;
+			src_reg_index = fetch_data & 0x07;
+			dest_kind = OP_KIND_REG;
+			dest_reg_index = fetch_data & 0x07;
 		} else if ((fetch_data & 0xFE) == 0xB6) {
 			/* MOVZX */
 			op_kind = OP_MOVZX;
@@ -369,9 +601,29 @@ int step(void) {
 			op_width = (fetch_data & 0x01) ? 2 : 1;
 			use_mod_rm = 1;
 			is_dest_reg = 1;
+		} else if (sse_is_opcode(fetch_data)) {
+			/* SSE/SSE2 (とPREFETCHh、複数バイトのNOP) */
+			if (strict_mode) {
+				if (report) {
+					fprintf(stderr, "SSE instruction, not in 80386, detected at %08"PRIx32"\n", inst_addr);
+					print_regs(stderr);
+				}
+				return 0;
+			}
+			op_kind = OP_SSE;
+			use_mod_rm = 1;
+			modrm_disable_src = 1;
+			op_sse.opcode = fetch_data;
+			if (is_rep) {
+				op_sse.prefix = is_rep_while_zero ? SSE_PREFIX_F3 : SSE_PREFIX_F2;
+			} else {
+				op_sse.prefix = is_data_16bit ? SSE_PREFIX_66 : SSE_PREFIX_NONE;
+			}
 		} else {
-			fprintf(stderr, "unsupported opcode \"0f %02"PRIx8"\" at %08"PRIx32"\n\n", fetch_data, inst_addr);
-			print_regs(stderr);
+			if (report) {
+				fprintf(stderr, "unsupported opcode \"0f %02"PRIx8"\" at %08"PRIx32"\n\n", fetch_data, inst_addr);
+				print_regs(stderr);
+			}
 			return 0;
 		}
 	} else {
@@ -498,12 +750,12 @@ int step(void) {
 			op_kind = OP_JUMP;
 			if (fetch_data == 0xE3) {
 				/* JCXZ */
-				jmp_take = ((is_data_16bit ? regs[ECX] & 0xffff : regs[ECX]) == 0);
+				cond = COND_CXZ;
 			} else if (fetch_data == 0xEB) {
 				/* JMP */
-				jmp_take = 1;
+				cond = COND_ALWAYS;
 			} else {
-				SET_JMP_TAKE
+				cond = fetch_data & 0x0F;
 			}
 			op_width = 1;
 			use_imm = 1;
@@ -708,6 +960,7 @@ int step(void) {
 			/* FPU instructions */
 			op_kind = OP_FPU;
 			use_mod_rm = 1;
+			modrm_disable_src = 1;
 			op_fpu_kind = fetch_data & 0x07;
 		} else if (fetch_data == 0xE0 || fetch_data == 0xE1 || fetch_data == 0xE2) {
 			/* LOOP* */
@@ -720,9 +973,9 @@ int step(void) {
 			dest_kind = OP_KIND_REG;
 			dest_reg_index = ECX;
 			switch (fetch_data) {
-			case 0xE0: jmp_take = !(eflags & ZF); break;
-			case 0xE1: jmp_take = (eflags & ZF); break;
-			case 0xE2: jmp_take = 1; break;
+			case 0xE0: cond = 0x5; break; /* ZFが0 (JNZと同じ) */
+			case 0xE1: cond = 0x4; break; /* ZFが1 (JZと同じ) */
+			case 0xE2: cond = COND_ALWAYS; break;
 			}
 		} else if ((fetch_data & 0xFC) == 0xE4 || (fetch_data & 0xFC) == 0xEC) {
 			/* IN/OUT */
@@ -733,17 +986,6 @@ int step(void) {
 			}
 			if ((fetch_data & 0x03) < 2) {
 				op_kind = OP_IN;
-				src_kind = OP_KIND_REG;
-				src_reg_index = EAX;
-				if (fetch_data <= 0xE7) {
-					dest_kind = OP_KIND_IMM;
-				} else {
-					dest_kind = OP_KIND_REG;
-					dest_reg_index = EDX;
-					need_dest_value = 1;
-				}
-			} else {
-				op_kind = OP_OUT;
 				dest_kind = OP_KIND_REG;
 				dest_reg_index = EAX;
 				if (fetch_data <= 0xE7) {
@@ -752,6 +994,17 @@ int step(void) {
 					src_kind = OP_KIND_REG;
 					src_reg_index = EDX;
 				}
+			} else {
+				op_kind = OP_OUT;
+				src_kind = OP_KIND_REG;
+				src_reg_index = EAX;
+				need_dest_value = 1;
+				if (fetch_data <= 0xE7) {
+					dest_kind = OP_KIND_IMM;
+				} else {
+					dest_kind = OP_KIND_REG;
+					dest_reg_index = EDX;
+				}
 			}
 		} else if (fetch_data == 0xE8) {
 			/* CALL */
@@ -763,7 +1016,7 @@ int step(void) {
 			op_kind = OP_JUMP;
 			op_width = is_data_16bit ? 2 : 4;
 			use_imm = 1;
-			jmp_take = 1;
+			cond = COND_ALWAYS;
 		} else if (fetch_data == 0xF4) {
 			/* HLT */
 			op_kind = OP_HLT;
@@ -790,8 +1043,10 @@ int step(void) {
 			op_width = (fetch_data & 0x01) ? (is_data_16bit ? 2 : 4) : 1;
 			use_mod_rm = 1;
 		} else {
-			fprintf(stderr, "unsupported opcode %02"PRIx8" at %08"PRIx32"\n\n", fetch_data, inst_addr);
-			print_regs(stderr);
+			if (report) {
+				fprintf(stderr, "unsupported opcode %02"PRIx8" at %08"PRIx32"\n\n", fetch_data, inst_addr);
+				print_regs(stderr);
+			}
 			return 0;
 		}
 	}
@@ -810,9 +1065,8 @@ int step(void) {
 	int modrm_is_mem = 0; /* mod r/m中のmod r/mがメモリか */
 
 	if (use_mod_rm) {
-		uint8_t mod_rm = step_memread(&memread_ok, inst_addr, CS, eip, 1);
-		if (!memread_ok) return 0;
-		eip++;
+		uint8_t mod_rm = (uint8_t)fetch_code_value(&fetch_ok, code, code_size, &pos, 1);
+		if (!fetch_ok) return decode_fetch_failed(inst_addr, code_size, report);
 
 		int mod = (mod_rm >> 6) & 3;
 		int reg = (mod_rm >> 3) & 7;
@@ -839,8 +1093,10 @@ int step(void) {
 			if (reg <= 1) {
 				use_imm = 1;
 				src_kind = OP_KIND_IMM;
+				modrm_disable_src = 1;
 			}
-			if (reg <= 3) need_dest_value = 1;
+			/* 1オペランドのIMULは、AL/AX/EAXを読む */
+			if (reg <= 3 || reg == 5) need_dest_value = 1;
 			if (4 <= reg) is_dest_reg = 1;
 			if (reg == 4 || reg == 5) imul_store_upper = 1;
 		} else if (op_arithmetic_kind == OP_READ_MODRM_INC) {
@@ -857,14 +1113,18 @@ int step(void) {
 				need_dest_value = 1;
 			} else if (reg <= 6) {
 				if (op_width == 1) {
-					fprintf(stderr, "undefined operation reg=%d at %08"PRIx32"\n", reg, inst_addr);
-					print_regs(stderr);
+					if (report) {
+						fprintf(stderr, "undefined operation reg=%d at %08"PRIx32"\n", reg, inst_addr);
+						print_regs(stderr);
+					}
 					return 0;
 				}
 				is_dest_reg = 1;
 			} else {
-				fprintf(stderr, "undefined operation reg=%d at %08"PRIx32"\n", reg, inst_addr);
-				print_regs(stderr);
+				if (report) {
+					fprintf(stderr, "undefined operation reg=%d at %08"PRIx32"\n", reg, inst_addr);
+					print_regs(stderr);
+				}
 				return 0;
 			}
 		}
@@ -875,16 +1135,58 @@ int step(void) {
 			};
 			op_shift_kind = kind_table[reg];
 		}
-		if (op_kind == OP_FPU) {
-			/* FPU系の演算を決定する */
-			if (op_fpu_kind == 3 && reg == 4) {
-				/* FNINIT/FINIT */
-				/* 無視 */
-			} else {
-				fprintf(stderr, "FPU operations are unimplemented at %08"PRIx32"\n", inst_addr);
-				print_regs(stderr);
+		if (op_bit_kind == OP_READ_MODRM_BIT) {
+			/* 「mod r/mを見て決定する」BT系の演算を決定する */
+			static const int kind_table[] = {OP_BT, OP_BTS, OP_BTR, OP_BTC};
+			if (reg < 4) {
+				if (report) {
+					fprintf(stderr, "undefined operation reg=%d at %08"PRIx32"\n", reg, inst_addr);
+					print_regs(stderr);
+				}
+				return 0;
+			}
+			op_bit_kind = kind_table[reg - 4];
+		}
+		if (op_kind == OP_SSE) {
+			/* SSE系の演算を決定する */
+			static const char* const prefix_names[] = {"", "66 ", "f3 ", "f2 "};
+			op_sse.reg = reg;
+			op_sse.rm = rm;
+			op_sse.is_mem = mod != 3;
+			if (!sse_decode(&op_sse)) {
+				if (report) {
+					fprintf(stderr, "unsupported SSE operation \"%s0f %02x\" (reg=%d, mod=%d) at %08"PRIx32"\n",
+						prefix_names[op_sse.prefix], op_sse.opcode, reg, mod, inst_addr);
+					print_regs(stderr);
+				}
 				return 0;
 			}
+			if (op_sse.use_imm) {
+				use_imm = 1;
+				one_byte_imm = 1;
+			}
+		}
+		if (op_kind == OP_FPU) {
+			/* FPU系の演算はregとr/mで決まるので、そのまま実行時に渡す */
+			op_fpu_reg = reg;
+			op_fpu_rm = rm;
+			if (strict_mode) {
+				const char* name = NULL;
+				if (mod == 3 && (op_fpu_kind == 2 || op_fpu_kind == 3) && reg < 4) {
+					name = "FCMOVcc";
+				} else if (mod == 3 && (op_fpu_kind == 3 || op_fpu_kind == 7) && (reg == 5 || reg == 6)) {
+					name = "FCOMI";
+				} else if (mod != 3 && (op_fpu_kind == 3 || op_fpu_kind == 5 || op_fpu_kind == 7) && reg == 1) {
+					name = "FISTTP";
+				}
+				if (name != NULL) {
+					if (report) {
+						fprintf(stderr, "%s instruction, not in 80387, detected at %08"PRIx32"\n", name, inst_addr);
+						print_regs(stderr);
+					}
+					return 0;
+				}
+			}
 		}
 
 		if (op_width == 1 && (op_kind != OP_MOVZX && op_kind != OP_MOVSX)) {
@@ -965,9 +1267,8 @@ int step(void) {
 
 	/* SIBを解析する */
 	if (use_sib) {
-		uint8_t sib = step_memread(&memread_ok, inst_addr, CS, eip, 1);
-		if (!memread_ok) return 0;
-		eip++;
+		uint8_t sib = (uint8_t)fetch_code_value(&fetch_ok, code, code_size, &pos, 1);
+		if (!fetch_ok) return decode_fetch_failed(inst_addr, code_size, report);
 
 		int ss  = (sib >> 6) & 3;
 		int idx = (sib >> 3) & 7;
@@ -993,23 +1294,17 @@ int step(void) {
 	uint32_t disp = 0;
 	if (!use_mod_rm) disp_size = direct_disp_size;
 	if (disp_size > 0) {
-		disp = step_memread(&memread_ok, inst_addr, CS, eip, disp_size);
-		if (!memread_ok) return 0;
-		eip += disp_size;
+		disp = fetch_code_value(&fetch_ok, code, code_size, &pos, disp_size);
+		if (!fetch_ok) return decode_fetch_failed(inst_addr, code_size, report);
 	}
 
-	/* mod r/m、sib、dispに基づき、オペランドを決定する */
+	/* mod r/m、sib、dispに基づき、オペランドを決定する (メモリの実効アドレスは実行時に求める) */
 	if (use_mod_rm) {
 		/* オペランドの参照先決定 */
 		int reg_kind = reg_is_high ? OP_KIND_REG_HIGH8 : OP_KIND_REG;
 		int modrm_kind;
-		uint32_t modrm_addr = 0;
 		if (modrm_is_mem) {
-			uint32_t mask = is_addr_16bit ? UINT32_C(0xffff) : UINT32_C(0xffffffff);
-			uint32_t reg1_value = regs[modrm_reg_index] & mask;
-			uint32_t reg2_value = regs[modrm_reg2_index] & mask;
 			modrm_kind = OP_KIND_MEM;
-			modrm_addr = ((modrm_no_reg ? 0 : reg1_value) + (reg2_value * modrm_reg2_scale) + disp) & mask;
 		} else {
 			modrm_kind = modrm_reg_is_high ? OP_KIND_REG_HIGH8 : OP_KIND_REG;
 		}
@@ -1021,7 +1316,6 @@ int step(void) {
 				/* destがregなので、srcはmod r/m */
 				src_kind = modrm_kind;
 				src_reg_index = modrm_reg_index;
-				src_addr = modrm_addr;
 			} else {
 				/* srcがreg */
 				src_kind = reg_kind;
@@ -1040,56 +1334,654 @@ int step(void) {
 		} else {
 			dest_kind = modrm_kind;
 			dest_reg_index = modrm_reg_index;
-			dest_addr = modrm_addr;
 		}
 	} else if (direct_disp_size > 0) {
-		uint32_t disp_value = disp;
-		if (direct_disp_size < 4) disp_value &= UINT32_C(0xffffffff) >> (8 * (4 - direct_disp_size));
+		if (direct_disp_size < 4) disp &= UINT32_C(0xffffffff) >> (8 * (4 - direct_disp_size));
+		modrm_no_reg = 1;
 		if (is_dest_direct_disp) {
 			dest_kind = OP_KIND_MEM;
-			dest_addr = disp_value;
 		} else {
 			src_kind = OP_KIND_MEM;
-			src_addr = disp_value;
 		}
 	}
 
 	/* 即値を解析する */
 	if (use_imm) {
 		int imm_size = one_byte_imm ? 1 : op_width;
-		imm_value = step_memread(&memread_ok, inst_addr, CS, eip, imm_size);
-		if (!memread_ok) return 0;
-		eip += imm_size;
+		imm_value = fetch_code_value(&fetch_ok, code, code_size, &pos, imm_size);
+		if (!fetch_ok) return decode_fetch_failed(inst_addr, code_size, report);
 	}
 
-	/* オペランドを読み込む */
-	uint32_t src_value = 0;
-	uint32_t dest_value = 0;
+	memset(inst, 0, sizeof(*inst));
+	inst->addr = inst_addr;
+	inst->length = (uint8_t)pos;
+	inst->is_data_16bit = (uint8_t)is_data_16bit;
+	inst->is_addr_16bit = (uint8_t)is_addr_16bit;
+	inst->is_rep = (uint8_t)is_rep;
+	inst->is_rep_while_zero = (uint8_t)is_rep_while_zero;
+	inst->op_kind = (uint8_t)op_kind;
+	inst->op_arithmetic_kind = (uint8_t)op_arithmetic_kind;
+	inst->op_shift_kind = (uint8_t)op_shift_kind;
+	inst->op_bit_kind = (uint8_t)op_bit_kind;
+	inst->op_string_kind = (uint8_t)op_string_kind;
+	inst->op_width = (uint8_t)op_width;
+	inst->cond = (uint8_t)cond;
+	inst->use_imm = (uint8_t)use_imm;
+	inst->imul_store_upper = (uint8_t)imul_store_upper;
+	inst->op_fpu_kind = (uint8_t)op_fpu_kind;
+	inst->op_fpu_reg = (uint8_t)op_fpu_reg;
+	inst->op_fpu_rm = (uint8_t)op_fpu_rm;
+	inst->src_kind = (uint8_t)src_kind;
+	inst->src_reg_index = (uint8_t)src_reg_index;
+	inst->dest_kind = (uint8_t)dest_kind;
+	inst->dest_reg_index = (uint8_t)dest_reg_index;
+	inst->need_dest_value = (uint8_t)need_dest_value;
+	inst->data_segment = (uint8_t)data_segment;
+	inst->ea_no_base = (uint8_t)modrm_no_reg;
+	inst->ea_base = (uint8_t)modrm_reg_index;
+	inst->ea_index = (uint8_t)modrm_reg2_index;
+	inst->ea_scale = (uint8_t)modrm_reg2_scale;
+	inst->ea_disp = disp;
+	inst->imm_value = imm_value;
+	inst->op_sse = op_sse;
+	inst->live_flags = STATUS_FLAGS;
+	return 1;
+}
 
-	switch (src_kind) {
-	case OP_KIND_IMM:
-		src_value = imm_value;
+/*
+命令のバイト列を読む。addrにセグメントを足したアドレスから、割り当てられているページにある分
+(最大X86_INST_MAX_LENGTHバイト) をcodeに入れ、その大きさを返す。
+*/
+static uint32_t fetch_code(uint8_t* code, uint32_t addr) {
+	uint32_t size = 0;
+	if (UINT32_MAX - segment_offsets[CS] < addr) return 0;
+	addr += segment_offsets[CS];
+	while (size < X86_INST_MAX_LENGTH) {
+		const uint8_t* page = dmemory_page_for_read(addr);
+		uint32_t offset = addr % DMEMORY_PAGE_SIZE;
+		uint32_t chunk = DMEMORY_PAGE_SIZE - offset;
+		if (page == NULL) break;
+		if (chunk > X86_INST_MAX_LENGTH - size) chunk = X86_INST_MAX_LENGTH - size;
+		memcpy(code + size, page + offset, chunk);
+		size += chunk;
+		if (UINT32_MAX - addr < chunk) break;
+		addr += chunk;
+	}
+	return size;
+}
+
+/* ブロックの最後になる命令か (分岐やシステムコールなど、次に実行する命令が変わりうるもの) */
+static int is_block_end(int op_kind) {
+	switch (op_kind) {
+	case OP_CALL: case OP_JUMP: case OP_CALL_ABSOLUTE: case OP_JUMP_ABSOLUTE:
+	case OP_CALL_FAR: case OP_JUMP_FAR: case OP_RETN: case OP_LOOP:
+	case OP_INT: case OP_INTO: case OP_IRET: case OP_HLT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* メモリオペランドの実効アドレス */
+static uint32_t effective_address(const x86_inst* inst) {
+	uint32_t mask = inst->is_addr_16bit ? UINT32_C(0xffff) : UINT32_C(0xffffffff);
+	uint32_t reg1_value = regs[inst->ea_base] & mask;
+	uint32_t reg2_value = regs[inst->ea_index] & mask;
+	return ((inst->ea_no_base ? 0 : reg1_value) + (reg2_value * inst->ea_scale) + inst->ea_disp) & mask;
+}
+
+/* 分岐・CMOVcc・SETccの条件が読むフラグ */
+static uint32_t condition_flags(int cond) {
+	static const uint32_t flags_table[8] = {
+		OF, CF, ZF, CF | ZF, SF, PF, SF | OF, ZF | SF | OF
+	};
+	if (cond >= COND_ALWAYS) return 0;
+	return flags_table[(cond >> 1) & 7];
+}
+
+/*
+命令がステータスフラグを読む・書く範囲を求める。
+must_writeは必ず書くフラグ、may_writeは書くかもしれないフラグ。
+調べていない命令は全てのフラグを読むものとし、その前の命令には全てのフラグを求めさせる。
+メモリに書く命令は、コードを書き換えて以降の命令を変えるかもしれないので、その後で全てのフラグを読むものとする。
+*/
+static void inst_flag_usage(const x86_inst* inst, uint32_t* read, uint32_t* must_write, uint32_t* may_write) {
+	int writes_memory = inst->dest_kind == OP_KIND_MEM;
+	*read = condition_flags(inst->cond);
+	*must_write = 0;
+	*may_write = 0;
+	switch (inst->op_kind) {
+	case OP_ARITHMETIC:
+		if (inst->op_arithmetic_kind == OP_ADC || inst->op_arithmetic_kind == OP_SBB) *read |= CF;
+		if (inst->op_arithmetic_kind == OP_CMP || inst->op_arithmetic_kind == OP_TEST) writes_memory = 0;
+		*must_write = *may_write = STATUS_FLAGS;
 		break;
-	case OP_KIND_MEM:
-		if (op_kind == OP_LEA) {
-			src_value = src_addr;
-		} else {
-			src_value = step_memread(&memread_ok, inst_addr, data_segment, src_addr, op_width);
-			if (!memread_ok) return 0;
+	case OP_SHIFT:
+		{
+			int is_double = inst->op_shift_kind == OP_SHLD || inst->op_shift_kind == OP_SHRD;
+			int is_rotate = inst->op_shift_kind == OP_ROL || inst->op_shift_kind == OP_ROR ||
+				inst->op_shift_kind == OP_RCL || inst->op_shift_kind == OP_RCR;
+			uint32_t result_flags = is_rotate ? 0 : (SF | ZF | PF);
+			if (inst->op_shift_kind == OP_RCL || inst->op_shift_kind == OP_RCR) *read |= CF;
+			*may_write = OF | CF | result_flags;
+			/* シフトする数が0なら何も変えないので、即値で決まる時だけ必ず書く */
+			if (is_double ? inst->use_imm : inst->src_kind == OP_KIND_IMM) {
+				uint32_t shift_width = inst->imm_value & 31;
+				if (shift_width > 0) *must_write = CF | result_flags | (shift_width == 1 ? OF : 0);
+			}
 		}
 		break;
-	case OP_KIND_REG:
-		src_value = regs[src_reg_index];
+	case OP_INCDEC:
+		*must_write = *may_write = OF | SF | ZF | AF | PF;
 		break;
-	case OP_KIND_REG_HIGH8:
-		src_value = regs[src_reg_index] >> 8;
+	case OP_MUL: case OP_IMUL:
+		*must_write = *may_write = OF | CF;
 		break;
-	}
-	if (op_width < 4) {
-		if (src_value & (UINT32_C(0x80) << ((op_width - 1) * 8))) {
-			src_value |= UINT32_C(0xffffffff) << (op_width * 8);
-		} else {
-			src_value &= UINT32_C(0xffffffff) >> ((4 - op_width) * 8);
+	case OP_CMPXCHG: case OP_BIT_SCAN:
+		*must_write = *may_write = ZF;
+		break;
+	case OP_BIT_TEST:
+		if (inst->op_bit_kind == OP_BT) writes_memory = 0;
+		*must_write = *may_write = CF;
+		break;
+	case OP_SAHF:
+		*must_write = *may_write = SF | ZF | AF | PF | CF;
+		break;
+	case OP_LAHF:
+		*read |= SF | ZF | AF | PF | CF;
+		break;
+	case OP_CMC:
+		*read |= CF;
+		*must_write = *may_write = CF;
+		break;
+	case OP_SET_FLAG: case OP_CLEAR_FLAG:
+		*must_write = *may_write = inst->imm_value & STATUS_FLAGS;
+		break;
+	case OP_POPF:
+		*must_write = *may_write = STATUS_FLAGS;
+		break;
+	case OP_STRING:
+		if (inst->op_string_kind == OP_STR_CMP || inst->op_string_kind == OP_STR_SCA) {
+			/* REPでECXが0なら何も変えない */
+			*may_write = STATUS_FLAGS;
+			if (!inst->is_rep) *must_write = STATUS_FLAGS;
+		}
+		writes_memory = inst->op_string_kind == OP_STR_MOV || inst->op_string_kind == OP_STR_STO ||
+			inst->op_string_kind == OP_STR_IN;
+		break;
+	case OP_XCHG:
+		writes_memory = writes_memory || inst->src_kind == OP_KIND_MEM;
+		break;
+	case OP_MOV: case OP_CMOV: case OP_MOVZX: case OP_MOVSX: case OP_SETCC: case OP_LEA: case OP_NOT:
+	case OP_DIV: case OP_IDIV: case OP_POP: case OP_CBW: case OP_CWD: case OP_LEAVE:
+	case OP_RDTSC: case OP_CPUID: case OP_BSWAP: case OP_IN: case OP_OUT:
+		break;
+	case OP_PUSH: case OP_PUSHF:
+		writes_memory = 1;
+		break;
+	default:
+		*read = STATUS_FLAGS;
+		break;
+	}
+	if (writes_memory) *read = STATUS_FLAGS;
+}
+
+/*
+ブロックの命令を後ろから見て、各命令が求める必要のあるフラグを決める。
+ブロックの後では全てのフラグが読まれるものとする。
+*/
+static void analyze_flag_liveness(x86_inst* insts, uint32_t inst_num) {
+	uint32_t live = STATUS_FLAGS;
+	uint32_t i;
+	for (i = inst_num; i > 0; i--) {
+		x86_inst* inst = &insts[i - 1];
+		uint32_t read, must_write, may_write;
+		inst_flag_usage(inst, &read, &must_write, &may_write);
+		if (read == STATUS_FLAGS) {
+			/* 後で全てのフラグを読むかもしれない命令 (メモリに書くものなど) */
+			inst->live_flags = STATUS_FLAGS;
+			live = STATUS_FLAGS;
+		} else {
+			inst->live_flags = (uint16_t)(live & may_write);
+			live = (live & ~must_write) | read;
+		}
+	}
+}
+
+/* 32ビットのレジスタをdeltaだけ変える命令 (INC/DEC/ADD/SUB) なら、そのレジスタを返す (違えば-1) */
+static int reg_step_target(const x86_inst* inst, int delta) {
+	if (inst->dest_kind != OP_KIND_REG || inst->op_width != 4) return -1;
+	if (inst->op_kind == OP_INCDEC && inst->imm_value == (uint32_t)delta) return inst->dest_reg_index;
+	if (inst->op_kind == OP_ARITHMETIC && inst->src_kind == OP_KIND_IMM &&
+	((inst->op_arithmetic_kind == OP_ADD && inst->imm_value == (uint32_t)delta) ||
+	(inst->op_arithmetic_kind == OP_SUB && inst->imm_value == (uint32_t)-delta))) {
+		return inst->dest_reg_index;
+	}
+	return -1;
+}
+
+/* 実効アドレスがregを係数1で1回だけ使い、他にはchangedのビットのレジスタを使わないか */
+static int ea_follows_reg(const x86_inst* inst, int reg, uint32_t changed) {
+	int uses = 0;
+	if (!inst->ea_no_base) {
+		if (inst->ea_base == reg) uses++;
+		else if (changed & (UINT32_C(1) << inst->ea_base)) return 0;
+	}
+	if (inst->ea_scale != 0) {
+		if (inst->ea_index == reg && inst->ea_scale == 1) uses++;
+		else if (inst->ea_index == reg || (changed & (UINT32_C(1) << inst->ea_index))) return 0;
+	}
+	return uses == 1;
+}
+
+/* 1バイトを読んでレジスタに入れる命令 (MOV r8, m8 / MOVZX r32, m8) か */
+static int is_byte_load(const x86_inst* inst) {
+	if (inst->src_kind != OP_KIND_MEM || inst->op_width != 1) return 0;
+	if (inst->op_kind == OP_MOV) return inst->dest_kind == OP_KIND_REG || inst->dest_kind == OP_KIND_REG_HIGH8;
+	return inst->op_kind == OP_MOVZX && inst->dest_kind == OP_KIND_REG && !inst->is_data_16bit;
+}
+
+/*
+mov r8, [src] / mov [dest], r8 / (srcとdestを1増やす) / dec count / jnz
+の形のコピーのループか
+*/
+static int match_copy_loop(const x86_inst* insts, uint32_t num, x86_loop_idiom* loop) {
+	const x86_inst* load = &insts[0];
+	const x86_inst* store = &insts[1];
+	int value_reg = load->dest_reg_index;
+	int src_reg, dest_reg, count_reg;
+	uint32_t changed;
+	if (num != 5 || load->op_kind != OP_MOV || !is_byte_load(load)) return 0;
+	if (store->op_kind != OP_MOV || store->op_width != 1 || store->dest_kind != OP_KIND_MEM ||
+	store->src_kind != load->dest_kind || store->src_reg_index != value_reg) return 0;
+	src_reg = reg_step_target(&insts[2], 1);
+	dest_reg = reg_step_target(&insts[3], 1);
+	count_reg = reg_step_target(&insts[4], -1);
+	if (src_reg < 0 || dest_reg < 0 || count_reg < 0) return 0;
+	if (!ea_follows_reg(load, src_reg, 0)) {
+		/* srcとdestを進める順が逆 */
+		int tmp = src_reg;
+		src_reg = dest_reg;
+		dest_reg = tmp;
+	}
+	if (src_reg == dest_reg || src_reg == count_reg || dest_reg == count_reg ||
+	value_reg == src_reg || value_reg == dest_reg || value_reg == count_reg) return 0;
+	changed = (UINT32_C(1) << src_reg) | (UINT32_C(1) << dest_reg) |
+		(UINT32_C(1) << count_reg) | (UINT32_C(1) << value_reg);
+	if (!ea_follows_reg(load, src_reg, changed) || !ea_follows_reg(store, dest_reg, changed)) return 0;
+	loop->kind = X86_LOOP_COPY;
+	loop->src_reg = (uint8_t)src_reg;
+	loop->dest_reg = (uint8_t)dest_reg;
+	loop->count_reg = (uint8_t)count_reg;
+	loop->src_inst = 0;
+	loop->dest_inst = 1;
+	return 1;
+}
+
+/*
+inc ptr / cmp byte [ptr], value / jne
+または mov r8, [ptr] / inc ptr / (test r8, r8 か cmp r8, imm) / jne
+の形の、値を探すループか
+*/
+static int match_scan_loop(const x86_inst* insts, uint32_t num, x86_loop_idiom* loop) {
+	const x86_inst* cmp = &insts[num - 1];
+	int ptr_reg;
+	if (num != 2 && num != 3) return 0;
+	if (cmp->op_kind != OP_ARITHMETIC || cmp->op_width != 1 ||
+	(cmp->op_arithmetic_kind != OP_CMP && cmp->op_arithmetic_kind != OP_TEST)) return 0;
+	if (num == 2) {
+		/* メモリと値を直接比べる */
+		ptr_reg = reg_step_target(&insts[0], 1);
+		if (ptr_reg < 0 || cmp->op_arithmetic_kind != OP_CMP || cmp->dest_kind != OP_KIND_MEM) return 0;
+		if (!ea_follows_reg(cmp, ptr_reg, UINT32_C(1) << ptr_reg)) return 0;
+		if (cmp->src_kind == OP_KIND_IMM) {
+			loop->value = cmp->imm_value & 0xff;
+		} else if (cmp->src_reg_index != ptr_reg) {
+			loop->value_reg = cmp->src_reg_index;
+		} else {
+			return 0;
+		}
+		loop->value_kind = cmp->src_kind;
+		loop->src_inst = 1;
+		loop->src_advanced = 1;
+	} else {
+		/* 読んだレジスタを比べる */
+		const x86_inst* load = &insts[0];
+		int value_reg = load->dest_reg_index;
+		ptr_reg = reg_step_target(&insts[1], 1);
+		if (ptr_reg < 0 || !is_byte_load(load) || value_reg == ptr_reg) return 0;
+		if (!ea_follows_reg(load, ptr_reg, (UINT32_C(1) << ptr_reg) | (UINT32_C(1) << value_reg))) return 0;
+		if (cmp->dest_kind != (load->op_kind == OP_MOVZX ? OP_KIND_REG : load->dest_kind) ||
+		cmp->dest_reg_index != value_reg) return 0;
+		if (cmp->op_arithmetic_kind == OP_TEST) {
+			if (cmp->src_kind != cmp->dest_kind || cmp->src_reg_index != value_reg) return 0;
+			loop->value = 0;
+		} else {
+			if (cmp->src_kind != OP_KIND_IMM) return 0;
+			loop->value = cmp->imm_value & 0xff;
+		}
+		loop->value_kind = OP_KIND_IMM;
+		loop->src_inst = 0;
+		loop->src_advanced = 0;
+	}
+	loop->kind = X86_LOOP_SCAN;
+	loop->src_reg = (uint8_t)ptr_reg;
+	return 1;
+}
+
+/* ブロックの命令の列が先頭に戻るJNZで終わる1バイトずつのループなら、その形を記録する */
+static void match_loop_idiom(const x86_inst* insts, uint32_t inst_num, x86_loop_idiom* out) {
+	const x86_inst* last = &insts[inst_num - 1];
+	x86_loop_idiom loop;
+	uint32_t i;
+	if (inst_num < 3) return;
+	if (last->op_kind != OP_JUMP || last->cond != 0x5 || last->is_data_16bit ||
+	last->addr + last->length + last->imm_value != insts[0].addr) return;
+	for (i = 0; i < inst_num; i++) {
+		if (insts[i].is_addr_16bit) return;
+	}
+	memset(&loop, 0, sizeof(loop));
+	if (match_copy_loop(insts, inst_num - 1, &loop) || match_scan_loop(insts, inst_num - 1, &loop)) {
+		*out = loop;
+	}
+}
+
+/*
+ブロックの最適化。命令の列だけを見るので、最適化のスレッドからも呼ぶ。
+トレースでは毎回フラグを表示するので、呼ばずに全てのフラグを求める。
+*/
+static void optimize_insts(x86_inst* insts, uint32_t inst_num, x86_loop_idiom* loop) {
+	analyze_flag_liveness(insts, inst_num);
+	match_loop_idiom(insts, inst_num, loop);
+}
+
+/* 最適化のスレッドから受け取った結果を、まだ最適化していない同じ内容のブロックに反映する */
+static void apply_optimized(uint32_t eip, const x86_inst* original, const x86_inst* optimized,
+uint32_t inst_num, const x86_loop_idiom* loop) {
+	x86_block* block = block_cache_lookup(eip);
+	/* 待つ間に、ブロックが書き換えられたり作り直されたりしているかもしれない */
+	if (block == NULL || block->optimized || block->inst_num != inst_num ||
+	memcmp(block->insts, original, sizeof(*original) * inst_num) != 0) return;
+	memcpy(block->insts, optimized, sizeof(*optimized) * inst_num);
+	block->loop = *loop;
+	block->optimized = 1;
+}
+
+/* ブロックの先頭から実行した回数がこれに達したら、最適化する */
+#define BLOCK_HOT_COUNT 32
+
+/* よく実行するブロックを最適化する (スレッドを使う時は、待ち行列に入れる) */
+static void optimize_hot_block(x86_block* block) {
+	if (use_optimize_thread) {
+		/* 最初に使う時に起動し、fork()した子プロセスでは起動し直す */
+		if (block_worker_start(optimize_insts)) {
+			/* いっぱいなら、また実行された時に入れ直す */
+			if (!block_worker_submit(block)) block->exec_count = 0;
+			return;
+		}
+		use_optimize_thread = 0;
+	}
+	optimize_insts(block->insts, block->inst_num, &block->loop);
+	block->optimized = 1;
+}
+
+/*
+startから始まるブロックをデコードしてキャッシュに入れる。
+ブロックは分岐命令などの後か、次の命令が別のページから始まる所で終える。
+最初の命令をデコードできなければ、エラーを表示してNULLを返す。
+*/
+static x86_block* translate_block(uint32_t start) {
+	x86_inst insts[X86_BLOCK_INST_MAX];
+	x86_block* block;
+	uint32_t inst_num = 0;
+	uint32_t addr = start;
+	uint32_t code_addr = segment_offsets[CS] + start;
+	while (inst_num < X86_BLOCK_INST_MAX) {
+		uint8_t code[X86_INST_MAX_LENGTH];
+		uint32_t code_size = fetch_code(code, addr);
+		if (!decode_inst(&insts[inst_num], addr, code, code_size, inst_num == 0)) {
+			if (inst_num == 0) return NULL;
+			break;
+		}
+		addr += insts[inst_num].length;
+		if (is_block_end(insts[inst_num++].op_kind)) break;
+		if (code_addr % DMEMORY_PAGE_SIZE + (addr - start) >= DMEMORY_PAGE_SIZE) break;
+	}
+	block = block_cache_new(start, code_addr, addr - start, insts, inst_num);
+	/* 最適化をスレッドに任せる時は、よく実行するブロックだけを後で最適化する */
+	if (enable_trace) {
+		block->optimized = 1;
+	} else if (!use_optimize_thread) {
+		optimize_insts(block->insts, block->inst_num, &block->loop);
+		block->optimized = 1;
+	}
+	return block;
+}
+
+/* 分岐・CMOVcc・SETccの条件を、現在のフラグ (とECX) で判定する */
+static int check_condition(int cond, int is_data_16bit) {
+	int take = 0;
+	if (cond == COND_ALWAYS) return 1;
+	if (cond == COND_NEVER) return 0;
+	if (cond == COND_CXZ) return (is_data_16bit ? regs[ECX] & 0xffff : regs[ECX]) == 0;
+	switch (cond & 0x0E) {
+	case 0x0: take = (eflags & OF) != 0; break; /* JO */
+	case 0x2: take = (eflags & CF) != 0; break; /* JB */
+	case 0x4: take = (eflags & ZF) != 0; break; /* JZ */
+	case 0x6: take = (eflags & CF) || (eflags & ZF); break; /* JBE */
+	case 0x8: take = (eflags & SF) != 0; break; /* JS */
+	case 0xA: take = (eflags & PF) != 0; break; /* JP */
+	case 0xC: take = ((eflags & SF) != 0) != ((eflags & OF) != 0); break; /* JL */
+	case 0xE: take = (eflags & ZF) || (((eflags & SF) != 0) != ((eflags & OF) != 0)); break; /* JLE */
+	}
+	if (cond & 0x01) take = !take;
+	return take;
+}
+
+/* addrから最大maxバイトのうち、先頭から続けて割り当てられている長さ */
+static uint32_t allocated_length(uint32_t addr, uint32_t max) {
+	uint32_t length = 0;
+	if (max > UINT32_MAX - addr) max = UINT32_MAX - addr;
+	while (length < max) {
+		uint32_t chunk = DMEMORY_PAGE_SIZE - (addr + length) % DMEMORY_PAGE_SIZE;
+		if (chunk > max - length) chunk = max - length;
+		if (!dmemory_is_allocated(addr + length, chunk)) break;
+		length += chunk;
+	}
+	return length;
+}
+
+/* 命令のメモリオペランドの、セグメントを足したアドレス (溢れるなら偽を返す) */
+static int linear_address(uint32_t* addr, const x86_inst* inst, uint32_t delta) {
+	uint32_t ea = effective_address(inst) + delta;
+	if (UINT32_MAX - segment_offsets[inst->data_segment] < ea) return 0;
+	*addr = segment_offsets[inst->data_segment] + ea;
+	return 1;
+}
+
+/*
+コピーのループを、最後の1回を残してまとめて実行し、実行した回数を返す。
+メモリが割り当てられていない所に届く場合は、その直前の1回も残す。
+残した回は命令ごとに実行するので、終了時や例外時のレジスタとフラグは1命令ずつ実行した時と同じになる。
+*/
+static uint32_t run_copy_loop(const x86_block* block) {
+	const x86_loop_idiom* loop = &block->loop;
+	uint32_t count = regs[loop->count_reg];
+	uint32_t src, dest, num, done;
+	uint8_t buffer[DMEMORY_PAGE_SIZE];
+	if (count < 2) return 0;
+	if (!linear_address(&src, &block->insts[loop->src_inst], 0) ||
+	!linear_address(&dest, &block->insts[loop->dest_inst], 0)) return 0;
+	num = allocated_length(src, count);
+	num = allocated_length(dest, num);
+	if (num < 2) return 0;
+	num--;
+	/* ループ自身のコードを書き換えるなら、命令ごとに実行する */
+	if (dest < block->code_addr + block->code_size && block->code_addr < dest + num) return 0;
+	for (done = 0; done < num; ) {
+		uint32_t size = num - done < sizeof(buffer) ? num - done : (uint32_t)sizeof(buffer);
+		dmemory_read(buffer, src + done, size);
+		/* コピー先がコピー元のすぐ後ろなら、1バイトずつコピーした時と同じく書いた値を繰り返す */
+		if (dest > src && dest - src < size) {
+			uint32_t i;
+			for (i = dest - src; i < size; i++) buffer[i] = buffer[i - (dest - src)];
+		}
+		dmemory_write(buffer, dest + done, size);
+		done += size;
+	}
+	regs[loop->src_reg] += num;
+	regs[loop->dest_reg] += num;
+	regs[loop->count_reg] -= num;
+	return num;
+}
+
+/* 値を探すループを、run_copy_loopと同じく最後の1回を残してまとめて実行し、実行した回数を返す */
+static uint32_t run_scan_loop(const x86_block* block) {
+	const x86_loop_idiom* loop = &block->loop;
+	uint32_t addr, num = 0, max;
+	int value;
+	if (!linear_address(&addr, &block->insts[loop->src_inst], loop->src_advanced)) return 0;
+	if (loop->value_kind == OP_KIND_IMM) value = (uint8_t)loop->value;
+	else if (loop->value_kind == OP_KIND_REG) value = (uint8_t)regs[loop->value_reg];
+	else value = (uint8_t)(regs[loop->value_reg] >> 8);
+	max = UINT32_MAX - addr;
+	while (num < max) {
+		const uint8_t* page = dmemory_page_for_read(addr + num);
+		uint32_t offset = (addr + num) % DMEMORY_PAGE_SIZE;
+		uint32_t size = DMEMORY_PAGE_SIZE - offset;
+		const uint8_t* found;
+		if (page == NULL) break;
+		if (size > max - num) size = max - num;
+		found = memchr(page + offset, value, size);
+		if (found != NULL) {
+			num += (uint32_t)(found - (page + offset)) + 1;
+			break;
+		}
+		num += size;
+	}
+	if (num < 2) return 0;
+	num--;
+	regs[loop->src_reg] += num;
+	return num;
+}
+
+/* ブロックが1バイトずつのループなら、まとめて実行できる分を実行する */
+static void run_loop_idiom(const x86_block* block) {
+	uint32_t num = block->loop.kind == X86_LOOP_COPY ? run_copy_loop(block) : run_scan_loop(block);
+	uint32_t i;
+	if (num == 0) return;
+	instructions_retired += (uint64_t)num * block->inst_num;
+	if (enable_coverage) {
+		/* 回数は飽和するので、それ以上は数えない */
+		for (i = 0; i < num && i <= UINT8_MAX; i++) coverage_record_block(block->eip);
+	}
+}
+
+/* 実行中のブロックと、その中で次に実行する命令の位置 */
+static x86_block* current_block = NULL;
+static uint32_t current_index = 0;
+
+int step(void) {
+	uint32_t inst_addr = eip; /* エラー時の検証用 */
+	const x86_inst* inst;
+	x86_block* block;
+	int memread_ok;
+	/* デコード済みの命令から取り出す値 */
+	int is_data_16bit, is_addr_16bit, is_rep, is_rep_while_zero;
+	int op_kind, op_arithmetic_kind, op_shift_kind, op_bit_kind, op_string_kind, op_width;
+	int use_imm, imul_store_upper, op_fpu_kind, op_fpu_reg, op_fpu_rm;
+	int src_kind, src_reg_index, dest_kind, dest_reg_index, need_dest_value, data_segment;
+	uint32_t imm_value;
+	int jmp_take; /* ジャンプを行うか */
+	uint32_t src_addr = 0;
+	uint32_t dest_addr = 0;
+	uint32_t ret_esp = 0; /* RETで戻りアドレスを読んだ位置 */
+	uint32_t src_value = 0;
+	uint32_t dest_value = 0;
+	uint32_t result = 0;
+	int result_write = 0;
+
+	/* 次の命令が実行中のブロックの続きでなければ、ブロックを探すかデコードする */
+	if (current_block == NULL || !current_block->valid || current_index >= current_block->inst_num ||
+	current_block->insts[current_index].addr != eip) {
+		current_block = block_cache_lookup(eip);
+		if (current_block == NULL) current_block = translate_block(eip);
+		if (current_block == NULL) return 0;
+		current_index = 0;
+	}
+	block = current_block;
+	if (current_index == 0) {
+		if (block_worker_pending() > 0) block_worker_collect(apply_optimized);
+		if (!block->optimized && ++block->exec_count == BLOCK_HOT_COUNT) optimize_hot_block(block);
+		if (block->loop.kind != X86_LOOP_NONE && enable_loop_idiom) run_loop_idiom(block);
+	}
+	inst = &block->insts[current_index++];
+	eip = inst_addr + inst->length;
+
+	is_data_16bit = inst->is_data_16bit;
+	is_addr_16bit = inst->is_addr_16bit;
+	is_rep = inst->is_rep;
+	is_rep_while_zero = inst->is_rep_while_zero;
+	op_kind = inst->op_kind;
+	op_arithmetic_kind = inst->op_arithmetic_kind;
+	op_shift_kind = inst->op_shift_kind;
+	op_bit_kind = inst->op_bit_kind;
+	op_string_kind = inst->op_string_kind;
+	op_width = inst->op_width;
+	use_imm = inst->use_imm;
+	imul_store_upper = inst->imul_store_upper;
+	op_fpu_kind = inst->op_fpu_kind;
+	op_fpu_reg = inst->op_fpu_reg;
+	op_fpu_rm = inst->op_fpu_rm;
+	src_kind = inst->src_kind;
+	src_reg_index = inst->src_reg_index;
+	dest_kind = inst->dest_kind;
+	dest_reg_index = inst->dest_reg_index;
+	need_dest_value = inst->need_dest_value;
+	data_segment = inst->data_segment;
+	imm_value = inst->imm_value;
+	jmp_take = inst->cond != COND_NEVER && check_condition(inst->cond, is_data_16bit);
+
+	/* メモリオペランドの実効アドレスを求める */
+	if (src_kind == OP_KIND_MEM || dest_kind == OP_KIND_MEM) {
+		uint32_t addr = effective_address(inst);
+		if (src_kind == OP_KIND_MEM) src_addr = addr; else dest_addr = addr;
+	}
+
+	/* BT系命令のメモリオペランドは、レジスタで指定したビットを含むワードを指すようにずらす */
+	if (op_kind == OP_BIT_TEST && dest_kind == OP_KIND_MEM && src_kind == OP_KIND_REG) {
+		int64_t offset = op_width == 2 ? (int16_t)regs[src_reg_index] : (int32_t)regs[src_reg_index];
+		int64_t bits = op_width * 8;
+		int64_t index = (offset >= 0 ? offset : offset - (bits - 1)) / bits;
+		dest_addr += (uint32_t)(index * op_width);
+		if (is_addr_16bit) dest_addr &= 0xffff;
+	}
+
+	/* オペランドを読み込む */
+	switch (src_kind) {
+	case OP_KIND_IMM:
+		src_value = imm_value;
+		break;
+	case OP_KIND_MEM:
+		if (op_kind == OP_LEA) {
+			src_value = src_addr;
+		} else {
+			src_value = step_memread(&memread_ok, inst_addr, data_segment, src_addr, op_width);
+			if (!memread_ok) return 0;
+		}
+		break;
+	case OP_KIND_REG:
+		src_value = regs[src_reg_index];
+		break;
+	case OP_KIND_REG_HIGH8:
+		src_value = regs[src_reg_index] >> 8;
+		break;
+	}
+	if (op_width < 4) {
+		if (src_value & (UINT32_C(0x80) << ((op_width - 1) * 8))) {
+			src_value |= UINT32_C(0xffffffff) << (op_width * 8);
+		} else {
+			src_value &= UINT32_C(0xffffffff) >> ((4 - op_width) * 8);
 		}
 	}
 
@@ -1119,9 +2011,6 @@ int step(void) {
 	}
 
 	/* 計算をする */
-	uint32_t result = 0;
-	int result_write = 0;
-
 #define NOT_IMPLEMENTED(name) \
 	fprintf(stderr, "operation " #name " not implemented at %08"PRIx32"\n", inst_addr); \
 	print_regs(stderr); \
@@ -1133,7 +2022,7 @@ int step(void) {
 			uint64_t result64 = 0;
 			uint64_t mask = ((UINT64_C(1) << (op_width * 8)) - 1);
 			uint64_t sign_mask = (UINT64_C(1) << (op_width * 8 - 1));
-			uint32_t next_eflags = eflags & ~(OF | SF | ZF | AF | PF | CF);
+			uint32_t next_eflags = 0;
 			uint64_t src_masked = src_value & mask, dest_masked = dest_value & mask;
 			int par = 0, i;
 			result_write = 1;
@@ -1186,15 +2075,20 @@ int step(void) {
 				print_regs(stderr);
 				return 0;
 			}
-			if (result64 & sign_mask) next_eflags |= SF;
-			if ((result64 & mask) == 0) next_eflags |= ZF;
-			if (result64 & (UINT64_C(1) << (op_width * 8))) next_eflags |= CF;
-			for (i = 0; i < 8; i++) {
-				if (result64 & (1 << i)) par++;
-			}
-			if (par % 2 == 0) next_eflags |= PF;
 			result = (uint32_t)result64;
-			eflags = next_eflags;
+			/* 後で読まれないフラグは求めない */
+			if (inst->live_flags != 0) {
+				if (result64 & sign_mask) next_eflags |= SF;
+				if ((result64 & mask) == 0) next_eflags |= ZF;
+				if (result64 & (UINT64_C(1) << (op_width * 8))) next_eflags |= CF;
+				if (inst->live_flags & PF) {
+					for (i = 0; i < 8; i++) {
+						if (result64 & (1 << i)) par++;
+					}
+					if (par % 2 == 0) next_eflags |= PF;
+				}
+				eflags = (eflags & ~inst->live_flags) | (next_eflags & inst->live_flags);
+			}
 		}
 		break;
 	case OP_SHIFT:
@@ -1279,10 +2173,12 @@ int step(void) {
 				if (carry) next_eflags |= CF; else next_eflags &= ~CF;
 				if (enable_result_flags) {
 					int i, par = 0;
-					for (i = 0; i < 8; i++) {
-						if ((result64 >> i) & 1) par++;
+					if (inst->live_flags & PF) {
+						for (i = 0; i < 8; i++) {
+							if ((result64 >> i) & 1) par++;
+						}
+						if (par % 2 == 0) next_eflags |= PF; else next_eflags &= ~PF;
 					}
-					if (par % 2 == 0) next_eflags |= PF; else next_eflags &= ~PF;
 					if ((result64 & value_mask) == 0) next_eflags |= ZF; else next_eflags &= ~ZF;
 					if (result64 & sign_mask) next_eflags |= SF; else next_eflags &= ~SF;
 				}
@@ -1364,13 +2260,22 @@ int step(void) {
 		{
 			uint32_t sign_mask = (UINT32_C(1) << (op_width * 8 - 1));
 			uint32_t next_eflags = eflags & ~(OF | SF | ZF | AF | PF);
+			int par = 0, i;
 			result = dest_value + imm_value;
 			result_write = 1;
-			if ((dest_value & sign_mask) == (src_value & sign_mask) &&
-			(result & sign_mask) != (dest_value & sign_mask)) next_eflags |= OF;
-			if (result & sign_mask) next_eflags |= SF;
-			if ((result & ((UINT64_C(1) << (op_width * 8)) - 1)) == 0) next_eflags |= ZF;
-			eflags = next_eflags;
+			if (inst->live_flags != 0) {
+				if ((dest_value & sign_mask) == (src_value & sign_mask) &&
+				(result & sign_mask) != (dest_value & sign_mask)) next_eflags |= OF;
+				if (result & sign_mask) next_eflags |= SF;
+				if ((result & ((UINT64_C(1) << (op_width * 8)) - 1)) == 0) next_eflags |= ZF;
+				if (inst->live_flags & PF) {
+					for (i = 0; i < 8; i++) {
+						if (result & (1 << i)) par++;
+					}
+					if (par % 2 == 0) next_eflags |= PF;
+				}
+				eflags = next_eflags;
+			}
 		}
 		break;
 	case OP_NOT:
@@ -1417,10 +2322,11 @@ int step(void) {
 				else if (op_width == 2) regs[EDX] = (regs[EDX] & UINT32_C(0xffff0000)) | (upper & 0xffff);
 				else regs[EDX] = upper;
 			}
+			/* 上位が下位の符号拡張になっていなければ、結果が収まっていない */
 			if ((upper & mask) == ((result & sign_mask) ? mask : 0)) {
-				eflags |= (OF | CF);
-			} else {
 				eflags &= ~(OF | CF);
+			} else {
+				eflags |= (OF | CF);
 			}
 		}
 		break;
@@ -1538,6 +2444,26 @@ int step(void) {
 			int zero = 0;
 			uint32_t delta = (eflags & DF) ? -op_width : op_width;
 			if (op_string_kind == OP_STR_LOD) result_write = 1;
+			if ((op_string_kind == OP_STR_IN || op_string_kind == OP_STR_OUT) && !use_port_io) {
+				NOT_IMPLEMENTED(OP_STRING)
+			}
+			/* rep outsbは、連続したバイトをまとめてデバイスに渡す */
+			if (op_string_kind == OP_STR_OUT && is_rep && op_width == 1 && !is_addr_16bit && !(eflags & DF)) {
+				uint8_t buffer[4096];
+				while (regs[ECX] != 0) {
+					uint32_t size = regs[ECX] < sizeof(buffer) ? regs[ECX] : (uint32_t)sizeof(buffer);
+					uint32_t addr = segment_offsets[DS] + regs[ESI];
+					/* 読めない場合は、1バイトずつの処理でエラーを報告させる */
+					if (UINT32_MAX - addr < size - 1 || !dmemory_is_allocated(addr, size)) break;
+					dmemory_read(buffer, addr, size);
+					regs[ESI] += size;
+					regs[ECX] -= size;
+					if (!step_port_done(port_io_write_block(regs[EDX] & 0xffff, buffer, size), inst_addr)) return 0;
+				}
+				if (regs[ECX] == 0) break;
+			}
+			/* ECXが0のREPは何もしない (フラグも変えない) */
+			if (is_rep && (is_addr_16bit ? regs[ECX] & 0xffff : regs[ECX]) == 0) break;
 			do {
 				uint32_t esi_addr = is_addr_16bit ? regs[ESI] & 0xffff : regs[ESI];
 				uint32_t edi_addr = is_addr_16bit ? regs[EDI] & 0xffff : regs[EDI];
@@ -1566,12 +2492,15 @@ int step(void) {
 					d = step_memread(&memread_ok, inst_addr, ES, edi_addr, op_width);
 					if (!memread_ok) return 0;
 					break;
-				/*
 				case OP_STR_IN:
+					if (!step_port_done(port_io_read(regs[EDX] & 0xffff, op_width, &s), inst_addr)) return 0;
+					if (!step_memwrite(inst_addr, ES, edi_addr, s, op_width)) return 0;
 					break;
 				case OP_STR_OUT:
+					s = step_memread(&memread_ok, inst_addr, DS, esi_addr, op_width);
+					if (!memread_ok) return 0;
+					if (!step_port_done(port_io_write(regs[EDX] & 0xffff, op_width, s), inst_addr)) return 0;
 					break;
-				*/
 				default:
 					fprintf(stderr, "unknown string operation %d at %08"PRIx32"\n", (int)op_string_kind, inst_addr);
 					print_regs(stderr);
@@ -1586,11 +2515,14 @@ int step(void) {
 					if (res & sign_mask) next_eflags |= SF;
 					if ((res & ((UINT64_C(1) << (op_width * 8)) - 1)) == 0) next_eflags |= ZF;
 					if (res & (UINT64_C(1) << (op_width * 8))) next_eflags |= CF;
-					par = 0;
-					for (i = 0; i < 8; i++) {
-						if (res & (1 << i)) par++;
+					/* REPの繰り返しの判定にはZFだけを使うので、PFは後で読まれる時だけ求める */
+					if (inst->live_flags & PF) {
+						par = 0;
+						for (i = 0; i < 8; i++) {
+							if (res & (1 << i)) par++;
+						}
+						if (par % 2 == 0) next_eflags |= PF;
 					}
-					if (par % 2 == 0) next_eflags |= PF;
 					new_eflags = next_eflags;
 					zero = (new_eflags & ZF);
 				}
@@ -1618,6 +2550,7 @@ int step(void) {
 		break;
 	case OP_CALL:
 		if (!step_push(inst_addr, eip, op_width, is_addr_16bit)) return 0;
+		block_cache_push_return(block, eip, regs[ESP]);
 		eip += src_value;
 		if (is_data_16bit) eip &= 0xffff;
 		break;
@@ -1626,6 +2559,7 @@ int step(void) {
 		break;
 	case OP_CALL_ABSOLUTE:
 		if (!step_push(inst_addr, eip, op_width, is_addr_16bit)) return 0;
+		block_cache_push_return(block, eip, regs[ESP]);
 		eip = src_value;
 		if (is_data_16bit) eip &= 0xffff;
 		break;
@@ -1658,15 +2592,23 @@ int step(void) {
 		result_write = 1;
 		break;
 	case OP_SAHF:
-		NOT_IMPLEMENTED(OP_SAHF)
+		eflags = (eflags & ~(SF | ZF | AF | PF | CF)) | ((regs[EAX] >> 8) & (SF | ZF | AF | PF | CF));
 		break;
 	case OP_LAHF:
-		NOT_IMPLEMENTED(OP_LAHF)
+		regs[EAX] = (regs[EAX] & UINT32_C(0xffff00ff)) | (((eflags & (SF | ZF | AF | PF | CF)) | 0x02) << 8);
 		break;
 	case OP_RETN:
 		{
-			uint32_t next_eip = step_pop(&memread_ok, inst_addr, is_data_16bit ? 2 : 4, is_addr_16bit);
+			uint32_t next_eip;
+			ret_esp = regs[ESP];
+			next_eip = step_pop(&memread_ok, inst_addr, is_data_16bit ? 2 : 4, is_addr_16bit);
 			if (!memread_ok) return 0;
+			/* RET imm16は、戻りアドレスの後の引数を消す */
+			if (is_addr_16bit) {
+				regs[ESP] = (regs[ESP] & UINT32_C(0xffff0000)) | ((regs[ESP] + (imm_value & 0xffff)) & 0xffff);
+			} else {
+				regs[ESP] += imm_value & 0xffff;
+			}
 			eip = next_eip;
 		}
 		break;
@@ -1690,7 +2632,23 @@ int step(void) {
 	case OP_INT:
 		if (use_xv6_syscall && src_value == 0x40) {
 			int sysret = xv6_syscall(regs);
-			if (sysret == 0) return 0;
+			if (sysret == 0) {
+				/* xv6のexitには終了ステータスが無い */
+				guest_exited = 1;
+				guest_exit_status = 0;
+				return 0;
+			}
+			else if (sysret < 0) {
+				print_regs(stderr);
+				return 0;
+			}
+		} else if (use_linux_syscall && (src_value & 0xff) == 0x80) { /* 即値は符号拡張されている */
+			int sysret = linux_syscall(regs);
+			if (sysret == 0) {
+				guest_exited = 1;
+				guest_exit_status = linux_syscall_exit_status();
+				return 0;
+			}
 			else if (sysret < 0) {
 				print_regs(stderr);
 				return 0;
@@ -1708,13 +2666,22 @@ int step(void) {
 	case OP_LOOP:
 		result = src_value - 1;
 		result_write = 1;
-		if (jmp_take && src_value != 1) eip += src_value;
+		if (jmp_take && src_value != 1) eip += imm_value;
 		break;
 	case OP_IN:
-		NOT_IMPLEMENTED(OP_IN)
+		if (!use_port_io) {
+			NOT_IMPLEMENTED(OP_IN)
+		}
+		if (!step_port_done(port_io_read(src_kind == OP_KIND_IMM ? imm_value & 0xff : regs[EDX] & 0xffff,
+		op_width, &result), inst_addr)) return 0;
+		result_write = 1;
 		break;
 	case OP_OUT:
-		NOT_IMPLEMENTED(OP_OUT)
+		if (!use_port_io) {
+			NOT_IMPLEMENTED(OP_OUT)
+		}
+		if (!step_port_done(port_io_write(dest_kind == OP_KIND_IMM ? imm_value & 0xff : regs[EDX] & 0xffff,
+		op_width, src_value), inst_addr)) return 0;
 		break;
 	case OP_HLT:
 		NOT_IMPLEMENTED(OP_HLT)
@@ -1729,7 +2696,77 @@ int step(void) {
 		eflags &= ~imm_value;
 		break;
 	case OP_FPU:
-		/* 無視(無視しない命令はデコード時に弾いているので) */
+		if (dest_kind == OP_KIND_MEM) {
+			uint8_t fpu_data[X87_MEM_OPERAND_MAX];
+			int is_store = 0;
+			int size = x87_mem_operand_size(op_fpu_kind, op_fpu_reg, is_data_16bit, &is_store);
+			if (size == 0) {
+				fprintf(stderr, "FPU operation %02X /%d is unimplemented at %08"PRIx32"\n",
+					0xD8 + op_fpu_kind, op_fpu_reg, inst_addr);
+				print_regs(stderr);
+				return 0;
+			}
+			if (!is_store && !step_memread_bytes(inst_addr, data_segment, dest_addr, fpu_data, size)) return 0;
+			x87_execute_mem(op_fpu_kind, op_fpu_reg, fpu_data);
+			if (is_store && !step_memwrite_bytes(inst_addr, data_segment, dest_addr, fpu_data, size)) return 0;
+		} else if (!x87_execute_reg(op_fpu_kind, op_fpu_reg, op_fpu_rm, &regs[EAX], &eflags)) {
+			fprintf(stderr, "FPU operation %02X %02X is unimplemented at %08"PRIx32"\n",
+				0xD8 + op_fpu_kind, 0xC0 | (op_fpu_reg << 3) | op_fpu_rm, inst_addr);
+			print_regs(stderr);
+			return 0;
+		}
+		break;
+	case OP_SSE:
+		{
+			uint8_t sse_data[16];
+			uint8_t* mem = dest_kind == OP_KIND_MEM ? sse_data : NULL;
+			sse_inst op_sse = inst->op_sse;
+			op_sse.imm = (uint8_t)imm_value;
+			if (mem != NULL && !op_sse.is_store &&
+			!step_memread_bytes(inst_addr, data_segment, dest_addr, sse_data, op_sse.mem_size)) return 0;
+			sse_execute(&op_sse, mem, regs, &eflags);
+			if (mem != NULL && op_sse.is_store &&
+			!step_memwrite_bytes(inst_addr, data_segment, dest_addr, sse_data, op_sse.mem_size)) return 0;
+		}
+		break;
+	case OP_RDTSC:
+		{
+			uint64_t tsc = use_host_tsc ? read_host_tsc() : instructions_retired;
+			regs[EAX] = (uint32_t)tsc;
+			regs[EDX] = (uint32_t)(tsc >> 32);
+		}
+		break;
+	case OP_CPUID:
+		step_cpuid();
+		break;
+	case OP_BIT_TEST:
+		{
+			uint32_t mask = UINT32_C(1) << (src_value & (op_width * 8 - 1));
+			if (dest_value & mask) eflags |= CF; else eflags &= ~CF;
+			switch (op_bit_kind) {
+			case OP_BTS: result = dest_value | mask; result_write = 1; break;
+			case OP_BTR: result = dest_value & ~mask; result_write = 1; break;
+			case OP_BTC: result = dest_value ^ mask; result_write = 1; break;
+			default: break;
+			}
+		}
+		break;
+	case OP_BIT_SCAN:
+		{
+			/* 0の時はdestを変えずにZFを立てる */
+			uint32_t value = src_value & (op_width == 2 ? UINT32_C(0xffff) : UINT32_C(0xffffffff));
+			if (value == 0) {
+				eflags |= ZF;
+			} else {
+				eflags &= ~ZF;
+				result = op_bit_kind == OP_BSF ? bit_scan_forward(value) : bit_scan_reverse(value);
+				result_write = 1;
+			}
+		}
+		break;
+	case OP_BSWAP:
+		result = byte_swap32(src_value);
+		result_write = 1;
 		break;
 	default:
 		fprintf(stderr, "unknown operation kind %d at %08"PRIx32"\n", (int)op_kind, inst_addr);
@@ -1764,9 +2801,34 @@ int step(void) {
 		}
 	}
 
-	/* フラグIDを0に固定し、CPUID命令が無いことを示す */
-	eflags &= ~UINT32_C(0x00200000);
+	/* 80386として動く時はフラグIDを0に固定し、CPUID命令が無いことを示す */
+	if (strict_mode) eflags &= ~UINT32_C(0x00200000);
+
+	/* ESPより上のスタックは、システムコールなどからも読み書きできるよう割り当てておく */
+	if (regs[ESP] < stack_commit_bottom) grow_stack(regs[ESP]);
+
+	instructions_retired++;
 
+	switch (op_kind) {
+	case OP_CALL: case OP_JUMP: case OP_CALL_ABSOLUTE: case OP_JUMP_ABSOLUTE:
+	case OP_RETN: case OP_LOOP:
+		/* 分岐命令の次に実行するブロックをカバレッジに記録する */
+		if (enable_coverage) coverage_record_block(eip);
+		/* 分岐先がスタブや置き換えた関数なら、続けて実行する */
+		if (!dispatch_branch_target()) return 0;
+		break;
+	default:
+		break;
+	}
+
+	/* ブロックを実行し終えたら、次のブロックを戻り先の予測か分岐先の表から探しておく */
+	if (current_index >= block->inst_num) {
+		x86_block* next = NULL;
+		if (op_kind == OP_RETN) next = block_cache_pop_return(eip, ret_esp);
+		if (next == NULL) next = block_cache_follow(block, eip);
+		current_block = next;
+		current_index = 0;
+	}
 	return 1;
 }
 
@@ -1807,28 +2869,563 @@ int str_to_uint32(uint32_t* out, const char* str) {
 	return 1;
 }
 
+/* レジスタとシステムコール・ライブラリの状態 (メモリ以外) を書き出す */
+static void save_machine_state(checkpoint_writer* writer) {
+	int i;
+	for (i = 0; i < 8; i++) checkpoint_put_uint(writer, regs[i]);
+	checkpoint_put_uint(writer, eip);
+	checkpoint_put_uint(writer, eflags);
+	for (i = 0; i < 6; i++) checkpoint_put_uint(writer, segment_offsets[i]);
+	checkpoint_put_uint(writer, stack_top);
+	checkpoint_put_uint(writer, stack_reserve_bottom);
+	checkpoint_put_uint(writer, stack_commit_bottom);
+	checkpoint_put_uint(writer, strict_mode);
+	checkpoint_put_uint(writer, (uint32_t)instructions_retired);
+	checkpoint_put_uint(writer, (uint32_t)(instructions_retired >> 32));
+	checkpoint_put_uint(writer, use_host_tsc);
+	checkpoint_put_uint(writer, cpuid_features_edx);
+	checkpoint_put_uint(writer, cpuid_features_ecx);
+	x87_save_state(writer);
+	sse_save_state(writer);
+	checkpoint_put_uint(writer, use_xv6_syscall);
+	checkpoint_put_uint(writer, use_pe_import);
+	checkpoint_put_uint(writer, use_linux_syscall);
+	checkpoint_put_uint(writer, use_port_io);
+	checkpoint_put_uint(writer, use_native_libc);
+	checkpoint_put_uint(writer, import_params.image_base);
+	checkpoint_put_uint(writer, import_params.import_addr);
+	checkpoint_put_uint(writer, import_params.import_size);
+	checkpoint_put_uint(writer, import_params.iat_addr);
+	checkpoint_put_uint(writer, import_params.iat_size);
+	if (use_xv6_syscall) xv6_syscall_save_state(writer);
+	if (use_pe_import) pe_import_save_state(writer);
+	if (use_linux_syscall) linux_syscall_save_state(writer);
+	if (use_port_io) port_io_save_state(writer);
+	if (use_native_libc) native_libc_save_state(writer);
+	checkpoint_put_uint(writer, use_plugins);
+	if (use_plugins) plugin_save_state(writer);
+}
+
+static int load_machine_state(checkpoint_reader* reader) {
+	uint32_t prev_cs_offset = segment_offsets[CS];
+	int prev_strict_mode = strict_mode;
+	int i;
+	for (i = 0; i < 8; i++) regs[i] = checkpoint_get_uint(reader);
+	eip = checkpoint_get_uint(reader);
+	eflags = checkpoint_get_uint(reader);
+	for (i = 0; i < 6; i++) segment_offsets[i] = checkpoint_get_uint(reader);
+	stack_top = checkpoint_get_uint(reader);
+	stack_reserve_bottom = checkpoint_get_uint(reader);
+	stack_commit_bottom = checkpoint_get_uint(reader);
+	strict_mode = checkpoint_get_uint(reader);
+	instructions_retired = checkpoint_get_uint(reader);
+	instructions_retired |= (uint64_t)checkpoint_get_uint(reader) << 32;
+	use_host_tsc = checkpoint_get_uint(reader);
+	cpuid_features_edx = checkpoint_get_uint(reader);
+	cpuid_features_ecx = checkpoint_get_uint(reader);
+	if (!reader->error && !x87_load_state(reader)) reader->error = 1;
+	if (!reader->error && !sse_load_state(reader)) reader->error = 1;
+	use_xv6_syscall = checkpoint_get_uint(reader);
+	use_pe_import = checkpoint_get_uint(reader);
+	use_linux_syscall = checkpoint_get_uint(reader);
+	use_port_io = checkpoint_get_uint(reader);
+	use_native_libc = checkpoint_get_uint(reader);
+	import_params.image_base = checkpoint_get_uint(reader);
+	import_params.import_addr = checkpoint_get_uint(reader);
+	import_params.import_size = checkpoint_get_uint(reader);
+	import_params.iat_addr = checkpoint_get_uint(reader);
+	import_params.iat_size = checkpoint_get_uint(reader);
+	if (!reader->error && use_xv6_syscall && !xv6_syscall_load_state(reader)) reader->error = 1;
+	if (!reader->error && use_pe_import && !pe_import_load_state(reader)) reader->error = 1;
+	if (!reader->error && use_linux_syscall && !linux_syscall_load_state(reader)) reader->error = 1;
+	if (!reader->error && use_port_io && !port_io_load_state(reader)) reader->error = 1;
+	if (!reader->error && use_native_libc && !native_libc_load_state(reader)) reader->error = 1;
+	/* ハンドラは保存していないので、同じプラグインを読み込んでおく必要がある */
+	if (!reader->error && checkpoint_get_uint(reader) != 0) {
+		if (!use_plugins) {
+			fprintf(stderr, "checkpoint needs the plugins given with --plugin\n");
+			reader->error = 1;
+		} else if (!plugin_load_state(reader)) {
+			reader->error = 1;
+		}
+	}
+	/* デコードの結果はCSのベースとstrict_modeに依る (メモリの書き換えはdmemoryから通知される) */
+	if (segment_offsets[CS] != prev_cs_offset || strict_mode != prev_strict_mode) block_cache_flush();
+	return !reader->error;
+}
+
+static int save_checkpoint(const char* filename) {
+	checkpoint_writer writer;
+	int ok;
+	checkpoint_writer_init(&writer);
+	save_machine_state(&writer);
+	ok = checkpoint_save(filename, &writer);
+	checkpoint_writer_free(&writer);
+	return ok;
+}
+
+static void hash_page(void* ctx, uint32_t addr, const uint8_t* data) {
+	uint64_t* hash = ctx;
+	uint32_t i;
+	for (i = 0; i < 4; i++) *hash = (*hash ^ ((addr >> (i * 8)) & 0xff)) * UINT64_C(0x100000001b3);
+	for (i = 0; i < DMEMORY_PAGE_SIZE; i++) *hash = (*hash ^ data[i]) * UINT64_C(0x100000001b3);
+}
+
+/*
+読み込んだイメージ (またはチェックポイント) のページの内容から、ブロックのファイルを決めて読み込む。
+デコードの結果に影響する設定もキーに含める。
+*/
+/* 実行中のインタプリタのファイルのハッシュをビルドIDとする (最初の1回だけ求める) */
+static int init_block_cache_build_id(void) {
+	file_image image;
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	size_t i;
+	if (block_cache_build_id[0] != '\0') return 1;
+	if (!open_file_image(&image, "/proc/self/exe")) return 0;
+	for (i = 0; i < image.size; i++) hash = (hash ^ image.data[i]) * UINT64_C(0x100000001b3);
+	close_file_image(&image);
+	sprintf(block_cache_build_id, "%016"PRIx64, hash);
+	return 1;
+}
+
+static int open_block_cache(void) {
+	uint64_t key = UINT64_C(0xcbf29ce484222325);
+	if (block_cache_dir == NULL) return 1;
+	if (!init_block_cache_build_id()) {
+		fprintf(stderr, "warning: cannot identify the interpreter binary, --block-cache ignored\n");
+		block_cache_dir = NULL;
+		return 1;
+	}
+	dmemory_for_each_page(hash_page, &key);
+	key = (key ^ (uint32_t)strict_mode) * UINT64_C(0x100000001b3);
+	key = (key ^ segment_offsets[CS]) * UINT64_C(0x100000001b3);
+	/* トレースする時はフラグの解析をしないので、ブロックの内容が違う */
+	key = (key ^ (uint32_t)enable_trace) * UINT64_C(0x100000001b3);
+	free(block_cache_path);
+	block_cache_path = malloc(strlen(block_cache_dir) + 32);
+	if (block_cache_path == NULL) {
+		perror("malloc");
+		return 0;
+	}
+	sprintf(block_cache_path, "%s/%016"PRIx64".x86blk", block_cache_dir, key);
+	block_cache_key = key;
+	block_cache_load_file(block_cache_path, block_cache_key, block_cache_build_id);
+	return 1;
+}
+
+static int load_checkpoint(const char* filename) {
+	checkpoint_reader reader;
+	if (!checkpoint_load(&reader, filename)) return 0;
+	if (!load_machine_state(&reader)) {
+		fprintf(stderr, "failed to restore state from checkpoint\n");
+		return 0;
+	}
+	return open_block_cache();
+}
+
+/*
+プロセス内で繰り返し実行するためのマシン全体のスナップショット。
+メモリはコピーオンライトで共有し、戻す時はスナップショット以降に書き込まれたページだけを復元する。
+*/
+typedef struct {
+	dmemory_snapshot* memory;
+	checkpoint_writer state;
+} machine_snapshot;
+
+static machine_snapshot* machine_take_snapshot(void) {
+	machine_snapshot* snapshot = malloc(sizeof(*snapshot));
+	if (snapshot == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	checkpoint_writer_init(&snapshot->state);
+	save_machine_state(&snapshot->state);
+	if (snapshot->state.error) {
+		checkpoint_writer_free(&snapshot->state);
+		free(snapshot);
+		return NULL;
+	}
+	snapshot->memory = dmemory_take_snapshot();
+	return snapshot;
+}
+
+static int machine_reset_to_snapshot(const machine_snapshot* snapshot) {
+	checkpoint_reader reader;
+	reader.data = snapshot->state.data;
+	reader.size = snapshot->state.size;
+	reader.pos = 0;
+	reader.error = 0;
+	dmemory_restore_snapshot(snapshot->memory);
+	if (!load_machine_state(&reader)) {
+		fprintf(stderr, "failed to restore state from snapshot\n");
+		return 0;
+	}
+	guest_exited = 0;
+	guest_exit_status = 0;
+	return 1;
+}
+
+static void machine_free_snapshot(machine_snapshot* snapshot) {
+	if (snapshot == NULL) return;
+	dmemory_free_snapshot(snapshot->memory);
+	checkpoint_writer_free(&snapshot->state);
+	free(snapshot);
+}
+
+/* ゲストを実行し、終了した時はその終了ステータスを、エラーで止まった時は-1を返す */
+static int run_guest(void) {
+	uint32_t slice_count = 0;
+	if (enable_trace) {
+		print_regs(stdout);
+		putchar('\n');
+	}
+	for (;;) {
+		if (save_checkpoint_path != NULL && (!use_checkpoint_eip || eip == checkpoint_eip)) {
+			if (!save_checkpoint(save_checkpoint_path)) return -1;
+			save_checkpoint_path = NULL;
+		}
+		if (!step()) break;
+		if (use_xv6_syscall && ++slice_count >= XV6_TIME_SLICE) {
+			slice_count = 0;
+			xv6_yield();
+		}
+		if (enable_trace) {
+			print_regs(stdout);
+			putchar('\n');
+		}
+	}
+	/* 保存できなくても、ゲストの実行には影響しない */
+	if (block_cache_path != NULL) block_cache_save_file(block_cache_path, block_cache_key, block_cache_build_id);
+	return guest_exited ? (int)(guest_exit_status & 0xff) : -1;
+}
+
+/*
+Linuxのプロセス開始時のスタックを作る。
+ESPの位置から argc, argv[], NULL, envp[] (空), NULL, auxv[] の順に並べ、文字列はその上に置く。
+*/
+static int setup_linux_stack(uint32_t argc2, char** argv2) {
+	static const uint8_t random_bytes[16] = {
+		0x3c, 0x91, 0x5e, 0x07, 0xa2, 0x6b, 0xd4, 0x18, 0xf9, 0x40, 0x8d, 0x33, 0xc6, 0x72, 0x1f, 0xeb
+	};
+	uint32_t auxv[] = {
+		6, DMEMORY_PAGE_SIZE, /* AT_PAGESZ */
+		9, initial_eip, /* AT_ENTRY */
+		25, 0, /* AT_RANDOM */
+		0, 0 /* AT_NULL */
+	};
+	uint32_t current_addr = initial_esp;
+	uint32_t* arg_addrs;
+	uint32_t table_words, j;
+	if (argc2 >= (UINT32_MAX / 4 - 16) / 2) {
+		fprintf(stderr, "too many arguments\n");
+		return 0;
+	}
+	arg_addrs = malloc(sizeof(*arg_addrs) * (argc2 + 1));
+	if (arg_addrs == NULL) {
+		perror("malloc");
+		return 0;
+	}
+	/* 引数の文字列とAT_RANDOMのデータを書き込む */
+	for (j = 0; j < argc2; j++) {
+		size_t alen = strlen(argv2[j]);
+		if (current_addr - stack_reserve_bottom <= alen) {
+			fprintf(stderr, "stack too small to hold argv[%"PRIu32"]\n", j);
+			free(arg_addrs);
+			return 0;
+		}
+		current_addr -= alen + 1;
+		grow_stack(current_addr);
+		dmemory_write(argv2[j], current_addr, alen + 1);
+		arg_addrs[j] = current_addr;
+	}
+	arg_addrs[argc2] = 0;
+	table_words = 1 + (argc2 + 1) + 1 + sizeof(auxv) / sizeof(*auxv);
+	if (current_addr - stack_reserve_bottom < sizeof(random_bytes) + 4 * table_words + 16) {
+		fprintf(stderr, "stack too small to hold arguments\n");
+		free(arg_addrs);
+		return 0;
+	}
+	current_addr -= sizeof(random_bytes);
+	grow_stack(current_addr);
+	dmemory_write((void*)random_bytes, current_addr, sizeof(random_bytes));
+	auxv[5] = current_addr;
+	/* 表を16バイト境界に揃えて書き込む */
+	current_addr = (current_addr - 4 * table_words) & ~UINT32_C(15);
+	grow_stack(current_addr);
+	dmem_write_uint(current_addr, argc2, 4);
+	for (j = 0; j <= argc2; j++) dmem_write_uint(current_addr + 4 * (1 + j), arg_addrs[j], 4);
+	dmem_write_uint(current_addr + 4 * (argc2 + 2), 0, 4);
+	for (j = 0; j < sizeof(auxv) / sizeof(*auxv); j++) {
+		dmem_write_uint(current_addr + 4 * (argc2 + 3 + j), auxv[j], 4);
+	}
+	free(arg_addrs);
+	regs[ESP] = current_addr;
+	return 1;
+}
+
+/*
+スタックを予約してargvを積み、entryから実行を開始する状態にする。
+argvの配列のアドレスを*argv_addr_outに格納する。
+*/
+static int setup_stack(uint32_t entry, int enable_args, uint32_t argc2, char** argv2, uint32_t* argv_addr_out) {
+	uint32_t argv_addr = 0, j;
+	if (stack_size > initial_esp) {
+		fprintf(stderr, "stack too big compared to esp\n");
+		return 0;
+	}
+
+	if (stack_limit < stack_size) stack_limit = stack_size;
+	if (stack_limit > initial_esp) stack_limit = initial_esp;
+
+	for (j = 0; j < 8; j++) regs[j] = 0;
+	eip = entry;
+	eflags = UINT32_C(0x00000002);
+	regs[ESP] = initial_esp;
+	stack_top = stack_commit_bottom = initial_esp;
+	stack_reserve_bottom = initial_esp - stack_limit;
+	grow_stack(initial_esp - stack_size);
+	if (use_linux_syscall) {
+		if (!setup_linux_stack(enable_args ? argc2 : 0, argv2)) return 0;
+	} else if (enable_args) {
+		uint32_t current_addr = initial_esp;
+		uint32_t num_buffer = 0;
+		/* argvが指す配列の領域を確保する */
+		if (argc2 == UINT32_MAX || UINT32_MAX / 4 < (argc2 + 1)) {
+			fprintf(stderr, "too many arguments\n");
+			return 0;
+		}
+		if (current_addr - stack_reserve_bottom < 4 * (argc2 + 1)) {
+			fprintf(stderr, "stack too small to hold argv table\n");
+			return 0;
+		}
+		current_addr -= 4 * (argc2 + 1);
+		argv_addr = current_addr;
+		*argv_addr_out = argv_addr;
+		grow_stack(current_addr);
+		/* 引数の文字列とargvが指す配列の値を書き込む */
+		for (j = 0; j < argc2; j++) {
+			uint32_t stack_left = current_addr - stack_reserve_bottom;
+			size_t alen = strlen(argv2[j]);
+			if (stack_left == 0 || stack_left - 1 < alen) {
+				fprintf(stderr, "stack too small to hold argv[%"PRIu32"]\n", j);
+				return 0;
+			}
+			current_addr -= alen + 1;
+			grow_stack(current_addr);
+			dmemory_write(argv2[j], current_addr, alen + 1);
+			dmemory_write(&current_addr, argv_addr + j * 4, sizeof(current_addr));
+		}
+		dmemory_write(&num_buffer, argv_addr + argc2 * 4, sizeof(num_buffer));
+		if (current_addr - stack_reserve_bottom < 12) {
+			fprintf(stderr, "stack too small to hold arguments\n");
+			return 0;
+		}
+		/* main関数に渡す引数とダミーのリターンアドレスを書き込む */
+		current_addr -= 12;
+		grow_stack(current_addr);
+		dmemory_write(&argv_addr, current_addr + 8, sizeof(argv_addr));
+		dmemory_write(&argc2, current_addr + 4, sizeof(argc2));
+		num_buffer = UINT32_C(0xfffffff0);
+		dmemory_write(&num_buffer, current_addr, sizeof(num_buffer));
+		regs[ESP] = current_addr;
+	}
+	return 1;
+}
+
+/* ゲストのプログラムを現在のアドレス空間に読み込み直す (xv6のexec) */
+int x86_cpu_exec(const char* filename, uint32_t argc, char** argv) {
+	uint32_t entry = 0, argv_addr = 0;
+	if (!read_elf(&entry, filename)) return 0;
+	if (use_native_libc && !native_libc_attach(filename)) return 0;
+	if (use_plugins && !plugin_attach(filename)) return 0;
+	x87_initialize();
+	sse_initialize();
+	return setup_stack(entry, 1, argc, argv, &argv_addr);
+}
+
+void x86_cpu_save(x86_cpu_state* state) {
+	memcpy(state->regs, regs, sizeof(state->regs));
+	state->eip = eip;
+	state->eflags = eflags;
+	memcpy(state->segment_offsets, segment_offsets, sizeof(state->segment_offsets));
+	state->stack_top = stack_top;
+	state->stack_reserve_bottom = stack_reserve_bottom;
+	state->stack_commit_bottom = stack_commit_bottom;
+	x87_save(&state->fpu);
+	sse_save(&state->sse);
+	native_libc_save(&state->native_libc);
+	state->plugin_image = plugin_current_image();
+}
+
+void x86_cpu_load(const x86_cpu_state* state) {
+	memcpy(regs, state->regs, sizeof(regs));
+	eip = state->eip;
+	eflags = state->eflags;
+	memcpy(segment_offsets, state->segment_offsets, sizeof(segment_offsets));
+	stack_top = state->stack_top;
+	stack_reserve_bottom = state->stack_reserve_bottom;
+	stack_commit_bottom = state->stack_commit_bottom;
+	x87_load(&state->fpu);
+	sse_load(&state->sse);
+	native_libc_load(&state->native_libc);
+	plugin_select_image(state->plugin_image);
+}
+
+static int setup_guest(int enable_args, uint32_t argc2, char** argv2) {
+	uint32_t argv_addr = 0;
+	if (!setup_stack(initial_eip, enable_args, argc2, argv2, &argv_addr)) return -1;
+	x87_initialize();
+	sse_initialize();
+	if (!enable_args) argc2 = 0;
+	if (import_as_iat) {
+		import_params.iat_addr = import_params.import_addr;
+		import_params.iat_size = import_params.import_size;
+	}
+	if (use_xv6_syscall) {
+		if (!initialize_xv6_syscall(xv6_syscall_work)) return -1;
+	}
+	if (use_linux_syscall) {
+		uint32_t guard_bottom = stack_reserve_bottom < STACK_GUARD_SIZE ? 0 : stack_reserve_bottom - STACK_GUARD_SIZE;
+		if (!initialize_linux_syscall(linux_brk_origin, guard_bottom)) return -1;
+	}
+	if (use_port_io) {
+		if (!port_io_initialize()) return -1;
+	}
+	if (use_pe_import) {
+		if (!pe_import_initialize(&import_params, pe_import_work, argc2, argv_addr)) return -1;
+	}
+	if (enable_fs) {
+		if (UINT32_MAX - 0x1000  + 1 < fs_addr) {
+			fprintf(stderr, "FS buffer address too high!\n");
+			return -1;
+		}
+		segment_offsets[FS] = fs_addr;
+		dmemory_allocate(fs_addr, 0x1000);
+		dmem_write_uint(fs_addr + 0x004, initial_esp, 4);
+		dmem_write_uint(fs_addr + 0x008, initial_esp - stack_size, 4);
+		dmem_write_uint(fs_addr + 0x018, fs_addr, 4);
+	}
+	return 0;
+}
+
+/* ゲストを準備して実行する。返り値はrun_guestと同じ */
+static int start_guest(int enable_args, uint32_t argc2, char** argv2) {
+	if (setup_guest(enable_args, argc2, argv2) < 0) return -1;
+	return run_guest();
+}
+
+/*
+ゲストを起動してfuzz_eipまで実行した状態を保存し、リストの各ファイルを標準入力として
+同じ状態から繰り返し実行する。実行のたびに書き込まれたページとライブラリの状態だけを戻す。
+*/
+static int run_fuzz_inputs(const char* list_path, int use_fuzz_eip, uint32_t fuzz_eip,
+int enable_args, uint32_t argc2, char** argv2) {
+	FILE* list;
+	char line[4096];
+	machine_snapshot* snapshot;
+	uint32_t input_cnt = 0, line_no = 0;
+	int error = 0, saved_loop_idiom;
+	if (setup_guest(enable_args, argc2, argv2) < 0) return 1;
+	/* ループの途中のfuzz_eipでも止まれるよう、ループをまとめない */
+	saved_loop_idiom = enable_loop_idiom;
+	if (use_fuzz_eip) enable_loop_idiom = 0;
+	while (use_fuzz_eip && eip != fuzz_eip) {
+		if (!step()) {
+			fprintf(stderr, "guest stopped before reaching %08"PRIx32"\n", fuzz_eip);
+			return 1;
+		}
+	}
+	enable_loop_idiom = saved_loop_idiom;
+	list = fopen(list_path, "r");
+	if (list == NULL) {
+		fprintf(stderr, "failed to open input list %s\n", list_path);
+		return 1;
+	}
+	snapshot = machine_take_snapshot();
+	if (snapshot == NULL) {
+		fclose(list);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), list) != NULL) {
+		size_t len = strlen(line);
+		uint32_t new_edges = 0, dirty_pages;
+		int status;
+		line_no++;
+		if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+		else if (!feof(list)) {
+			fprintf(stderr, "%s:%"PRIu32": line too long\n", list_path, line_no);
+			error = 1;
+			break;
+		}
+		if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+		if (len == 0 || line[0] == '#') continue;
+		if (freopen(line, "rb", stdin) == NULL) {
+			fprintf(stderr, "failed to open input %s\n", line);
+			error = 1;
+			break;
+		}
+		if (enable_coverage) coverage_begin_run();
+		status = run_guest();
+		if (enable_coverage) new_edges = coverage_end_run();
+		dirty_pages = dmemory_dirty_page_count();
+		fflush(stdout);
+		fprintf(stderr, "input %"PRIu32" (%s): %s, %"PRIu32" new edges, %"PRIu32" dirty pages\n",
+			input_cnt, line, status >= 0 ? "exit" : "stop", new_edges, dirty_pages);
+		input_cnt++;
+		if (!machine_reset_to_snapshot(snapshot)) {
+			error = 1;
+			break;
+		}
+	}
+	fclose(list);
+	machine_free_snapshot(snapshot);
+	return error;
+}
+
+/* ゲストの終了ステータスを返す (準備できなかった時やエラーで止まった時は2) */
+static int run_batch_job(const batch_job* job) {
+	int ret = start_guest(job->argc > 0, job->argc, job->argv);
+	return ret < 0 ? 2 : ret;
+}
+
+static machine_snapshot* server_snapshot = NULL;
+
+/* run_batch_jobと同じく、ゲストの終了ステータスを返す */
+static int run_checkpoint_job(const batch_job* job) {
+	int ret;
+	/* 引数などはチェックポイントに含まれている */
+	if (job->argc > 0) {
+		fprintf(stderr, "arguments cannot be given to a guest started from a checkpoint\n");
+		return 2;
+	}
+	/* 開いているファイルを開き直し、ファイル位置を他の要求と共有しないようにする */
+	if (!machine_reset_to_snapshot(server_snapshot)) return 2;
+	ret = run_guest();
+	return ret < 0 ? 2 : ret;
+}
+
 int main(int argc, char *argv[]) {
 	int i;
-	int enable_trace = 0;
 	int enable_args = 0;
-	int import_as_iat = 0;
-	int enable_fs = 0;
-	uint32_t initial_eip = 0;
-	uint32_t initial_esp = UINT32_C(0xfffff000);
-	uint32_t stack_size = 4096;
-	uint32_t xv6_syscall_work = UINT32_C(0x80000000);
-	uint32_t pe_import_work = UINT32_C(0x80000000);
-	uint32_t fs_addr = UINT32_C(0x7ffff000);
-	uint32_t argc2 = 0, argv_addr = 0;
+	const char* batch_manifest = NULL;
+	const char* server_path = NULL;
+	uint32_t batch_jobs = 0;
+	const char* load_checkpoint_path = NULL;
+	const char* fuzz_inputs = NULL;
+	int use_fuzz_eip = 0;
+	uint32_t fuzz_eip = 0;
+	const char* coverage_path = NULL;
+	const char* elf_path = NULL;
+	int ret;
 	for (i = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--raw") == 0) {
 			if (++i < argc) { if (!read_raw(argv[i])) return 1; }
 			else { fprintf(stderr, "no filename for --raw\n"); return 1; }
 		} else if (strcmp(argv[i], "--elf") == 0) {
-			if (++i < argc) { if (!read_elf(&initial_eip, argv[i])) return 1; }
+			if (++i < argc) { if (!read_elf(&initial_eip, argv[i])) return 1; elf_path = argv[i]; }
 			else { fprintf(stderr, "no filename for --elf\n"); return 1; }
 		} else if (strcmp(argv[i], "--pe") == 0) {
-			if (++i < argc) { if (!read_pe(&initial_eip, &stack_size, &import_params, argv[i])) return 1; }
+			if (++i < argc) { if (!read_pe(&initial_eip, &stack_limit, &import_params, argv[i])) return 1; }
 			else { fprintf(stderr, "no filename for --pe\n"); return 1; }
 		} else if (strcmp(argv[i], "--trace") == 0) {
 			enable_trace = 1;
@@ -1853,6 +3450,13 @@ int main(int argc, char *argv[]) {
 					return 1;
 				}
 			} else { fprintf(stderr, "no stack size for --stacksize\n"); return 1;}
+		} else if (strcmp(argv[i], "--stack-limit") == 0) {
+			if (++i < argc) {
+				if (!str_to_uint32(&stack_limit, argv[i])) {
+					fprintf(stderr, "invalid stack limit %s\n", argv[i]);
+					return 1;
+				}
+			} else { fprintf(stderr, "no stack limit for --stack-limit\n"); return 1;}
 		} else if (strcmp(argv[i], "--args") == 0) {
 			i++;
 			enable_args = 1;
@@ -1865,6 +3469,16 @@ int main(int argc, char *argv[]) {
 					return 1;
 				}
 			} else { fprintf(stderr, "no work buffer origin for --xv6-syscall\n"); return 1;}
+		} else if (strcmp(argv[i], "--port-io") == 0) {
+			use_port_io = 1;
+		} else if (strcmp(argv[i], "--linux-syscall") == 0) {
+			use_linux_syscall = 1;
+			if (++i < argc) {
+				if (!str_to_uint32(&linux_brk_origin, argv[i])) {
+					fprintf(stderr, "invalid Linux brk origin %s\n", argv[i]);
+					return 1;
+				}
+			} else { fprintf(stderr, "no brk origin for --linux-syscall\n"); return 1;}
 		} else if (strcmp(argv[i], "--pe-import") == 0) {
 			use_pe_import = 1;
 			if (++i < argc) {
@@ -1883,96 +3497,150 @@ int main(int argc, char *argv[]) {
 					return 1;
 				}
 			} else { fprintf(stderr, "no FS buffer origin for --pe-fs\n"); return 1;}
+		} else if (strcmp(argv[i], "--native-libc") == 0) {
+			if (++i < argc) { if (!native_libc_enable(argv[i])) return 1; use_native_libc = 1; }
+			else { fprintf(stderr, "no function list for --native-libc\n"); return 1; }
+		} else if (strcmp(argv[i], "--native-libc-reference") == 0) {
+			if (++i < argc) { if (!native_libc_set_reference(argv[i])) return 1; }
+			else { fprintf(stderr, "no filename for --native-libc-reference\n"); return 1; }
+		} else if (strcmp(argv[i], "--plugin") == 0) {
+			if (++i < argc) { if (!plugin_load(argv[i])) return 1; use_plugins = 1; }
+			else { fprintf(stderr, "no filename for --plugin\n"); return 1; }
 		} else if (strcmp(argv[i], "--strict") == 0) {
 			strict_mode = 1;
+		} else if (strcmp(argv[i], "--rdtsc") == 0) {
+			if (++i < argc) {
+				if (strcmp(argv[i], "host") == 0) {
+					use_host_tsc = 1;
+				} else if (strcmp(argv[i], "virtual") == 0) {
+					use_host_tsc = 0;
+				} else {
+					fprintf(stderr, "invalid RDTSC mode %s (host or virtual)\n", argv[i]);
+					return 1;
+				}
+			} else { fprintf(stderr, "no mode for --rdtsc\n"); return 1; }
+		} else if (strcmp(argv[i], "--cpuid-edx") == 0 || strcmp(argv[i], "--cpuid-ecx") == 0) {
+			uint32_t* features = strcmp(argv[i], "--cpuid-edx") == 0 ? &cpuid_features_edx : &cpuid_features_ecx;
+			if (++i < argc) {
+				if (!str_to_uint32(features, argv[i])) {
+					fprintf(stderr, "invalid CPUID feature flags %s\n", argv[i]);
+					return 1;
+				}
+			} else { fprintf(stderr, "no value for %s\n", argv[i - 1]); return 1; }
+		} else if (strcmp(argv[i], "--save-checkpoint") == 0) {
+			if (++i < argc) save_checkpoint_path = argv[i];
+			else { fprintf(stderr, "no filename for --save-checkpoint\n"); return 1; }
+		} else if (strcmp(argv[i], "--checkpoint-eip") == 0) {
+			if (++i < argc) {
+				if (!str_to_uint32(&checkpoint_eip, argv[i])) {
+					fprintf(stderr, "invalid checkpoint eip value %s\n", argv[i]);
+					return 1;
+				}
+				use_checkpoint_eip = 1;
+			} else { fprintf(stderr, "no eip value for --checkpoint-eip\n"); return 1;}
+		} else if (strcmp(argv[i], "--load-checkpoint") == 0) {
+			if (++i < argc) load_checkpoint_path = argv[i];
+			else { fprintf(stderr, "no filename for --load-checkpoint\n"); return 1; }
+		} else if (strcmp(argv[i], "--fuzz-inputs") == 0) {
+			if (++i < argc) fuzz_inputs = argv[i];
+			else { fprintf(stderr, "no input list for --fuzz-inputs\n"); return 1; }
+		} else if (strcmp(argv[i], "--fuzz-eip") == 0) {
+			if (++i < argc) {
+				if (!str_to_uint32(&fuzz_eip, argv[i])) {
+					fprintf(stderr, "invalid fuzzing start eip value %s\n", argv[i]);
+					return 1;
+				}
+				use_fuzz_eip = 1;
+			} else { fprintf(stderr, "no eip value for --fuzz-eip\n"); return 1;}
+		} else if (strcmp(argv[i], "--coverage") == 0) {
+			if (++i < argc) {
+				coverage_path = argv[i];
+				enable_coverage = 1;
+			} else { fprintf(stderr, "no filename for --coverage\n"); return 1; }
+		} else if (strcmp(argv[i], "--batch") == 0) {
+			if (++i < argc) batch_manifest = argv[i];
+			else { fprintf(stderr, "no manifest file for --batch\n"); return 1; }
+		} else if (strcmp(argv[i], "--server") == 0) {
+			if (++i < argc) server_path = argv[i];
+			else { fprintf(stderr, "no socket path for --server\n"); return 1; }
+		} else if (strcmp(argv[i], "--optimize-thread") == 0) {
+			use_optimize_thread = 1;
+		} else if (strcmp(argv[i], "--block-cache") == 0) {
+			if (++i < argc) block_cache_dir = argv[i];
+			else { fprintf(stderr, "no directory for --block-cache\n"); return 1; }
+		} else if (strcmp(argv[i], "--batch-jobs") == 0) {
+			if (++i < argc) {
+				if (!str_to_uint32(&batch_jobs, argv[i]) || batch_jobs == 0 || batch_jobs > INT_MAX) {
+					fprintf(stderr, "invalid number of batch jobs %s\n", argv[i]);
+					return 1;
+				}
+			} else { fprintf(stderr, "no number of jobs for --batch-jobs\n"); return 1;}
 		} else {
 			fprintf(stderr, "unknown command line option %s\n", argv[i]);
 			return 1;
 		}
 	}
-	if (stack_size > initial_esp) {
-		fprintf(stderr, "stack too big compared to esp\n");
+
+	/* トレースやEIPを指定したチェックポイントでは、ループも1命令ずつ実行する */
+	if (enable_trace || use_checkpoint_eip) enable_loop_idiom = 0;
+	if (use_linux_syscall && (use_xv6_syscall || use_pe_import)) {
+		fprintf(stderr, "--linux-syscall cannot be used with --xv6-syscall or --pe-import\n");
 		return 1;
 	}
-
-	eip = initial_eip;
-	eflags = UINT32_C(0x00000002);
-	regs[ESP] = initial_esp;
-	dmemory_allocate(initial_esp - stack_size, stack_size);
-	if (enable_args) {
-		uint32_t j;
-		char** argv2 = argv + i;
-		uint32_t stack_limit = initial_esp - stack_size;
-		uint32_t current_addr = initial_esp;
-		uint32_t num_buffer = 0;
-		argc2 = argc - i;
-		/* argvが指す配列の領域を確保する */
-		if (argc2 == UINT32_MAX || UINT32_MAX / 4 < (argc2 + 1)) {
-			fprintf(stderr, "too many arguments\n");
+	if (use_native_libc) {
+		/* チェックポイントには、置き換える関数が含まれている */
+		if (elf_path == NULL || load_checkpoint_path != NULL) {
+			fprintf(stderr, "--native-libc needs --elf and cannot be used with --load-checkpoint\n");
 			return 1;
 		}
-		if (current_addr - stack_limit < 4 * (argc2 + 1)) {
-			fprintf(stderr, "stack too small to hold argv table\n");
+		if (!native_libc_attach(elf_path)) return 1;
+	}
+	if (use_plugins && elf_path != NULL && load_checkpoint_path == NULL) {
+		if (!plugin_attach(elf_path)) return 1;
+	}
+	/* 引数を置く前のイメージで決める (チェックポイントは読み込んだ時に決める) */
+	if (load_checkpoint_path == NULL && !open_block_cache()) return 1;
+	if (server_path != NULL) {
+		/* イメージ (またはチェックポイント) を読み込んだ状態で待ち受ける */
+		if (enable_args || batch_manifest != NULL || fuzz_inputs != NULL || enable_coverage) {
+			fprintf(stderr, "--args, --batch, --fuzz-inputs and --coverage cannot be used with --server\n");
 			return 1;
 		}
-		current_addr -= 4 * (argc2 + 1);
-		argv_addr = current_addr;
-		/* 引数の文字列とargvが指す配列の値を書き込む */
-		for (j = 0; j < argc2; j++) {
-			uint32_t stack_left = current_addr - stack_limit;
-			size_t alen = strlen(argv2[j]);
-			if (stack_left == 0 || stack_left - 1 < alen) {
-				fprintf(stderr, "stack too small to hold argv[%"PRIu32"]\n", j);
-				return 1;
-			}
-			current_addr -= alen + 1;
-			dmemory_write(argv2[j], current_addr, alen + 1);
-			dmemory_write(&current_addr, argv_addr + j * 4, sizeof(current_addr));
+		if (load_checkpoint_path != NULL) {
+			if (!load_checkpoint(load_checkpoint_path)) return 1;
+			if ((server_snapshot = machine_take_snapshot()) == NULL) return 1;
+			return run_server(server_path, run_checkpoint_job);
 		}
-		dmemory_write(&num_buffer, argv_addr + argc2 * 4, sizeof(num_buffer));
-		if (current_addr - stack_limit < 12) {
-			fprintf(stderr, "stack too small to hold arguments\n");
+		return run_server(server_path, run_batch_job);
+	}
+	if (load_checkpoint_path != NULL) {
+		/* 引数などはチェックポイントに含まれている */
+		if (enable_args || batch_manifest != NULL || fuzz_inputs != NULL) {
+			fprintf(stderr, "--load-checkpoint cannot be used with --args, --batch or --fuzz-inputs\n");
 			return 1;
 		}
-		/* main関数に渡す引数とダミーのリターンアドレスを書き込む */
-		current_addr -= 12;
-		dmemory_write(&argv_addr, current_addr + 8, sizeof(argv_addr));
-		dmemory_write(&argc2, current_addr + 4, sizeof(argc2));
-		num_buffer = UINT32_C(0xfffffff0);
-		dmemory_write(&num_buffer, current_addr, sizeof(num_buffer));
-		regs[ESP] = current_addr;
-	}
-	if (import_as_iat) {
-		import_params.iat_addr = import_params.import_addr;
-		import_params.iat_size = import_params.import_size;
-	}
-	if (use_xv6_syscall) {
-		if (!initialize_xv6_syscall(xv6_syscall_work)) return 1;
-	}
-	if (use_pe_import) {
-		if (!pe_import_initialize(&import_params, pe_import_work, argc2, argv_addr)) return 1;
-	}
-	if (enable_fs) {
-		if (UINT32_MAX - 0x1000  + 1 < fs_addr) {
-			fprintf(stderr, "FS buffer address too high!\n");
+		if (!load_checkpoint(load_checkpoint_path)) return 1;
+		if (enable_coverage) coverage_begin_run();
+		ret = run_guest();
+		if (ret < 0) ret = 1;
+	} else if (batch_manifest != NULL) {
+		if (enable_args || fuzz_inputs != NULL || enable_coverage) {
+			fprintf(stderr, "--args, --fuzz-inputs and --coverage cannot be used with --batch\n");
 			return 1;
 		}
-		segment_offsets[FS] = fs_addr;
-		dmemory_allocate(fs_addr, 0x1000);
-		dmem_write_uint(fs_addr + 0x004, initial_esp, 4);
-		dmem_write_uint(fs_addr + 0x008, initial_esp - stack_size, 4);
-		dmem_write_uint(fs_addr + 0x018, fs_addr, 4);
-	}
-
-	if (enable_trace) {
-		print_regs(stdout);
-		putchar('\n');
+		return run_batch(batch_manifest, (int)batch_jobs, run_batch_job);
+	} else if (fuzz_inputs != NULL) {
+		ret = run_fuzz_inputs(fuzz_inputs, use_fuzz_eip, fuzz_eip,
+			enable_args, enable_args ? (uint32_t)(argc - i) : 0, argv + i);
+	} else {
+		if (enable_coverage) coverage_begin_run();
+		/* ゲストの終了ステータスを終了ステータスにする (エラーで止まったら1) */
+		ret = start_guest(enable_args, enable_args ? (uint32_t)(argc - i) : 0, argv + i);
+		if (ret < 0) ret = 1;
 	}
-	while(step()) {
-		if (enable_trace) {
-			print_regs(stdout);
-			putchar('\n');
-		}
+	if (enable_coverage) {
+		if (fuzz_inputs == NULL) coverage_end_run();
+		if (!coverage_save(coverage_path)) ret = 1;
 	}
-	return 0;
+	return ret;
 }
@@ -0,0 +1,77 @@
+#ifndef X86_PLUGIN_H_GUARD_F6F86671_D1C2_43E5_95BD_63D5E235AF2A
+#define X86_PLUGIN_H_GUARD_F6F86671_D1C2_43E5_95BD_63D5E235AF2A
+
+#include <stdint.h>
+
+/*
+ゲストの関数をネイティブの実装で置き換えるプラグインのインターフェース。
+プラグインは共有ライブラリで、X86_PLUGIN_INIT_NAMEの関数を公開する。
+インタプリタは--pluginで指定されたファイルをdlopenし、その関数にx86_plugin_apiを渡して呼ぶ。
+プラグインはその中で、置き換える関数とハンドラを登録する。
+*/
+
+#define X86_PLUGIN_API_VERSION 1
+#define X86_PLUGIN_INIT_NAME "x86_plugin_init"
+
+/* 呼び出し規約 */
+enum {
+	X86_PLUGIN_CDECL, /* 引数は全てスタック、呼び出し元が消す */
+	X86_PLUGIN_STDCALL, /* 引数は全てスタック、呼ばれた側が消す */
+	X86_PLUGIN_FASTCALL, /* 最初の2個はECXとEDX、残りはスタックで呼ばれた側が消す */
+	X86_PLUGIN_THISCALL /* 最初の1個はECX、残りはスタックで呼ばれた側が消す */
+};
+
+#define X86_PLUGIN_ARG_MAX 16
+
+/*
+ハンドラ。argsには呼び出し規約に従って読んだarg_num個の引数が入る。
+espは呼ばれた時のESP (戻りアドレスの位置) で、可変長引数などを自分で読むのに使える。
+ret[0]がEAX、ret[1]がEDXになる (呼ばれた時の値が入っている)。
+成功:1 失敗:0 (ゲストの実行を止める)
+*/
+typedef int (*x86_plugin_func)(void* ctx, uint32_t ret[2], const uint32_t args[], uint32_t esp);
+
+typedef struct {
+	x86_plugin_func func;
+	void* ctx;
+	int convention;
+	uint32_t arg_num; /* X86_PLUGIN_ARG_MAX以下 */
+} x86_plugin_handler;
+
+/*
+メモリの連続した範囲を、ページを越えない部分ごとに渡すコールバック。
+offsetは範囲の先頭からの位置。続ける:1 やめる:0
+*/
+typedef int (*x86_plugin_read_chunk)(void* ctx, const uint8_t* data, uint32_t offset, uint32_t size);
+typedef int (*x86_plugin_write_chunk)(void* ctx, uint8_t* data, uint32_t offset, uint32_t size);
+
+typedef struct {
+	int version; /* X86_PLUGIN_API_VERSION */
+
+	/*
+	ハンドラを登録する。handlerの内容は複製される。成功:1 失敗:0
+	import : PEのインポート (DLL名は大文字と小文字を区別しない)。組み込みの実装より優先する
+	import_ordinal : PEの序数によるインポート
+	symbol : ELFの.symtabの大域の関数シンボル (ELFを読み込むたびにアドレスを探す)
+	address : ゲストのアドレス (EIPがそこに来た時に呼ぶ)
+	*/
+	int (*register_import)(const char* lib_name, const char* func_name, const x86_plugin_handler* handler);
+	int (*register_import_ordinal)(const char* lib_name, uint16_t ordinal, const x86_plugin_handler* handler);
+	int (*register_symbol)(const char* name, const x86_plugin_handler* handler);
+	int (*register_address)(uint32_t addr, const x86_plugin_handler* handler);
+
+	/*
+	ゲストのメモリをページ単位で、ホストのポインタとして直接読み書きする。
+	範囲に割り当てられていないページがあれば、その手前までを渡して0を返す。成功:1
+	*/
+	int (*read_chunks)(uint32_t addr, uint32_t size, x86_plugin_read_chunk callback, void* ctx);
+	int (*write_chunks)(uint32_t addr, uint32_t size, x86_plugin_write_chunk callback, void* ctx);
+	/* ゲストのメモリとホストのバッファの間でコピーする。成功:1 失敗:0 */
+	int (*read)(void* dest, uint32_t addr, uint32_t size);
+	int (*write)(const void* src, uint32_t addr, uint32_t size);
+} x86_plugin_api;
+
+/* プラグインが公開する関数。成功:1 失敗:0 */
+typedef int (*x86_plugin_init_func)(const x86_plugin_api* api);
+
+#endif
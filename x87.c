@@ -0,0 +1,738 @@
+#include <string.h>
+#include <math.h>
+#include "x87.h"
+#include "x86_regs.h"
+
+#ifdef X87_EXTENDED_PRECISION
+#define X87_MATH(name) name##l
+#else
+#define X87_MATH(name) name
+#endif
+
+/* ステータスワード */
+#define FSW_IE 0x0001
+#define FSW_ZE 0x0004
+#define FSW_SF 0x0040
+#define FSW_ES 0x0080
+#define FSW_C0 0x0100
+#define FSW_C1 0x0200
+#define FSW_C2 0x0400
+#define FSW_TOP 0x3800
+#define FSW_C3 0x4000
+#define FSW_B 0x8000
+#define FSW_CC (FSW_C0 | FSW_C1 | FSW_C2 | FSW_C3)
+
+/* D8, DA, DC, DEの算術命令 (mod r/mのreg) */
+enum {
+	X87_ADD, X87_MUL, X87_COM, X87_COMP, X87_SUB, X87_SUBR, X87_DIV, X87_DIVR
+};
+
+static x87_state fpu;
+
+void x87_initialize(void) {
+	memset(&fpu, 0, sizeof(fpu));
+	fpu.control_word = 0x037f;
+	fpu.empty = 0xff;
+}
+
+void x87_save(x87_state* state) {
+	*state = fpu;
+}
+
+void x87_load(const x87_state* state) {
+	fpu = *state;
+}
+
+static uint16_t get_status_word(void) {
+	return (fpu.status_word & ~FSW_TOP) | (fpu.top << 11);
+}
+
+static void set_status_word(uint16_t value) {
+	fpu.status_word = value & ~FSW_TOP;
+	fpu.top = (value >> 11) & 7;
+}
+
+static void set_condition(uint16_t cc) {
+	fpu.status_word = (fpu.status_word & ~FSW_CC) | cc;
+}
+
+static void raise_exception(uint16_t flags) {
+	fpu.status_word |= flags;
+	/* マスクされていない例外は、ES (とB) を立てるだけにする */
+	if (fpu.status_word & ~fpu.control_word & 0x3f) fpu.status_word |= FSW_ES | FSW_B;
+}
+
+/* 不正な演算の結果 (負のQNaN) */
+static x87_float default_nan(void) {
+	return X87_MATH(copysign)((x87_float)NAN, -1);
+}
+
+/* レジスタスタック */
+static int st_index(int i) {
+	return (fpu.top + i) & 7;
+}
+
+static int st_is_empty(int i) {
+	return (fpu.empty >> st_index(i)) & 1;
+}
+
+static x87_float st_get(int i) {
+	if (st_is_empty(i)) {
+		/* スタックアンダーフロー */
+		fpu.status_word &= ~FSW_C1;
+		raise_exception(FSW_IE | FSW_SF);
+		return default_nan();
+	}
+	return fpu.st[st_index(i)];
+}
+
+static void st_set(int i, x87_float value) {
+	int index = st_index(i);
+	fpu.st[index] = value;
+	fpu.empty &= ~(1 << index);
+}
+
+static void st_push(x87_float value) {
+	fpu.top = (fpu.top - 1) & 7;
+	if (!st_is_empty(0)) {
+		/* スタックオーバーフロー */
+		fpu.status_word |= FSW_C1;
+		raise_exception(FSW_IE | FSW_SF);
+		value = default_nan();
+	}
+	st_set(0, value);
+}
+
+static void st_pop(void) {
+	fpu.empty |= 1 << st_index(0);
+	fpu.top = (fpu.top + 1) & 7;
+}
+
+/* メモリ上の形式との変換 (リトルエンディアン) */
+static uint64_t get_le(const uint8_t* data, int size) {
+	uint64_t value = 0;
+	int i;
+	for (i = size - 1; i >= 0; i--) value = (value << 8) | data[i];
+	return value;
+}
+
+static void put_le(uint8_t* data, uint64_t value, int size) {
+	int i;
+	for (i = 0; i < size; i++) {
+		data[i] = (uint8_t)value;
+		value >>= 8;
+	}
+}
+
+static x87_float load_real32(const uint8_t* data) {
+	uint32_t bits = (uint32_t)get_le(data, 4);
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static x87_float load_real64(const uint8_t* data) {
+	uint64_t bits = get_le(data, 8);
+	double value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static x87_float load_real80(const uint8_t* data) {
+	uint64_t significand = get_le(data, 8);
+	int exponent = (int)(get_le(data + 8, 2) & 0x7fff);
+	int negative = (data[9] & 0x80) != 0;
+	x87_float value;
+	if (exponent == 0x7fff) {
+		value = (significand << 1) == 0 ? (x87_float)INFINITY : (x87_float)NAN;
+	} else {
+		/* 指数が0の時 (非正規化数) は、最小の指数と同じ倍率になる */
+		value = X87_MATH(ldexp)((x87_float)significand, (exponent == 0 ? 1 : exponent) - 16383 - 63);
+	}
+	return negative ? -value : value;
+}
+
+static void store_real32(uint8_t* data, x87_float value) {
+	float f = (float)value;
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	put_le(data, bits, 4);
+}
+
+static void store_real64(uint8_t* data, x87_float value) {
+	double d = (double)value;
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	put_le(data, bits, 8);
+}
+
+static void store_real80(uint8_t* data, x87_float value) {
+	uint64_t significand = 0;
+	int exponent = 0;
+	int negative = signbit(value) != 0;
+	if (isnan(value)) {
+		exponent = 0x7fff;
+		significand = UINT64_C(0xc000000000000000);
+	} else if (isinf(value)) {
+		exponent = 0x7fff;
+		significand = UINT64_C(0x8000000000000000);
+	} else if (value != 0) {
+		int e;
+		/* 0.5 <= |m| < 1 なので、2^64倍すると最上位ビットが立った64ビットの整数になる */
+		x87_float m = X87_MATH(frexp)(X87_MATH(fabs)(value), &e);
+		significand = (uint64_t)X87_MATH(ldexp)(m, 64);
+		exponent = e - 1 + 16383;
+		if (exponent <= 0) {
+			significand = 1 - exponent < 64 ? significand >> (1 - exponent) : 0;
+			exponent = 0;
+		}
+	}
+	put_le(data, significand, 8);
+	put_le(data + 8, (negative ? 0x8000 : 0) | exponent, 2);
+}
+
+static x87_float load_int(const uint8_t* data, int size) {
+	uint64_t bits = get_le(data, size);
+	if (size < 8 && (bits & (UINT64_C(1) << (size * 8 - 1)))) bits |= ~UINT64_C(0) << (size * 8);
+	return (x87_float)(int64_t)bits;
+}
+
+static x87_float load_bcd(const uint8_t* data) {
+	x87_float value = 0;
+	int i;
+	for (i = 8; i >= 0; i--) {
+		value = value * 100 + (data[i] >> 4) * 10 + (data[i] & 0x0f);
+	}
+	return (data[9] & 0x80) ? -value : value;
+}
+
+/* 制御ワードの丸めモードで整数に丸める */
+static x87_float round_to_integer(x87_float value) {
+	switch ((fpu.control_word >> 10) & 3) {
+	case 0: return X87_MATH(nearbyint)(value);
+	case 1: return X87_MATH(floor)(value);
+	case 2: return X87_MATH(ceil)(value);
+	default: return X87_MATH(trunc)(value);
+	}
+}
+
+static void store_int(uint8_t* data, int size, x87_float value, int truncate) {
+	x87_float limit = X87_MATH(ldexp)(1, size * 8 - 1);
+	x87_float rounded = truncate ? X87_MATH(trunc)(value) : round_to_integer(value);
+	if (isnan(rounded) || rounded < -limit || rounded >= limit) {
+		/* 範囲外は不定値 (最小の負の数) にする */
+		raise_exception(FSW_IE);
+		rounded = -limit;
+	}
+	put_le(data, (uint64_t)(int64_t)rounded, size);
+}
+
+static void store_bcd(uint8_t* data, x87_float value) {
+	x87_float rounded = round_to_integer(value);
+	x87_float magnitude = X87_MATH(fabs)(rounded);
+	int i;
+	if (isnan(rounded) || magnitude >= (x87_float)1e18) {
+		raise_exception(FSW_IE);
+		memset(data, 0, 10);
+		data[7] = 0xc0;
+		data[8] = data[9] = 0xff;
+		return;
+	}
+	{
+		uint64_t digits = (uint64_t)magnitude;
+		for (i = 0; i < 9; i++) {
+			data[i] = (uint8_t)((digits % 10) | ((digits / 10 % 10) << 4));
+			digits /= 100;
+		}
+	}
+	data[9] = signbit(rounded) ? 0x80 : 0x00;
+}
+
+/* 演算 */
+static x87_float arith(int kind, x87_float a, x87_float b) {
+	x87_float result;
+	switch (kind) {
+	case X87_ADD: result = a + b; break;
+	case X87_MUL: result = a * b; break;
+	case X87_SUB: result = a - b; break;
+	case X87_SUBR: result = b - a; break;
+	case X87_DIV: result = a / b; break;
+	default: result = b / a; break;
+	}
+	if (isnan(result) && !isnan(a) && !isnan(b)) {
+		raise_exception(FSW_IE);
+		result = default_nan();
+	} else if ((kind == X87_DIV && b == 0 && isfinite(a) && a != 0) ||
+	(kind == X87_DIVR && a == 0 && isfinite(b) && b != 0)) {
+		raise_exception(FSW_ZE);
+	}
+	return result;
+}
+
+/* 比較結果をC3, C2, C0の形で返す。quietなら (FUCOM系) NaNとの比較を不正な演算としない */
+static uint16_t compare(x87_float a, x87_float b, int quiet) {
+	if (isnan(a) || isnan(b)) {
+		if (!quiet) raise_exception(FSW_IE);
+		return FSW_C3 | FSW_C2 | FSW_C0;
+	}
+	if (a > b) return 0;
+	if (a < b) return FSW_C0;
+	return FSW_C3;
+}
+
+/* FCOMI系は、比較結果をZF, PF, CFに入れる */
+static void compare_to_eflags(uint32_t* eflags, x87_float a, x87_float b, int quiet) {
+	uint16_t cc = compare(a, b, quiet);
+	*eflags &= ~(OF | SF | ZF | AF | PF | CF);
+	if (cc & FSW_C3) *eflags |= ZF;
+	if (cc & FSW_C2) *eflags |= PF;
+	if (cc & FSW_C0) *eflags |= CF;
+	fpu.status_word &= ~FSW_C1;
+}
+
+/* FPREM/FPREM1の商の下位3ビットを、C0 (bit2), C3 (bit1), C1 (bit0) に入れる */
+static void set_quotient_condition(int quotient) {
+	uint16_t cc = 0;
+	if (quotient & 4) cc |= FSW_C0;
+	if (quotient & 2) cc |= FSW_C3;
+	if (quotient & 1) cc |= FSW_C1;
+	set_condition(cc);
+}
+
+/* タグワード (各レジスタ2ビット。00:有効 01:ゼロ 10:特殊 11:空) */
+static uint16_t get_tag_word(void) {
+	uint16_t tag = 0;
+	int i;
+	for (i = 0; i < 8; i++) {
+		uint16_t t;
+		if ((fpu.empty >> i) & 1) {
+			t = 3;
+		} else if (fpu.st[i] == 0) {
+			t = 1;
+		} else if (!isnormal(fpu.st[i])) {
+			t = 2;
+		} else {
+			t = 0;
+		}
+		tag |= t << (i * 2);
+	}
+	return tag;
+}
+
+static void set_tag_word(uint16_t tag) {
+	int i;
+	fpu.empty = 0;
+	for (i = 0; i < 8; i++) {
+		if (((tag >> (i * 2)) & 3) == 3) fpu.empty |= 1 << i;
+	}
+}
+
+/* 32ビット形式の環境 (28バイト)。命令とオペランドのポインタは記録していないので0にする */
+static void store_env(uint8_t* data) {
+	memset(data, 0, 28);
+	put_le(data, fpu.control_word, 2);
+	put_le(data + 4, get_status_word(), 2);
+	put_le(data + 8, get_tag_word(), 2);
+}
+
+static void load_env(const uint8_t* data) {
+	fpu.control_word = (uint16_t)get_le(data, 2);
+	set_status_word((uint16_t)get_le(data + 4, 2));
+	set_tag_word((uint16_t)get_le(data + 8, 2));
+}
+
+static const uint8_t mem_size_table[8][8] = {
+	{4, 4, 4, 4, 4, 4, 4, 4}, /* D8 : m32real */
+	{4, 0, 4, 4, 28, 2, 28, 2}, /* D9 : FLD/FST/FSTP m32real, FLDENV, FLDCW, FNSTENV, FNSTCW */
+	{4, 4, 4, 4, 4, 4, 4, 4}, /* DA : m32int */
+	{4, 4, 4, 4, 0, 10, 0, 10}, /* DB : FILD/FISTTP/FIST/FISTP m32int, FLD/FSTP m80real */
+	{8, 8, 8, 8, 8, 8, 8, 8}, /* DC : m64real */
+	{8, 8, 8, 8, 108, 0, 108, 2}, /* DD : FLD/FISTTP/FST/FSTP m64real, FRSTOR, FNSAVE, FNSTSW */
+	{2, 2, 2, 2, 2, 2, 2, 2}, /* DE : m16int */
+	{2, 2, 2, 2, 10, 8, 10, 8} /* DF : FILD/FISTTP/FIST/FISTP m16int, FBLD, FILD m64int, FBSTP, FISTP m64int */
+};
+
+/* メモリに書き込む命令のregのビット */
+static const uint8_t mem_store_table[8] = {0x00, 0xcc, 0x00, 0x8e, 0x00, 0xce, 0x00, 0xce};
+
+int x87_mem_operand_size(int opcode, int reg, int is_data_16bit, int* is_store) {
+	int size = mem_size_table[opcode & 7][reg & 7];
+	/* 16ビット形式の環境には対応しない */
+	if (is_data_16bit && size >= 28) return 0;
+	*is_store = (mem_store_table[opcode & 7] >> (reg & 7)) & 1;
+	return size;
+}
+
+int x87_execute_mem(int opcode, int reg, uint8_t* data) {
+	x87_float value;
+	int i;
+	if ((opcode & 1) == 0) {
+		/* D8, DA, DC, DE : ST(0)とメモリの算術演算 */
+		static const int int_size_table[] = {0, 4, 0, 2};
+		if (opcode == 0) {
+			value = load_real32(data);
+		} else if (opcode == 4) {
+			value = load_real64(data);
+		} else {
+			value = load_int(data, int_size_table[opcode >> 1]);
+		}
+		if (reg == X87_COM || reg == X87_COMP) {
+			set_condition(compare(st_get(0), value, 0));
+			if (reg == X87_COMP) st_pop();
+		} else {
+			st_set(0, arith(reg, st_get(0), value));
+		}
+		return 1;
+	}
+	switch (opcode) {
+	case 1:
+		switch (reg) {
+		case 0: st_push(load_real32(data)); return 1;
+		case 2: store_real32(data, st_get(0)); return 1;
+		case 3: store_real32(data, st_get(0)); st_pop(); return 1;
+		case 4: load_env(data); return 1;
+		case 5: fpu.control_word = (uint16_t)get_le(data, 2); return 1;
+		case 6:
+			store_env(data);
+			fpu.control_word |= 0x3f;
+			return 1;
+		case 7: put_le(data, fpu.control_word, 2); return 1;
+		}
+		break;
+	case 3:
+		switch (reg) {
+		case 0: st_push(load_int(data, 4)); return 1;
+		case 1: store_int(data, 4, st_get(0), 1); st_pop(); return 1;
+		case 2: store_int(data, 4, st_get(0), 0); return 1;
+		case 3: store_int(data, 4, st_get(0), 0); st_pop(); return 1;
+		case 5: st_push(load_real80(data)); return 1;
+		case 7: store_real80(data, st_get(0)); st_pop(); return 1;
+		}
+		break;
+	case 5:
+		switch (reg) {
+		case 0: st_push(load_real64(data)); return 1;
+		case 1: store_int(data, 8, st_get(0), 1); st_pop(); return 1;
+		case 2: store_real64(data, st_get(0)); return 1;
+		case 3: store_real64(data, st_get(0)); st_pop(); return 1;
+		case 4:
+			load_env(data);
+			for (i = 0; i < 8; i++) fpu.st[st_index(i)] = load_real80(data + 28 + i * 10);
+			return 1;
+		case 6:
+			store_env(data);
+			for (i = 0; i < 8; i++) store_real80(data + 28 + i * 10, fpu.st[st_index(i)]);
+			x87_initialize();
+			return 1;
+		case 7: put_le(data, get_status_word(), 2); return 1;
+		}
+		break;
+	case 7:
+		switch (reg) {
+		case 0: st_push(load_int(data, 2)); return 1;
+		case 1: store_int(data, 2, st_get(0), 1); st_pop(); return 1;
+		case 2: store_int(data, 2, st_get(0), 0); return 1;
+		case 3: store_int(data, 2, st_get(0), 0); st_pop(); return 1;
+		case 4: st_push(load_bcd(data)); return 1;
+		case 5: st_push(load_int(data, 8)); return 1;
+		case 6: store_bcd(data, st_get(0)); st_pop(); return 1;
+		case 7: store_int(data, 8, st_get(0), 0); st_pop(); return 1;
+		}
+		break;
+	}
+	return 0;
+}
+
+/* FXAMの分類 */
+static void examine(void) {
+	x87_float value = fpu.st[st_index(0)];
+	uint16_t cc = signbit(value) ? FSW_C1 : 0;
+	if (st_is_empty(0)) {
+		cc = FSW_C3 | FSW_C0;
+	} else {
+		switch (fpclassify(value)) {
+		case FP_NAN: cc |= FSW_C0; break;
+		case FP_INFINITE: cc |= FSW_C2 | FSW_C0; break;
+		case FP_ZERO: cc |= FSW_C3; break;
+		case FP_SUBNORMAL: cc |= FSW_C3 | FSW_C2; break;
+		default: cc |= FSW_C2; break;
+		}
+	}
+	set_condition(cc);
+}
+
+/* D9 E0～FF : 引数なしの命令 */
+static int execute_d9_misc(int op) {
+	static const x87_float constants[] = {
+		1.0L,
+		3.32192809488736234787031942948939018L, /* log2(10) */
+		1.44269504088896340735992468100189214L, /* log2(e) */
+		3.14159265358979323846264338327950288L, /* pi */
+		0.301029995663981195213738894724493027L, /* log10(2) */
+		0.693147180559945309417232121458176568L, /* ln(2) */
+		0.0L
+	};
+	x87_float value, other;
+	if (0x28 <= op && op <= 0x2e) {
+		st_push(constants[op - 0x28]);
+		return 1;
+	}
+	switch (op) {
+	case 0x20: /* FCHS */
+		st_set(0, -st_get(0));
+		return 1;
+	case 0x21: /* FABS */
+		st_set(0, X87_MATH(fabs)(st_get(0)));
+		return 1;
+	case 0x24: /* FTST */
+		set_condition(compare(st_get(0), 0, 0));
+		return 1;
+	case 0x25: /* FXAM */
+		examine();
+		return 1;
+	case 0x30: /* F2XM1 */
+		st_set(0, X87_MATH(expm1)(st_get(0) * constants[5]));
+		return 1;
+	case 0x31: /* FYL2X */
+		value = st_get(0);
+		st_set(1, st_get(1) * X87_MATH(log2)(value));
+		st_pop();
+		return 1;
+	case 0x32: /* FPTAN */
+		st_set(0, X87_MATH(tan)(st_get(0)));
+		st_push(1.0);
+		set_condition(0);
+		return 1;
+	case 0x33: /* FPATAN */
+		value = st_get(0);
+		st_set(1, X87_MATH(atan2)(st_get(1), value));
+		st_pop();
+		return 1;
+	case 0x34: /* FXTRACT */
+		value = st_get(0);
+		if (value == 0) {
+			raise_exception(FSW_ZE);
+			st_set(0, -(x87_float)INFINITY);
+			st_push(value);
+		} else {
+			other = X87_MATH(logb)(value);
+			st_set(0, other);
+			st_push(isfinite(other) ? X87_MATH(scalbn)(value, -(int)other) : value);
+		}
+		return 1;
+	case 0x35: /* FPREM1 */
+	case 0x38: /* FPREM */
+		value = st_get(0);
+		other = st_get(1);
+		if (isnan(value) || isnan(other) || isinf(value) || other == 0) {
+			if (!isnan(value) && !isnan(other)) raise_exception(FSW_IE);
+			st_set(0, default_nan());
+			set_condition(0);
+		} else if (op == 0x35) {
+			int quotient;
+			st_set(0, X87_MATH(remquo)(value, other, &quotient));
+			set_quotient_condition(quotient < 0 ? -quotient : quotient);
+		} else {
+			/* 商の下位3ビットは、除数の8倍で割った余りから求める */
+			x87_float low = X87_MATH(fmod)(X87_MATH(fabs)(value), X87_MATH(fabs)(other) * 8);
+			st_set(0, X87_MATH(fmod)(value, other));
+			set_quotient_condition((int)X87_MATH(fmod)(X87_MATH(trunc)(low / X87_MATH(fabs)(other)), 8));
+		}
+		return 1;
+	case 0x39: /* FYL2XP1 */
+		value = st_get(0);
+		st_set(1, st_get(1) * X87_MATH(log1p)(value) / constants[5]);
+		st_pop();
+		return 1;
+	case 0x3a: /* FSQRT */
+		value = st_get(0);
+		if (value < 0) {
+			raise_exception(FSW_IE);
+			st_set(0, default_nan());
+		} else {
+			st_set(0, X87_MATH(sqrt)(value));
+		}
+		return 1;
+	case 0x3b: /* FSINCOS */
+		value = st_get(0);
+		st_set(0, X87_MATH(sin)(value));
+		st_push(X87_MATH(cos)(value));
+		set_condition(0);
+		return 1;
+	case 0x3c: /* FRNDINT */
+		st_set(0, round_to_integer(st_get(0)));
+		return 1;
+	case 0x3d: /* FSCALE */
+		value = st_get(0);
+		other = X87_MATH(trunc)(st_get(1));
+		/* doubleでもlong doubleでも確実に0か無限大になる範囲に制限する */
+		if (other > 100000) other = 100000;
+		if (other < -100000) other = -100000;
+		st_set(0, isnan(other) ? other : X87_MATH(scalbn)(value, (int)other));
+		return 1;
+	case 0x3e: /* FSIN */
+		st_set(0, X87_MATH(sin)(st_get(0)));
+		set_condition(0);
+		return 1;
+	case 0x3f: /* FCOS */
+		st_set(0, X87_MATH(cos)(st_get(0)));
+		set_condition(0);
+		return 1;
+	}
+	return 0;
+}
+
+/* FCMOVccの条件 (DAはB, E, BE, U、DBはその否定) */
+static int fcmov_condition(int opcode, int reg, uint32_t eflags) {
+	static const uint32_t flag_table[] = {CF, ZF, CF | ZF, PF};
+	int cond = (eflags & flag_table[reg & 3]) != 0;
+	return opcode == 2 ? cond : !cond;
+}
+
+int x87_execute_reg(int opcode, int reg, int rm, uint32_t* eax, uint32_t* eflags) {
+	x87_float value;
+	switch (opcode) {
+	case 0: /* D8 : ST(0) = ST(0) op ST(i) */
+		if (reg == X87_COM || reg == X87_COMP) {
+			set_condition(compare(st_get(0), st_get(rm), 0));
+			if (reg == X87_COMP) st_pop();
+		} else {
+			st_set(0, arith(reg, st_get(0), st_get(rm)));
+		}
+		return 1;
+	case 1:
+		switch (reg) {
+		case 0: /* FLD ST(i) */
+			st_push(st_get(rm));
+			return 1;
+		case 1: /* FXCH */
+			value = st_get(rm);
+			st_set(rm, st_get(0));
+			st_set(0, value);
+			fpu.status_word &= ~FSW_C1;
+			return 1;
+		case 2:
+			if (rm == 0) return 1; /* FNOP */
+			break;
+		case 4: case 5: case 6: case 7:
+			return execute_d9_misc((reg << 3) | rm);
+		}
+		break;
+	case 2:
+		if (reg < 4) {
+			/* FCMOVB, FCMOVE, FCMOVBE, FCMOVU */
+			if (fcmov_condition(opcode, reg, *eflags)) st_set(0, st_get(rm));
+			return 1;
+		}
+		if (reg == 5 && rm == 1) {
+			/* FUCOMPP */
+			set_condition(compare(st_get(0), st_get(1), 1));
+			st_pop();
+			st_pop();
+			return 1;
+		}
+		break;
+	case 3:
+		if (reg < 4) {
+			/* FCMOVNB, FCMOVNE, FCMOVNBE, FCMOVNU */
+			if (fcmov_condition(opcode, reg, *eflags)) st_set(0, st_get(rm));
+			return 1;
+		}
+		if (reg == 4) {
+			switch (rm) {
+			case 0: case 1: case 4: /* FENI, FDISI, FSETPM (何もしない) */
+				return 1;
+			case 2: /* FNCLEX */
+				fpu.status_word &= ~(FSW_B | FSW_ES | FSW_SF | 0x3f);
+				return 1;
+			case 3: /* FNINIT */
+				x87_initialize();
+				return 1;
+			}
+			break;
+		}
+		if (reg == 5 || reg == 6) {
+			/* FUCOMI, FCOMI */
+			compare_to_eflags(eflags, st_get(0), st_get(rm), reg == 5);
+			return 1;
+		}
+		break;
+	case 4:
+	case 6:
+		/* DC : ST(i) = ST(0) op ST(i)、DEはその後ポップする (SUBとSUBR、DIVとDIVRは逆になる) */
+		if (reg == X87_COM || reg == X87_COMP) {
+			if (opcode == 6 && !(reg == X87_COMP && rm == 1)) break;
+			/* DE D9はFCOMPP */
+			set_condition(compare(st_get(0), st_get(rm), 0));
+			if (opcode == 6) {
+				st_pop();
+				st_pop();
+			} else if (reg == X87_COMP) {
+				st_pop();
+			}
+		} else {
+			st_set(rm, arith(reg, st_get(0), st_get(rm)));
+			if (opcode == 6) st_pop();
+		}
+		return 1;
+	case 5:
+		switch (reg) {
+		case 0: /* FFREE */
+			fpu.empty |= 1 << st_index(rm);
+			return 1;
+		case 2: /* FST ST(i) */
+			st_set(rm, st_get(0));
+			return 1;
+		case 3: /* FSTP ST(i) */
+			st_set(rm, st_get(0));
+			st_pop();
+			return 1;
+		case 4: /* FUCOM */
+		case 5: /* FUCOMP */
+			set_condition(compare(st_get(0), st_get(rm), 1));
+			if (reg == 5) st_pop();
+			return 1;
+		}
+		break;
+	case 7:
+		if (reg == 4 && rm == 0) {
+			/* FNSTSW AX */
+			*eax = (*eax & UINT32_C(0xffff0000)) | get_status_word();
+			return 1;
+		}
+		if (reg == 5 || reg == 6) {
+			/* FUCOMIP, FCOMIP */
+			compare_to_eflags(eflags, st_get(0), st_get(rm), reg == 5);
+			st_pop();
+			return 1;
+		}
+		break;
+	}
+	return 0;
+}
+
+void x87_save_state(checkpoint_writer* writer) {
+	uint8_t data[10];
+	int i;
+	checkpoint_put_uint(writer, fpu.control_word);
+	checkpoint_put_uint(writer, get_status_word());
+	checkpoint_put_uint(writer, fpu.empty);
+	/* 精度の設定によらず読めるように、80ビット形式で書き出す */
+	for (i = 0; i < 8; i++) {
+		store_real80(data, fpu.st[i]);
+		checkpoint_put_bytes(writer, data, sizeof(data));
+	}
+}
+
+int x87_load_state(checkpoint_reader* reader) {
+	uint8_t data[10];
+	int i;
+	fpu.control_word = (uint16_t)checkpoint_get_uint(reader);
+	set_status_word((uint16_t)checkpoint_get_uint(reader));
+	fpu.empty = (uint8_t)checkpoint_get_uint(reader);
+	for (i = 0; i < 8; i++) {
+		checkpoint_get_bytes(reader, data, sizeof(data));
+		fpu.st[i] = reader->error ? 0 : load_real80(data);
+	}
+	return !reader->error;
+}
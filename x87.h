@@ -0,0 +1,59 @@
+#ifndef X87_H_GUARD_7CB9913F_09A3_457C_80E3_49EE8E527A02
+#define X87_H_GUARD_7CB9913F_09A3_457C_80E3_49EE8E527A02
+
+#include <stdint.h>
+#include "checkpoint.h"
+
+/*
+x87 FPUのエミュレーション。
+レジスタの値はホストのdoubleで持って計算するので、80ビットの拡張精度の下位ビットは失われる。
+X87_EXTENDED_PRECISIONを定義してビルドすると、long doubleで持って計算する
+(x86のホストなら80ビットの拡張精度と一致する)。
+例外はステータスワードに記録するだけで、マスクされていなくても割り込みは起こさない。
+*/
+#ifdef X87_EXTENDED_PRECISION
+typedef long double x87_float;
+#else
+typedef double x87_float;
+#endif
+
+typedef struct {
+	x87_float st[8]; /* 物理レジスタ。ST(i)はst[(top + i) & 7] */
+	uint16_t control_word;
+	uint16_t status_word; /* TOPのビットは使わず、topに持つ */
+	uint8_t empty; /* ビットiが1なら物理レジスタiは空 */
+	uint8_t top;
+} x87_state;
+
+/* メモリオペランドの最大の大きさ (32ビット形式のFNSAVE/FRSTOR) */
+#define X87_MEM_OPERAND_MAX 108
+
+/* FNINITと同じ状態にする */
+void x87_initialize(void);
+
+void x87_save(x87_state* state);
+void x87_load(const x87_state* state);
+
+/*
+以下のopcodeはD8～DFの下位3ビット、regとrmはmod r/mのフィールド。
+*/
+
+/*
+mod r/mがメモリを指す命令のメモリオペランドの大きさを返す。未対応の命令には0を返す。
+*is_storeに、命令がメモリに書き込む (読み込まない) かを入れる。
+*/
+int x87_mem_operand_size(int opcode, int reg, int is_data_16bit, int* is_store);
+
+/*
+メモリオペランドの命令を実行する。
+読み込む命令ではdataに読み込んだ内容を渡し、書き込む命令ではdataに書き込む内容が入る。
+*/
+int x87_execute_mem(int opcode, int reg, uint8_t* data);
+
+/* mod r/mがレジスタ (mod=3) の命令を実行する。FNSTSW AX、FCOMI、FCMOVccのためにEAXとEFLAGSを渡す */
+int x87_execute_reg(int opcode, int reg, int rm, uint32_t* eax, uint32_t* eflags);
+
+void x87_save_state(checkpoint_writer* writer);
+int x87_load_state(checkpoint_reader* reader);
+
+#endif
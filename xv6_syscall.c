@@ -1,16 +1,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "x86_regs.h"
+#include "x86_cpu.h"
 #include "dynamic_memory.h"
 #include "dmem_utils.h"
 #include "xv6_syscall.h"
+#include "checkpoint.h"
 
 static uint32_t sbrk_origin = 0;
-static uint32_t sbrk_addr = 0;
+static uint32_t sbrk_addr = 0; /* 実行中のプロセスのもの */
+
+#define PIPE_MAX 256
+#define PIPE_SIZE 4096
+
+/* パイプのリングバッファ。nwrite - nreadがバッファ内のデータ量 */
+typedef struct {
+	int in_use;
+	uint8_t data[PIPE_SIZE];
+	uint32_t nread, nwrite;
+	int read_open, write_open;
+} pipe_info;
+
+static pipe_info pipes[PIPE_MAX];
 
 typedef struct {
 	FILE* stream;
+	char* path; /* チェックポイントから開き直すため、openしたファイルの名前を保持する */
+	pipe_info* pipe; /* パイプの端の場合 (streamはNULL) */
+	int is_pipe_writer;
+	int is_pollable; /* 端末やパイプなど、読み込みが待たされうるホストのファイル */
 	int ref_cnt;
 	int can_read, can_write;
 	enum e_pop {
@@ -22,15 +45,68 @@ typedef struct {
 #define FD_MAX 1024
 
 static stream_info streams[STREAM_MAX];
-static stream_info* fds[FD_MAX];
+
+#define PROC_MAX 256
+#define EXEC_ARG_MAX 32
+
+/*
+プロセスはアドレス空間とCPUの状態とファイルディスクリプタの表を持つ。
+眠っているプロセスはchanに対するwakeupで実行可能に戻り、中断したシステムコールを再実行する。
+*/
+typedef struct {
+	int pid;
+	enum {
+		PROC_UNUSED, PROC_RUNNABLE, PROC_SLEEPING, PROC_ZOMBIE
+	} state;
+	const void* chan;
+	int wait_fd; /* 入力を待っているホストのfd (-1 = 無し) */
+	int parent; /* 親プロセスの添字 (-1 = 無し) */
+	x86_cpu_state cpu;
+	dmemory_space* space;
+	uint32_t sbrk_addr;
+	uint32_t write_progress; /* パイプへの書き込みで、再実行前までに書いたバイト数 */
+	stream_info* fds[FD_MAX];
+} process;
+
+static process procs[PROC_MAX];
+static int current_proc = 0;
+static int next_pid = 1;
+static stream_info** fds = procs[0].fds; /* 実行中のプロセスのもの */
+
+static int is_pollable(FILE* stream) {
+	struct stat st;
+	return fstat(fileno(stream), &st) == 0 && !S_ISREG(st.st_mode);
+}
 
 int initialize_xv6_syscall(uint32_t work_addr) {
 	int i;
+	dmemory_space* space = dmemory_current_space();
 	sbrk_origin = work_addr;
 	sbrk_addr = work_addr;
 
+	/* 現在のアドレス空間で実行するプロセスだけにする */
+	for (i = 0; i < PROC_MAX; i++) {
+		if (procs[i].state != PROC_UNUSED && procs[i].space != space) dmemory_free_space(procs[i].space);
+		procs[i].state = PROC_UNUSED;
+		procs[i].space = NULL;
+	}
+	for (i = 0; i < PIPE_MAX; i++) pipes[i].in_use = 0;
+	current_proc = 0;
+	next_pid = 2;
+	procs[0].pid = 1;
+	procs[0].state = PROC_RUNNABLE;
+	procs[0].wait_fd = -1;
+	procs[0].parent = -1;
+	procs[0].space = space;
+	procs[0].write_progress = 0;
+	fds = procs[0].fds;
+
 	for (i = 0; i < STREAM_MAX; i++) {
 		streams[i].stream = NULL;
+		streams[i].path = NULL;
+		streams[i].pipe = NULL;
+		streams[i].is_pipe_writer = 0;
+		streams[i].is_pollable = 0;
 		streams[i].ref_cnt = 0;
 		streams[i].can_read = 0;
 		streams[i].can_write = 0;
@@ -52,12 +128,189 @@ int initialize_xv6_syscall(uint32_t work_addr) {
 	streams[2].ref_cnt = 1 + 1;
 	streams[2].can_read = 0;
 	streams[2].can_write = 1;
+	streams[0].is_pollable = is_pollable(stdin);
 	fds[0] = &streams[0];
 	fds[1] = &streams[1];
 	fds[2] = &streams[2];
 	return 1;
 }
 
+static void switch_to(int next) {
+	process* p = &procs[next];
+	if (next == current_proc) return;
+	x86_cpu_save(&procs[current_proc].cpu);
+	procs[current_proc].sbrk_addr = sbrk_addr;
+	current_proc = next;
+	dmemory_switch_space(p->space);
+	x86_cpu_load(&p->cpu);
+	sbrk_addr = p->sbrk_addr;
+	fds = p->fds;
+}
+
+/* 実行中のプロセスの次から順に実行可能なプロセスを探す (実行中のプロセスは最後に調べる) */
+static int find_runnable(void) {
+	int i;
+	for (i = 1; i <= PROC_MAX; i++) {
+		int idx = (current_proc + i) % PROC_MAX;
+		if (procs[idx].state == PROC_RUNNABLE) return idx;
+	}
+	return -1;
+}
+
+/*
+入力を待っているプロセスのfdをまとめてpollし、読めるようになったプロセスを起こす。
+timeoutはpollに渡す。待っているプロセスが無いかpollに失敗した時は0を返す。
+*/
+static int poll_waiting(int timeout) {
+	static struct pollfd pfds[PROC_MAX];
+	static int owners[PROC_MAX];
+	int i, num = 0;
+	for (i = 0; i < PROC_MAX; i++) {
+		if (procs[i].state == PROC_SLEEPING && procs[i].wait_fd >= 0) {
+			pfds[num].fd = procs[i].wait_fd;
+			pfds[num].events = POLLIN;
+			pfds[num].revents = 0;
+			owners[num] = i;
+			num++;
+		}
+	}
+	if (num == 0) return 0;
+	if (poll(pfds, num, timeout) < 0) {
+		if (errno == EINTR) return 1;
+		perror("poll");
+		return 0;
+	}
+	for (i = 0; i < num; i++) {
+		/* POLLHUPなども、readで結果を返すために起こす */
+		if (pfds[i].revents != 0) {
+			procs[owners[i]].state = PROC_RUNNABLE;
+			procs[owners[i]].wait_fd = -1;
+		}
+	}
+	return 1;
+}
+
+/* 次に実行するプロセスを決める。全プロセスが入力待ちの時は、入力が来るまで待つ */
+static int pick_next(void) {
+	int next;
+	while ((next = find_runnable()) < 0) {
+		fflush(NULL); /* 待つ前に、溜まっている出力を出す */
+		if (!poll_waiting(-1)) {
+			fprintf(stderr, "all xv6 processes are blocked\n");
+			return -1;
+		}
+	}
+	return next;
+}
+
+void xv6_yield(void) {
+	int next;
+	poll_waiting(0);
+	next = find_runnable();
+	if (next >= 0) switch_to(next);
+}
+
+/*
+実行中のプロセスを眠らせて切り替える。起きた時はint 0x40 (2バイト) から再実行する。
+wait_fdが0以上の時はchanの代わりにホストのfdの入力を待つ。
+*/
+static int sleep_on(const void* chan, int wait_fd) {
+	process* p = &procs[current_proc];
+	int next;
+	x86_cpu_save(&p->cpu);
+	p->cpu.eip -= 2;
+	x86_cpu_load(&p->cpu);
+	p->state = PROC_SLEEPING;
+	p->chan = chan;
+	p->wait_fd = wait_fd;
+	if ((next = pick_next()) < 0) return -1;
+	switch_to(next);
+	return 1;
+}
+
+static void wakeup(const void* chan) {
+	int i;
+	for (i = 0; i < PROC_MAX; i++) {
+		if (procs[i].state == PROC_SLEEPING && procs[i].chan == chan) procs[i].state = PROC_RUNNABLE;
+	}
+}
+
+static int stream_is_free(const stream_info* si) {
+	return si->stream == NULL && si->pipe == NULL;
+}
+
+static void release_stream(stream_info* si) {
+	si->ref_cnt--;
+	if (si->ref_cnt > 0) return;
+	if (si->pipe != NULL) {
+		if (si->is_pipe_writer) si->pipe->write_open = 0;
+		else si->pipe->read_open = 0;
+		wakeup(si->pipe);
+		if (!si->pipe->read_open && !si->pipe->write_open) si->pipe->in_use = 0;
+		si->pipe = NULL;
+	} else {
+		fclose(si->stream);
+		si->stream = NULL;
+		free(si->path);
+		si->path = NULL;
+	}
+}
+
+static int pipe_read(uint32_t regs[], pipe_info* pipe, uint32_t buf, uint32_t n) {
+	uint32_t size, done;
+	if (n == 0) {
+		regs[EAX] = 0;
+		return 1;
+	}
+	if (pipe->nread == pipe->nwrite) {
+		if (pipe->write_open) return sleep_on(pipe, -1);
+		regs[EAX] = 0; /* 書き込み側が閉じられている */
+		return 1;
+	}
+	size = pipe->nwrite - pipe->nread;
+	if (size > n) size = n;
+	if (!dmemory_is_allocated(buf, size)) {
+		regs[EAX] = -1;
+		return 1;
+	}
+	for (done = 0; done < size; ) {
+		uint32_t offset = pipe->nread % PIPE_SIZE;
+		uint32_t chunk = PIPE_SIZE - offset;
+		if (chunk > size - done) chunk = size - done;
+		dmemory_write(pipe->data + offset, buf + done, chunk);
+		pipe->nread += chunk;
+		done += chunk;
+	}
+	wakeup(pipe);
+	regs[EAX] = size;
+	return 1;
+}
+
+/* 全部書き込めるまで、読み込み側を待ちながら書き込む */
+static int pipe_write(uint32_t regs[], pipe_info* pipe, uint32_t buf, uint32_t n) {
+	process* p = &procs[current_proc];
+	if (!pipe->read_open) {
+		p->write_progress = 0;
+		regs[EAX] = -1;
+		return 1;
+	}
+	while (p->write_progress < n && pipe->nwrite - pipe->nread < PIPE_SIZE) {
+		uint32_t offset = pipe->nwrite % PIPE_SIZE;
+		uint32_t chunk = PIPE_SIZE - offset;
+		uint32_t space_left = PIPE_SIZE - (pipe->nwrite - pipe->nread);
+		if (chunk > space_left) chunk = space_left;
+		if (chunk > n - p->write_progress) chunk = n - p->write_progress;
+		dmemory_read(pipe->data + offset, buf + p->write_progress, chunk);
+		pipe->nwrite += chunk;
+		p->write_progress += chunk;
+	}
+	wakeup(pipe);
+	if (p->write_progress < n) return sleep_on(pipe, -1);
+	p->write_progress = 0;
+	regs[EAX] = n;
+	return 1;
+}
+
 static int xv6_read(uint32_t regs[]) {
 	uint32_t fd, buf, n;
 	uint8_t* data;
@@ -71,17 +324,32 @@ static int xv6_read(uint32_t regs[]) {
 		regs[EAX] = -1;
 		return 1;
 	}
+	if (fds[fd]->pipe != NULL) return pipe_read(regs, fds[fd]->pipe, buf, n);
+	if (fds[fd]->is_pollable && n > 0) {
+		/* 入力が来ていなければ、インタプリタ全体を止めずにこのプロセスだけを待たせる */
+		struct pollfd pfd;
+		pfd.fd = fileno(fds[fd]->stream);
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) == 0) return sleep_on(fds[fd], pfd.fd);
+	}
 	/* データを取得 */
 	data = malloc(n);
 	if (data == NULL) {
 		perror("malloc");
 		return -1;
 	}
-	if (fds[fd]->prev_operation == POP_WRITE) fseek(fds[fd]->stream, 0, SEEK_CUR);
-	read_size = fread(data, 1, n, fds[fd]->stream);
+	if (fds[fd]->is_pollable) {
+		/* 来ている分だけを読む (freadではnバイト揃うまで待たされる) */
+		ssize_t ret = read(fileno(fds[fd]->stream), data, n);
+		read_size = ret < 0 ? 0 : (size_t)ret;
+	} else {
+		if (fds[fd]->prev_operation == POP_WRITE) fseek(fds[fd]->stream, 0, SEEK_CUR);
+		read_size = fread(data, 1, n, fds[fd]->stream);
+	}
 	fds[fd]->prev_operation = POP_READ;
 	if (!dmemory_is_allocated(buf, read_size)) {
 		/* 指定された領域が確保されていない */
+		free(data);
 		regs[EAX] = -1;
 		return 1;
 	}
@@ -138,7 +406,7 @@ static int xv6_open(uint32_t regs[]) {
 		if (fds[fd] == NULL) break;
 	}
 	for (si = NULL, i = 0; i < STREAM_MAX; i++) {
-		if (streams[i].stream == NULL) {
+		if (stream_is_free(&streams[i])) {
 			si = &streams[i];
 			break;
 		}
@@ -166,6 +434,8 @@ static int xv6_open(uint32_t regs[]) {
 		return 1;
 	}
 	/* ファイルが開けたので、その他の情報を登録する */
+	si->path = name;
+	si->is_pollable = is_pollable(si->stream);
 	si->ref_cnt = 1;
 	si->can_read = want_read;
 	si->can_write = want_write;
@@ -173,7 +443,6 @@ static int xv6_open(uint32_t regs[]) {
 	fds[fd] = si;
 
 	/* 成功 */
-	free(name);
 	regs[EAX] = fd;
 	return 1;
 }
@@ -245,6 +514,7 @@ static int xv6_write(uint32_t regs[]) {
 		regs[EAX] = -1;
 		return 1;
 	}
+	if (fds[fd]->pipe != NULL) return pipe_write(regs, fds[fd]->pipe, buf, n);
 	/* データを取得して出力 */
 	data = malloc(n);
 	if (data == NULL) {
@@ -269,24 +539,198 @@ static int xv6_close(uint32_t regs[]) {
 		regs[EAX] = -1;
 		return 1;
 	}
-	fds[fd]->ref_cnt--;
-	if (fds[fd]->ref_cnt <= 0) {
-		fclose(fds[fd]->stream);
-		fds[fd]->stream = NULL;
-	}
+	release_stream(fds[fd]);
 	fds[fd] = NULL;
 	regs[EAX] = 0;
 	return 1;
 }
 
+static int xv6_fork(uint32_t regs[]) {
+	process* child = NULL;
+	int i;
+	for (i = 0; i < PROC_MAX; i++) {
+		if (procs[i].state == PROC_UNUSED) {
+			child = &procs[i];
+			break;
+		}
+	}
+	if (child == NULL) {
+		regs[EAX] = -1;
+		return 1;
+	}
+	child->pid = next_pid++;
+	child->wait_fd = -1;
+	child->parent = current_proc;
+	child->space = dmemory_fork_space();
+	child->sbrk_addr = sbrk_addr;
+	child->write_progress = 0;
+	for (i = 0; i < FD_MAX; i++) {
+		child->fds[i] = fds[i];
+		if (fds[i] != NULL) fds[i]->ref_cnt++;
+	}
+	regs[EAX] = child->pid;
+	x86_cpu_save(&child->cpu);
+	child->cpu.regs[EAX] = 0;
+	child->state = PROC_RUNNABLE;
+	return 1;
+}
+
+static int xv6_exit(void) {
+	int prev = current_proc, next, i;
+	process* p = &procs[prev];
+	/* 最初のプロセスが終了したら、インタプリタを終了する */
+	if (p->pid == 1) return 0;
+	for (i = 0; i < FD_MAX; i++) {
+		if (fds[i] != NULL) {
+			release_stream(fds[i]);
+			fds[i] = NULL;
+		}
+	}
+	for (i = 0; i < PROC_MAX; i++) {
+		if (procs[i].state != PROC_UNUSED && procs[i].parent == prev) {
+			procs[i].parent = -1;
+			if (procs[i].state == PROC_ZOMBIE) procs[i].state = PROC_UNUSED;
+		}
+	}
+	p->state = PROC_ZOMBIE;
+	if (p->parent >= 0) wakeup(&procs[p->parent]);
+	if ((next = pick_next()) < 0) return -1;
+	switch_to(next);
+	dmemory_free_space(p->space);
+	p->space = NULL;
+	if (p->parent < 0) p->state = PROC_UNUSED;
+	return 1;
+}
+
+static int xv6_wait(uint32_t regs[]) {
+	int i, have_child = 0;
+	for (i = 0; i < PROC_MAX; i++) {
+		if (procs[i].state == PROC_UNUSED || procs[i].parent != current_proc) continue;
+		if (procs[i].state == PROC_ZOMBIE) {
+			procs[i].state = PROC_UNUSED;
+			regs[EAX] = procs[i].pid;
+			return 1;
+		}
+		have_child = 1;
+	}
+	if (!have_child) {
+		regs[EAX] = -1;
+		return 1;
+	}
+	return sleep_on(&procs[current_proc], -1);
+}
+
+static int xv6_pipe(uint32_t regs[]) {
+	uint32_t fd_ptr, rfd, wfd, i;
+	pipe_info* pipe = NULL;
+	stream_info* rs = NULL;
+	stream_info* ws = NULL;
+	if (!dmem_get_args(regs[ESP], 1, &fd_ptr) || !dmemory_is_allocated(fd_ptr, 8)) {
+		regs[EAX] = -1;
+		return 1;
+	}
+	for (i = 0; i < PIPE_MAX && pipe == NULL; i++) {
+		if (!pipes[i].in_use) pipe = &pipes[i];
+	}
+	for (i = 0; i < STREAM_MAX && ws == NULL; i++) {
+		if (stream_is_free(&streams[i])) {
+			if (rs == NULL) rs = &streams[i];
+			else ws = &streams[i];
+		}
+	}
+	for (rfd = 0; rfd < FD_MAX && fds[rfd] != NULL; rfd++);
+	for (wfd = rfd + 1; wfd < FD_MAX && fds[wfd] != NULL; wfd++);
+	if (pipe == NULL || ws == NULL || wfd >= FD_MAX) {
+		regs[EAX] = -1;
+		return 1;
+	}
+	pipe->in_use = 1;
+	pipe->nread = pipe->nwrite = 0;
+	pipe->read_open = pipe->write_open = 1;
+	rs->pipe = pipe;
+	rs->is_pipe_writer = 0;
+	rs->ref_cnt = 1;
+	rs->can_read = 1;
+	rs->can_write = 0;
+	ws->pipe = pipe;
+	ws->is_pipe_writer = 1;
+	ws->ref_cnt = 1;
+	ws->can_read = 0;
+	ws->can_write = 1;
+	fds[rfd] = rs;
+	fds[wfd] = ws;
+	dmem_write_uint(fd_ptr, rfd, 4);
+	dmem_write_uint(fd_ptr + 4, wfd, 4);
+	regs[EAX] = 0;
+	return 1;
+}
+
+/* 新しいアドレス空間にプログラムを読み込み、成功したら古い空間を捨てる */
+static int xv6_exec(uint32_t regs[]) {
+	uint32_t path_ptr, argv_ptr, argc;
+	char* args[EXEC_ARG_MAX];
+	char* path;
+	int ok = 1;
+	if (!dmem_get_args(regs[ESP], 2, &path_ptr, &argv_ptr) || (path = dmem_read_string(path_ptr)) == NULL) {
+		regs[EAX] = -1;
+		return 1;
+	}
+	for (argc = 0; ; argc++) {
+		int read_ok;
+		uint32_t arg_ptr = dmem_read_uint(&read_ok, argv_ptr + 4 * argc, 4);
+		if (!read_ok || (arg_ptr != 0 && argc >= EXEC_ARG_MAX)) {
+			ok = 0;
+			break;
+		}
+		if (arg_ptr == 0) break;
+		if ((args[argc] = dmem_read_string(arg_ptr)) == NULL) {
+			ok = 0;
+			break;
+		}
+	}
+	if (ok) {
+		x86_cpu_state saved;
+		dmemory_space* old_space = dmemory_current_space();
+		dmemory_space* new_space = dmemory_new_space();
+		x86_cpu_save(&saved);
+		dmemory_switch_space(new_space);
+		if (x86_cpu_exec(path, argc, args)) {
+			dmemory_free_space(old_space);
+			procs[current_proc].space = new_space;
+			sbrk_addr = sbrk_origin;
+		} else {
+			dmemory_switch_space(old_space);
+			dmemory_free_space(new_space);
+			x86_cpu_load(&saved);
+			regs[EAX] = -1;
+		}
+	} else {
+		regs[EAX] = -1;
+	}
+	while (argc > 0) free(args[--argc]);
+	free(path);
+	return 1;
+}
+
 int xv6_syscall(uint32_t regs[]) {
 	switch (regs[EAX]) {
+		case 1: /* fork */
+			return xv6_fork(regs);
 		case 2: /* exit */
-			return 0;
+			return xv6_exit();
+		case 3: /* wait */
+			return xv6_wait(regs);
+		case 4: /* pipe */
+			return xv6_pipe(regs);
 		case 5: /* read */
 			return xv6_read(regs);
+		case 7: /* exec */
+			return xv6_exec(regs);
 		case 10: /* dup */
 			return xv6_dup(regs);
+		case 11: /* getpid */
+			regs[EAX] = procs[current_proc].pid;
+			break;
 		case 12: /* sbrk */
 			return xv6_sbrk(regs);
 		case 15: /* open */
@@ -301,3 +745,99 @@ int xv6_syscall(uint32_t regs[]) {
 	}
 	return 1;
 }
+
+void xv6_syscall_save_state(checkpoint_writer* writer) {
+	uint32_t i, num;
+	/* プロセスが1個でパイプが無い状態のみ保存できる */
+	for (i = 0; i < PROC_MAX; i++) {
+		if ((int)i != current_proc && procs[i].state != PROC_UNUSED) writer->error = 1;
+	}
+	for (i = 0; i < PIPE_MAX; i++) {
+		if (pipes[i].in_use) writer->error = 1;
+	}
+	if (writer->error) {
+		fprintf(stderr, "cannot save state with multiple xv6 processes or pipes\n");
+		return;
+	}
+	checkpoint_put_uint(writer, sbrk_origin);
+	checkpoint_put_uint(writer, sbrk_addr);
+	for (num = 0, i = 0; i < STREAM_MAX; i++) {
+		if (streams[i].stream != NULL) num++;
+	}
+	checkpoint_put_uint(writer, num);
+	for (i = 0; i < STREAM_MAX; i++) {
+		stream_info* si = &streams[i];
+		long pos;
+		if (si->stream == NULL) continue;
+		/* 標準入出力以外は、ファイル名と位置から開き直す */
+		pos = si->path != NULL ? ftell(si->stream) : 0;
+		checkpoint_put_uint(writer, i);
+		checkpoint_put_string(writer, si->path);
+		checkpoint_put_uint(writer, pos < 0 ? 0 : (uint32_t)pos);
+		checkpoint_put_uint(writer, si->ref_cnt);
+		checkpoint_put_uint(writer, si->can_read);
+		checkpoint_put_uint(writer, si->can_write);
+		checkpoint_put_uint(writer, si->prev_operation);
+	}
+	for (num = 0, i = 0; i < FD_MAX; i++) {
+		if (fds[i] != NULL) num++;
+	}
+	checkpoint_put_uint(writer, num);
+	for (i = 0; i < FD_MAX; i++) {
+		if (fds[i] == NULL) continue;
+		checkpoint_put_uint(writer, i);
+		checkpoint_put_uint(writer, (uint32_t)(fds[i] - streams));
+	}
+}
+
+int xv6_syscall_load_state(checkpoint_reader* reader) {
+	uint32_t origin, addr, num, i;
+	origin = checkpoint_get_uint(reader);
+	addr = checkpoint_get_uint(reader);
+	/* 現在開いているファイルを閉じてから状態を戻す */
+	for (i = 0; i < STREAM_MAX; i++) {
+		if (streams[i].path != NULL) {
+			fclose(streams[i].stream);
+			free(streams[i].path);
+			streams[i].path = NULL;
+		}
+	}
+	if (!initialize_xv6_syscall(origin)) return 0;
+	sbrk_addr = addr;
+	for (i = 0; i < FD_MAX; i++) fds[i] = NULL;
+	num = checkpoint_get_uint(reader);
+	while (!reader->error && num-- > 0) {
+		uint32_t idx = checkpoint_get_uint(reader);
+		char* path = checkpoint_get_string(reader);
+		uint32_t pos = checkpoint_get_uint(reader);
+		stream_info* si;
+		if (reader->error || idx >= STREAM_MAX) {
+			free(path);
+			return 0;
+		}
+		si = &streams[idx];
+		si->ref_cnt = checkpoint_get_uint(reader);
+		si->can_read = checkpoint_get_uint(reader);
+		si->can_write = checkpoint_get_uint(reader);
+		si->prev_operation = (enum e_pop)checkpoint_get_uint(reader);
+		if (path != NULL) {
+			si->stream = fopen(path, si->can_write ? "r+" : "r");
+			if (si->stream == NULL || fseek(si->stream, pos, SEEK_SET) != 0) {
+				fprintf(stderr, "failed to reopen %s from checkpoint\n", path);
+				free(path);
+				return 0;
+			}
+			si->path = path;
+			si->is_pollable = is_pollable(si->stream);
+			si->prev_operation = POP_SEEK;
+		}
+	}
+	num = checkpoint_get_uint(reader);
+	while (!reader->error && num-- > 0) {
+		uint32_t fd = checkpoint_get_uint(reader);
+		uint32_t idx = checkpoint_get_uint(reader);
+		if (fd >= FD_MAX || idx >= STREAM_MAX || streams[idx].stream == NULL) return 0;
+		fds[fd] = &streams[idx];
+	}
+	return !reader->error;
+}
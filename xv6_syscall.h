@@ -2,10 +2,20 @@
 #define XV6_SYSCALL_H_GUARD_05AC6687_373D_412B_8406_6BA9C13F8576
 
 #include <stdint.h>
+#include "checkpoint.h"
 
 int initialize_xv6_syscall(uint32_t work_addr);
 
 /* 成功:1 失敗:-1 プログラム終了(成功):0 */
 int xv6_syscall(uint32_t regs[]);
 
+/* この命令数ごとにxv6_yieldを呼び、実行するプロセスを切り替える */
+#define XV6_TIME_SLICE 10000
+
+/* 他に実行可能なプロセスがあれば、そちらに切り替える */
+void xv6_yield(void);
+
+void xv6_syscall_save_state(checkpoint_writer* writer);
+int xv6_syscall_load_state(checkpoint_reader* reader);
+
 #endif